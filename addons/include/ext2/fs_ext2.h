@@ -35,6 +35,12 @@
     the ext2fs layer anyway, as this layer should give you everything you need
     by interfacing with the VFS in the normal fashion.
 
+    Files that are read sequentially are read ahead of the file pointer by a
+    background thread, so that streaming data off of the device doesn't stall
+    on every block. The size of the read-ahead window can be changed (or the
+    read-ahead disabled, with a size of 0) on a per-file basis with the
+    F_SETRA fcntl() command. The window is limited to half of the block cache.
+
     There's one final note that I should make. Everything in fs_ext2 and ext2fs
     is licensed under the same license as the rest of KOS. None of it was
     derived from GPLed sources. Pretty much all of what's in ext2fs was written
@@ -23,6 +23,12 @@
     the fatfs layer anyway, as this layer should give you everything you need
     by interfacing with the VFS in the normal fashion.
 
+    Files that are read sequentially are read ahead of the file pointer by a
+    background thread, so that streaming data off of the device doesn't stall
+    on every cluster. The size of the read-ahead window can be changed (or the
+    read-ahead disabled, with a size of 0) on a per-file basis with the
+    F_SETRA fcntl() command. The window is limited to half of the cluster cache.
+
     \author Lawrence Sebald
 */
 
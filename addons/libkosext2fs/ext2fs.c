@@ -4,6 +4,7 @@
    Copyright (C) 2012, 2013 Lawrence Sebald
 */
 
+#include <malloc.h>
 #include <stdio.h>
 #include <errno.h>
 #include <stdint.h>
@@ -21,70 +22,14 @@
 
 static int initted = 0;
 
-/* This is basically the same as bgrad_cache from fs_iso9660 */
-static void make_mru(ext2_fs_t *fs, ext2_cache_t **cache, int block) {
-    int i;
-    ext2_cache_t *tmp;
-
-    /* Don't try it with the end block */
-    if(block < 0 || block >= fs->cache_size - 1)
-        return;
-
-    /* Make a copy and scoot everything down */
-    tmp = cache[block];
-
-    for(i = block; i < fs->cache_size - 1; ++i) {
-        cache[i] = cache[i + 1];
-    }
-
-    cache[fs->cache_size - 1] = tmp;
-}
-
 /* XXXX: This needs locking! */
 uint8_t *ext2_block_read(ext2_fs_t *fs, uint32_t bl, int *err) {
-    int i;
-    uint8_t *rv;
-    ext2_cache_t **cache = fs->bcache;
-
-    /* Look through the cache from the most recently used to the least recently
-       used entry. */
-    for(i = fs->cache_size - 1; i >= 0; --i) {
-        if(cache[i]->block == bl && cache[i]->flags) {
-            rv = cache[i]->data;
-            make_mru(fs, cache, i);
-            goto out;
-        }
-    }
-
-    /* If we didn't get anything, did we end up with an invalid entry or do we
-       need to boot someone out? */
-    if(i < 0) {
-        i = 0;
-
-        /* Make sure that if the block is dirty, we write it back out. */
-        if(cache[0]->flags & EXT2_CACHE_FLAG_DIRTY) {
-            if(ext2_block_write_nc(fs, cache[0]->block, cache[0]->data)) {
-                /* XXXX: Uh oh... */
-                *err = EIO;
-                return NULL;
-            }
-        }
-    }
-
-    /* Try to read the block in question. */
-    if(ext2_block_read_nc(fs, bl, cache[i]->data)) {
-        *err = EIO;
-        cache[i]->flags = 0;            /* Mark it as invalid... */
+    if(fs->sb.s_blocks_count <= bl) {
+        *err = EINVAL;
         return NULL;
     }
 
-    cache[i]->block = bl;
-    cache[i]->flags = EXT2_CACHE_FLAG_VALID;
-    rv = cache[i]->data;
-    make_mru(fs, cache, i);
-
-out:
-    return rv;
+    return blockcache_read(fs->bcache, bl, err);
 }
 
 int ext2_block_read_nc(ext2_fs_t *fs, uint32_t block_num, uint8_t *rv) {
@@ -124,40 +69,84 @@ int ext2_block_write_nc(ext2_fs_t *fs, uint32_t block_num, const uint8_t *blk) {
 }
 
 int ext2_block_mark_dirty(ext2_fs_t *fs, uint32_t block_num) {
-    int i;
-    ext2_cache_t **cache = fs->bcache;
-
-    /* Look through the cache from the most recently used to the least recently
-       used entry. */
-    for(i = fs->cache_size - 1; i >= 0; --i) {
-        if(cache[i]->block == block_num && cache[i]->flags) {
-            cache[i]->flags |= EXT2_CACHE_FLAG_DIRTY;
-            make_mru(fs, cache, i);
-            return 0;
-        }
+    return blockcache_mark_dirty(fs->bcache, block_num);
+}
+
+/* Read a run of contiguous blocks straight from the device. */
+static int ext2_blocks_read_nc(ext2_fs_t *fs, uint32_t block_num,
+                               uint32_t count, uint8_t *buf) {
+    int fs_per_block = fs->sb.s_log_block_size - fs->dev->l_block_size + 10;
+
+    if(fs_per_block < 0)
+        return -EINVAL;
+
+    if(fs->sb.s_blocks_count < block_num + count)
+        return -EINVAL;
+
+    if(fs->dev->read_blocks(fs->dev, block_num << fs_per_block,
+                            count << fs_per_block, buf))
+        return -EIO;
+
+    return 0;
+}
+
+int ext2_block_prefetch(ext2_fs_t *fs, uint32_t block_num, uint32_t count) {
+    uint32_t i;
+    uint8_t *buf;
+    int rv;
+
+    /* Don't bother re-reading the blocks at either end of the run that are
+       already in the cache. */
+    while(count && blockcache_lookup(fs->bcache, block_num)) {
+        ++block_num;
+        --count;
     }
 
-    return -EINVAL;
+    while(count && blockcache_lookup(fs->bcache, block_num + count - 1))
+        --count;
+
+    if(!count)
+        return 0;
+
+    if(!(buf = (uint8_t *)memalign(32, count * fs->block_size)))
+        return -ENOMEM;
+
+    if(!(rv = ext2_blocks_read_nc(fs, block_num, count, buf))) {
+        for(i = 0; i < count && !rv; ++i)
+            rv = blockcache_insert(fs->bcache, block_num + i,
+                                   buf + i * fs->block_size);
+    }
+
+    free(buf);
+    return rv;
 }
 
-int ext2_block_cache_wb(ext2_fs_t *fs) {
-    int i, err;
-    ext2_cache_t **cache = fs->bcache;
+int ext2_block_read_direct(ext2_fs_t *fs, uint32_t block_num, uint32_t count,
+                           uint8_t *buf) {
+    int rv;
+
+    /* Make sure the device has the latest copy of the blocks first. */
+    if((fs->mnt_flags & EXT2FS_MNT_FLAG_RW) &&
+       (rv = blockcache_writeback_range(fs->bcache, block_num, count)) < 0)
+        return rv;
 
+    return ext2_blocks_read_nc(fs, block_num, count, buf);
+}
+
+int ext2_block_cached(ext2_fs_t *fs, uint32_t block_num) {
+    return blockcache_lookup(fs->bcache, block_num) != NULL;
+}
+
+uint32_t ext2_block_cache_size(const ext2_fs_t *fs) {
+    return (uint32_t)blockcache_size(fs->bcache);
+}
+
+int ext2_block_cache_wb(ext2_fs_t *fs) {
     /* Don't even bother if we're mounted read-only. */
     if(!(fs->mnt_flags & EXT2FS_MNT_FLAG_RW))
         return 0;
 
-    for(i = fs->cache_size - 1; i >= 0; --i) {
-        if(cache[i]->flags & EXT2_CACHE_FLAG_DIRTY) {
-            if((err = ext2_block_write_nc(fs, cache[i]->block, cache[i]->data)))
-                return err;
-
-            cache[i]->flags &= ~EXT2_CACHE_FLAG_DIRTY;
-        }
-    }
-    
-    return 0;
+    return blockcache_writeback(fs->bcache);
 }
 
 uint8_t *ext2_block_alloc(ext2_fs_t *fs, uint32_t bg, uint32_t *bn, int *err) {
@@ -274,7 +263,6 @@ ext2_fs_t *ext2_fs_init(kos_blockdev_t *bd, uint32_t flags) {
 ext2_fs_t *ext2_fs_init_ex(kos_blockdev_t *bd, uint32_t flags, int cache_sz) {
     ext2_fs_t *rv;
     uint32_t bc;
-    int j;
     int block_size;
 
 #ifdef EXT2FS_DEBUG
@@ -409,46 +397,14 @@ ext2_fs_t *ext2_fs_init_ex(kos_blockdev_t *bd, uint32_t flags, int cache_sz) {
 #endif /* EXT2FS_DEBUG */
 
     /* Make space for the block cache. */
-    if(!(rv->bcache = (ext2_cache_t **)malloc(sizeof(ext2_cache_t *) *
-                                              cache_sz))) {
+    if(!(rv->bcache = blockcache_create(bd, block_size, cache_sz))) {
         free(rv->bg);
         free(rv);
         bd->shutdown(bd);
         return NULL;
     }
 
-    for(j = 0; j < cache_sz; ++j) {
-        if(!(rv->bcache[j] = (ext2_cache_t *)malloc(sizeof(ext2_cache_t))))
-            goto out_cache;
-    }
-
-    for(j = 0; j < cache_sz; ++j) {
-        if(!(rv->bcache[j]->data = (uint8_t *)malloc(block_size)))
-            goto out_bcache;
-
-        rv->bcache[j]->flags = 0;
-    }
-
-    rv->cache_size = cache_sz;
-
     return rv;
-
-out_bcache:
-    for(; j >= 0; --j) {
-        free(rv->bcache[j]->data);
-    }
-
-    j = cache_sz - 1;
-out_cache:
-    for(; j >= 0; --j) {
-        free(rv->bcache[j]);
-    }
-
-    free(rv->bcache);
-    free(rv->bg);
-    free(rv);
-    bd->shutdown(bd);
-    return NULL;
 }
 
 int ext2_fs_sync(ext2_fs_t *fs) {
@@ -499,17 +455,10 @@ int ext2_fs_sync(ext2_fs_t *fs) {
 }
 
 void ext2_fs_shutdown(ext2_fs_t *fs) {
-    int i;
-
     /* Sync the filesystem back to the block device, if needed. */
     ext2_fs_sync(fs);
 
-    for(i = 0; i < fs->cache_size; ++i) {
-        free(fs->bcache[i]->data);
-        free(fs->bcache[i]);
-    }
-
-    free(fs->bcache);
+    blockcache_destroy(fs->bcache);
     fs->dev->shutdown(fs->dev);
     free(fs->bg);
     free(fs);
@@ -104,6 +104,18 @@ int ext2_block_write_nc(ext2_fs_t *fs, uint32_t block_num, const uint8_t *blk);
 
 int ext2_block_mark_dirty(ext2_fs_t *fs, uint32_t block_num);
 
+/* Read count contiguous blocks, starting at block_num, into the block cache
+   with a single device read. Blocks that are already cached are left alone. */
+int ext2_block_prefetch(ext2_fs_t *fs, uint32_t block_num, uint32_t count);
+uint32_t ext2_block_cache_size(const ext2_fs_t *fs);
+
+/* Read count contiguous blocks, starting at block_num, straight into buf,
+   without going through the block cache. Dirty cached copies of the blocks are
+   written back first. */
+int ext2_block_read_direct(ext2_fs_t *fs, uint32_t block_num, uint32_t count,
+                           uint8_t *buf);
+int ext2_block_cached(ext2_fs_t *fs, uint32_t block_num);
+
 /* Write-back all dirty blocks from the filesystem's cache. You probably want to
    call the corresponding inode function before this one. */
 int ext2_block_cache_wb(ext2_fs_t *fs);
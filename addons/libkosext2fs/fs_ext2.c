@@ -16,6 +16,7 @@
 #include <kos/fs.h>
 #include <kos/mutex.h>
 #include <kos/dbglog.h>
+#include <kos/worker_thread.h>
 
 #include <ext2/fs_ext2.h>
 
@@ -33,6 +34,24 @@ char *strdup(const char *);
 
 #define MAX_EXT2_FILES 16
 
+/* Read-ahead parameters. A file handle is considered to be read sequentially
+   once EXT2_RA_SEQ_READS reads in a row have started where the previous one
+   ended. The read-ahead worker then reads up to the handle's window ahead of
+   the file pointer, in runs of contiguous blocks of at most EXT2_RA_MAX_RUN
+   bytes each, dropping the lock between runs so that readers don't have to
+   wait for the whole window. */
+#define EXT2_RA_SEQ_READS   2
+#define EXT2_RA_DEFAULT     (64 * 1024)
+#define EXT2_RA_MAX_RUN     (64 * 1024)
+
+/* Reads of at least EXT2_DIRECT_MIN contiguous blocks into a buffer aligned
+   on EXT2_DIRECT_ALIGN bytes (enough for DMA) bypass the block cache, and are
+   read straight into the caller's buffer, up to EXT2_DIRECT_MAX bytes at a
+   time. */
+#define EXT2_DIRECT_MIN     2
+#define EXT2_DIRECT_MAX     (1024 * 1024)
+#define EXT2_DIRECT_ALIGN   32
+
 typedef struct fs_ext2_fs {
     LIST_ENTRY(fs_ext2_fs) entry;
 
@@ -52,8 +71,19 @@ static struct {
     dirent_t dent;
     ext2_inode_t *inode;
     fs_ext2_fs_t *fs;
+
+    /* Read-ahead state. ra_end is the file block up to which the file has
+       been read ahead. */
+    uint32_t ra_window;
+    uint64_t ra_next;
+    uint32_t ra_end;
+    int ra_seq;
+    int ra_queued;
+    kthread_job_t ra_job;
 } fh[MAX_EXT2_FILES];
 
+static kthread_worker_t *ra_worker;
+
 static int create_empty_file(fs_ext2_fs_t *fs, const char *fn,
                              ext2_inode_t **rinode, uint32_t *rinode_num) {
     int irv;
@@ -120,6 +150,168 @@ static int create_empty_file(fs_ext2_fs_t *fs, const char *fn,
     return 0;
 }
 
+/* Limit the read-ahead window to half of the block cache, so that reading
+   ahead doesn't evict the blocks that are about to be read. */
+static uint32_t ext2_ra_clamp(ext2_fs_t *fs, uint32_t window) {
+    uint32_t bs = ext2_block_size(fs);
+    uint32_t max = (ext2_block_cache_size(fs) / 2) * bs;
+
+    if(window > max)
+        window = max;
+
+    return window & ~(bs - 1);
+}
+
+/* Read ahead of the file pointer of a handle. Called from the read-ahead
+   worker, without ext2_mutex held. */
+static void ext2_readahead(file_t fd) {
+    ext2_fs_t *fs;
+    uint32_t lbs, bn, next, run, max_run;
+    uint64_t end;
+
+    mutex_lock(&ext2_mutex);
+    fh[fd].ra_queued = 0;
+
+    for(;;) {
+        /* The handle may have been closed or seeked since the job was queued,
+           in which case there is nothing (more) to do. */
+        if(!fh[fd].inode_num || !fh[fd].ra_window ||
+           fh[fd].ra_seq < EXT2_RA_SEQ_READS)
+            break;
+
+        fs = fh[fd].fs->fs;
+        lbs = ext2_log_block_size(fs);
+
+        /* Figure out where the window ends, without going past the end of
+           the file. */
+        end = ext2_inode_size(fh[fd].inode);
+
+        if(fh[fd].ptr + fh[fd].ra_window < end)
+            end = fh[fd].ptr + fh[fd].ra_window;
+
+        end = (end + (1 << lbs) - 1) >> lbs;
+
+        if(fh[fd].ra_end < (fh[fd].ptr >> lbs))
+            fh[fd].ra_end = fh[fd].ptr >> lbs;
+
+        if(fh[fd].ra_end >= end)
+            break;
+
+        /* Holes in sparse files can't be read ahead. */
+        if(ext2_inode_map_block(fs, fh[fd].inode, fh[fd].ra_end, &bn) < 0 ||
+           !bn)
+            break;
+
+        /* See how many contiguous blocks we can read at once. */
+        max_run = EXT2_RA_MAX_RUN >> lbs;
+        if(!max_run)
+            max_run = 1;
+
+        for(run = 1; fh[fd].ra_end + run < end && run < max_run; ++run) {
+            if(ext2_inode_map_block(fs, fh[fd].inode, fh[fd].ra_end + run,
+                                    &next) < 0 || next != bn + run)
+                break;
+        }
+
+        if(ext2_block_prefetch(fs, bn, run) < 0)
+            break;
+
+        fh[fd].ra_end += run;
+
+        /* Let any waiting reader in before reading the next run. */
+        mutex_unlock(&ext2_mutex);
+        thd_pass();
+        mutex_lock(&ext2_mutex);
+    }
+
+    mutex_unlock(&ext2_mutex);
+}
+
+static void ext2_readahead_thd(void *d) {
+    kthread_job_t *job;
+
+    (void)d;
+
+    while((job = thd_worker_dequeue_job(ra_worker)))
+        ext2_readahead((file_t)(uintptr_t)job->data);
+}
+
+/* Queue read-ahead for a handle, if it is being read sequentially and less
+   than half of its window is left ahead of the file pointer. Called with
+   ext2_mutex held. */
+static void ext2_readahead_queue(file_t fd) {
+    kthread_attr_t attr = { 0 };
+    uint64_t ahead;
+
+    if(fh[fd].ra_seq < EXT2_RA_SEQ_READS || !fh[fd].ra_window ||
+       fh[fd].ra_queued)
+        return;
+
+    ahead = (uint64_t)fh[fd].ra_end << ext2_log_block_size(fh[fd].fs->fs);
+
+    if(ahead >= ext2_inode_size(fh[fd].inode) ||
+       ahead >= fh[fd].ptr + fh[fd].ra_window / 2)
+        return;
+
+    if(!ra_worker) {
+        attr.label = "fs_ext2 readahead";
+
+        if(!(ra_worker = thd_worker_create_ex(&attr, ext2_readahead_thd,
+                                              NULL)))
+            return;
+    }
+
+    fh[fd].ra_queued = 1;
+    thd_worker_add_job(ra_worker, &fh[fd].ra_job);
+    thd_worker_wakeup(ra_worker);
+}
+
+/* Read as many whole, contiguous blocks as possible from the file pointer
+   straight into buf. Returns the number of blocks read, 0 if the read should
+   go through the cache instead, or a negative errno value on error. */
+static int ext2_read_direct(ext2_fs_t *fs, file_t fd, uint8_t *buf,
+                            size_t cnt) {
+    uint32_t lbs = ext2_log_block_size(fs);
+    uint32_t fbn = fh[fd].ptr >> lbs, bn, next, run, max;
+    int err;
+
+    if(((uintptr_t)buf & (EXT2_DIRECT_ALIGN - 1)) ||
+       cnt < (EXT2_DIRECT_MIN << lbs))
+        return 0;
+
+    if((err = ext2_inode_map_block(fs, fh[fd].inode, fbn, &bn)) < 0)
+        return err;
+
+    /* Holes read as zeroes, leave them to the normal path. And don't go to
+       the device for data we already have. */
+    if(!bn || ext2_block_cached(fs, bn))
+        return 0;
+
+    max = cnt >> lbs;
+
+    if(max > (EXT2_DIRECT_MAX >> lbs))
+        max = EXT2_DIRECT_MAX >> lbs;
+
+    for(run = 1; run < max; ++run) {
+        if((err = ext2_inode_map_block(fs, fh[fd].inode, fbn + run,
+                                       &next)) < 0)
+            return err;
+
+        if(next != bn + run)
+            break;
+    }
+
+    if(run < EXT2_DIRECT_MIN)
+        return 0;
+
+    if((err = ext2_block_read_direct(fs, bn, run, buf)) < 0)
+        return err;
+
+    fh[fd].ptr += (uint64_t)run << lbs;
+
+    return (int)run;
+}
+
 static void *fs_ext2_open(vfs_handler_t *vfs, const char *fn, int mode) {
     file_t fd;
     fs_ext2_fs_t *mnt = (fs_ext2_fs_t *)vfs->privdata;
@@ -220,6 +412,11 @@ created:
     fh[fd].mode = mode;
     fh[fd].ptr = 0;
     fh[fd].fs = mnt;
+    fh[fd].ra_window = ext2_ra_clamp(mnt->fs, EXT2_RA_DEFAULT);
+    fh[fd].ra_next = 0;
+    fh[fd].ra_end = 0;
+    fh[fd].ra_seq = 0;
+    fh[fd].ra_job.data = (void *)(uintptr_t)fd;
 
     mutex_unlock(&ext2_mutex);
 
@@ -249,7 +446,7 @@ static ssize_t fs_ext2_read(void *h, void *buf, size_t cnt) {
     uint8_t *bbuf = (uint8_t *)buf;
     ssize_t rv;
     uint64_t sz;
-    int mode;
+    int mode, run, direct = 0;
 
     mutex_lock(&ext2_mutex);
 
@@ -280,6 +477,16 @@ static ssize_t fs_ext2_read(void *h, void *buf, size_t cnt) {
     if((fh[fd].ptr + cnt) > sz)
         cnt = sz - fh[fd].ptr;
 
+    /* Keep track of whether the file is being read sequentially. */
+    if(fh[fd].ptr == fh[fd].ra_next) {
+        if(fh[fd].ra_seq < EXT2_RA_SEQ_READS)
+            ++fh[fd].ra_seq;
+    }
+    else {
+        fh[fd].ra_seq = 0;
+        fh[fd].ra_end = 0;
+    }
+
     fs = fh[fd].fs->fs;
     bs = ext2_block_size(fs);
     lbs = ext2_log_block_size(fs);
@@ -309,6 +516,19 @@ static ssize_t fs_ext2_read(void *h, void *buf, size_t cnt) {
 
     /* While we still have more to read, do it. */
     while(cnt) {
+        /* Big reads go straight from the device to the buffer, if we can. */
+        if((run = ext2_read_direct(fs, fd, bbuf, cnt)) < 0) {
+            mutex_unlock(&ext2_mutex);
+            errno = -run;
+            return -1;
+        }
+        else if(run) {
+            direct = 1;
+            cnt -= run << lbs;
+            bbuf += run << lbs;
+            continue;
+        }
+
         if(!(block = ext2_inode_read_block(fs, fh[fd].inode, fh[fd].ptr >> lbs,
                                            NULL, &errno))) {
             mutex_unlock(&ext2_mutex);
@@ -328,6 +548,14 @@ static ssize_t fs_ext2_read(void *h, void *buf, size_t cnt) {
         }
     }
 
+    /* Start reading ahead of the reader, if it looks like it'll need it.
+       Reads that go straight to the device don't need it, and it would only
+       get in their way by filling the cache ahead of them. */
+    fh[fd].ra_next = fh[fd].ptr;
+
+    if(!direct)
+        ext2_readahead_queue(fd);
+
     /* We're done, clean up and return. */
     mutex_unlock(&ext2_mutex);
     return rv;
@@ -1329,8 +1557,6 @@ static int fs_ext2_fcntl(void *h, int cmd, va_list ap) {
     file_t fd = ((file_t)h) - 1;
     int rv = -1;
 
-    (void)ap;
-
     mutex_lock(&ext2_mutex);
 
     if(fd >= MAX_EXT2_FILES || !fh[fd].inode_num) {
@@ -1350,6 +1576,23 @@ static int fs_ext2_fcntl(void *h, int cmd, va_list ap) {
             rv = 0;
             break;
 
+        case F_GETRA:
+            rv = (int)fh[fd].ra_window;
+            break;
+
+        case F_SETRA:
+            rv = va_arg(ap, int);
+
+            if(rv < 0) {
+                errno = EINVAL;
+                rv = -1;
+                break;
+            }
+
+            fh[fd].ra_window = ext2_ra_clamp(fh[fd].fs->fs, (uint32_t)rv);
+            rv = 0;
+            break;
+
         default:
             errno = EINVAL;
     }
@@ -2068,6 +2311,11 @@ int fs_ext2_shutdown(void) {
     if(!initted)
         return 0;
 
+    if(ra_worker) {
+        thd_worker_destroy(ra_worker);
+        ra_worker = NULL;
+    }
+
     /* Clean up the mounted filesystems */
     i = LIST_FIRST(&ext2_fses);
     while(i) {
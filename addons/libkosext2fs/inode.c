@@ -1278,13 +1278,13 @@ next_token:
     return 0;
 }
 
-uint8_t *ext2_inode_read_block(ext2_fs_t *fs, const ext2_inode_t *inode,
-                               uint32_t block_num, uint32_t *r_block,
-                               int *err) {
+int ext2_inode_map_block(ext2_fs_t *fs, const ext2_inode_t *inode,
+                         uint32_t block_num, uint32_t *r_block) {
     uint32_t blks_per_ind, ibn;
     uint32_t *iblock;
     int shift = 1 + fs->sb.s_log_block_size;
     uint64_t sz;
+    int err;
 
     /* Grab the size */
     if((inode->i_mode & 0xF000) == EXT2_S_IFREG)
@@ -1293,17 +1293,13 @@ uint8_t *ext2_inode_read_block(ext2_fs_t *fs, const ext2_inode_t *inode,
         sz = (uint64_t)inode->i_size;
 
     /* Check to be sure we're not being asked to do something stupid... */
-    if((block_num << (shift + 9)) >= sz) {
-        *err = EINVAL;
-        return NULL;
-    }
+    if((block_num << (shift + 9)) >= sz)
+        return -EINVAL;
 
     /* If we're reading a direct block, this is easy. */
     if(block_num < 12) {
-        if(r_block)
-            *r_block = inode->i_block[block_num];
-
-        return ext2_block_read(fs, inode->i_block[block_num], err);
+        *r_block = inode->i_block[block_num];
+        return 0;
     }
 
     blks_per_ind = fs->block_size >> 2;
@@ -1311,64 +1307,76 @@ uint8_t *ext2_inode_read_block(ext2_fs_t *fs, const ext2_inode_t *inode,
 
     /* Are we looking at the singly-indirect block? */
     if(block_num < blks_per_ind) {
-        if(!(iblock = (uint32_t *)ext2_block_read(fs, inode->i_block[12], err)))
-            return NULL;
-
-        if(r_block)
-            *r_block = iblock[block_num];
+        if(!(iblock = (uint32_t *)ext2_block_read(fs, inode->i_block[12],
+                                                  &err)))
+            return -err;
 
-        return ext2_block_read(fs, iblock[block_num], err);
+        *r_block = iblock[block_num];
+        return 0;
     }
 
     /* Ok, we're looking at at least a doubly-indirect block... */
     block_num -= blks_per_ind;
     if(block_num < (blks_per_ind * blks_per_ind)) {
-        if(!(iblock = (uint32_t *)ext2_block_read(fs, inode->i_block[13], err)))
-            return NULL;
+        if(!(iblock = (uint32_t *)ext2_block_read(fs, inode->i_block[13],
+                                                  &err)))
+            return -err;
 
         /* Figure out what entry we want in here... */
         ibn = block_num / blks_per_ind;
         block_num %= blks_per_ind;
 
-        if(!(iblock = (uint32_t *)ext2_block_read(fs, iblock[ibn], err)))
-            return NULL;
+        if(!(iblock = (uint32_t *)ext2_block_read(fs, iblock[ibn], &err)))
+            return -err;
 
         /* Ok... Now we should be good to go. */
-        if(r_block)
-            *r_block = iblock[block_num];
-
-        return ext2_block_read(fs, iblock[block_num], err);
+        *r_block = iblock[block_num];
+        return 0;
     }
 
     /* Ugh... You're going to make me look at a triply-indirect block now? */
     block_num -= blks_per_ind * blks_per_ind;
-    if(!(iblock = (uint32_t *)ext2_block_read(fs, inode->i_block[14], err)))
-        return NULL;
+    if(!(iblock = (uint32_t *)ext2_block_read(fs, inode->i_block[14], &err)))
+        return -err;
 
     /* Figure out what entry we want in here... */
     ibn = block_num / blks_per_ind;
     block_num %= blks_per_ind;
 
-    if(!(iblock = (uint32_t *)ext2_block_read(fs, iblock[ibn], err)))
-        return NULL;
+    if(!(iblock = (uint32_t *)ext2_block_read(fs, iblock[ibn], &err)))
+        return -err;
 
     /* And in this one too... */
     ibn = block_num / blks_per_ind;
     block_num %= blks_per_ind;
 
-    if(!(iblock = (uint32_t *)ext2_block_read(fs, iblock[ibn], err)))
-        return NULL;
+    if(!(iblock = (uint32_t *)ext2_block_read(fs, iblock[ibn], &err)))
+        return -err;
 
     /* Ok... Now we should be good to go. Finally. */
     if(block_num < blks_per_ind) {
-        if(r_block)
-            *r_block = iblock[block_num];
-
-        return ext2_block_read(fs, iblock[block_num], err);
+        *r_block = iblock[block_num];
+        return 0;
     }
     else {
         /* This really shouldn't happen... */
-        *err = EIO;
+        return -EIO;
+    }
+}
+
+uint8_t *ext2_inode_read_block(ext2_fs_t *fs, const ext2_inode_t *inode,
+                               uint32_t block_num, uint32_t *r_block,
+                               int *err) {
+    uint32_t bn;
+    int rv;
+
+    if((rv = ext2_inode_map_block(fs, inode, block_num, &bn)) < 0) {
+        *err = -rv;
         return NULL;
     }
+
+    if(r_block)
+        *r_block = bn;
+
+    return ext2_block_read(fs, bn, err);
 }
@@ -154,6 +154,11 @@ int ext2_inode_deref(ext2_fs_t *fs, uint32_t inode_num, int isdir);
 uint8_t *ext2_inode_alloc_block(ext2_fs_t *fs, ext2_inode_t *inode,
                                 uint32_t blocks,int *err);
 
+/* Figure out which filesystem block holds the given block of an inode,
+   without reading the block itself. */
+int ext2_inode_map_block(ext2_fs_t *fs, const ext2_inode_t *inode,
+                         uint32_t block_num, uint32_t *r_block);
+
 uint8_t *ext2_inode_read_block(ext2_fs_t *fs, const ext2_inode_t *inode,
                                uint32_t block_num, uint32_t *r_block,
                                int *err);
@@ -204,6 +204,10 @@ int fat_read_boot(fat_superblock_t *sb, kos_blockdev_t *bd) {
         return -EINVAL;
     }
 
+    /* Without a valid FSinfo sector, we don't know how many clusters are
+       free until the whole FAT has been looked at. */
+    sb->free_clusters = FAT_FREE_UNKNOWN;
+
     /* If we have an fsinfo sector, read it. */
     if(sb->fsinfo_sector) {
         memset(&fsinfo, 0, sizeof(fat32_fsinfo_t));
@@ -4,6 +4,7 @@
    Copyright (C) 2012, 2013, 2019 Lawrence Sebald
 */
 
+#include <malloc.h>
 #include <stdio.h>
 #include <errno.h>
 #include <stdint.h>
@@ -14,26 +15,6 @@
 #include "fatfs.h"
 #include "fatinternal.h"
 
-/* This is basically the same as bgrad_cache from fs_iso9660 */
-static void make_mru(fat_fs_t *fs, fat_cache_t **cache, int block) {
-    int i;
-    fat_cache_t *tmp;
-
-    /* Don't try it with the end block */
-    if(block < 0 || block >= fs->cache_size - 1)
-        return;
-
-    /* Make a copy and scoot everything down */
-    tmp = cache[block];
-
-    for(i = block; i < fs->cache_size - 1; ++i) {
-        cache[i] = cache[i + 1];
-    }
-
-    cache[fs->cache_size - 1] = tmp;
-}
-
-
 static int fat_fatblock_read_nc(fat_fs_t *fs, uint32_t bn, uint8_t *rv) {
     if(fs->sb.fat_size <= bn)
         return -EINVAL;
@@ -55,88 +36,32 @@ static int fat_fatblock_write_nc(fat_fs_t *fs, uint32_t bn,
     return 0;
 }
 
-static uint8_t *fat_read_fatblock(fat_fs_t *fs, uint32_t block, int *err) {
-    int i;
-    uint8_t *rv;
-    fat_cache_t **cache = fs->fcache;
-
-    /* Look through the cache from the most recently used to the least recently
-       used entry. */
-    for(i = fs->fcache_size - 1; i >= 0; --i) {
-        if(cache[i]->block == block && cache[i]->flags) {
-            rv = cache[i]->data;
-            make_mru(fs, cache, i);
-            goto out;
-        }
-    }
-
-    /* If we didn't get anything, did we end up with an invalid entry or do we
-       need to boot someone out? */
-    if(i < 0) {
-        i = 0;
-
-        /* Make sure that if the block is dirty, we write it back out. */
-        if(cache[0]->flags & FAT_CACHE_FLAG_DIRTY) {
-            if(fat_fatblock_write_nc(fs, cache[0]->block, cache[0]->data)) {
-                /* XXXX: Uh oh... */
-                *err = EIO;
-                return NULL;
-            }
-        }
-    }
-
-    /* Try to read the block in question. */
-    if(fat_fatblock_read_nc(fs, block, cache[i]->data)) {
-        *err = EIO;
-        cache[i]->flags = 0;            /* Mark it as invalid... */
-        return NULL;
-    }
-
-    cache[i]->block = block;
-    cache[i]->flags = FAT_CACHE_FLAG_VALID;
-    rv = cache[i]->data;
-    make_mru(fs, cache, i);
+/* Callbacks for the FAT block cache. */
+int fat_fatblock_cache_read(void *data, uint64_t bn, void *buf) {
+    return fat_fatblock_read_nc((fat_fs_t *)data, (uint32_t)bn,
+                                (uint8_t *)buf);
+}
 
-out:
-    return rv;
+int fat_fatblock_cache_write(void *data, uint64_t bn, const void *buf) {
+    return fat_fatblock_write_nc((fat_fs_t *)data, (uint32_t)bn,
+                                 (const uint8_t *)buf);
 }
 
-static int fat_fatblock_mark_dirty(fat_fs_t *fs, uint32_t bn) {
-    int i;
-    fat_cache_t **cache = fs->fcache;
-
-    /* Look through the cache from the most recently used to the least recently
-       used entry. */
-    for(i = fs->fcache_size - 1; i >= 0; --i) {
-        if(cache[i]->block == bn && cache[i]->flags) {
-            cache[i]->flags |= FAT_CACHE_FLAG_DIRTY;
-            make_mru(fs, cache, i);
-            return 0;
-        }
-    }
+static inline uint8_t *fat_read_fatblock(fat_fs_t *fs, uint32_t block,
+                                         int *err) {
+    return blockcache_read(fs->fcache, block, err);
+}
 
-    return -EINVAL;
+static inline int fat_fatblock_mark_dirty(fat_fs_t *fs, uint32_t bn) {
+    return blockcache_mark_dirty(fs->fcache, bn);
 }
 
 int fat_fatblock_cache_wb(fat_fs_t *fs) {
-    int i, err;
-    fat_cache_t **cache = fs->fcache;
-
     /* Don't even bother if we're mounted read-only. */
     if(!(fs->mnt_flags & FAT_MNT_FLAG_RW))
         return 0;
 
-    for(i = fs->fcache_size - 1; i >= 0; --i) {
-        if(cache[i]->flags & FAT_CACHE_FLAG_DIRTY) {
-            if((err = fat_fatblock_write_nc(fs, cache[i]->block,
-                                            cache[i]->data)))
-                return err;
-
-            cache[i]->flags &= ~FAT_CACHE_FLAG_DIRTY;
-        }
-    }
-
-    return 0;
+    return blockcache_writeback(fs->fcache);
 }
 
 uint32_t fat_read_fat(fat_fs_t *fs, uint32_t cl, int *err) {
@@ -213,8 +138,247 @@ uint32_t fat_read_fat(fat_fs_t *fs, uint32_t cl, int *err) {
     return val;
 }
 
+/* The free cluster map is split up in chunks of FAT_MAP_CHUNK clusters, which
+   are only read in from the FAT when an allocation first needs them. That way,
+   mounting doesn't need to read the whole FAT in, and allocations done on a
+   mostly empty part of the disk never have to look at the rest of it. */
+#define FAT_MAP_CHUNK_BITS  12
+#define FAT_MAP_CHUNK       (1 << FAT_MAP_CHUNK_BITS)
+#define FAT_MAP_UNSCANNED   0xFFFFFFFF
+
+static inline int map_test(const uint32_t *map, uint32_t cl) {
+    return (map[cl >> 5] >> (cl & 31)) & 1;
+}
+
+static int fat_map_init(fat_fs_t *fs) {
+    uint32_t i;
+
+    fs->map_chunks = (fs->sb.num_clusters + 2 + FAT_MAP_CHUNK - 1) >>
+        FAT_MAP_CHUNK_BITS;
+    fs->free_map = (uint32_t *)calloc(fs->map_chunks <<
+                                      (FAT_MAP_CHUNK_BITS - 5),
+                                      sizeof(uint32_t));
+    fs->chunk_free = (uint32_t *)malloc(fs->map_chunks * sizeof(uint32_t));
+
+    if(!fs->free_map || !fs->chunk_free) {
+        fat_map_free(fs);
+        return -ENOMEM;
+    }
+
+    for(i = 0; i < fs->map_chunks; ++i)
+        fs->chunk_free[i] = FAT_MAP_UNSCANNED;
+
+    fs->map_unscanned = fs->map_chunks;
+    return 0;
+}
+
+void fat_map_free(fat_fs_t *fs) {
+    free(fs->free_map);
+    free(fs->chunk_free);
+    fs->free_map = NULL;
+    fs->chunk_free = NULL;
+}
+
+/* Read in the part of the FAT that covers one chunk of the free map. */
+static int fat_map_scan(fat_fs_t *fs, uint32_t chunk) {
+    uint32_t first = chunk << FAT_MAP_CHUNK_BITS, last, cl, val, nfree = 0;
+    uint32_t sn, count, off, shift, bps = fs->sb.bytes_per_sector;
+    uint8_t *buf;
+    int err;
+
+    if(fs->chunk_free[chunk] != FAT_MAP_UNSCANNED)
+        return 0;
+
+    last = first + FAT_MAP_CHUNK;
+
+    if(last > fs->sb.num_clusters + 2)
+        last = fs->sb.num_clusters + 2;
+
+    if(first < 2)
+        first = 2;
+
+    if(fs->sb.fs_type == FAT_FS_FAT12) {
+        /* FAT12 volumes are tiny, so just go through the FAT cache. */
+        for(cl = first; cl < last; ++cl) {
+            if((val = fat_read_fat(fs, cl, &err)) == FAT_INVALID_CLUSTER)
+                return -err;
+
+            if(!val) {
+                fs->free_map[cl >> 5] |= 1U << (cl & 31);
+                ++nfree;
+            }
+        }
+    }
+    else {
+        /* Read the whole range of the FAT with one read. Anything that is
+           dirty in the FAT cache has to make it to the disk first. */
+        shift = fs->sb.fs_type == FAT_FS_FAT32 ? 2 : 1;
+        sn = fs->sb.reserved_sectors + (((chunk << FAT_MAP_CHUNK_BITS) <<
+                                         shift) / bps);
+        off = ((first - (chunk << FAT_MAP_CHUNK_BITS)) << shift) & (bps - 1);
+        count = (((last - (chunk << FAT_MAP_CHUNK_BITS)) << shift) + bps - 1) /
+            bps;
+
+        if((err = blockcache_writeback_range(fs->fcache, sn, count)) < 0)
+            return err;
+
+        /* The buffer goes straight to the device, which may DMA into it. */
+        if(!(buf = (uint8_t *)memalign(32, count * bps)))
+            return -ENOMEM;
+
+        if(fs->dev->read_blocks(fs->dev, sn, count, buf)) {
+            free(buf);
+            return -EIO;
+        }
+
+        for(cl = first; cl < last; ++cl, off += 1 << shift) {
+            if(shift == 2)
+                val = (buf[off] | (buf[off + 1] << 8) | (buf[off + 2] << 16) |
+                       (buf[off + 3] << 24)) & 0x0FFFFFFF;
+            else
+                val = buf[off] | (buf[off + 1] << 8);
+
+            if(!val) {
+                fs->free_map[cl >> 5] |= 1U << (cl & 31);
+                ++nfree;
+            }
+        }
+
+        free(buf);
+    }
+
+    fs->chunk_free[chunk] = nfree;
+
+    /* Once the whole FAT has been seen, we know exactly how many clusters
+       are free, no matter what the FSinfo sector said. */
+    if(!--fs->map_unscanned) {
+        for(nfree = 0, chunk = 0; chunk < fs->map_chunks; ++chunk)
+            nfree += fs->chunk_free[chunk];
+
+        fs->sb.free_clusters = nfree;
+    }
+
+    return 0;
+}
+
+/* Keep the free cluster count (and map) in sync with a change to the FAT. */
+static void fat_map_update(fat_fs_t *fs, uint32_t cl, int was_free,
+                           int is_free) {
+    uint32_t chunk = cl >> FAT_MAP_CHUNK_BITS;
+
+    if(was_free == is_free)
+        return;
+
+    if(fs->sb.free_clusters != FAT_FREE_UNKNOWN)
+        fs->sb.free_clusters += is_free ? 1 : -1;
+
+    if(!fs->free_map || fs->chunk_free[chunk] == FAT_MAP_UNSCANNED)
+        return;
+
+    if(is_free) {
+        fs->free_map[cl >> 5] |= 1U << (cl & 31);
+        ++fs->chunk_free[chunk];
+    }
+    else {
+        fs->free_map[cl >> 5] &= ~(1U << (cl & 31));
+        --fs->chunk_free[chunk];
+    }
+}
+
+/* Look for a run of want free clusters in a chunk, starting at cl. If there
+   isn't one, return the start of the longest run found. */
+static uint32_t fat_map_find_run(fat_fs_t *fs, uint32_t chunk, uint32_t cl,
+                                 uint32_t want) {
+    uint32_t last = (chunk + 1) << FAT_MAP_CHUNK_BITS;
+    uint32_t run = 0, start = 0, best = 0, best_start = FAT_INVALID_CLUSTER;
+
+    if(last > fs->sb.num_clusters + 2)
+        last = fs->sb.num_clusters + 2;
+
+    while(cl < last) {
+        /* Skip over completely used words quickly. */
+        if(!(cl & 31) && !fs->free_map[cl >> 5]) {
+            run = 0;
+            cl += 32;
+            continue;
+        }
+
+        if(map_test(fs->free_map, cl)) {
+            if(!run++)
+                start = cl;
+
+            if(run > best) {
+                best = run;
+                best_start = start;
+
+                if(run >= want)
+                    break;
+            }
+        }
+        else {
+            run = 0;
+        }
+
+        ++cl;
+    }
+
+    return best_start;
+}
+
+static uint32_t fat_map_alloc(fat_fs_t *fs, uint32_t hint, uint32_t want,
+                              int *err) {
+    uint32_t total = fs->sb.num_clusters + 2, chunk, start, cl, i;
+    int rv;
+
+    /* If we can, just keep extending the run the previous cluster is in. */
+    if(hint >= 2 && hint + 1 < total) {
+        if((rv = fat_map_scan(fs, (hint + 1) >> FAT_MAP_CHUNK_BITS)) < 0) {
+            *err = -rv;
+            return FAT_INVALID_CLUSTER;
+        }
+
+        if(map_test(fs->free_map, hint + 1))
+            return hint + 1;
+    }
+
+    if(!want)
+        want = 1;
+    else if(want > FAT_MAP_CHUNK)
+        want = FAT_MAP_CHUNK;
+
+    /* Otherwise, look for room for the whole run in the first chunk that has
+       any free space, starting from where the last allocation left off. */
+    start = fs->sb.last_alloc_cluster + 1;
+
+    if(start < 2 || start >= total)
+        start = 2;
+
+    chunk = start >> FAT_MAP_CHUNK_BITS;
+
+    for(i = 0; i <= fs->map_chunks; ++i) {
+        if((rv = fat_map_scan(fs, chunk)) < 0) {
+            *err = -rv;
+            return FAT_INVALID_CLUSTER;
+        }
+
+        if(fs->chunk_free[chunk]) {
+            cl = fat_map_find_run(fs, chunk, i ? chunk << FAT_MAP_CHUNK_BITS :
+                                  start, want);
+
+            if(cl != FAT_INVALID_CLUSTER)
+                return cl;
+        }
+
+        if(++chunk == fs->map_chunks)
+            chunk = 0;
+    }
+
+    *err = ENOSPC;
+    return FAT_INVALID_CLUSTER;
+}
+
 int fat_write_fat(fat_fs_t *fs, uint32_t cl, uint32_t val) {
-    uint32_t sn, off;
+    uint32_t sn, off, old;
     uint8_t *blk, *blk2;
     int err;
 
@@ -222,17 +386,22 @@ int fat_write_fat(fat_fs_t *fs, uint32_t cl, uint32_t val) {
     if(!(fs->mnt_flags & FAT_MNT_FLAG_RW))
         return -EROFS;
 
+    /* Grab the old value, so we can keep track of the free clusters. */
+    err = 0;
+
+    if((old = fat_read_fat(fs, cl, &err)) == FAT_INVALID_CLUSTER && err)
+        return -err;
+
     /* Figure out what sector the value is on... */
     switch(fs->sb.fs_type) {
         case FAT_FS_FAT32:
-            cl <<= 2;
-            sn = fs->sb.reserved_sectors + (cl / fs->sb.bytes_per_sector);
-            off = cl & (fs->sb.bytes_per_sector - 1);
+            sn = fs->sb.reserved_sectors + ((cl << 2) / fs->sb.bytes_per_sector);
+            off = (cl << 2) & (fs->sb.bytes_per_sector - 1);
 
             /* Read the FAT block. */
             blk = fat_read_fatblock(fs, sn, &err);
             if(!blk)
-                return err;
+                return -err;
 
             blk[off] = (uint8_t)val;
             blk[off + 1] = (uint8_t)(val >> 8);
@@ -246,14 +415,13 @@ int fat_write_fat(fat_fs_t *fs, uint32_t cl, uint32_t val) {
             break;
 
         case FAT_FS_FAT16:
-            cl <<= 1;
-            sn = fs->sb.reserved_sectors + (cl / fs->sb.bytes_per_sector);
-            off = cl & (fs->sb.bytes_per_sector - 1);
+            sn = fs->sb.reserved_sectors + ((cl << 1) / fs->sb.bytes_per_sector);
+            off = (cl << 1) & (fs->sb.bytes_per_sector - 1);
 
             /* Read the FAT block. */
             blk = fat_read_fatblock(fs, sn, &err);
             if(!blk)
-                return err;
+                return -err;
 
             blk[off] = (uint8_t)val;
             blk[off + 1] = (uint8_t)(val >> 8);
@@ -270,7 +438,7 @@ int fat_write_fat(fat_fs_t *fs, uint32_t cl, uint32_t val) {
             /* Read the FAT block. */
             blk = fat_read_fatblock(fs, sn, &err);
             if(!blk)
-                return err;
+                return -err;
 
             /* See if we have the very special case of the entry spanning two
                blocks... This is why we can't have nice things... */
@@ -278,7 +446,7 @@ int fat_write_fat(fat_fs_t *fs, uint32_t cl, uint32_t val) {
                 blk2 = fat_read_fatblock(fs, sn + 1, &err);
 
                 if(!blk2)
-                    return err;
+                    return -err;
 
                 /* The bright side here is that we at least know that the
                    cluster number is odd... */
@@ -308,6 +476,7 @@ int fat_write_fat(fat_fs_t *fs, uint32_t cl, uint32_t val) {
             break;
     }
 
+    fat_map_update(fs, cl, !(old & 0x0FFFFFFF), !(val & 0x0FFFFFFF));
     return 0;
 }
 
@@ -326,18 +495,14 @@ int fat_is_eof(fat_fs_t *fs, uint32_t cl) {
     return -1;
 }
 
-uint32_t fat_allocate_cluster(fat_fs_t *fs, int *err) {
+/* Find and allocate a free cluster by searching through the FAT itself. This is
+   only used if there isn't enough memory for the free cluster map. */
+static uint32_t fat_allocate_cluster_scan(fat_fs_t *fs, int *err) {
     uint32_t sn, off, val;
     uint8_t *blk;
     uint32_t cl, i, cps, last;
     int tries = 1;
 
-    /* Don't let us write to the FAT if we're on a read-only FS. */
-    if(!(fs->mnt_flags & FAT_MNT_FLAG_RW)) {
-        *err = EROFS;
-        return FAT_INVALID_CLUSTER;
-    }
-
     i = fs->sb.last_alloc_cluster + 1;
     last = fs->sb.num_clusters + 2;
 
@@ -372,7 +537,10 @@ retry_fat32:
                     fat_fatblock_mark_dirty(fs, sn);
 
                     fs->sb.last_alloc_cluster = i;
-                    --fs->sb.free_clusters;
+
+                    if(fs->sb.free_clusters != FAT_FREE_UNKNOWN)
+                        --fs->sb.free_clusters;
+
                     return i;
                 }
 
@@ -424,6 +592,10 @@ retry_fat16:
                     fat_fatblock_mark_dirty(fs, sn);
 
                     fs->sb.last_alloc_cluster = i;
+
+                    if(fs->sb.free_clusters != FAT_FREE_UNKNOWN)
+                        --fs->sb.free_clusters;
+
                     return i;
                 }
 
@@ -457,10 +629,13 @@ retry_fat16:
                 ++i) {
                 if(!(cl = fat_read_fat(fs, i, err))) {
                     /* Allocate it by adding in an end of chain marker. */
-                    if((*err = fat_write_fat(fs, i, 0x0FFF)) < 0)
+                    if((*err = fat_write_fat(fs, i, 0x0FFF)) < 0) {
+                        *err = -*err;
                         return FAT_INVALID_CLUSTER;
+                    }
 
                     fs->sb.last_alloc_cluster = i;
+                    return i;
                 }
                 else if(cl == FAT_INVALID_CLUSTER) {
                     return cl;
@@ -470,10 +645,13 @@ retry_fat16:
             for(i = 2; i < fs->sb.last_alloc_cluster + 1; ++i) {
                 if(!(cl = fat_read_fat(fs, i, err))) {
                     /* Allocate it by adding in an end of chain marker. */
-                    if((*err = fat_write_fat(fs, i, 0x0FFF)) < 0)
+                    if((*err = fat_write_fat(fs, i, 0x0FFF)) < 0) {
+                        *err = -*err;
                         return FAT_INVALID_CLUSTER;
+                    }
 
                     fs->sb.last_alloc_cluster = i;
+                    return i;
                 }
                 else if(cl == FAT_INVALID_CLUSTER) {
                     return cl;
@@ -492,6 +670,49 @@ retry_fat16:
     return val;
 }
 
+uint32_t fat_allocate_cluster_ex(fat_fs_t *fs, uint32_t hint, uint32_t want,
+                                 int *err) {
+    uint32_t cl, i;
+    int rv;
+
+    /* Don't let us write to the FAT if we're on a read-only FS. */
+    if(!(fs->mnt_flags & FAT_MNT_FLAG_RW)) {
+        *err = EROFS;
+        return FAT_INVALID_CLUSTER;
+    }
+
+    if(!fs->free_map && fat_map_init(fs) < 0)
+        return fat_allocate_cluster_scan(fs, err);
+
+    if((cl = fat_map_alloc(fs, hint, want, err)) == FAT_INVALID_CLUSTER)
+        return cl;
+
+    /* Put an end of chain marker in to allocate it. */
+    if((rv = fat_write_fat(fs, cl, 0x0FFFFFFF)) < 0) {
+        *err = -rv;
+        return FAT_INVALID_CLUSTER;
+    }
+
+    fs->sb.last_alloc_cluster = cl;
+
+    /* If the FSinfo sector didn't tell us how many clusters are free, read
+       in another chunk of the map, so that we eventually find out. */
+    if(fs->sb.free_clusters == FAT_FREE_UNKNOWN) {
+        for(i = 0; i < fs->map_chunks; ++i) {
+            if(fs->chunk_free[i] == FAT_MAP_UNSCANNED) {
+                fat_map_scan(fs, i);
+                break;
+            }
+        }
+    }
+
+    return cl;
+}
+
+uint32_t fat_allocate_cluster(fat_fs_t *fs, int *err) {
+    return fat_allocate_cluster_ex(fs, 0, 1, err);
+}
+
 /* This function could be made better/more optimized... However, it takes the
    simplest/most clear approach to this for now. */
 int fat_erase_chain(fat_fs_t *fs, uint32_t cluster) {
@@ -517,7 +738,6 @@ int fat_erase_chain(fat_fs_t *fs, uint32_t cluster) {
         }
 
         cluster = next;
-        ++fs->sb.free_clusters;
     }
 
     return 0;
@@ -16,110 +16,19 @@
 #include "bpb.h"
 #include "fatinternal.h"
 
-/* This is basically the same as bgrad_cache from fs_iso9660 */
-static void make_mru(fat_fs_t *fs, fat_cache_t **cache, int block) {
-    int i;
-    fat_cache_t *tmp;
-
-    /* Don't try it with the end block */
-    if(block < 0 || block >= fs->cache_size - 1)
-        return;
-
-    /* Make a copy and scoot everything down */
-    tmp = cache[block];
-
-    for(i = block; i < fs->cache_size - 1; ++i) {
-        cache[i] = cache[i + 1];
-    }
-
-    cache[fs->cache_size - 1] = tmp;
-}
-
 /* XXXX: This needs locking! */
 uint8_t *fat_cluster_read(fat_fs_t *fs, uint32_t cl, int *err) {
-    int i;
-    uint8_t *rv;
-    fat_cache_t **cache = fs->bcache;
-
-    /* Look through the cache from the most recently used to the least recently
-       used entry. */
-    for(i = fs->cache_size - 1; i >= 0; --i) {
-        if(cache[i]->block == cl && cache[i]->flags) {
-            rv = cache[i]->data;
-            make_mru(fs, cache, i);
-            goto out;
-        }
-    }
-
-    /* If we didn't get anything, did we end up with an invalid entry or do we
-       need to boot someone out? */
-    if(i < 0) {
-        i = 0;
-
-        /* Make sure that if the block is dirty, we write it back out. */
-        if(cache[0]->flags & FAT_CACHE_FLAG_DIRTY) {
-            if(fat_cluster_write_nc(fs, cache[0]->block, cache[0]->data)) {
-                /* XXXX: Uh oh... */
-                *err = EIO;
-                return NULL;
-            }
-        }
-    }
-
-    /* Try to read the block in question. */
-    if(fat_cluster_read_nc(fs, cl, cache[i]->data)) {
-        *err = EIO;
-        cache[i]->flags = 0;            /* Mark it as invalid... */
-        return NULL;
-    }
-
-    cache[i]->block = cl;
-    cache[i]->flags = FAT_CACHE_FLAG_VALID;
-    rv = cache[i]->data;
-    make_mru(fs, cache, i);
-
-out:
-    return rv;
+    return blockcache_read(fs->bcache, cl, err);
 }
 
 uint8_t *fat_cluster_clear(fat_fs_t *fs, uint32_t cl, int *err) {
-    int i;
     uint8_t *rv;
-    fat_cache_t **cache = fs->bcache;
-
-    /* Look through the cache from the most recently used to the least recently
-       used entry. */
-    for(i = fs->cache_size - 1; i >= 0; --i) {
-        if(cache[i]->block == cl && cache[i]->flags) {
-            rv = cache[i]->data;
-            make_mru(fs, cache, i);
-            goto out;
-        }
-    }
-
-    /* If we didn't get anything, did we end up with an invalid entry or do we
-       need to boot someone out? */
-    if(i < 0) {
-        i = 0;
-
-        /* Make sure that if the block is dirty, we write it back out. */
-        if(cache[0]->flags & FAT_CACHE_FLAG_DIRTY) {
-            if(fat_cluster_write_nc(fs, cache[0]->block, cache[0]->data)) {
-                /* XXXX: Uh oh... */
-                *err = EIO;
-                return NULL;
-            }
-        }
-    }
 
     /* Don't bother reading the cluster from disk, since we're erasing it
        anyway... */
-    cache[i]->block = cl;
-    cache[i]->flags = FAT_CACHE_FLAG_VALID | FAT_CACHE_FLAG_DIRTY;
-    rv = cache[i]->data;
-    make_mru(fs, cache, i);
+    if(!(rv = blockcache_get(fs->bcache, cl, err)))
+        return NULL;
 
-out:
     memset(rv, 0, fs->sb.bytes_per_sector * fs->sb.sectors_per_cluster);
     return rv;
 }
@@ -181,41 +90,91 @@ int fat_cluster_write_nc(fat_fs_t *fs, uint32_t cluster, const uint8_t *blk) {
 }
 
 int fat_cluster_mark_dirty(fat_fs_t *fs, uint32_t cluster) {
-    int i;
-    fat_cache_t **cache = fs->bcache;
-
-    /* Look through the cache from the most recently used to the least recently
-       used entry. */
-    for(i = fs->cache_size - 1; i >= 0; --i) {
-        if(cache[i]->block == cluster && cache[i]->flags) {
-            cache[i]->flags |= FAT_CACHE_FLAG_DIRTY;
-            make_mru(fs, cache, i);
-            return 0;
-        }
+    return blockcache_mark_dirty(fs->bcache, cluster);
+}
+
+/* Read a run of contiguous clusters straight from the device. */
+static int fat_clusters_read_nc(fat_fs_t *fs, uint32_t cl, uint32_t count,
+                                uint8_t *buf) {
+    uint32_t spc = fs->sb.sectors_per_cluster;
+
+    if(cl < 2 || cl + count > fs->sb.num_clusters + 2)
+        return -EINVAL;
+
+    if(fs->dev->read_blocks(fs->dev, (cl - 2) * spc + fs->sb.first_data_block,
+                            spc * count, buf))
+        return -EIO;
+
+    return 0;
+}
+
+int fat_cluster_prefetch(fat_fs_t *fs, uint32_t cl, uint32_t count) {
+    uint32_t cs = fs->sb.bytes_per_sector * fs->sb.sectors_per_cluster, i;
+    uint8_t *buf;
+    int rv;
+
+    /* Don't bother re-reading the clusters at either end of the run that are
+       already in the cache. */
+    while(count && blockcache_lookup(fs->bcache, cl)) {
+        ++cl;
+        --count;
     }
 
-    return -EINVAL;
+    while(count && blockcache_lookup(fs->bcache, cl + count - 1))
+        --count;
+
+    if(!count)
+        return 0;
+
+    if(!(buf = (uint8_t *)memalign(32, cs * count)))
+        return -ENOMEM;
+
+    if(!(rv = fat_clusters_read_nc(fs, cl, count, buf))) {
+        for(i = 0; i < count && !rv; ++i)
+            rv = blockcache_insert(fs->bcache, cl + i, buf + i * cs);
+    }
+
+    free(buf);
+    return rv;
 }
 
-int fat_cluster_cache_wb(fat_fs_t *fs) {
-    int i, err;
-    fat_cache_t **cache = fs->bcache;
+int fat_cluster_read_direct(fat_fs_t *fs, uint32_t cl, uint32_t count,
+                            uint8_t *buf) {
+    int rv;
 
+    /* Make sure the device has the latest copy of the clusters first. */
+    if((fs->mnt_flags & FAT_MNT_FLAG_RW) &&
+       (rv = blockcache_writeback_range(fs->bcache, cl, count)) < 0)
+        return rv;
+
+    return fat_clusters_read_nc(fs, cl, count, buf);
+}
+
+int fat_cluster_cached(fat_fs_t *fs, uint32_t cl) {
+    return blockcache_lookup(fs->bcache, cl) != NULL;
+}
+
+uint32_t fat_cluster_cache_size(const fat_fs_t *fs) {
+    return (uint32_t)blockcache_size(fs->bcache);
+}
+
+int fat_cluster_cache_wb(fat_fs_t *fs) {
     /* Don't even bother if we're mounted read-only. */
     if(!(fs->mnt_flags & FAT_MNT_FLAG_RW))
         return 0;
 
-    for(i = fs->cache_size - 1; i >= 0; --i) {
-        if(cache[i]->flags & FAT_CACHE_FLAG_DIRTY) {
-            if((err = fat_cluster_write_nc(fs, cache[i]->block,
-                                           cache[i]->data)))
-                return err;
+    return blockcache_writeback(fs->bcache);
+}
 
-            cache[i]->flags &= ~FAT_CACHE_FLAG_DIRTY;
-        }
-    }
+/* Callbacks for the cluster cache. */
+static int fat_cluster_cache_read(void *data, uint64_t cl, void *buf) {
+    return fat_cluster_read_nc((fat_fs_t *)data, (uint32_t)cl,
+                               (uint8_t *)buf);
+}
 
-    return 0;
+static int fat_cluster_cache_write(void *data, uint64_t cl, const void *buf) {
+    return fat_cluster_write_nc((fat_fs_t *)data, (uint32_t)cl,
+                                (const uint8_t *)buf);
 }
 
 static inline uint32_t ilog2(uint32_t i) {
@@ -265,7 +224,6 @@ fat_fs_t *fat_fs_init(kos_blockdev_t *bd, uint32_t flags) {
 fat_fs_t *fat_fs_init_ex(kos_blockdev_t *bd, uint32_t flags, int cache_sz,
                          int fcache_sz) {
     fat_fs_t *rv;
-    int j;
     int block_size, cluster_size;
 
     if(bd->init(bd)) {
@@ -278,6 +236,8 @@ fat_fs_t *fat_fs_init_ex(kos_blockdev_t *bd, uint32_t flags, int cache_sz,
     }
 
     rv->dev = bd;
+    rv->free_map = NULL;
+    rv->chunk_free = NULL;
     rv->mnt_flags = flags & FAT_MNT_VALID_FLAGS_MASK;
 
     if(rv->mnt_flags != flags) {
@@ -302,81 +262,25 @@ fat_fs_t *fat_fs_init_ex(kos_blockdev_t *bd, uint32_t flags, int cache_sz,
     cluster_size = rv->sb.bytes_per_sector * rv->sb.sectors_per_cluster;
 
     /* Make space for the block cache. */
-    if(!(rv->bcache = (fat_cache_t **)malloc(sizeof(fat_cache_t *) *
-                                             cache_sz))) {
+    if(!(rv->bcache = blockcache_create_ex(cluster_size, cache_sz,
+                                           fat_cluster_cache_read,
+                                           fat_cluster_cache_write, rv))) {
         free(rv);
         bd->shutdown(bd);
         return NULL;
     }
 
-    for(j = 0; j < cache_sz; ++j) {
-        if(!(rv->bcache[j] = (fat_cache_t *)malloc(sizeof(fat_cache_t)))) {
-            goto out_cache;
-        }
-    }
-
-    for(j = 0; j < cache_sz; ++j) {
-        if(!(rv->bcache[j]->data = (uint8_t *)memalign(32, cluster_size))) {
-            goto out_bcache;
-        }
-
-        rv->bcache[j]->flags = 0;
-    }
-
-    rv->cache_size = cache_sz;
-
     /* Make space for the FAT block cache. */
-    if(!(rv->fcache = (fat_cache_t **)malloc(sizeof(fat_cache_t *) *
-                                             fcache_sz))) {
-        goto out_bcache;
-    }
-
-    for(j = 0; j < fcache_sz; ++j) {
-        if(!(rv->fcache[j] = (fat_cache_t *)malloc(sizeof(fat_cache_t)))) {
-            goto out_fcache;
-        }
-    }
-
-    for(j = 0; j < fcache_sz; ++j) {
-        if(!(rv->fcache[j]->data = (uint8_t *)memalign(32, block_size))) {
-            goto out_fcache2;
-        }
-
-        rv->fcache[j]->flags = 0;
+    if(!(rv->fcache = blockcache_create_ex(block_size, fcache_sz,
+                                           fat_fatblock_cache_read,
+                                           fat_fatblock_cache_write, rv))) {
+        blockcache_destroy(rv->bcache);
+        free(rv);
+        bd->shutdown(bd);
+        return NULL;
     }
 
-    rv->fcache_size = fcache_sz;
     return rv;
-
-out_fcache2:
-    for(; j >= 0; --j) {
-        free(rv->fcache[j]->data);
-    }
-
-    j = fcache_sz - 1;
-
-out_fcache:
-    for(; j >= 0; --j) {
-        free(rv->fcache[j]);
-    }
-
-    free(rv->fcache);
-
-out_bcache:
-    for(; j >= 0; --j) {
-        free(rv->bcache[j]->data);
-    }
-
-    j = cache_sz - 1;
-out_cache:
-    for(; j >= 0; --j) {
-        free(rv->bcache[j]);
-    }
-
-    free(rv->bcache);
-    free(rv);
-    bd->shutdown(bd);
-    return NULL;
 }
 
 int fat_fs_sync(fat_fs_t *fs) {
@@ -415,22 +319,12 @@ int fat_fs_sync(fat_fs_t *fs) {
 }
 
 void fat_fs_shutdown(fat_fs_t *fs) {
-    int i;
-
     /* Sync the filesystem back to the block device, if needed. */
     fat_fs_sync(fs);
 
-    for(i = 0; i < fs->cache_size; ++i) {
-        free(fs->bcache[i]->data);
-        free(fs->bcache[i]);
-    }
-
-    free(fs->bcache);
-
-    for(i = 0; i < fs->fcache_size; ++i) {
-        free(fs->fcache[i]->data);
-        free(fs->fcache[i]);
-    }
+    blockcache_destroy(fs->bcache);
+    blockcache_destroy(fs->fcache);
+    fat_map_free(fs);
 
     fs->dev->shutdown(fs->dev);
     free(fs);
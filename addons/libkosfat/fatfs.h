@@ -91,6 +91,18 @@ int fat_cluster_write_nc(fat_fs_t *fs, uint32_t cluster, const uint8_t *blk);
 
 int fat_cluster_mark_dirty(fat_fs_t *fs, uint32_t cluster);
 
+/* Read count contiguous clusters, starting at cl, into the cluster cache with
+   a single device read. Clusters that are already cached are left alone. */
+int fat_cluster_prefetch(fat_fs_t *fs, uint32_t cl, uint32_t count);
+uint32_t fat_cluster_cache_size(const fat_fs_t *fs);
+
+/* Read count contiguous clusters, starting at cl, straight into buf, without
+   going through the cluster cache. Dirty cached copies of the clusters are
+   written back first. */
+int fat_cluster_read_direct(fat_fs_t *fs, uint32_t cl, uint32_t count,
+                            uint8_t *buf);
+int fat_cluster_cached(fat_fs_t *fs, uint32_t cl);
+
 uint32_t fat_block_size(const fat_fs_t *fs);
 uint32_t fat_log_block_size(const fat_fs_t *fs);
 uint32_t fat_cluster_size(const fat_fs_t *fs);
@@ -121,6 +133,12 @@ uint32_t fat_read_fat(fat_fs_t *fs, uint32_t cl, int *err);
 int fat_write_fat(fat_fs_t *fs, uint32_t cl, uint32_t val);
 int fat_is_eof(fat_fs_t *fs, uint32_t cl);
 uint32_t fat_allocate_cluster(fat_fs_t *fs, int *err);
+
+/* Allocate a cluster to follow hint in a chain (or 0 for a new chain), trying
+   to keep the chain contiguous. If the cluster after hint is in use, look for
+   room for want contiguous clusters. */
+uint32_t fat_allocate_cluster_ex(fat_fs_t *fs, uint32_t hint, uint32_t want,
+                                 int *err);
 int fat_erase_chain(fat_fs_t *fs, uint32_t cluster);
 
 __END_DECLS
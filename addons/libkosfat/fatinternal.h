@@ -10,31 +10,38 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#include "bpb.h"
-
-#define FAT_CACHE_FLAG_VALID    1
-#define FAT_CACHE_FLAG_DIRTY    2
+#include <kos/blockcache.h>
 
-typedef struct fat_cache {
-    uint32_t flags;
-    uint32_t block;
-    uint8_t *data;
-} fat_cache_t;
+#include "bpb.h"
 
 struct fatfs_struct {
     kos_blockdev_t *dev;
     fat_superblock_t sb;
 
-    fat_cache_t **bcache;
-    int cache_size;
+    kos_blockcache_t *bcache;
+    kos_blockcache_t *fcache;
 
-    fat_cache_t **fcache;
-    int fcache_size;
+    /* Free cluster map (one bit per cluster, set if the cluster is free) and
+       the number of free clusters in each of its chunks, in fat.c. Only
+       allocated once something needs to allocate a cluster. */
+    uint32_t *free_map;
+    uint32_t *chunk_free;
+    uint32_t map_chunks;
+    uint32_t map_unscanned;
 
     uint32_t flags;
     uint32_t mnt_flags;
 };
 
+/* Block cache I/O callbacks for the FAT itself, in fat.c. */
+int fat_fatblock_cache_read(void *data, uint64_t bn, void *buf);
+int fat_fatblock_cache_write(void *data, uint64_t bn, const void *buf);
+
+void fat_map_free(fat_fs_t *fs);
+
+/* Value of the free cluster count when it isn't known. */
+#define FAT_FREE_UNKNOWN    0xFFFFFFFF
+
 /* The BPB/FSinfo blocks need to be written back to the block device... */
 #define FAT_FS_FLAG_SB_DIRTY   1
 
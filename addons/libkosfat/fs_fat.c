@@ -17,6 +17,7 @@
 #include <kos/fs.h>
 #include <kos/mutex.h>
 #include <kos/dbglog.h>
+#include <kos/worker_thread.h>
 
 #include <fat/fs_fat.h>
 
@@ -35,6 +36,24 @@ char *strdup(const char *);
 
 #define MAX_FAT_FILES 16
 
+/* Read-ahead parameters. A file handle is considered to be read sequentially
+   once FAT_RA_SEQ_READS reads in a row have started where the previous one
+   ended. The read-ahead worker then reads up to the handle's window ahead of
+   the file pointer, in runs of contiguous clusters of at most FAT_RA_MAX_RUN
+   bytes each, dropping the lock between runs so that readers don't have to
+   wait for the whole window. */
+#define FAT_RA_SEQ_READS    2
+#define FAT_RA_DEFAULT      (64 * 1024)
+#define FAT_RA_MAX_RUN      (64 * 1024)
+
+/* Reads of at least FAT_DIRECT_MIN contiguous clusters into a buffer aligned
+   on FAT_DIRECT_ALIGN bytes (enough for DMA) bypass the cluster cache, and are
+   read straight into the caller's buffer, up to FAT_DIRECT_MAX bytes at a
+   time. */
+#define FAT_DIRECT_MIN      2
+#define FAT_DIRECT_MAX      (1024 * 1024)
+#define FAT_DIRECT_ALIGN    32
+
 typedef struct fs_fat_fs {
     LIST_ENTRY(fs_fat_fs) entry;
 
@@ -60,8 +79,19 @@ static struct {
     uint32_t ptr;
     dirent_t dent;
     fs_fat_fs_t *fs;
+
+    /* Read-ahead state. ra_end is the cluster order up to which the file has
+       been read ahead. */
+    uint32_t ra_window;
+    uint32_t ra_next;
+    uint32_t ra_end;
+    int ra_seq;
+    int ra_queued;
+    kthread_job_t ra_job;
 } fh[MAX_FAT_FILES];
 
+static kthread_worker_t *ra_worker;
+
 static uint16_t longname_buf[256];
 
 static int fat_create_entry(fat_fs_t *fs, const char *fn, uint8_t attr,
@@ -137,7 +167,11 @@ static int fat_create_entry(fat_fs_t *fs, const char *fn, uint8_t attr,
     return 0;
 }
 
-static int advance_cluster(fat_fs_t *fs, int fd, uint32_t order, int write) {
+/* Move the handle to the cluster of the given order in the file. If alloc is
+   non-zero, clusters are allocated as needed to get there, trying to make
+   room for alloc contiguous clusters in total. */
+static int advance_cluster(fat_fs_t *fs, int fd, uint32_t order,
+                           uint32_t alloc) {
     uint32_t clo, cl, cl2;
     int err;
 
@@ -166,15 +200,16 @@ static int advance_cluster(fat_fs_t *fs, int fd, uint32_t order, int write) {
         else if(fat_is_eof(fs, cl2)) {
             /* If we've hit the EOF and we're writing, we need to allocate a new
                cluster to the file. If we're reading, then return error. */
-            if(!write) {
+            if(!alloc) {
                 fh[fd].cluster = cl2;
                 fh[fd].cluster_order = clo;
                 fh[fd].mode &= ~0x80000000;
                 return -EDOM;
             }
             else {
-                /* Allocate a new cluster */
-                cl2 = fat_allocate_cluster(fs, &err);
+                /* Allocate a new cluster, right after the last one if we
+                   can. */
+                cl2 = fat_allocate_cluster_ex(fs, cl, alloc, &err);
 
                 if(cl2 == FAT_INVALID_CLUSTER) {
                     return -err;
@@ -204,6 +239,176 @@ static int advance_cluster(fat_fs_t *fs, int fd, uint32_t order, int write) {
     return 0;
 }
 
+/* Limit the read-ahead window to half of the cluster cache, so that reading
+   ahead doesn't evict the clusters that are about to be read. */
+static uint32_t fat_ra_clamp(fat_fs_t *fs, uint32_t window) {
+    uint32_t bs = fat_cluster_size(fs);
+    uint32_t max = (fat_cluster_cache_size(fs) / 2) * bs;
+
+    if(window > max)
+        window = max;
+
+    return window & ~(bs - 1);
+}
+
+/* Read ahead of the file pointer of a handle. Called from the read-ahead
+   worker, without fat_mutex held. */
+static void fat_readahead(file_t fd) {
+    fat_fs_t *fs;
+    uint32_t bs, cl, next, order, run, max_run;
+    uint64_t end;
+    int err;
+
+    mutex_lock(&fat_mutex);
+    fh[fd].ra_queued = 0;
+
+    for(;;) {
+        /* The handle may have been closed or seeked since the job was queued,
+           in which case there is nothing (more) to do. */
+        if(!fh[fd].opened || !fh[fd].ra_window ||
+           fh[fd].ra_seq < FAT_RA_SEQ_READS || (fh[fd].mode & 0x80000000))
+            break;
+
+        fs = fh[fd].fs->fs;
+        bs = fat_cluster_size(fs);
+        cl = fh[fd].cluster;
+        order = fh[fd].cluster_order;
+
+        /* Figure out where the window ends, without going past the end of
+           the file. */
+        end = fh[fd].dentry.size;
+
+        if((uint64_t)fh[fd].ptr + fh[fd].ra_window < end)
+            end = (uint64_t)fh[fd].ptr + fh[fd].ra_window;
+
+        end = (end + bs - 1) / bs;
+
+        if(fh[fd].ra_end < order)
+            fh[fd].ra_end = order;
+
+        if(fh[fd].ra_end >= end || fat_is_eof(fs, cl))
+            break;
+
+        /* Follow the chain up to where we stopped last time around... */
+        while(order < fh[fd].ra_end) {
+            cl = fat_read_fat(fs, cl, &err);
+
+            if(cl == FAT_INVALID_CLUSTER || fat_is_eof(fs, cl))
+                goto out;
+
+            ++order;
+        }
+
+        /* ... and see how many contiguous clusters we can read at once. */
+        max_run = FAT_RA_MAX_RUN / bs;
+        if(!max_run)
+            max_run = 1;
+
+        for(run = 1; order + run < end && run < max_run; ++run) {
+            next = fat_read_fat(fs, cl + run - 1, &err);
+
+            if(next != cl + run)
+                break;
+        }
+
+        if(fat_cluster_prefetch(fs, cl, run) < 0)
+            break;
+
+        fh[fd].ra_end = order + run;
+
+        /* Let any waiting reader in before reading the next run. */
+        mutex_unlock(&fat_mutex);
+        thd_pass();
+        mutex_lock(&fat_mutex);
+    }
+
+out:
+    mutex_unlock(&fat_mutex);
+}
+
+static void fat_readahead_thd(void *d) {
+    kthread_job_t *job;
+
+    (void)d;
+
+    while((job = thd_worker_dequeue_job(ra_worker)))
+        fat_readahead((file_t)(uintptr_t)job->data);
+}
+
+/* Queue read-ahead for a handle, if it is being read sequentially and less
+   than half of its window is left ahead of the file pointer. Called with
+   fat_mutex held. */
+static void fat_readahead_queue(file_t fd) {
+    kthread_attr_t attr = { 0 };
+    uint64_t ahead;
+
+    if(fh[fd].ra_seq < FAT_RA_SEQ_READS || !fh[fd].ra_window ||
+       fh[fd].ra_queued)
+        return;
+
+    ahead = (uint64_t)fh[fd].ra_end * fat_cluster_size(fh[fd].fs->fs);
+
+    if(ahead >= fh[fd].dentry.size ||
+       ahead >= (uint64_t)fh[fd].ptr + fh[fd].ra_window / 2)
+        return;
+
+    if(!ra_worker) {
+        attr.label = "fs_fat readahead";
+
+        if(!(ra_worker = thd_worker_create_ex(&attr, fat_readahead_thd,
+                                              NULL)))
+            return;
+    }
+
+    fh[fd].ra_queued = 1;
+    thd_worker_add_job(ra_worker, &fh[fd].ra_job);
+    thd_worker_wakeup(ra_worker);
+}
+
+/* Read as many whole, contiguous clusters as possible from the file pointer
+   straight into buf. Returns the number of clusters read, 0 if the read should
+   go through the cache instead, or a negative errno value on error. */
+static int fat_read_direct(fat_fs_t *fs, file_t fd, uint8_t *buf, size_t cnt) {
+    uint32_t bs = fat_cluster_size(fs);
+    uint32_t cl = fh[fd].cluster, next, run, max;
+    int err;
+
+    if(((uintptr_t)buf & (FAT_DIRECT_ALIGN - 1)) ||
+       cnt < FAT_DIRECT_MIN * bs)
+        return 0;
+
+    /* Don't go to the device for data we already have. */
+    if(fat_cluster_cached(fs, cl))
+        return 0;
+
+    max = cnt / bs;
+
+    if(max > FAT_DIRECT_MAX / bs)
+        max = FAT_DIRECT_MAX / bs;
+
+    for(run = 1;; ++run) {
+        next = fat_read_fat(fs, cl + run - 1, &err);
+
+        if(next == FAT_INVALID_CLUSTER)
+            return -err;
+
+        if(run >= max || next != cl + run)
+            break;
+    }
+
+    if(run < FAT_DIRECT_MIN)
+        return 0;
+
+    if((err = fat_cluster_read_direct(fs, cl, run, buf)) < 0)
+        return err;
+
+    fh[fd].cluster = next;
+    fh[fd].cluster_order += run;
+    fh[fd].ptr += run * bs;
+
+    return (int)run;
+}
+
 static void *fs_fat_open(vfs_handler_t *vfs, const char *fn, int mode) {
     file_t fd;
     fs_fat_fs_t *mnt = (fs_fat_fs_t *)vfs->privdata;
@@ -341,6 +546,11 @@ created:
     fh[fd].cluster = fh[fd].dentry.cluster_low |
         (fh[fd].dentry.cluster_high << 16);
     fh[fd].cluster_order = 0;
+    fh[fd].ra_window = fat_ra_clamp(mnt->fs, FAT_RA_DEFAULT);
+    fh[fd].ra_next = 0;
+    fh[fd].ra_end = 0;
+    fh[fd].ra_seq = 0;
+    fh[fd].ra_job.data = (void *)(uintptr_t)fd;
     fh[fd].opened = 1;
 
     mutex_unlock(&fat_mutex);
@@ -375,7 +585,7 @@ static ssize_t fs_fat_read(void *h, void *buf, size_t cnt) {
     uint8_t *bbuf = (uint8_t *)buf;
     ssize_t rv;
     uint64_t sz, cl;
-    int mode;
+    int mode, run, direct = 0;
 
     mutex_lock(&fat_mutex);
 
@@ -411,6 +621,16 @@ static ssize_t fs_fat_read(void *h, void *buf, size_t cnt) {
         return 0;
     }
 
+    /* Keep track of whether the file is being read sequentially. */
+    if(fh[fd].ptr == fh[fd].ra_next) {
+        if(fh[fd].ra_seq < FAT_RA_SEQ_READS)
+            ++fh[fd].ra_seq;
+    }
+    else {
+        fh[fd].ra_seq = 0;
+        fh[fd].ra_end = 0;
+    }
+
     /* Do we have enough left? */
     if((fh[fd].ptr + cnt) > sz)
         cnt = sz - fh[fd].ptr;
@@ -485,6 +705,26 @@ static ssize_t fs_fat_read(void *h, void *buf, size_t cnt) {
 
     /* While we still have more to read, do it. */
     while(cnt) {
+        /* Big reads go straight from the device to the buffer, if we can. */
+        if((run = fat_read_direct(fs, fd, bbuf, cnt)) < 0) {
+            mutex_unlock(&fat_mutex);
+            errno = -run;
+            return -1;
+        }
+        else if(run) {
+            direct = 1;
+            cnt -= run * bs;
+            bbuf += run * bs;
+
+            if(cnt && fat_is_eof(fs, fh[fd].cluster)) {
+                mutex_unlock(&fat_mutex);
+                errno = EIO;
+                return -1;
+            }
+
+            continue;
+        }
+
         if(!(block = fat_cluster_read(fs, fh[fd].cluster, &errno))) {
             mutex_unlock(&fat_mutex);
             return -1;
@@ -532,6 +772,14 @@ static ssize_t fs_fat_read(void *h, void *buf, size_t cnt) {
         }
     }
 
+    /* Start reading ahead of the reader, if it looks like it'll need it.
+       Reads that go straight to the device don't need it, and it would only
+       get in their way by filling the cache ahead of them. */
+    fh[fd].ra_next = fh[fd].ptr;
+
+    if(!direct)
+        fat_readahead_queue(fd);
+
     /* We're done, clean up and return. */
     mutex_unlock(&fat_mutex);
     return rv;
@@ -576,7 +824,8 @@ static ssize_t fs_fat_write(void *h, const void *buf, size_t cnt) {
     /* Have we had an intervening seek call (or a write that ended exactly on
        a cluster boundary)? */
     if((fh[fd].mode & 0x80000000)) {
-        if((err = advance_cluster(fs, fd, fh[fd].ptr / bs, 1)) < 0) {
+        if((err = advance_cluster(fs, fd, fh[fd].ptr / bs,
+                                  (cnt + bs - 1) / bs)) < 0) {
             mutex_unlock(&fat_mutex);
             errno = -err;
             return -1;
@@ -601,7 +850,7 @@ static ssize_t fs_fat_write(void *h, const void *buf, size_t cnt) {
             cnt -= bs - bo;
 
             if((err = advance_cluster(fs, fd, fh[fd].cluster_order + 1,
-                                      1)) < 0) {
+                                      (cnt + bs - 1) / bs)) < 0) {
                 mutex_unlock(&fat_mutex);
                 errno = -err;
                 return -1;
@@ -638,7 +887,7 @@ static ssize_t fs_fat_write(void *h, const void *buf, size_t cnt) {
             bbuf += bs;
 
             if((err = advance_cluster(fs, fd, fh[fd].cluster_order + 1,
-                                      1)) < 0) {
+                                      (cnt + bs - 1) / bs)) < 0) {
                 mutex_unlock(&fat_mutex);
                 errno = -err;
                 return -1;
@@ -950,8 +1199,6 @@ static int fs_fat_fcntl(void *h, int cmd, va_list ap) {
     file_t fd = ((file_t)h) - 1;
     int rv = -1;
 
-    (void)ap;
-
     mutex_lock(&fat_mutex);
 
     if(fd >= MAX_FAT_FILES || !fh[fd].opened) {
@@ -971,6 +1218,23 @@ static int fs_fat_fcntl(void *h, int cmd, va_list ap) {
             rv = 0;
             break;
 
+        case F_GETRA:
+            rv = (int)fh[fd].ra_window;
+            break;
+
+        case F_SETRA:
+            rv = va_arg(ap, int);
+
+            if(rv < 0) {
+                errno = EINVAL;
+                rv = -1;
+                break;
+            }
+
+            fh[fd].ra_window = fat_ra_clamp(fh[fd].fs->fs, (uint32_t)rv);
+            rv = 0;
+            break;
+
         default:
             errno = EINVAL;
     }
@@ -1496,6 +1760,11 @@ int fs_fat_shutdown(void) {
     if(!initted)
         return 0;
 
+    if(ra_worker) {
+        thd_worker_destroy(ra_worker);
+        ra_worker = NULL;
+    }
+
     /* Clean up the mounted filesystems */
     i = LIST_FIRST(&fat_fses);
     while(i) {
@@ -0,0 +1,231 @@
+/* KallistiOS ##version##
+
+   tq_bench.c
+
+   Timer Queue Microbenchmark
+
+   This program measures the cost of the kernel's timed wait queue, which
+   holds every thread blocked in thd_sleep() or any other genwait_wait() call
+   with a timeout. It starts a number of sleeper threads, at a higher priority
+   than its own, and has them all block in genwait_wait() at once, then wakes
+   them all up early, and finally lets them all time out together.
+
+   Blocking and waking up also cost a context switch and the rest of the
+   genwait work, so the first two phases are run both with and without a
+   timeout, and the difference between the two is what gets reported: the
+   cost of putting a thread in the timer queue, and of taking it back out
+   when it gets woken up before its timeout. For the last phase, the time
+   from the shared deadline until the last thread is running again is
+   reported, so that one includes the context switches (and the latency of
+   the scheduler noticing the deadline to begin with).
+
+   Every thread gets a distinct timeout, handed out in a scrambled order, so
+   the queue doesn't just get filled from one end. The numbers are averages
+   per thread, for an increasing number of threads. They should stay about
+   flat (insertion) or grow slowly (the others) as the number of threads goes
+   up.
+*/
+
+#include <kos/genwait.h>
+#include <kos/thread.h>
+#include <kos/timer.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#define MAX_THREADS     512
+#define STACK_SIZE      8192
+
+/* How many times each measurement is repeated */
+#define ROUNDS          16
+
+/* Timeouts are spread out this far apart (in ms), well past the end of the
+   benchmark, so that they only expire when they're meant to. */
+#define TIMEOUT_BASE    60000
+#define TIMEOUT_STEP    3
+
+/* How far ahead (in ms) the shared deadline is set for the last phase */
+#define EXPIRE_DELAY    100
+
+/* Any odd number will scramble the timeouts, as the thread counts are all
+   powers of two. */
+#define SCRAMBLE        2654435761u
+
+static const unsigned int thread_counts[] = { 16, 64, 128, 256, MAX_THREADS };
+
+typedef enum {
+    MODE_UNTIMED,       /* Wait with no timeout */
+    MODE_TIMED,         /* Wait with a long, distinct timeout */
+    MODE_EXPIRE,        /* Wait until the shared deadline */
+    MODE_QUIT
+} bench_mode_t;
+
+static kthread_t *thds[MAX_THREADS];
+static int objs[MAX_THREADS];
+static unsigned int count;
+static volatile bench_mode_t mode;
+static volatile uint64_t deadline;
+static volatile unsigned int woken;
+static int go;
+
+static void *sleeper(void *param) {
+    unsigned int i = (unsigned int)(uintptr_t)param;
+    unsigned int timeout;
+
+    for(;;) {
+        genwait_wait(&go, "tq_bench go", 0);
+
+        switch(mode) {
+            case MODE_UNTIMED:
+                genwait_wait(&objs[i], "tq_bench", 0);
+                break;
+
+            case MODE_TIMED:
+                timeout = TIMEOUT_BASE +
+                          ((i * SCRAMBLE) & (count - 1)) * TIMEOUT_STEP;
+                genwait_wait(&objs[i], "tq_bench", timeout);
+                break;
+
+            case MODE_EXPIRE:
+                genwait_wait(&objs[i], "tq_bench",
+                             (unsigned int)(deadline - timer_ms_gettime64()));
+                ++woken;
+                break;
+
+            case MODE_QUIT:
+                return NULL;
+        }
+    }
+}
+
+/* Start the sleepers on their next wait, and let them all block. As they have
+   a higher priority, this only returns once they have. */
+static uint64_t block_all(bench_mode_t m) {
+    uint64_t start;
+
+    mode = m;
+
+    start = timer_ns_gettime64();
+    genwait_wake_all(&go);
+    thd_pass();
+
+    return timer_ns_gettime64() - start;
+}
+
+/* Wake every sleeper up, one at a time, and let them go back to waiting to be
+   started again. */
+static uint64_t wake_all(void) {
+    uint64_t start;
+    unsigned int i;
+
+    start = timer_ns_gettime64();
+
+    for(i = 0; i < count; i++)
+        genwait_wake_all(&objs[i]);
+
+    thd_pass();
+
+    return timer_ns_gettime64() - start;
+}
+
+/* Block every sleeper until the same deadline, and time how long after it
+   passes the last one is running again. */
+static uint64_t expire_all(void) {
+    deadline = timer_ms_gettime64() + EXPIRE_DELAY;
+    woken = 0;
+    block_all(MODE_EXPIRE);
+
+    /* The sleepers preempt us as soon as they're woken up. */
+    while(woken < count)
+        ;
+
+    return timer_ns_gettime64() - deadline * 1000000;
+}
+
+static int start_sleepers(void) {
+    kthread_attr_t attr = {
+        .stack_size = STACK_SIZE,
+        .prio = PRIO_DEFAULT - 1,
+        .label = "tq_bench sleeper"
+    };
+    unsigned int i;
+
+    for(i = 0; i < count; i++) {
+        if(!(thds[i] = thd_create_ex(&attr, sleeper, (void *)(uintptr_t)i))) {
+            fprintf(stderr, "Cannot create sleeper thread %u\n", i);
+            count = i;
+            return -1;
+        }
+    }
+
+    /* Let them all get to their first wait. */
+    thd_pass();
+
+    return 0;
+}
+
+static void stop_sleepers(void) {
+    unsigned int i;
+
+    /* Make sure they're all waiting to be started again first. */
+    thd_pass();
+
+    mode = MODE_QUIT;
+    genwait_wake_all(&go);
+
+    for(i = 0; i < count; i++)
+        thd_join(thds[i], NULL);
+}
+
+static int run(unsigned int n) {
+    int64_t ins = 0, rem = 0;
+    uint64_t exp = 0;
+    unsigned int r;
+
+    count = n;
+
+    if(start_sleepers()) {
+        stop_sleepers();
+        return -1;
+    }
+
+    for(r = 0; r < ROUNDS; r++) {
+        ins += block_all(MODE_TIMED);
+        rem += wake_all();
+        ins -= block_all(MODE_UNTIMED);
+        rem -= wake_all();
+        exp += expire_all();
+    }
+
+    stop_sleepers();
+
+    printf("%4u threads: insert %5lld ns, remove %5lld ns, expire %6llu ns\n",
+           n,
+           (long long)(ins / ((int64_t)ROUNDS * n)),
+           (long long)(rem / ((int64_t)ROUNDS * n)),
+           (unsigned long long)(exp / ((uint64_t)ROUNDS * n)));
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    unsigned int i;
+
+    (void)argc;
+    (void)argv;
+
+    /* Drop below the sleepers, so that they run whenever they can. */
+    thd_set_prio(thd_get_current(), PRIO_DEFAULT);
+
+    printf("Timer queue benchmark\n");
+
+    for(i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]); i++) {
+        if(run(thread_counts[i]))
+            return EXIT_FAILURE;
+    }
+
+    printf("Done!\n");
+
+    return EXIT_SUCCESS;
+}
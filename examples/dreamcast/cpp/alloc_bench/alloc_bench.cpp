@@ -0,0 +1,100 @@
+/* KallistiOS ##version##
+
+   examples/dreamcast/cpp/alloc_bench/alloc_bench.cpp
+
+*/
+
+/*
+    This example is a small benchmark of the system allocator under
+    contention. A number of worker threads each perform a mix of small
+    allocations and deallocations of random sizes (similar to what the
+    network stack or the filesystems do for packets and handles), keeping a
+    window of live blocks around so that blocks get freed in a different
+    order than they were allocated.
+
+    The benchmark runs with an increasing number of threads and reports the
+    average time per allocation/deallocation pair, as well as the total
+    throughput. With the per-thread allocator caches, the cost per operation
+    should stay roughly flat as threads are added, as the common small
+    allocations never have to wait on the global allocator lock.
+*/
+
+#include <iostream>
+#include <iomanip>
+#include <array>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <cstdlib>
+#include <cstdint>
+
+// Number of allocations performed by each thread
+inline constexpr unsigned ALLOCS_PER_THREAD = 100000;
+// Number of live blocks kept around by each thread
+inline constexpr unsigned WINDOW_SIZE = 64;
+// Largest allocation size
+inline constexpr unsigned MAX_ALLOC_SIZE = 128;
+// Thread counts to run the benchmark with
+inline constexpr std::array THREAD_COUNTS = { 1, 2, 4, 8, 16 };
+
+using clock_type = std::chrono::steady_clock;
+
+static void worker(unsigned seed) {
+    std::minstd_rand rng(seed);
+    std::uniform_int_distribution<unsigned> size_dist(1, MAX_ALLOC_SIZE);
+    std::array<void *, WINDOW_SIZE> window {};
+
+    for(unsigned i = 0; i < ALLOCS_PER_THREAD; ++i) {
+        void *&slot = window[rng() % WINDOW_SIZE];
+
+        std::free(slot);
+        slot = std::malloc(size_dist(rng));
+
+        if(!slot) {
+            std::cerr << "Allocation failure!" << std::endl;
+            std::abort();
+        }
+
+        // Touch the block, like a real user would.
+        *static_cast<volatile uint8_t *>(slot) = static_cast<uint8_t>(i);
+    }
+
+    for(void *block : window)
+        std::free(block);
+}
+
+static void run(unsigned thread_count) {
+    std::vector<std::thread> threads;
+
+    const auto start = clock_type::now();
+
+    for(unsigned t = 0; t < thread_count; ++t)
+        threads.emplace_back(worker, t + 1);
+
+    for(auto &thread : threads)
+        thread.join();
+
+    const auto end = clock_type::now();
+
+    const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        end - start).count();
+    const unsigned long long ops =
+        static_cast<unsigned long long>(thread_count) * ALLOCS_PER_THREAD;
+
+    std::cout << std::setw(3) << thread_count << " thread(s): "
+              << std::setw(6) << ns / ops << " ns/op, "
+              << std::setw(8) << ops * 1000000000ull / ns << " ops/s"
+              << std::endl;
+}
+
+int main() {
+    std::cout << "Multi-threaded allocation benchmark" << std::endl;
+
+    for(unsigned thread_count : THREAD_COUNTS)
+        run(thread_count);
+
+    std::cout << "Done!" << std::endl;
+
+    return EXIT_SUCCESS;
+}
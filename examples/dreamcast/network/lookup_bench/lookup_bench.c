@@ -0,0 +1,383 @@
+/* KallistiOS ##version##
+
+   lookup_bench.c
+
+   Socket Lookup Microbenchmark
+
+   This program measures how long it takes the network stack to match an
+   incoming packet to its socket. For an increasing number of open sockets,
+   it builds packets by hand and feeds them straight into net_input(), just
+   like a network driver would, and reports the average time it takes to
+   process one of them:
+     - UDP datagrams, sent to the first of the open UDP sockets.
+     - TCP segments with the RST bit set, sent to the first of the open
+       listening TCP sockets (which will simply ignore them).
+     - TCP segments with the RST bit set and a malformed option, sent to the
+       first of a growing number of established TCP connections (which will
+       drop them as soon as they've been matched to the connection). The
+       connections are made over the loopback device, so each one has both of
+       its ends in the stack.
+
+   Nothing is ever sent over the wire, but a network adapter has to be set up
+   for the stack to be initialized. The time per packet includes checking the
+   checksums and (for UDP) queueing the data, but it should stay flat as the
+   number of sockets grows.
+*/
+
+#include <kos/init.h>
+#include <kos/net.h>
+#include <kos/timer.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT | INIT_NET);
+
+#define MAX_SOCKETS     256
+#define BASE_PORT       20000
+#define CONN_PORT       19999
+#define PACKETS         2000
+#define PAYLOAD_SIZE    16
+
+/* Where the fake packets come from (TEST-NET-1) */
+#define SRC_IP          0xC0000201
+#define SRC_PORT        40000
+
+#define LOOPBACK_IP     0x7F000001
+
+/* Keep the connections' buffers small, as there are a lot of them */
+#define CONN_BUF_SIZE   2048
+
+static const unsigned int socket_counts[] = { 1, 16, 64, MAX_SOCKETS };
+
+static int socks[MAX_SOCKETS];
+static int clients[MAX_SOCKETS], servers[MAX_SOCKETS];
+static uint8_t frame[14 + 20 + 20 + PAYLOAD_SIZE] __attribute__((aligned(4)));
+
+static uint32_t sum16(const void *data, size_t len, uint32_t sum) {
+    const uint8_t *p = (const uint8_t *)data;
+
+    while(len > 1) {
+        sum += (p[0] << 8) | p[1];
+        p += 2;
+        len -= 2;
+    }
+
+    if(len)
+        sum += p[0] << 8;
+
+    return sum;
+}
+
+static uint16_t fold(uint32_t sum) {
+    while(sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+
+    return htons(~sum & 0xFFFF);
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v & 0xFF;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    put16(p, v >> 16);
+    put16(p + 2, v & 0xFFFF);
+}
+
+/* Build an Ethernet frame with an IPv4 packet in it, with a transport header
+   and payload of the given size already filled in. Returns the frame size. */
+static size_t build_frame(int proto, size_t size, uint32_t src, uint32_t dst) {
+    uint8_t *ip = frame + 14, *th = ip + 20;
+    uint32_t sum;
+    uint16_t cs;
+
+    memcpy(frame, net_default_dev->mac_addr, 6);
+    memcpy(frame + 6, "\x02\x00\x00\x00\x00\x01", 6);
+    put16(frame + 12, 0x0800);
+
+    memset(ip, 0, 20);
+    ip[0] = 0x45;
+    put16(ip + 2, 20 + size);
+    ip[8] = 64;
+    ip[9] = proto;
+    put32(ip + 12, src);
+    put32(ip + 16, dst);
+    cs = fold(sum16(ip, 20, 0));
+    memcpy(ip + 10, &cs, 2);
+
+    /* Checksum the transport header and payload with the pseudo-header. */
+    sum = sum16(ip + 12, 8, proto + size);
+    cs = fold(sum16(th, size, sum));
+    memcpy(th + (proto == IPPROTO_UDP ? 6 : 16), &cs, 2);
+
+    return 14 + 20 + size;
+}
+
+static size_t build_udp(void) {
+    uint8_t *th = frame + 34;
+
+    memset(th, 0, 8 + PAYLOAD_SIZE);
+    put16(th, SRC_PORT);
+    put16(th + 2, BASE_PORT);
+    put16(th + 4, 8 + PAYLOAD_SIZE);
+
+    return build_frame(IPPROTO_UDP, 8 + PAYLOAD_SIZE, SRC_IP,
+                       net_ipv4_address(net_default_dev->ip_addr));
+}
+
+static size_t build_tcp_rst(void) {
+    uint8_t *th = frame + 34;
+
+    memset(th, 0, 20);
+    put16(th, SRC_PORT);
+    put16(th + 2, BASE_PORT);
+    put32(th + 4, 1);
+    put16(th + 12, 0x5004);         /* Header length 20, RST */
+
+    return build_frame(IPPROTO_TCP, 20, SRC_IP,
+                       net_ipv4_address(net_default_dev->ip_addr));
+}
+
+/* A RST for the connection from the given loopback port, with an MSS option
+   of the wrong length, so that it gets dropped right after the lookup rather
+   than resetting the connection. It comes in through the network adapter,
+   which doesn't care that its addresses are loopback ones. */
+static size_t build_tcp_conn(uint16_t port) {
+    uint8_t *th = frame + 34;
+
+    memset(th, 0, 24);
+    put16(th, port);
+    put16(th + 2, CONN_PORT);
+    put32(th + 4, 1);
+    put16(th + 12, 0x6004);         /* Header length 24, RST */
+    th[20] = 2;                     /* MSS, with a length of 3 */
+    th[21] = 3;
+
+    return build_frame(IPPROTO_TCP, 24, LOOPBACK_IP, LOOPBACK_IP);
+}
+
+static int open_socks(int type, unsigned int count) {
+    struct sockaddr_in addr;
+    unsigned int i;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+
+    for(i = 0; i < count; ++i) {
+        if((socks[i] = socket(AF_INET, type, 0)) < 0) {
+            perror("socket");
+            return -1;
+        }
+
+        addr.sin_port = htons(BASE_PORT + i);
+
+        if(bind(socks[i], (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            perror("bind");
+            return -1;
+        }
+
+        if(type == SOCK_STREAM && listen(socks[i], 1) < 0) {
+            perror("listen");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void close_socks(unsigned int count) {
+    unsigned int i;
+
+    for(i = 0; i < count; ++i)
+        close(socks[i]);
+}
+
+static int run(int type, unsigned int count) {
+    uint8_t buf[PAYLOAD_SIZE];
+    uint64_t start, total = 0;
+    size_t len;
+    int i;
+
+    if(open_socks(type, count))
+        return -1;
+
+    len = type == SOCK_DGRAM ? build_udp() : build_tcp_rst();
+
+    for(i = 0; i < PACKETS; ++i) {
+        start = timer_ns_gettime64();
+        net_input(net_default_dev, frame, len);
+        total += timer_ns_gettime64() - start;
+
+        /* Don't let the datagrams pile up. */
+        if(type == SOCK_DGRAM)
+            recv(socks[0], buf, sizeof(buf), MSG_DONTWAIT);
+    }
+
+    close_socks(count);
+
+    printf("%s, %3u sockets: %6llu ns/packet\n",
+           type == SOCK_DGRAM ? "UDP" : "TCP", count, total / PACKETS);
+
+    return 0;
+}
+
+static int set_bufs(int sock) {
+    uint32_t sz = CONN_BUF_SIZE;
+
+    if(setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz)) < 0 ||
+       setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &sz, sizeof(sz)) < 0) {
+        perror("setsockopt");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Make connections over the loopback device until there are count of them,
+   keeping open up to date as they get made. */
+static int open_conns(int lsock, unsigned int *open, unsigned int count) {
+    struct sockaddr_in addr;
+    int cs, ss;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(CONN_PORT);
+    addr.sin_addr.s_addr = htonl(LOOPBACK_IP);
+
+    while(*open < count) {
+        if((cs = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+            perror("socket");
+            return -1;
+        }
+
+        if(set_bufs(cs)) {
+            close(cs);
+            return -1;
+        }
+
+        if(connect(cs, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            perror("connect");
+            close(cs);
+            return -1;
+        }
+
+        if((ss = accept(lsock, NULL, NULL)) < 0) {
+            perror("accept");
+            close(cs);
+            return -1;
+        }
+
+        clients[*open] = cs;
+        servers[*open] = ss;
+        ++*open;
+    }
+
+    return 0;
+}
+
+/* Time segments sent to the first of a growing number of connections. */
+static int run_conns(void) {
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    uint64_t start, total;
+    unsigned int i, open = 0;
+    size_t len;
+    int lsock, j, rv = -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(CONN_PORT);
+    addr.sin_addr.s_addr = htonl(LOOPBACK_IP);
+
+    if((lsock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    if(set_bufs(lsock))
+        goto out;
+
+    if(bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        goto out;
+    }
+
+    if(listen(lsock, 1) < 0) {
+        perror("listen");
+        goto out;
+    }
+
+    for(i = 0; i < sizeof(socket_counts) / sizeof(socket_counts[0]); i++) {
+        if(open_conns(lsock, &open, socket_counts[i]))
+            goto out;
+
+        if(getsockname(clients[0], (struct sockaddr *)&addr, &addrlen) < 0) {
+            perror("getsockname");
+            goto out;
+        }
+
+        len = build_tcp_conn(ntohs(addr.sin_port));
+        total = 0;
+
+        for(j = 0; j < PACKETS; ++j) {
+            start = timer_ns_gettime64();
+            net_input(net_default_dev, frame, len);
+            total += timer_ns_gettime64() - start;
+        }
+
+        printf("TCP, %3u connections: %6llu ns/packet\n", open,
+               total / PACKETS);
+    }
+
+    rv = 0;
+
+out:
+    for(i = 0; i < open; ++i) {
+        close(clients[i]);
+        close(servers[i]);
+    }
+
+    close(lsock);
+    return rv;
+}
+
+int main(int argc, char **argv) {
+    unsigned int i;
+
+    (void)argc;
+    (void)argv;
+
+    if(!net_default_dev) {
+        fprintf(stderr, "No network adapter found\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("Socket lookup benchmark\n");
+
+    for(i = 0; i < sizeof(socket_counts) / sizeof(socket_counts[0]); i++) {
+        if(run(SOCK_DGRAM, socket_counts[i]))
+            return EXIT_FAILURE;
+    }
+
+    for(i = 0; i < sizeof(socket_counts) / sizeof(socket_counts[0]); i++) {
+        if(run(SOCK_STREAM, socket_counts[i]))
+            return EXIT_FAILURE;
+    }
+
+    if(run_conns())
+        return EXIT_FAILURE;
+
+    printf("Done!\n");
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,301 @@
+/* KallistiOS ##version##
+
+   loopback_bench.c
+
+   Loopback Network Stack Benchmark
+
+   This program measures the overhead of the network stack itself, without any
+   network hardware involved. Everything is sent to 127.0.0.1, so the packets
+   go through the full TCP/UDP and IPv4 paths on both ends, but are handed
+   straight back to the stack by the loopback device instead of going out
+   over the wire. It runs three tests, each with a server thread and a client
+   thread talking to one another:
+     - TCP bulk transfer throughput, in KiB/s.
+     - UDP datagram rate, in packets per second (and how many got dropped).
+     - TCP connection setup and teardown rate, in connections per second.
+
+   No network adapter is needed for this one, so it will run just as well on
+   an emulator as on real hardware.
+*/
+
+#include <kos/init.h>
+#include <kos/net.h>
+#include <kos/thread.h>
+#include <kos/timer.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT | INIT_NET);
+
+#define BENCH_PORT      5000
+
+#define TCP_TOTAL       (4 * 1024 * 1024)
+#define TCP_CHUNK       8192
+
+#define UDP_PACKETS     10000
+#define UDP_SIZE        64
+#define UDP_RCVBUF      (256 * 1024)
+#define UDP_IDLE_MS     500
+
+#define CONN_COUNT      200
+
+static uint8_t tcp_buf[TCP_CHUNK];
+static uint8_t tcp_rbuf[TCP_CHUNK];
+
+/* Results passed back from the server threads */
+static size_t tcp_received;
+static int udp_received;
+static uint64_t udp_last;
+static int conn_accepted;
+
+static void loopback_addr(struct sockaddr_in *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(BENCH_PORT);
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+}
+
+static int open_server(int type) {
+    struct sockaddr_in addr;
+    int s;
+
+    if((s = socket(AF_INET, type, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    loopback_addr(&addr);
+
+    if(bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        close(s);
+        return -1;
+    }
+
+    if(type == SOCK_STREAM && listen(s, 8) < 0) {
+        perror("listen");
+        close(s);
+        return -1;
+    }
+
+    return s;
+}
+
+static int open_client(int type) {
+    struct sockaddr_in addr;
+    int s;
+
+    if((s = socket(AF_INET, type, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    loopback_addr(&addr);
+
+    if(connect(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        close(s);
+        return -1;
+    }
+
+    return s;
+}
+
+static void *tcp_server(void *param) {
+    int ls = (int)param, s;
+    ssize_t rv;
+
+    if((s = accept(ls, NULL, NULL)) < 0) {
+        perror("accept");
+        return NULL;
+    }
+
+    while((rv = recv(s, tcp_rbuf, sizeof(tcp_rbuf), 0)) > 0)
+        tcp_received += rv;
+
+    close(s);
+    return NULL;
+}
+
+static int bench_tcp(void) {
+    kthread_t *thd;
+    uint64_t start, end;
+    size_t sent = 0;
+    ssize_t rv;
+    int ls, s;
+
+    if((ls = open_server(SOCK_STREAM)) < 0)
+        return -1;
+
+    tcp_received = 0;
+    memset(tcp_buf, 0xA5, sizeof(tcp_buf));
+    thd = thd_create(0, &tcp_server, (void *)ls);
+
+    start = timer_ms_gettime64();
+
+    if((s = open_client(SOCK_STREAM)) >= 0) {
+        while(sent < TCP_TOTAL) {
+            if((rv = send(s, tcp_buf, sizeof(tcp_buf), 0)) < 0) {
+                perror("send");
+                break;
+            }
+
+            sent += rv;
+        }
+
+        close(s);
+    }
+
+    thd_join(thd, NULL);
+    end = timer_ms_gettime64();
+    close(ls);
+
+    if(end == start)
+        end = start + 1;
+
+    printf("TCP bulk:    %u bytes in %llu ms, %llu KiB/s\n",
+           (unsigned int)tcp_received, end - start,
+           ((uint64_t)tcp_received * 1000 / 1024) / (end - start));
+
+    return tcp_received == TCP_TOTAL ? 0 : -1;
+}
+
+static void *udp_server(void *param) {
+    uint8_t buf[UDP_SIZE];
+    struct pollfd pfd;
+
+    pfd.fd = (int)param;
+    pfd.events = POLLIN;
+
+    /* Keep going until nothing has shown up for a while. */
+    while(poll(&pfd, 1, UDP_IDLE_MS) > 0) {
+        while(recv(pfd.fd, buf, sizeof(buf), MSG_DONTWAIT) >= 0) {
+            ++udp_received;
+            udp_last = timer_ms_gettime64();
+        }
+    }
+
+    return NULL;
+}
+
+static int bench_udp(void) {
+    uint8_t buf[UDP_SIZE];
+    int rcvbuf = UDP_RCVBUF;
+    kthread_t *thd;
+    uint64_t start;
+    int i, ss, s, sent = 0;
+
+    if((ss = open_server(SOCK_DGRAM)) < 0)
+        return -1;
+
+    setsockopt(ss, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    if((s = open_client(SOCK_DGRAM)) < 0) {
+        close(ss);
+        return -1;
+    }
+
+    udp_received = 0;
+    memset(buf, 0x5A, sizeof(buf));
+    start = udp_last = timer_ms_gettime64();
+    thd = thd_create(0, &udp_server, (void *)ss);
+
+    for(i = 0; i < UDP_PACKETS; ++i) {
+        if(send(s, buf, sizeof(buf), 0) == sizeof(buf))
+            ++sent;
+    }
+
+    thd_join(thd, NULL);
+    close(s);
+    close(ss);
+
+    if(udp_last == start)
+        udp_last = start + 1;
+
+    printf("UDP packets: %d sent, %d received in %llu ms, %llu packets/s\n",
+           sent, udp_received, udp_last - start,
+           (uint64_t)udp_received * 1000 / (udp_last - start));
+
+    return udp_received ? 0 : -1;
+}
+
+static void *conn_server(void *param) {
+    int ls = (int)param, s;
+
+    while(conn_accepted < CONN_COUNT) {
+        if((s = accept(ls, NULL, NULL)) < 0) {
+            perror("accept");
+            break;
+        }
+
+        ++conn_accepted;
+        close(s);
+    }
+
+    return NULL;
+}
+
+static int bench_conn(void) {
+    kthread_t *thd;
+    uint64_t start, end;
+    int i, ls, s;
+
+    if((ls = open_server(SOCK_STREAM)) < 0)
+        return -1;
+
+    conn_accepted = 0;
+    thd = thd_create(0, &conn_server, (void *)ls);
+
+    start = timer_ms_gettime64();
+
+    for(i = 0; i < CONN_COUNT; ++i) {
+        if((s = open_client(SOCK_STREAM)) < 0)
+            break;
+
+        close(s);
+    }
+
+    /* If a connect failed, the server would sit in accept() forever. */
+    if(i < CONN_COUNT)
+        thd_destroy(thd);
+    else
+        thd_join(thd, NULL);
+
+    end = timer_ms_gettime64();
+    close(ls);
+
+    if(end == start)
+        end = start + 1;
+
+    printf("TCP connect: %d connections in %llu ms, %llu connections/s\n",
+           conn_accepted, end - start,
+           (uint64_t)conn_accepted * 1000 / (end - start));
+
+    return conn_accepted == CONN_COUNT ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+    int rv = 0;
+
+    (void)argc;
+    (void)argv;
+
+    printf("Loopback network stack benchmark\n");
+
+    rv |= bench_tcp();
+    rv |= bench_udp();
+    rv |= bench_conn();
+
+    printf("Done!\n");
+
+    return rv ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,171 @@
+/* KallistiOS ##version##
+
+   tx_bench.c
+
+   Packet Transmit Microbenchmark
+
+   This program measures how long it takes the network adapter's driver to
+   copy a packet out to the hardware, which is most of what it costs to send
+   one. It sends full-sized frames, laid out the way the network stack hands
+   them to the driver: the Ethernet, IP and UDP headers (42 bytes) in one
+   piece, and the payload in another. It reports the average time per packet:
+     - For a single, flat, aligned buffer, with everything copied into it
+       first (that's what drivers without if_tx_iov get).
+     - For the two pieces handed to if_tx_iov, with the payload starting at
+       each of the four possible offsets from a 32-bit boundary.
+
+   Run it on a build of the tree from before and after a change to the
+   driver's transmit path to compare the two. Only the calls that actually
+   send a packet are timed, so waiting for the wire doesn't get counted.
+
+   The frames use the local experimental EtherType, and are sent to the
+   broadcast address, so anything else on the network will simply ignore
+   them.
+*/
+
+#include <kos/init.h>
+#include <kos/net.h>
+#include <kos/timer.h>
+
+#include <sys/uio.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT | INIT_NET);
+
+#define PACKETS         2000
+#define HDR_SIZE        42
+#define PAYLOAD_SIZE    1472
+
+/* Give up if the adapter doesn't take a packet for that long (in ms). */
+#define TX_TIMEOUT      1000
+
+static uint8_t headroom[64] __attribute__((aligned(32)));
+static uint8_t payload[PAYLOAD_SIZE + 4] __attribute__((aligned(32)));
+static uint8_t flat[HDR_SIZE + PAYLOAD_SIZE] __attribute__((aligned(32)));
+
+/* The headers sit at the end of the headroom, the way the stack builds
+   them, which leaves them 16-bit aligned. */
+static uint8_t *build_headers(void) {
+    uint8_t *hdr = headroom + sizeof(headroom) - HDR_SIZE;
+
+    memset(hdr, 0, HDR_SIZE);
+    memset(hdr, 0xFF, 6);
+    memcpy(hdr + 6, net_default_dev->mac_addr, 6);
+    hdr[12] = 0x88;
+    hdr[13] = 0xB5;
+
+    return hdr;
+}
+
+/* Send a packet, retrying for as long as the adapter is busy. Returns how
+   long the successful call took, or 0 if it never went through. */
+static uint64_t send_one(const struct iovec *iov, int iovcnt) {
+    uint64_t start, end, deadline;
+    int rv;
+
+    deadline = timer_ms_gettime64() + TX_TIMEOUT;
+
+    do {
+        start = timer_ns_gettime64();
+
+        if(iovcnt)
+            rv = net_default_dev->if_tx_iov(net_default_dev, iov, iovcnt,
+                                            NETIF_NOBLOCK);
+        else
+            rv = net_default_dev->if_tx(net_default_dev, iov->iov_base,
+                                        iov->iov_len, NETIF_NOBLOCK);
+
+        end = timer_ns_gettime64();
+    } while(rv != NETIF_TX_OK && timer_ms_gettime64() < deadline);
+
+    return rv == NETIF_TX_OK ? end - start : 0;
+}
+
+static int run_flat(const uint8_t *hdr) {
+    struct iovec iov = { flat, sizeof(flat) };
+    uint64_t start, total = 0, t;
+    int i;
+
+    for(i = 0; i < PACKETS; ++i) {
+        start = timer_ns_gettime64();
+        memcpy(flat, hdr, HDR_SIZE);
+        memcpy(flat + HDR_SIZE, payload, PAYLOAD_SIZE);
+        total += timer_ns_gettime64() - start;
+
+        if(!(t = send_one(&iov, 0))) {
+            fprintf(stderr, "The adapter isn't sending anything\n");
+            return -1;
+        }
+
+        total += t;
+    }
+
+    printf("flat buffer:            %6llu ns/packet\n", total / PACKETS);
+
+    return 0;
+}
+
+static int run_iov(const uint8_t *hdr, unsigned int off) {
+    struct iovec iov[2] = {
+        { (void *)hdr, HDR_SIZE },
+        { payload + off, PAYLOAD_SIZE }
+    };
+    uint64_t total = 0, t;
+    int i;
+
+    for(i = 0; i < PACKETS; ++i) {
+        if(!(t = send_one(iov, 2))) {
+            fprintf(stderr, "The adapter isn't sending anything\n");
+            return -1;
+        }
+
+        total += t;
+    }
+
+    printf("pieces, payload at +%u: %6llu ns/packet\n", off, total / PACKETS);
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const uint8_t *hdr;
+    unsigned int i;
+
+    (void)argc;
+    (void)argv;
+
+    if(!net_default_dev) {
+        fprintf(stderr, "No network adapter found\n");
+        return EXIT_FAILURE;
+    }
+
+    if(!net_default_dev->if_tx_iov) {
+        fprintf(stderr, "The %s driver doesn't do scatter/gather\n",
+                net_default_dev->name);
+        return EXIT_FAILURE;
+    }
+
+    for(i = 0; i < sizeof(payload); ++i)
+        payload[i] = (uint8_t)i;
+
+    hdr = build_headers();
+
+    printf("Packet transmit benchmark (%s, %d byte frames)\n",
+           net_default_dev->name, HDR_SIZE + PAYLOAD_SIZE);
+
+    if(run_flat(hdr))
+        return EXIT_FAILURE;
+
+    for(i = 0; i < 4; ++i) {
+        if(run_iov(hdr, i))
+            return EXIT_FAILURE;
+    }
+
+    printf("Done!\n");
+
+    return EXIT_SUCCESS;
+}
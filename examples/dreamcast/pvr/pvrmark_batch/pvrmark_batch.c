@@ -0,0 +1,197 @@
+/* KallistiOS ##version##
+
+   pvrmark_batch.c
+
+   Primitive Batching Benchmark
+
+   This draws a bunch of small textured quads to the opaque list, each of them
+   using one of a handful of textures picked at random, which is about the
+   worst case there is for state changes. It alternates between sending
+   everything straight to the TA in the order it was generated (and so with a
+   header before every single quad), and going through a pvr_batch_t, which
+   groups the quads by texture and only sends each header once. The average
+   frame rate and the number of headers sent per frame are printed for each.
+
+   Each quad gets a depth of its own, further to the front than the ones
+   before it, so the picture comes out the same whatever order they're drawn
+   in. That's what makes it safe to turn sorting on for the batch: with quads
+   overlapping at the same depth, sorting them would change which one ends up
+   on top.
+
+   Press Start to exit.
+*/
+
+#include <kos.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define QUADS       3000
+#define TEXTURES    8
+#define TXR_SIZE    8
+#define TEST_SECS   5
+
+static pvr_init_params_t pvr_params = {
+    { PVR_BINSIZE_16, PVR_BINSIZE_0, PVR_BINSIZE_0, PVR_BINSIZE_0, PVR_BINSIZE_0 },
+    1024 * 1024, 0, 0, 0, 0, 0
+};
+
+static pvr_poly_hdr_t hdrs[TEXTURES];
+static pvr_batch_t batch;
+
+static int check_start(void) {
+    maple_device_t *cont;
+    cont_state_t *state;
+
+    cont = maple_enum_type(0, MAPLE_FUNC_CONTROLLER);
+
+    if(!cont)
+        return 0;
+
+    state = (cont_state_t *)maple_dev_status(cont);
+
+    return state && (state->buttons & CONT_START);
+}
+
+static void setup(void) {
+    uint16_t pixels[TXR_SIZE * TXR_SIZE];
+    pvr_poly_cxt_t cxt;
+    pvr_ptr_t txr;
+    int i, j;
+
+    pvr_init(&pvr_params);
+    pvr_set_bg_color(0, 0, 0);
+
+    /* Each texture is just a different solid color. */
+    for(i = 0; i < TEXTURES; i++) {
+        for(j = 0; j < TXR_SIZE * TXR_SIZE; j++)
+            pixels[j] = ((i & 1) ? 0xF800 : 0) | ((i & 2) ? 0x07E0 : 0) |
+                        ((i & 4) ? 0x001F : 0) | 0x4208;
+
+        txr = pvr_mem_malloc(sizeof(pixels));
+        pvr_txr_load(pixels, txr, sizeof(pixels));
+
+        pvr_poly_cxt_txr(&cxt, PVR_LIST_OP_POLY,
+                         PVR_TXRFMT_RGB565 | PVR_TXRFMT_NONTWIDDLED,
+                         TXR_SIZE, TXR_SIZE, txr, PVR_FILTER_NONE);
+        pvr_poly_compile(&hdrs[i], &cxt);
+    }
+
+    if(pvr_batch_init(&batch, PVR_LIST_OP_POLY, QUADS, QUADS * 4 *
+                      sizeof(pvr_vertex_t))) {
+        fprintf(stderr, "Can't allocate the batch\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pvr_batch_set_sort(&batch, 1);
+}
+
+static void send_hdr(int batched, const pvr_poly_hdr_t *hdr) {
+    if(batched)
+        pvr_batch_hdr(&batch, hdr);
+    else
+        pvr_prim(hdr, sizeof(*hdr));
+}
+
+static void send_vert(int batched, const pvr_vertex_t *vert) {
+    if(batched)
+        pvr_batch_prim(&batch, vert, sizeof(*vert));
+    else
+        pvr_prim(vert, sizeof(*vert));
+}
+
+static int do_frame(int batched) {
+    pvr_vertex_t vert;
+    float x, y;
+    int i, hdrs_sent = QUADS;
+
+    /* Same quads every frame. */
+    srand(1234);
+
+    pvr_wait_ready();
+    pvr_scene_begin();
+    pvr_list_begin(PVR_LIST_OP_POLY);
+
+    if(batched)
+        pvr_batch_begin(&batch);
+
+    vert.argb = 0xFFFFFFFF;
+    vert.oargb = 0;
+
+    for(i = 0; i < QUADS; i++) {
+        x = rand() % 624;
+        y = rand() % 464;
+        send_hdr(batched, &hdrs[rand() % TEXTURES]);
+
+        vert.z = 1.0f + i;
+        vert.flags = PVR_CMD_VERTEX;
+        vert.x = x;
+        vert.y = y + 16.0f;
+        vert.u = 0.0f;
+        vert.v = 1.0f;
+        send_vert(batched, &vert);
+
+        vert.y = y;
+        vert.v = 0.0f;
+        send_vert(batched, &vert);
+
+        vert.x = x + 16.0f;
+        vert.y = y + 16.0f;
+        vert.u = 1.0f;
+        vert.v = 1.0f;
+        send_vert(batched, &vert);
+
+        vert.flags = PVR_CMD_VERTEX_EOL;
+        vert.y = y;
+        vert.v = 0.0f;
+        send_vert(batched, &vert);
+    }
+
+    if(batched) {
+        pvr_batch_finish(&batch);
+        hdrs_sent = batch.hdrs_out;
+    }
+
+    pvr_list_finish();
+    pvr_scene_finish();
+
+    return hdrs_sent;
+}
+
+int main(int argc, char **argv) {
+    pvr_stats_t stats;
+    time_t begin;
+    float fps;
+    int batched = 0, frames, hdrs_sent = 0;
+
+    (void)argc;
+    (void)argv;
+
+    setup();
+
+    printf("Primitive batching benchmark: %d quads, %d textures\n",
+           QUADS, TEXTURES);
+
+    while(!check_start()) {
+        begin = time(NULL);
+        fps = 0.0f;
+        frames = 0;
+
+        while(time(NULL) < begin + TEST_SECS && !check_start()) {
+            hdrs_sent = do_frame(batched);
+
+            pvr_get_stats(&stats);
+            fps += stats.frame_rate;
+            ++frames;
+        }
+
+        printf("  %-8s ~%f fps, %d headers per frame\n",
+               batched ? "Batched:" : "Direct:",
+               (double)(frames ? fps / frames : 0.0f), hdrs_sent);
+
+        batched = !batched;
+    }
+
+    pvr_batch_shutdown(&batch);
+
+    return 0;
+}
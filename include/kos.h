@@ -54,6 +54,7 @@ __BEGIN_DECLS
 #include <kos/exports.h>
 #include <kos/dbgio.h>
 #include <kos/blockdev.h>
+#include <kos/blockcache.h>
 #include <kos/dbglog.h>
 #include <kos/elf.h>
 #include <kos/fs_socket.h>
@@ -62,6 +63,7 @@ __BEGIN_DECLS
 #include <kos/oneshot_timer.h>
 #include <kos/regfield.h>
 #include <kos/spinlock.h>
+#include <kos/slab.h>
 
 #include <arch/arch.h>
 #include <arch/cache.h>
@@ -0,0 +1,228 @@
+/* KallistiOS ##version##
+
+   kos/blockcache.h
+*/
+
+/** \file    kos/blockcache.h
+    \brief   Block cache for filesystems.
+    \ingroup vfs_blockcache
+
+    This file contains a simple write-back block cache, meant to be shared by
+    the filesystems that sit on top of a block device. The cache holds a fixed
+    number of equally sized blocks, which are looked up through a hash table
+    and evicted in least recently used order, so that the cost of an access
+    does not depend on the size of the cache.
+
+    The cache does not do any locking of its own. Filesystems are expected to
+    serialize accesses to a cache with the same lock that protects the rest of
+    their data structures. Pointers returned by the cache are only valid until
+    the next call that may evict a block.
+*/
+
+#ifndef __KOS_BLOCKCACHE_H
+#define __KOS_BLOCKCACHE_H
+
+#include <kos/cdefs.h>
+__BEGIN_DECLS
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** \defgroup vfs_blockcache    Block Cache
+    \brief                      Shared block cache for filesystems
+    \ingroup                    vfs_blockdev
+
+    @{
+*/
+
+struct kos_blockdev;
+
+/** \brief  Opaque type for a block cache. */
+typedef struct kos_blockcache kos_blockcache_t;
+
+/** \brief  Block read callback.
+
+    \param  data            The user data passed to blockcache_create_ex().
+    \param  block           The cache block to read.
+    \param  buf             The buffer to read into.
+
+    \retval 0               On success.
+    \return                 A negative errno value on failure.
+*/
+typedef int (*blockcache_read_t)(void *data, uint64_t block, void *buf);
+
+/** \brief  Block write callback.
+
+    \param  data            The user data passed to blockcache_create_ex().
+    \param  block           The cache block to write.
+    \param  buf             The buffer to write from.
+
+    \retval 0               On success.
+    \return                 A negative errno value on failure.
+*/
+typedef int (*blockcache_write_t)(void *data, uint64_t block, const void *buf);
+
+/** \brief  Block cache statistics.
+
+    \sa blockcache_get_stats
+*/
+typedef struct blockcache_stats {
+    uint32_t hits;          /**< \brief Lookups served from the cache */
+    uint32_t misses;        /**< \brief Lookups that needed a read */
+    uint32_t writebacks;    /**< \brief Dirty blocks written back */
+} blockcache_stats_t;
+
+/** \brief  Create a block cache on top of a block device.
+
+    Cache block n maps to the device blocks starting at n * (block_size /
+    device block size).
+
+    \param  dev             The block device to cache.
+    \param  block_size      The size of a cache block, in bytes. This must be
+                            a power of two, and at least as large as the block
+                            size of the device.
+    \param  count           The number of blocks to keep in the cache.
+
+    \return                 The new cache, or NULL on error (with errno set).
+*/
+kos_blockcache_t *blockcache_create(struct kos_blockdev *dev,
+                                    uint32_t block_size, size_t count);
+
+/** \brief  Create a block cache with custom I/O callbacks.
+
+    This allows filesystems whose blocks do not map linearly onto the device
+    (or that do not use a block device at all) to use the cache.
+
+    \param  block_size      The size of a cache block, in bytes.
+    \param  count           The number of blocks to keep in the cache.
+    \param  rd              The function used to read a block.
+    \param  wr              The function used to write a block back. May be
+                            NULL for read-only caches.
+    \param  data            User data passed to the callbacks.
+
+    \return                 The new cache, or NULL on error (with errno set).
+*/
+kos_blockcache_t *blockcache_create_ex(uint32_t block_size, size_t count,
+                                       blockcache_read_t rd,
+                                       blockcache_write_t wr, void *data);
+
+/** \brief  Destroy a block cache.
+
+    Dirty blocks are not written back; call blockcache_writeback() first if
+    needed.
+
+    \param  c               The cache to destroy.
+*/
+void blockcache_destroy(kos_blockcache_t *c);
+
+/** \brief  Read a block through the cache.
+
+    \param  c               The cache to read from.
+    \param  block           The block to read.
+    \param  err             Set to an errno value on failure.
+
+    \return                 The cached copy of the block, or NULL on failure.
+*/
+uint8_t *blockcache_read(kos_blockcache_t *c, uint64_t block, int *err);
+
+/** \brief  Get a cache buffer for a block, without reading it.
+
+    This is meant for blocks that are about to be completely overwritten. The
+    block is marked as dirty, and its contents are undefined if it was not
+    already in the cache.
+
+    \param  c               The cache to use.
+    \param  block           The block to get a buffer for.
+    \param  err             Set to an errno value on failure.
+
+    \return                 The cache buffer for the block, or NULL on failure.
+*/
+uint8_t *blockcache_get(kos_blockcache_t *c, uint64_t block, int *err);
+
+/** \brief  Look up a block in the cache, without doing any I/O.
+
+    \param  c               The cache to look in.
+    \param  block           The block to look for.
+
+    \return                 The cached copy of the block, or NULL if the block
+                            is not in the cache.
+*/
+uint8_t *blockcache_lookup(kos_blockcache_t *c, uint64_t block);
+
+/** \brief  Insert a block that was read by the caller into the cache.
+
+    This is meant for filesystems that read several blocks at once straight
+    from the device (for instance, to read ahead of a sequential reader), and
+    want to make them available through the cache. If the block is already in
+    the cache, the cached copy is kept and the data is ignored.
+
+    \param  c               The cache to insert into.
+    \param  block           The block to insert.
+    \param  buf             The contents of the block.
+
+    \retval 0               On success.
+    \return                 A negative errno value on failure.
+*/
+int blockcache_insert(kos_blockcache_t *c, uint64_t block, const void *buf);
+
+/** \brief  Mark a cached block as dirty.
+
+    \param  c               The cache holding the block.
+    \param  block           The block to mark.
+
+    \retval 0               On success.
+    \retval -EINVAL         If the block is not in the cache.
+*/
+int blockcache_mark_dirty(kos_blockcache_t *c, uint64_t block);
+
+/** \brief  Write back all of the dirty blocks of a cache.
+
+    \param  c               The cache to write back.
+
+    \retval 0               On success.
+    \return                 A negative errno value on failure.
+*/
+int blockcache_writeback(kos_blockcache_t *c);
+
+/** \brief  Write back the dirty blocks of a cache within a range.
+
+    This is meant to be used before reading a range of blocks straight from
+    the device, bypassing the cache.
+
+    \param  c               The cache to write back.
+    \param  first           The first block of the range.
+    \param  count           The number of blocks in the range.
+
+    \retval 0               On success.
+    \return                 A negative errno value on failure.
+*/
+int blockcache_writeback_range(kos_blockcache_t *c, uint64_t first,
+                               size_t count);
+
+/** \brief  Drop all of the blocks of a cache, without writing them back.
+
+    \param  c               The cache to invalidate.
+*/
+void blockcache_invalidate(kos_blockcache_t *c);
+
+/** \brief  Get the number of blocks a cache can hold.
+
+    \param  c               The cache to query.
+
+    \return                 The number of blocks in the cache.
+*/
+size_t blockcache_size(const kos_blockcache_t *c);
+
+/** \brief  Retrieve the statistics of a cache.
+
+    \param  c               The cache to query.
+    \param  stats           Where to copy the statistics.
+*/
+void blockcache_get_stats(const kos_blockcache_t *c,
+                          blockcache_stats_t *stats);
+
+/** @} */
+
+__END_DECLS
+
+#endif /* !__KOS_BLOCKCACHE_H */
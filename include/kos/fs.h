@@ -230,6 +230,18 @@ extern struct fs_hnd *fd_table[FD_SETSIZE];
 #define O_META      0x2000      /**< \brief Open as metadata */
 /** @} */
 
+/** \anchor vfs_fcntl_cmds
+    \name   KOS-specific fcntl() Commands
+
+    These are extra commands that may be passed to fs_fcntl(), on top of the
+    standard ones. Filesystems that don't support them fail with EINVAL.
+
+    @{
+*/
+#define F_GETRA     0x4b00      /**< \brief Get read-ahead window (bytes) */
+#define F_SETRA     0x4b01      /**< \brief Set read-ahead window (bytes) */
+/** @} */
+
 /** \anchor vfs_seek_modes
     \name   Seek Modes
 
@@ -86,7 +86,7 @@ void fs_romdisk_shutdown(void);
                             must free it if appropriate. If true, img will be
                             freed when it is unmounted
     \retval 0               On success
-    \retval -1              If fs_romdisk_init not called
+    \retval -1              If fs_romdisk_init not called (or it failed)
     \retval -2              If img is invalid
     \retval -3              If a malloc fails
 */
@@ -377,6 +377,36 @@ typedef struct fs_socket_proto {
                             currently true in the socket. 0 if none are true.
     */
     short (*poll)(net_socket_t *s, short events);
+
+    /** \brief  Send a message gathered from several buffers.
+
+        This function should implement the ::sendmsg() system call for the
+        protocol. It is optional; if it is NULL, the buffers are copied into a
+        single one and passed to sendto() instead.
+
+        \param  s           The socket to send data on
+        \param  msg         The message to send
+        \param  flags       Flags to the function
+        \retval -1          On error (set errno appropriately)
+        \retval n           The number of bytes actually sent
+    */
+    ssize_t (*sendmsg)(net_socket_t *s, const struct msghdr *msg, int flags);
+
+    /** \brief  Receive a message into several buffers.
+
+        This function should implement the ::recvmsg() system call for the
+        protocol, including setting MSG_TRUNC in the msg_flags field of the
+        message if it didn't fit. It is optional; if it is NULL, the message is
+        received into a single buffer with recvfrom() and copied out from there
+        instead.
+
+        \param  s           The socket to receive data on
+        \param  msg         Where to store the message
+        \param  flags       Flags to the function
+        \retval -1          On error (set errno appropriately)
+        \retval n           The number of bytes received
+    */
+    ssize_t (*recvmsg)(net_socket_t *s, struct msghdr *msg, int flags);
 } fs_socket_proto_t;
 
 /** \brief   Initializer for the entry field in the fs_socket_proto_t struct. 
@@ -164,6 +164,7 @@ extern const void * __kos_romdisk;
 #define INIT_FS_RND      0x00000200  /**< Enable support for /dev/urandom VFS */
 
 #define INIT_NO_SHUTDOWN 0x00000400  /**< Disable hardware shutdown */
+#define INIT_THD_TICKLESS 0x00000800 /**< Use the tickless scheduler */
 /** @} */
 
 __END_DECLS
@@ -25,6 +25,7 @@
 __BEGIN_DECLS
 
 #include <sys/queue.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 
 /* All functions in this header return < 0 on failure, and 0 on success. */
@@ -181,6 +182,23 @@ typedef struct knetif {
         \param  count       The number of addresses in list.
     */
     int (*if_set_mc)(struct knetif *self, const uint8_t *list, int count);
+
+    /** \brief  Queue a packet made up of several pieces for transmission.
+
+        This is optional. Drivers that can copy each piece straight to the
+        device should implement it, so that packets don't have to be copied
+        into one buffer first. If this is NULL, if_tx will be used instead.
+
+        \param  self        The network device in question.
+        \param  iov         The pieces of the packet, in order.
+        \param  iovcnt      The number of pieces.
+        \param  blocking    1 if we should block if needed, 0 otherwise.
+        \retval NETIF_TX_OK     On success.
+        \retval NETIF_TX_ERROR  On general failure.
+        \retval NETIF_TX_AGAIN  If non-blocking and we must block to send.
+    */
+    int (*if_tx_iov)(struct knetif *self, const struct iovec *iov, int iovcnt,
+                     int blocking);
 } netif_t;
 
 /** \defgroup net_drivers_flags netif_t Flags
@@ -792,6 +810,8 @@ typedef struct net_udp_stats {
     uint32_t  pkt_recv_bad_size;      /**< \brief Packets of a bad size */
     uint32_t  pkt_recv_bad_chksum;    /**< \brief Packets with a bad checksum */
     uint32_t  pkt_recv_no_sock;       /**< \brief Packets with to a closed port */
+    uint32_t  pkt_recv_dropped;       /**< \brief Packets dropped for lack of
+                                                   receive buffer space */
 } net_udp_stats_t;
 
 /** \brief  Retrieve statistics from the UDP layer.
@@ -978,6 +998,11 @@ int net_unreg_device(netif_t *device);
     \param  ip              The IPv4 address to set on the default device, in
                             host byte order.
 
+    \note                   The loopback device (127.0.0.1 and ::1) is
+                            always brought up, even if no network hardware
+                            is detected. In that case, this function returns
+                            -1, but local sockets remain usable.
+
     \return                 0 on success, <0 on failure.
 */
 int net_init(uint32_t ip);
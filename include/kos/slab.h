@@ -0,0 +1,135 @@
+/* KallistiOS ##version##
+
+   kos/slab.h
+
+   Fixed-size object caches
+*/
+
+/** \file    kos/slab.h
+    \brief   Fixed-size object caches (slab allocator).
+    \ingroup slab
+
+    This file contains the interface to the kernel's object caches. An object
+    cache hands out objects of a single fixed size, which are carved out of
+    larger "slabs" of memory requested from malloc(). Allocating and freeing
+    objects is done in constant time, and keeping objects of the same size
+    together greatly reduces the fragmentation of the main heap for objects
+    that are frequently allocated and freed, like packets, sockets or file
+    handles.
+
+    Object caches can be used from within interrupt context, as long as they
+    do not need to grow (which needs malloc()).
+*/
+
+#ifndef __KOS_SLAB_H
+#define __KOS_SLAB_H
+
+#include <kos/cdefs.h>
+__BEGIN_DECLS
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** \defgroup slab  Object Caches
+    \brief          Fixed-size object allocator
+    \ingroup        system_allocator
+
+    @{
+*/
+
+/** \brief  Opaque type for an object cache. */
+typedef struct kmem_cache kmem_cache_t;
+
+/** \name   Object cache flags
+    \brief  Flags for kmem_cache_create().
+
+    @{
+*/
+#define KMEM_CACHE_HWALIGN  0x1   /**< \brief Align objects on cache lines */
+#define KMEM_CACHE_ZERO     0x2   /**< \brief Zero objects on allocation */
+/** @} */
+
+/** \brief  Object cache statistics.
+
+    \sa kmem_cache_get_stats
+*/
+typedef struct kmem_cache_stats {
+    size_t   obj_size;      /**< \brief Size of each object, with padding */
+    size_t   slab_size;     /**< \brief Size of each slab, in bytes */
+    uint32_t objs_per_slab; /**< \brief Number of objects in a slab */
+    uint32_t slabs;         /**< \brief Number of slabs allocated */
+    uint32_t in_use;        /**< \brief Number of objects in use */
+    uint32_t peak_in_use;   /**< \brief Highest number of objects in use */
+    uint32_t allocs;        /**< \brief Total number of allocations */
+    uint32_t frees;         /**< \brief Total number of frees */
+    uint32_t failures;      /**< \brief Number of failed allocations */
+} kmem_cache_stats_t;
+
+/** \brief  Create an object cache.
+
+    \param  name            A name for the cache, used in statistics. The
+                            string is not copied, and must stay valid for the
+                            lifetime of the cache.
+    \param  size            The size of each object, in bytes.
+    \param  align           The required alignment of each object, in bytes
+                            (must be a power of two, or 0 for the default).
+    \param  flags           A mask of KMEM_CACHE_* flags.
+
+    \return                 The new cache, or NULL on error (with errno set).
+*/
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align,
+                                unsigned int flags);
+
+/** \brief  Destroy an object cache.
+
+    All of the memory held by the cache is released. Any object allocated
+    from the cache must have been freed before calling this function.
+
+    \param  cache           The cache to destroy.
+*/
+void kmem_cache_destroy(kmem_cache_t *cache);
+
+/** \brief  Allocate an object from a cache.
+
+    \param  cache           The cache to allocate from.
+
+    \return                 The new object, or NULL if no memory is available.
+*/
+void *kmem_cache_alloc(kmem_cache_t *cache);
+
+/** \brief  Free an object back to its cache.
+
+    \param  cache           The cache the object was allocated from.
+    \param  obj             The object to free. NULL is ignored.
+*/
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+
+/** \brief  Release the unused slabs of a cache.
+
+    \param  cache           The cache to shrink.
+
+    \return                 The number of bytes released.
+*/
+size_t kmem_cache_shrink(kmem_cache_t *cache);
+
+/** \brief  Retrieve the statistics of a cache.
+
+    \param  cache           The cache to query.
+    \param  stats           Where to copy the statistics.
+*/
+void kmem_cache_get_stats(const kmem_cache_t *cache,
+                          kmem_cache_stats_t *stats);
+
+/** \brief  Print the statistics of all object caches.
+
+    \param  pf              The printf-like function to print with.
+
+    \retval 0               On success.
+*/
+int kmem_cache_pslist(int (*pf)(const char *fmt, ...));
+
+/** @} */
+
+__END_DECLS
+
+#endif /* __KOS_SLAB_H */
@@ -112,6 +112,13 @@ __BEGIN_DECLS
 */
 #define KTHREAD_PWD_SIZE    256
 
+/** \brief   Number of size classes in the per-thread allocator caches.
+
+    Each class holds free blocks 16 bytes larger than the previous one, so
+    this covers requests of up to 16 * KTHREAD_MALLOC_CLASSES - 4 bytes.
+*/
+#define KTHREAD_MALLOC_CLASSES  8
+
 /* Pre-define list/queue types */
 struct kthread;
 
@@ -156,6 +163,52 @@ typedef enum kthread_state {
 typedef int tid_t;            /**< \brief Thread ID type */
 typedef int prio_t;           /**< \brief Priority value type */
 
+/** \brief   Number of buckets in the scheduler statistics histograms.
+
+    Bucket n counts the events that lasted between 2^n and 2^(n+1)
+    microseconds, except for the first one (which also counts anything below
+    1us) and the last one (which counts everything above).
+*/
+#define THD_SCHED_HIST_SIZE 16
+
+/** \brief   Per-thread scheduler statistics.
+
+    These statistics are only collected while enabled with
+    thd_set_sched_stats(), as they require reading the timer on every context
+    switch. They can be used to track down starvation and priority inversion
+    issues.
+
+    \sa thd_get_sched_stats, thd_set_sched_stats
+*/
+typedef struct kthread_sched_stats {
+    /** \brief  Number of times the thread was switched in. */
+    uint32_t runs;
+
+    /** \brief  Number of times the thread gave up the CPU by itself
+                (blocking, sleeping or passing). */
+    uint32_t voluntary;
+
+    /** \brief  Number of times the thread was preempted while runnable. */
+    uint32_t preempted;
+
+    /** \brief  Total time spent ready to run, but not running (ns). */
+    uint64_t latency_total;
+
+    /** \brief  Longest time spent ready to run, but not running (ns). */
+    uint64_t latency_max;
+
+    /** \brief  log2 histogram of the wakeup-to-run latencies (us). */
+    uint32_t latency_hist[THD_SCHED_HIST_SIZE];
+
+    /** \brief  log2 histogram of the lengths of the run slices (us). */
+    uint32_t slice_hist[THD_SCHED_HIST_SIZE];
+
+    /** \cond Internal timestamps (ns) */
+    uint64_t ready_time;
+    uint64_t run_time;
+    /** \endcond */
+} kthread_sched_stats_t;
+
 /** \brief   Structure describing one running thread.
 
     Each thread has one of these structures assigned to it, which holds all the
@@ -172,8 +225,16 @@ typedef struct __attribute__((aligned(32))) kthread {
     /** \brief  Run/Wait queue handle. Once again, not a function. */
     TAILQ_ENTRY(kthread) thdq;
 
-    /** \brief  Timer queue handle (if applicable). Also not a function. */
-    TAILQ_ENTRY(kthread) timerq;
+    /** \brief  Timer queue handle (if applicable). Also not a function.
+
+        The timer queue is a pairing heap keyed on wait_timeout; these are the
+        links of the thread's heap node.
+    */
+    struct {
+        struct kthread *child;  /**< \brief First child node */
+        struct kthread *next;   /**< \brief Next sibling node */
+        struct kthread *prev;   /**< \brief Previous sibling, or parent */
+    } timerq;
 
     /** \brief  Kernel thread id. */
     tid_t tid;
@@ -184,6 +245,13 @@ typedef struct __attribute__((aligned(32))) kthread {
     /** \brief  Static priority: 0..PRIO_MAX (higher means lower priority). */
     prio_t real_prio;
 
+    /** \brief  Priority the thread was put in the run queue with.
+
+        Only meaningful while THD_QUEUED is set. This is kept separately from
+        prio, as the dynamic priority may be changed while queued.
+    */
+    prio_t queued_prio;
+
     /** \brief  Thread flags. */
     kthread_flags_t flags;
 
@@ -222,6 +290,9 @@ typedef struct __attribute__((aligned(32))) kthread {
         uint64_t total;     /**< \brief total running CPU time for thread */
     } cpu_time;
 
+    /** \brief Scheduler statistics, if enabled. */
+    kthread_sched_stats_t sched_stats;
+
     /** \brief  Thread label.
 
         This value is used when printing out a user-readable process listing.
@@ -255,6 +326,16 @@ typedef struct __attribute__((aligned(32))) kthread {
     /** \brief Compiler-level thread-local storage. */
     void *tls_hnd;
 
+    /** \brief  Per-thread cache of small free memory blocks.
+
+        This is managed by malloc(), so that common small allocations don't
+        need to take the global allocator lock.
+    */
+    struct {
+        void *blocks[KTHREAD_MALLOC_CLASSES];   /**< \brief Free lists */
+        uint8_t count[KTHREAD_MALLOC_CLASSES];  /**< \brief List lengths */
+    } malloc_cache;
+
     /** \brief  Return value of the thread function.
 
         This is only used in joinable threads.
@@ -297,16 +378,15 @@ typedef struct kthread_attr {
 
 /** \brief  kthread mode values
 
-    \deprecated
-    Only preemptive scheduling is still supported!
-
     The threading system will always be in one of the following modes. This
-    represents either pre-emptive scheduling or an un-initialized state.
+    represents either pre-emptive scheduling (periodic or tickless) or an
+    un-initialized state. Cooperative scheduling is no longer supported.
 */
 typedef enum kthread_mode {
-    THD_MODE_NONE    = -1,  /**< \brief Threads not running */
-    THD_MODE_COOP    =  0,  /**< \brief Cooperative mode \deprecated */
-    THD_MODE_PREEMPT =  1   /**< \brief Preemptive threading mode */
+    THD_MODE_NONE     = -1, /**< \brief Threads not running */
+    THD_MODE_COOP     =  0, /**< \brief Cooperative mode \deprecated */
+    THD_MODE_PREEMPT  =  1, /**< \brief Preemptive threading mode */
+    THD_MODE_TICKLESS =  2  /**< \brief Tickless preemptive threading mode */
 } kthread_mode_t;
 
 /** \cond The currently executing thread -- Do not manipulate directly! */
@@ -678,38 +758,74 @@ uint64_t thd_get_cpu_time(kthread_t *thd);
 */
 uint64_t thd_get_total_cpu_time(void);
 
+/** \brief   Enable or disable scheduler statistics collection.
+
+    When enabled, the scheduler records for each thread the latency between
+    becoming ready and actually running, how many context switches were
+    voluntary or preemptive, and the distribution of run slice lengths.
+    Enabling the collection resets the statistics of all threads.
+
+    When statistics are enabled, thd_pslist() also prints them out.
+
+    \param  enable          True to enable collection, false to disable it.
+
+    \return                 Whether collection was previously enabled.
+
+    \sa thd_get_sched_stats
+*/
+bool thd_set_sched_stats(bool enable);
+
+/** \brief       Retrieve a thread's scheduler statistics.
+    \relatesalso kthread_t
+
+    \param  thd             The thread to query, or NULL for the current one.
+    \param  stats           Where to copy the statistics.
+
+    \retval 0               On success.
+    \retval -1              If statistics collection is disabled.
+
+    \sa thd_set_sched_stats
+*/
+int thd_get_sched_stats(const kthread_t *thd, kthread_sched_stats_t *stats);
+
 /** \brief   Change threading modes.
 
-    This function changes the current threading mode of the system.
-    With preemptive threading being the only mode.
+    This function changes the current threading mode of the system. The
+    scheduler is always preemptive, but it can either run off a periodic timer
+    interrupt (THD_MODE_PREEMPT, the default), or in tickless mode
+    (THD_MODE_TICKLESS).
+
+    In tickless mode, the scheduler timer is only programmed for the next
+    event that actually requires a reschedule: the earliest timed genwait
+    (sleeps, timed locks, etc.), or the end of the current timeslice when
+    another thread of the same priority is ready to run. An idle system then
+    receives no scheduler interrupts at all.
 
-    \deprecated
-    This is now deprecated
+    Tickless mode can also be selected at startup with the INIT_THD_TICKLESS
+    init flag.
 
-    \param  mode            One of the THD_MODE values.
+    \param  mode            THD_MODE_PREEMPT or THD_MODE_TICKLESS.
 
-    \return                 The old mode of the threading system.
+    \return                 The old mode of the threading system, or -1 if the
+                            requested mode is not supported.
 
     \sa thd_get_mode
 */
-int thd_set_mode(kthread_mode_t mode) __deprecated;
+int thd_set_mode(kthread_mode_t mode);
 
 /** \brief   Fetch the current threading mode.
 
-    With preemptive threading being the only mode.
-
-    \deprecated
-    This is now deprecated.
-
     \return                 The current mode of the threading system.
 
     \sa thd_set_mode
 */
-kthread_mode_t thd_get_mode(void) __deprecated;
+kthread_mode_t thd_get_mode(void);
 
 /** \brief   Set the scheduler's frequency.
 
-    Sets the frequency of the scheduler interrupts in hertz.
+    Sets the frequency of the scheduler interrupts in hertz. In tickless mode,
+    this sets the length of the timeslice given to threads which share their
+    priority with another ready thread.
 
     \param hertz    The new frequency in hertz (1-1000)
 
@@ -24,6 +24,8 @@
 #include <sys/cdefs.h>
 __BEGIN_DECLS
 
+struct kthread;
+
 /** \defgroup system_allocator  Allocator Extensions
     \brief                      KOS custom allocator extensions
     \ingroup                    system
@@ -54,6 +56,19 @@ __BEGIN_DECLS
 */
 int malloc_irq_safe(void);
 
+/** \brief  Release a thread's cached memory blocks.
+
+    Small allocations are served from per-thread caches of free blocks, to
+    avoid taking the global allocator lock. This returns all of the blocks
+    cached by the given thread to the allocator. This is called automatically
+    when a thread is destroyed, but can also be used to trim the memory held
+    by a long-lived thread.
+
+    \param  thd             The thread whose cache to release, or NULL for the
+                            calling thread. It must not be running.
+*/
+void malloc_thread_cache_flush(struct kthread *thd);
+
 /** \brief Only available with KM_DBG
 */
 int mem_check_block(void *p);
@@ -136,6 +136,14 @@ struct sockaddr_in6 {
 */
 #define INADDR_BROADCAST 0xFFFFFFFF
 
+/** \brief   IPv4 loopback address.
+    \ingroup networking_ipv4
+
+    This address (127.0.0.1) always refers to the local host, and is handled by
+    the loopback device rather than sent out on any network.
+*/
+#define INADDR_LOOPBACK  0x7F000001
+
 /** \brief   IPv4 error address.
     \ingroup networking_ipv4
 
@@ -47,6 +47,32 @@ __BEGIN_DECLS
 
 #define TCP_NODELAY             1 /**< \brief Don't delay to coalesce. */
 
+/** \brief  Use slow start, congestion avoidance, fast retransmit and fast
+            recovery (RFC 5681). Enabled by default.
+
+    This is a KOS extension, and takes an int (non-zero to enable). */
+#define TCP_CONGESTION_CONTROL  0x1000
+
+/** \brief  Offer window scaling (RFC 7323). Enabled by default.
+
+    This also allows for buffers bigger than 65535 bytes to be set with
+    SO_RCVBUF and SO_SNDBUF. This is a KOS extension, and takes an int
+    (non-zero to enable). It only affects connections opened after it is set.
+*/
+#define TCP_WINDOW_SCALING      0x1001
+
+/** \brief  Offer timestamps (RFC 7323). Enabled by default.
+
+    This is a KOS extension, and takes an int (non-zero to enable). It only
+    affects connections opened after it is set. */
+#define TCP_TIMESTAMPS          0x1002
+
+/** \brief  Offer selective acknowledgements (RFC 2018). Enabled by default.
+
+    This is a KOS extension, and takes an int (non-zero to enable). It only
+    affects connections opened after it is set. */
+#define TCP_SACK                0x1003
+
 /** @} */
 
 __END_DECLS
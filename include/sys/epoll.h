@@ -0,0 +1,146 @@
+/* KallistiOS ##version##
+
+   sys/epoll.h
+*/
+
+/** \file    sys/epoll.h
+    \brief   Scalable I/O event notification.
+    \ingroup threading_polling
+
+    This file contains the definitions for the epoll() family of functions, as
+    found on Linux. Unlike poll() and select(), which are given the full list
+    of file descriptors to watch on every call, an epoll instance keeps a
+    persistent set of file descriptors, and only the ones that had something
+    happen to them are looked at when waiting. This makes the cost of waiting
+    depend on the number of file descriptors that are ready, instead of the
+    number of file descriptors that are watched.
+
+    Like poll(), this only really works for sockets for the time being. Other
+    file descriptors are always reported as ready for reading and writing.
+
+    \sa poll.h
+*/
+
+#ifndef __SYS_EPOLL_H
+#define __SYS_EPOLL_H
+
+#include <kos/cdefs.h>
+__BEGIN_DECLS
+
+#include <stdint.h>
+#include <poll.h>
+
+/** \addtogroup threading_polling
+    @{
+*/
+
+/** \defgroup epoll_events              Events for epoll
+    \brief                              Masks representing event types for epoll
+
+    These are the events that can be set in the events field of the struct
+    epoll_event. They share their values with the \ref poll_events.
+
+    @{
+*/
+#define EPOLLIN         POLLIN      /**< \brief Data may be read */
+#define EPOLLPRI        POLLPRI     /**< \brief High-priority data may be read */
+#define EPOLLOUT        POLLOUT     /**< \brief Data may be written */
+#define EPOLLRDNORM     POLLRDNORM  /**< \brief Normal data may be read */
+#define EPOLLRDBAND     POLLRDBAND  /**< \brief Priority data may be read */
+#define EPOLLWRNORM     POLLWRNORM  /**< \brief Normal data may be written */
+#define EPOLLWRBAND     POLLWRBAND  /**< \brief Priority data may be written */
+#define EPOLLERR        POLLERR     /**< \brief Error has occurred (always reported) */
+#define EPOLLHUP        POLLHUP     /**< \brief Peer disconnected (always reported) */
+
+/** \brief  Only report a file descriptor once, until it is re-armed with
+            EPOLL_CTL_MOD. */
+#define EPOLLONESHOT    (1U << 30)
+/** \brief  Edge-triggered: only report events as they happen, rather than for
+            as long as the file descriptor is ready. */
+#define EPOLLET         (1U << 31)
+/** @} */
+
+/** \name   Operations for epoll_ctl()
+    @{
+*/
+#define EPOLL_CTL_ADD   1   /**< \brief Add a file descriptor to the set */
+#define EPOLL_CTL_DEL   2   /**< \brief Remove a file descriptor from the set */
+#define EPOLL_CTL_MOD   3   /**< \brief Change the events of a file descriptor */
+/** @} */
+
+/** \brief  Flag for epoll_create1(), accepted for compatibility. */
+#define EPOLL_CLOEXEC   1
+
+/** \brief   User data associated with a watched file descriptor. */
+typedef union epoll_data {
+    void *ptr;              /**< \brief Pointer */
+    int fd;                 /**< \brief File descriptor */
+    uint32_t u32;           /**< \brief 32-bit value */
+    uint64_t u64;           /**< \brief 64-bit value */
+} epoll_data_t;
+
+/** \brief   Structure representing an event for epoll.
+    \headerfile sys/epoll.h
+*/
+struct epoll_event {
+    uint32_t events;        /**< \brief Events (see \ref epoll_events) */
+    epoll_data_t data;      /**< \brief User data */
+};
+
+/** \brief   Create an epoll instance.
+
+    \param  size        Ignored, but must be greater than zero.
+
+    \return             A file descriptor for the new instance, or -1 on error
+                        (sets errno as appropriate). Close it with close() when
+                        done.
+*/
+int epoll_create(int size);
+
+/** \brief   Create an epoll instance.
+
+    \param  flags       0 or EPOLL_CLOEXEC.
+
+    \return             A file descriptor for the new instance, or -1 on error
+                        (sets errno as appropriate).
+*/
+int epoll_create1(int flags);
+
+/** \brief   Add, modify or remove a file descriptor of an epoll instance.
+
+    Closing a file descriptor removes it from every instance watching it, so
+    a file descriptor opened later with the same number has to be added
+    again.
+
+    \param  epfd        The epoll instance.
+    \param  op          The operation (EPOLL_CTL_ADD, EPOLL_CTL_MOD or
+                        EPOLL_CTL_DEL).
+    \param  fd          The file descriptor to operate on.
+    \param  event       The events to watch for and user data to report with
+                        them. Ignored for EPOLL_CTL_DEL.
+
+    \retval 0           On success.
+    \retval -1          On error (sets errno as appropriate).
+*/
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+
+/** \brief   Wait for events on an epoll instance.
+
+    \param  epfd        The epoll instance.
+    \param  events      Where to store the events.
+    \param  maxevents   The maximum number of events to return.
+    \param  timeout     Maximum amount of time to block, in milliseconds. Pass
+                        0 to return immediately and -1 to block until an event
+                        occurs.
+
+    \return             The number of events stored, 0 on timeout, or -1 on
+                        error (sets errno as appropriate).
+*/
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+               int timeout);
+
+/** @} */
+
+__END_DECLS
+
+#endif /* !__SYS_EPOLL_H */
@@ -87,6 +87,29 @@ struct sockaddr_storage {
     char _ss_pad2[_SS_PAD2SIZE];
 };
 
+/** \brief  Message header, for sendmsg().
+    \headerfile sys/socket.h
+*/
+struct msghdr {
+    void         *msg_name;         /**< \brief Optional address */
+    socklen_t     msg_namelen;      /**< \brief Size of address */
+    struct iovec *msg_iov;          /**< \brief Scatter/gather array */
+    int           msg_iovlen;       /**< \brief Members in msg_iov */
+    void         *msg_control;      /**< \brief Ancillary data (ignored) */
+    socklen_t     msg_controllen;   /**< \brief Ancillary data length */
+    int           msg_flags;        /**< \brief Flags on received message */
+};
+
+/** \brief  Message header for sendmmsg() and recvmmsg().
+    \headerfile sys/socket.h
+*/
+struct mmsghdr {
+    struct msghdr msg_hdr;          /**< \brief The message */
+    unsigned int  msg_len;          /**< \brief Bytes sent or received */
+};
+
+struct timespec;
+
 /** \brief  Datagram socket type.
 
     This socket type specifies that the socket in question transmits datagrams
@@ -168,9 +191,10 @@ struct sockaddr_storage {
 #define MSG_EOR         0x04    /**< \brief Terminate a record (U) */
 #define MSG_OOB         0x08    /**< \brief Out-of-band data (U) */
 #define MSG_PEEK        0x10    /**< \brief Leave received data in queue */
-#define MSG_TRUNC       0x20    /**< \brief Normal data truncated (U) */
+#define MSG_TRUNC       0x20    /**< \brief Normal data truncated (UDP only) */
 #define MSG_WAITALL     0x40    /**< \brief Attempt to fill read buffer */
 #define MSG_DONTWAIT    0x80    /**< \brief Make this call non-blocking (non-standard) */
+#define MSG_WAITFORONE  0x100   /**< \brief Only block for the first message of recvmmsg() (non-standard) */
 /** @} */
 
 /** \addtogroup networking_sockets
@@ -339,6 +363,85 @@ ssize_t send(int socket, const void *message, size_t length, int flags);
 ssize_t sendto(int socket, const void *message, size_t length, int flags,
                const struct sockaddr *dest_addr, socklen_t dest_len);
 
+/** \brief  Send a message made up of several buffers on a socket.
+
+    This function works like sendto(), except that the message is gathered
+    from the buffers described by the msg_iov array, and the destination (if
+    any) is given by the msg_name field. The control fields are ignored.
+
+    For datagram sockets, all of the buffers are sent in one datagram. On
+    sockets where the protocol supports it, the data is handed to the network
+    device straight from the buffers, without being copied to an intermediate
+    buffer first.
+
+    \param  socket      The socket to send on.
+    \param  message     The message to send.
+    \param  flags       The type of message transmission. Set to 0 for now.
+
+    \return             On success, the number of bytes sent. On error, -1,
+                        and sets errno as appropriate.
+*/
+ssize_t sendmsg(int socket, const struct msghdr *message, int flags);
+
+/** \brief  Send several messages on a socket.
+
+    This function sends each of the messages in turn, as sendmsg() would, until
+    all of them have been sent or one of them fails. This is a non-standard
+    function, as found on Linux.
+
+    \param  socket      The socket to send on.
+    \param  msgvec      The messages to send. The msg_len field of each one
+                        that was sent is set to the number of bytes sent.
+    \param  vlen        The number of messages in msgvec.
+    \param  flags       The type of message transmission.
+
+    \return             The number of messages sent. If the first message
+                        could not be sent, -1 is returned, and errno is set as
+                        appropriate.
+*/
+int sendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+
+/** \brief  Receive a message into several buffers.
+
+    This function works like recvfrom(), except that the message is scattered
+    into the buffers described by the msg_iov array, and the address of the
+    peer is stored in the msg_name field (if it isn't NULL). No control data is
+    ever returned. If a datagram is too big for the buffers, the rest of it is
+    dropped, and MSG_TRUNC is set in the msg_flags field. Passing MSG_TRUNC in
+    flags makes it return the full length of the datagram in that case.
+
+    \param  socket      The socket to receive on.
+    \param  message     Where to store the message.
+    \param  flags       The type of message reception.
+
+    \return             On success, the length of the message in bytes. On
+                        error, -1, and sets errno as appropriate.
+*/
+ssize_t recvmsg(int socket, struct msghdr *message, int flags);
+
+/** \brief  Receive several messages from a socket.
+
+    This function receives messages in turn, as recvmsg() would, until vlen of
+    them have been received, or receiving one fails. This makes it possible to
+    drain all of the datagrams that are waiting on a socket in one call, by
+    passing MSG_DONTWAIT (or MSG_WAITFORONE, to wait for the first one only).
+    This is a non-standard function, as found on Linux.
+
+    \param  socket      The socket to receive on.
+    \param  msgvec      Where to store the messages. The msg_len field of each
+                        one that was received is set to its length.
+    \param  vlen        The number of messages in msgvec.
+    \param  flags       The type of message reception.
+    \param  timeout     If not NULL, stop once this much time has passed. This
+                        is only checked after each message is received.
+
+    \return             The number of messages received. If the first message
+                        could not be received, -1 is returned, and errno is set
+                        as appropriate.
+*/
+int recvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags,
+             struct timespec *timeout);
+
 /** \brief  Shutdown socket send and receive operations.
 
     This function closes a specific socket for the set of specified operations.
@@ -38,6 +38,8 @@ ISO9660 systems, as these were used as references as well.
 #include <kos/fs.h>
 #include <kos/opts.h>
 #include <kos/dbglog.h>
+#include <kos/slab.h>
+#include <kos/blockcache.h>
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -191,126 +193,84 @@ static uint32 iso_733(const uint8 *from) {
 
 
 /********************************************************************************/
-/* Low-level block caching routines. This implements a simple queue-based
-   LRU/MRU caching system. Whenever a block is requested, it will be placed
-   on the MRU end of the queue. As more blocks are loaded than can fit in
-   the cache, blocks are deleted from the LRU end. */
-
-/* Holds the data for one cache block, and a pointer to the next one.
-   As sectors are read from the disc, they are added to the front of
-   this cache. As the cache fills up, sectors are removed from the end
-   of it. */
-typedef struct {
-    uint8   *data;          /* Sector data */
-    uint32  sector;         /* CD sector */
-} cache_block_t;
+/* Low-level block caching routines. Sectors are kept in two separate block
+   caches, one for directory data and one for file data, so that reading
+   through a large file doesn't keep on evicting the directory sectors. */
 
-/* List of cache blocks (ordered least recently used to most recently) */
 #define NUM_CACHE_BLOCKS 16
-static cache_block_t *icache[NUM_CACHE_BLOCKS];     /* inode cache */
-static cache_block_t *dcache[NUM_CACHE_BLOCKS];     /* data cache */
-
-static unsigned char *cache_data;
-static cache_block_t *caches;
+static kos_blockcache_t *icache;     /* inode cache */
+static kos_blockcache_t *dcache;     /* data cache */
 
 /* Cache modification mutex */
 static mutex_t cache_mutex;
 
 /* Clears all cache blocks */
-static void bclear_cache(cache_block_t **cache) {
-    int i;
-
+static void bclear_cache(kos_blockcache_t *cache) {
     mutex_lock(&cache_mutex);
-
-    for(i = 0; i < NUM_CACHE_BLOCKS; i++)
-        cache[i]->sector = (uint32)-1;
-
+    blockcache_invalidate(cache);
     mutex_unlock(&cache_mutex);
 }
 
-/* Graduate a block from its current position to the MRU end of the cache */
-static void bgrad_cache(cache_block_t **cache, int block) {
-    int     i;
-    cache_block_t   *tmp;
-
-    /* Don't try it with the end block */
-    if(block < 0 || block >= (NUM_CACHE_BLOCKS - 1)) return;
-
-    /* Make a copy and scoot everything down */
-    tmp = cache[block];
-
-    for(i = block; i < (NUM_CACHE_BLOCKS - 1); i++)
-        cache[i] = cache[i + 1];
-
-    cache[NUM_CACHE_BLOCKS - 1] = tmp;
-}
-
-/* Pulls the requested sector into a cache block and returns the cache
-   block index. Note that the sector in question may already be in the
-   cache, in which case it just returns the containing block. */
-static void iso_break_all(void);
+/* Reads a sector from the disc into a cache block. A disc change is reported
+   as ENXIO, so that the caller can reinitialize things once it's done with
+   the cache. */
 static void iso_abort_stream(bool lock);
-static int bread_cache(cache_block_t **cache, uint32 sector) {
-    int i, j, rv;
+static int bread_sector(uint32_t sector, void *buf, bool inode) {
+    int rv;
 
-    rv = -1;
-    mutex_lock(&cache_mutex);
+    iso_abort_stream(inode);
+    // dbglog(DBG_DEBUG, "Stream stop for %s read\n", inode ? "cached" : "inode");
 
-    /* Look for a pre-existing cache block */
-    for(i = NUM_CACHE_BLOCKS - 1; i >= 0; i--) {
-        if(cache[i]->sector == sector) {
-            bgrad_cache(cache, i);
-            rv = NUM_CACHE_BLOCKS - 1;
-            goto bread_exit;
-        }
-    }
+    /* Load the requested block */
+    rv = cdrom_read_sectors_ex(buf, sector + 150, 1, true);
 
-    /* If not, look for an open cache slot; if we find one, use it */
-    for(i = 0; i < NUM_CACHE_BLOCKS; i++) {
-        if(cache[i]->sector == (uint32)-1) break;
-    }
+    if(rv != ERR_OK) {
+        //dbglog(DBG_ERROR, "fs_iso9660: can't read_sectors for %d: %d\n",
+        //  sector+150, rv);
+        if(rv == ERR_DISC_CHG || rv == ERR_NO_DISC)
+            return -ENXIO;
 
-    /* If we didn't find one, kick an LRU block out of cache */
-    if(i >= NUM_CACHE_BLOCKS) {
-        i = 0;
+        return -EIO;
     }
 
-    iso_abort_stream(cache == icache);
-    // dbglog(DBG_DEBUG, "Stream stop for %s read\n", cache == icache ? "cached" : "inode");
+    return 0;
+}
 
-    /* Load the requested block */
-    j = cdrom_read_sectors_ex(cache[i]->data, sector + 150, 1, true);
+static int bread_isector(void *data, uint64_t sector, void *buf) {
+    (void)data;
+    return bread_sector((uint32_t)sector, buf, true);
+}
 
-    if(j != ERR_OK) {
-        //dbglog(DBG_ERROR, "fs_iso9660: can't read_sectors for %d: %d\n",
-        //  sector+150, j);
-        if(j == ERR_DISC_CHG || j == ERR_NO_DISC) {
-            init_percd();
-        }
+static int bread_dsector(void *data, uint64_t sector, void *buf) {
+    (void)data;
+    return bread_sector((uint32_t)sector, buf, false);
+}
 
-        rv = -1;
-        goto bread_exit;
-    }
+/* Pulls the requested sector into a cache block and returns a pointer to
+   its data. Note that the sector in question may already be in the cache,
+   in which case it just returns the containing block. */
+static void iso_break_all(void);
+static uint8_t *bread_cache(kos_blockcache_t *cache, uint32 sector) {
+    uint8_t *rv;
+    int err;
 
-    cache[i]->sector = sector;
+    mutex_lock(&cache_mutex);
+    rv = blockcache_read(cache, sector, &err);
+    mutex_unlock(&cache_mutex);
 
-    /* Move it to the most-recently-used position */
-    bgrad_cache(cache, i);
-    rv = NUM_CACHE_BLOCKS - 1;
+    if(!rv && err == ENXIO)
+        init_percd();
 
-    /* Return the new cache block index */
-bread_exit:
-    mutex_unlock(&cache_mutex);
     return rv;
 }
 
 /* read data block */
-static inline int bdread(uint32_t sector) {
+static inline uint8_t *bdread(uint32_t sector) {
     return bread_cache(dcache, sector);
 }
 
 /* read inode block */
-static inline int biread(uint32_t sector) {
+static inline uint8_t *biread(uint32_t sector) {
     return bread_cache(icache, sector);
 }
 
@@ -336,7 +296,8 @@ static iso_dirent_t root_dirent;
 /* Per-disc initialization; this is done every time it's discovered that
    a new CD has been inserted. */
 static int init_percd(void) {
-    int     i, blk;
+    int     i;
+    uint8_t *blk;
     cd_toc_t   toc;
 
     dbglog(DBG_NOTICE, "fs_iso9660: disc change detected\n");
@@ -362,10 +323,10 @@ static int init_percd(void) {
     for(i = 1; i <= 3; i++) {
         blk = biread(session_base + i + 16 - 150);
 
-        if(blk < 0) return blk;
+        if(!blk) return -1;
 
-        if(memcmp((char *)icache[blk]->data, "\02CD001", 6) == 0) {
-            joliet = isjoliet((char *)icache[blk]->data + 88);
+        if(memcmp((char *)blk, "\02CD001", 6) == 0) {
+            joliet = isjoliet((char *)blk + 88);
             dbglog(DBG_NOTICE, "  (joliet level %d extensions detected)\n", joliet);
 
             if(joliet) break;
@@ -377,16 +338,16 @@ static int init_percd(void) {
         /* Grab and check the volume descriptor */
         blk = biread(session_base + 16 - 150);
 
-        if(blk < 0) return i;
+        if(!blk) return -1;
 
-        if(memcmp((char*)icache[blk]->data, "\01CD001", 6)) {
+        if(memcmp((char*)blk, "\01CD001", 6)) {
             dbglog(DBG_ERROR, "fs_iso9660: disc is not iso9660\r\n");
             return -1;
         }
     }
 
     /* Locate the root directory */
-    memcpy(&root_dirent, icache[blk]->data + 156, sizeof(iso_dirent_t));
+    memcpy(&root_dirent, blk + 156, sizeof(iso_dirent_t));
     root_extent = iso_733(root_dirent.extent);
     root_size = iso_733(root_dirent.size);
 
@@ -435,7 +396,8 @@ static int fncompare(const char *isofn, int isosize, const char *normalfn) {
  */
 static iso_dirent_t *find_object(const char *fn, int dir,
                                  uint32 dir_extent, uint32 dir_size) {
-    int     i, c;
+    int     i;
+    uint8_t *blk;
     iso_dirent_t    *de;
 
     /* RockRidge */
@@ -456,13 +418,13 @@ static iso_dirent_t *find_object(const char *fn, int dir,
         utf2ucs(ucsname, (uint8 *)fn);
 
     while(size_left > 0) {
-        c = biread(dir_extent);
+        blk = biread(dir_extent);
 
-        if(c < 0) return NULL;
+        if(!blk) return NULL;
 
         for(i = 0; i < 2048 && i < size_left;) {
             /* Locate the current dirent */
-            de = (iso_dirent_t *)(icache[c]->data + i);
+            de = (iso_dirent_t *)(blk + i);
 
             if(!de->length) break;
 
@@ -595,6 +557,9 @@ static TAILQ_HEAD(iso_fd_queue, iso_fd) iso_fd_queue;
 static mutex_t fh_mutex;
 static iso_fd_t *stream_fd = NULL;
 
+/* Object cache for the file handles */
+static kmem_cache_t *fd_cache;
+
 /* Break all of our open file descriptor. This is necessary when the disc
    is changed so that we don't accidentally try to keep on doing stuff
    with the old info. As files are closed and re-opened, the broken flag
@@ -653,7 +618,7 @@ static void * iso_open(vfs_handler_t * vfs, const char *fn, int mode) {
         return 0;
     }
 
-    fd = aligned_alloc(32, sizeof(*fd));
+    fd = kmem_cache_alloc(fd_cache);
     if(!fd) {
         errno = ENOMEM;
         return 0;
@@ -688,7 +653,7 @@ static int iso_close(void * h) {
     }
 
     TAILQ_REMOVE(&iso_fd_queue, fd, next);
-    free(fd);
+    kmem_cache_free(fd_cache, fd);
 
     return 0;
 }
@@ -702,6 +667,7 @@ static ssize_t iso_read(void * h, void *buf, size_t bytes) {
     int rv, c;
     size_t toread, thissect;
     uint8 * outbuf;
+    uint8_t *blk;
     size_t remain_size = 0, req_size;
     uint32_t sector;
     iso_fd_t *fd = (iso_fd_t *)h;
@@ -837,12 +803,12 @@ read_loop:
         }
         else {
             toread = (toread > thissect) ? thissect : toread;
-            c = bdread(sector);
+            blk = bdread(sector);
 
-            if(c < 0) {
+            if(!blk) {
                 goto read_error;
             }
-            memcpy(outbuf, dcache[c]->data + (fd->ptr % 2048), toread);
+            memcpy(outbuf, blk + (fd->ptr % 2048), toread);
         }
 
 end_loop:
@@ -963,7 +929,7 @@ static void fn_postprocess(char *fnin) {
 
 /* Read a directory entry */
 static const dirent_t *iso_readdir(void * h) {
-    int     c;
+    uint8_t *blk;
     iso_dirent_t    *de;
 
     /* RockRidge */
@@ -979,16 +945,15 @@ static const dirent_t *iso_readdir(void * h) {
 
     /* Scan forwards until we find the next valid entry, an
        end-of-entry mark, or run out of dir size. */
-    c = -1;
     de = NULL;
 
     while(fd->ptr < fd->size) {
         /* Get the current dirent block */
-        c = biread(fd->first_extent + fd->ptr / 2048);
+        blk = biread(fd->first_extent + fd->ptr / 2048);
 
-        if(c < 0) return NULL;
+        if(!blk) return NULL;
 
-        de = (iso_dirent_t *)(icache[c]->data + (fd->ptr % 2048));
+        de = (iso_dirent_t *)(blk + (fd->ptr % 2048));
 
         if(de->length) break;
 
@@ -1001,9 +966,9 @@ static const dirent_t *iso_readdir(void * h) {
     /* If we're at the first, skip the two blank entries */
     if(!de->name[0] && de->name_len == 1) {
         fd->ptr += de->length;
-        de = (iso_dirent_t *)(icache[c]->data + (fd->ptr % 2048));
+        de = (iso_dirent_t *)(blk + (fd->ptr % 2048));
         fd->ptr += de->length;
-        de = (iso_dirent_t *)(icache[c]->data + (fd->ptr % 2048));
+        de = (iso_dirent_t *)(blk + (fd->ptr % 2048));
 
         if(!de->length) return NULL;
     }
@@ -1259,26 +1224,38 @@ static vfs_handler_t vh = {
 
 /* Initialize the file system */
 void fs_iso9660_init(void) {
-    int i;
-
     /* Init the linked list */
     TAILQ_INIT(&iso_fd_queue);
 
+    /* Create the file handle cache, keeping the stream buffer aligned */
+    fd_cache = kmem_cache_create("iso_fd", sizeof(iso_fd_t),
+                                 alignof(iso_fd_t), 0);
+
+    if(!fd_cache) {
+        dbglog(DBG_ERROR, "fs_iso9660: can't create the file handle cache\n");
+        return;
+    }
+
     /* Init thread mutexes */
     mutex_init(&cache_mutex, MUTEX_TYPE_NORMAL);
     mutex_init(&fh_mutex, MUTEX_TYPE_NORMAL);
 
-    /* Allocate cache block space, properly aligned for DMA access */
-    cache_data = aligned_alloc(32, 2 * NUM_CACHE_BLOCKS * 2048);
-    caches = malloc(2 * NUM_CACHE_BLOCKS * sizeof(cache_block_t));
-
-    for(i = 0; i < NUM_CACHE_BLOCKS; i++) {
-        icache[i] = &caches[i * 2];
-        icache[i]->data = &cache_data[i * 2 * 2048];
-        icache[i]->sector = -1;
-        dcache[i] = &caches[i * 2 + 1];
-        dcache[i]->data = &cache_data[i * 2 * 2048 + 2048];
-        dcache[i]->sector = -1;
+    /* Allocate the sector caches */
+    icache = blockcache_create_ex(2048, NUM_CACHE_BLOCKS, bread_isector,
+                                  NULL, NULL);
+    dcache = blockcache_create_ex(2048, NUM_CACHE_BLOCKS, bread_dsector,
+                                  NULL, NULL);
+
+    if(!icache || !dcache) {
+        dbglog(DBG_ERROR, "fs_iso9660: can't allocate the sector caches\n");
+        blockcache_destroy(icache);
+        blockcache_destroy(dcache);
+        icache = dcache = NULL;
+        kmem_cache_destroy(fd_cache);
+        fd_cache = NULL;
+        mutex_destroy(&cache_mutex);
+        mutex_destroy(&fh_mutex);
+        return;
     }
 
     percd_done = 0;
@@ -1293,12 +1270,19 @@ void fs_iso9660_init(void) {
 
 /* De-init the file system */
 void fs_iso9660_shutdown(void) {
+    /* Nothing to do if we never got set up */
+    if(!fd_cache)
+        return;
+
     /* De-register with vblank */
     vblank_handler_remove(iso_vblank_hnd);
 
     /* Dealloc cache block space */
-    free(cache_data);
-    free(caches);
+    blockcache_destroy(icache);
+    blockcache_destroy(dcache);
+
+    kmem_cache_destroy(fd_cache);
+    fd_cache = NULL;
 
     /* Free muteces */
     mutex_destroy(&cache_mutex);
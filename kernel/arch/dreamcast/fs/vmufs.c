@@ -35,6 +35,14 @@ the user may never give your program another frame of time if it corrupts
 their save games! If you want better control to save loading and saving
 stuff for a big batch of changes, then use the low-level funcs.
 
+That said, reading the root block, the FAT and the directory of a VMU takes
+more than a dozen maple transactions, at one block per frame. So the higher
+level functions keep a copy of those for each memory card and only go to the
+card for the file data itself. Changes to the FAT and directory are written
+through to the card right away, and the copy is dropped whenever something
+goes wrong, when the card is unplugged, or when the low-level functions are
+used to write any of these blocks.
+
 Function comments located in vmufs.h.
 
 */
@@ -48,6 +56,39 @@ Function comments located in vmufs.h.
    be much of an issue :) */
 static mutex_t mutex;
 
+/* Cached metadata of a memory card. The valid flag is cleared when the card
+   is unplugged, from the VMU driver's detach hook (which runs in interrupt
+   context), so nothing else should
+   be touched there; the buffers are released on the next access. The gen
+   counter lets a load that raced with a detach know that it's stale. */
+typedef struct {
+    maple_device_t  *dev;
+    volatile int    valid;
+    volatile uint32 gen;
+    vmu_root_t      root;
+    vmu_dir_t       *dir;
+    int             dirsize;
+    uint16          *fat;
+    int             fatsize;
+} vmufs_meta_t;
+
+static vmufs_meta_t meta_cache[MAPLE_PORT_COUNT][MAPLE_UNIT_COUNT];
+
+static vmufs_meta_t *vmufs_meta(maple_device_t *dev) {
+    return &meta_cache[dev->port][dev->unit];
+}
+
+void vmufs_invalidate(maple_device_t *dev) {
+    vmufs_meta_t *m;
+
+    if(!dev || dev->port >= MAPLE_PORT_COUNT || dev->unit >= MAPLE_UNIT_COUNT)
+        return;
+
+    m = vmufs_meta(dev);
+    m->valid = 0;
+    m->gen++;
+}
+
 /* Convert a decimal number to BCD; max of two digits */
 static uint8 __pure dec_to_bcd(int dec) {
     uint8 rv = 0;
@@ -89,6 +130,8 @@ int vmufs_root_read(maple_device_t * dev, vmu_root_t * root_buf) {
 }
 
 int vmufs_root_write(maple_device_t * dev, vmu_root_t * root_buf) {
+    vmufs_invalidate(dev);
+
     /* XXX: Assume root is at 255.. is there some way to figure this out dynamically? */
     if(vmu_block_write(dev, 255, (uint8 *)root_buf) != 0) {
         dbglog(DBG_ERROR, "vmufs_root_write: can't write block %d on device %c%c\n",
@@ -107,49 +150,92 @@ int vmufs_fat_blocks(vmu_root_t * root_buf) {
     return root_buf->fat_size * 512;
 }
 
+/* Write the FAT (if fat_buf isn't NULL) and the dirty blocks of the dir (if
+   dir_buf isn't NULL) back to the card, all in one go so that the writes get
+   pipelined. They're written in the order given by fat_first, for whichever
+   order is safest if the card gets pulled halfway through. */
+static int vmufs_meta_write(maple_device_t * dev, vmu_root_t * root, vmu_dir_t * dir_buf,
+                            uint16 * fat_buf, int fat_first) {
+    uint16  blocks[257];
+    uint8   *buf;
+    unsigned int i, j, n = 0, dir_size = dir_buf ? root->dir_size : 0;
+    int rv, needsop;
+
+    if(!(buf = (uint8 *)malloc((dir_size + 1) * 512))) {
+        dbglog(DBG_ERROR, "vmufs_meta_write: can't alloc %d bytes on device %c%c\n",
+               (int)(dir_size + 1) * 512, dev->port + 'A', dev->unit + '0');
+        return -1;
+    }
+
+    if(fat_buf && fat_first) {
+        blocks[n] = root->fat_loc;
+        memcpy(buf + n++ * 512, fat_buf, 512);
+    }
+
+    /* The dir is stored backwards, starting at dir_loc. */
+    for(i = 0; i < dir_size; i++, dir_buf += 512 / sizeof(vmu_dir_t)) {
+        /* Scan this block for changes */
+        for(j = 0, needsop = 0; j < 512 / sizeof(vmu_dir_t); j++) {
+            if(dir_buf[j].dirty)
+                needsop = 1;
+
+            dir_buf[j].dirty = 0;
+        }
+
+        if(needsop) {
+            blocks[n] = root->dir_loc - i;
+            memcpy(buf + n++ * 512, dir_buf, 512);
+        }
+    }
+
+    if(fat_buf && !fat_first) {
+        blocks[n] = root->fat_loc;
+        memcpy(buf + n++ * 512, fat_buf, 512);
+    }
+
+    rv = n ? vmu_block_write_multi(dev, blocks, n, buf) : 0;
+    free(buf);
+
+    if(rv != 0) {
+        dbglog(DBG_ERROR, "vmufs_meta_write: can't write %u blocks on device %c%c (error %d)\n",
+               n, dev->port + 'A', dev->unit + '0', rv);
+        return -1;
+    }
+
+    return 0;
+}
+
 /* Common code for both dir_read and dir_write */
 static int vmufs_dir_ops(maple_device_t * dev, vmu_root_t * root, vmu_dir_t * dir_buf, int write) {
-    uint16  dir_block, dir_size;
-    unsigned int i;
-    int needsop, rv;
+    uint16  dir_block, dir_size, blocks[256];
+    unsigned int n;
+    int rv;
 
     /* Find the directory starting block and length */
     dir_block = root->dir_loc;
     dir_size = root->dir_size;
 
-    /* The dir is stored backwards, so we start at the end and go back. */
-    while(dir_size > 0) {
-        if(write) {
-            /* Scan this block for changes */
-            for(i = 0, needsop = 0; i < 512 / sizeof(vmu_dir_t); i++) {
-                if(dir_buf[i].dirty) {
-                    needsop = 1;
-                }
+    if(dir_size > 256 || dir_size > dir_block + 1) {
+        dbglog(DBG_ERROR, "vmufs_dir_%s: bogus dir size %d on device %c%c\n",
+               write ? "write" : "read",
+               (int)dir_size, dev->port + 'A', dev->unit + '0');
+        return -1;
+    }
 
-                dir_buf[i].dirty = 0;
-            }
-        }
-        else
-            needsop = 1;
+    /* Only the blocks that changed get written. */
+    if(write)
+        return vmufs_meta_write(dev, root, dir_buf, NULL, 0);
 
-        if(needsop) {
-            if(!write)
-                rv = vmu_block_read(dev, dir_block, (uint8 *)dir_buf);
-            else
-                rv = vmu_block_write(dev, dir_block, (uint8 *)dir_buf);
-
-            if(rv != 0) {
-                dbglog(DBG_ERROR, "vmufs_dir_%s: can't %s block %d on device %c%c\n",
-                       write ? "write" : "read",
-                       write ? "write" : "read",
-                       (int)dir_block, dev->port + 'A', dev->unit + '0');
-                return -1;
-            }
-        }
+    /* Reads are done all at once. The dir is stored backwards, so we start at
+       the end and go back. */
+    for(n = 0; n < dir_size; n++)
+        blocks[n] = dir_block - n;
 
-        dir_block--;
-        dir_size--;
-        dir_buf += 512 / sizeof(vmu_dir_t); /* == 16 */
+    if((rv = vmu_block_read_multi(dev, blocks, dir_size, (uint8 *)dir_buf)) != 0) {
+        dbglog(DBG_ERROR, "vmufs_dir_read: can't read blocks %d-%d on device %c%c\n",
+               (int)(dir_block - dir_size + 1), (int)dir_block,
+               dev->port + 'A', dev->unit + '0');
+        return -1;
     }
 
     return 0;
@@ -160,6 +246,7 @@ int vmufs_dir_read(maple_device_t * dev, vmu_root_t * root, vmu_dir_t * dir_buf)
 }
 
 int vmufs_dir_write(maple_device_t * dev, vmu_root_t * root, vmu_dir_t * dir_buf) {
+    vmufs_invalidate(dev);
     return vmufs_dir_ops(dev, root, dir_buf, 1);
 }
 
@@ -180,15 +267,13 @@ static int vmufs_fat_ops(maple_device_t * dev, vmu_root_t * root, uint16 * fat_b
         return -1;
     }
 
-    if(!write)
-        rv = vmu_block_read(dev, fat_block, (uint8 *)fat_buf);
-    else
-        rv = vmu_block_write(dev, fat_block, (uint8 *)fat_buf);
+    if(write)
+        return vmufs_meta_write(dev, root, NULL, fat_buf, 1) < 0 ? -2 : 0;
+
+    rv = vmu_block_read(dev, fat_block, (uint8 *)fat_buf);
 
     if(rv != 0) {
-        dbglog(DBG_ERROR, "vmufs_fat_%s: can't %s block %d on device %c%c (error %d)\n",
-               write ? "write" : "read",
-               write ? "write" : "read",
+        dbglog(DBG_ERROR, "vmufs_fat_read: can't read block %d on device %c%c (error %d)\n",
                (int)fat_block, dev->port + 'A', dev->unit + '0', rv);
         return -2;
     }
@@ -201,6 +286,7 @@ int vmufs_fat_read(maple_device_t * dev, vmu_root_t * root, uint16 * fat_buf) {
 }
 
 int vmufs_fat_write(maple_device_t * dev, vmu_root_t * root, uint16 * fat_buf) {
+    vmufs_invalidate(dev);
     return vmufs_fat_ops(dev, root, fat_buf, 1);
 }
 
@@ -249,41 +335,36 @@ int vmufs_dir_add(vmu_root_t * root, vmu_dir_t * dir, vmu_dir_t * newdirent) {
 }
 
 int vmufs_file_read(maple_device_t * dev, uint16 * fat, vmu_dir_t * dirent, void * outbuf) {
-    int curblk, blkleft, rv;
-    uint8   * out;
-
-    out = (uint8 *)outbuf;
+    int curblk, blkcnt, rv;
+    uint16  * blocks;
 
     /* Find the first block */
     curblk = dirent->firstblk;
 
-    /* And the blocks remaining */
-    blkleft = dirent->filesize;
+    /* Gather up the blocks of the file, so they can be read all at once */
+    blocks = (uint16 *)malloc(dirent->filesize * sizeof(uint16));
+
+    if(!blocks && dirent->filesize) {
+        dbglog(DBG_ERROR, "vmufs_file_read: can't alloc block list on device %c%c\n",
+               dev->port + 'A', dev->unit + '0');
+        return -2;
+    }
 
     /* While we've got stuff remaining... */
-    while(blkleft > 0) {
+    for(blkcnt = 0; blkcnt < dirent->filesize; blkcnt++) {
         /* Make sure the FAT matches up with the directory */
-        if(curblk == 0xfffc || curblk == 0xfffa) {
+        if(curblk == 0xfffc || curblk == 0xfffa || curblk >= 256) {
             char fn[13] = {0};
             memcpy(fn, dirent->filename, 12);
             dbglog(DBG_ERROR, "vmufs_file_read: file '%s' ends prematurely in fat on device %c%c\n",
                    fn, dev->port + 'A', dev->unit + '0');
+            free(blocks);
             return -1;
         }
 
-        /* Read the block */
-        rv = vmu_block_read(dev, curblk, (uint8 *)out);
-
-        if(rv != 0) {
-            dbglog(DBG_ERROR, "vmufs_file_read: can't read block %d on device %c%c (error %d)\n",
-                   curblk, dev->port + 'A', dev->unit + '0', rv);
-            return -2;
-        }
-
         /* Scoot our counters */
+        blocks[blkcnt] = curblk;
         curblk = fat[curblk];
-        blkleft--;
-        out += 512;
     }
 
     /* Make sure the FAT matches up with the directory */
@@ -292,9 +373,20 @@ int vmufs_file_read(maple_device_t * dev, uint16 * fat, vmu_dir_t * dirent, void
         memcpy(fn, dirent->filename, 12);
         dbglog(DBG_ERROR, "vmufs_file_read: file '%s' is sized shorter than in the FAT on device %c%c\n",
                fn, dev->port + 'A', dev->unit + '0');
+        free(blocks);
         return -3;
     }
 
+    /* Read the blocks */
+    rv = vmu_block_read_multi(dev, blocks, blkcnt, (uint8 *)outbuf);
+    free(blocks);
+
+    if(rv != 0) {
+        dbglog(DBG_ERROR, "vmufs_file_read: can't read file on device %c%c (error %d)\n",
+               dev->port + 'A', dev->unit + '0', rv);
+        return -2;
+    }
+
     return 0;
 }
 
@@ -335,9 +427,9 @@ static int vmufs_find_block(vmu_root_t * root, uint16 * fat, vmu_dir_t * dirent)
 
 int vmufs_file_write(maple_device_t * dev, vmu_root_t * root, uint16 * fat,
                      vmu_dir_t * dir, vmu_dir_t * newdirent, void * filebuf, int size) {
-    int curblk, blkleft, rv;
+    int curblk, blkcnt, rv;
     int vmuspaceleft;
-    uint8   * out;
+    uint16  * blocks;
 
     /* Files must be at least one block long */
     if(size <= 0) {
@@ -356,8 +448,6 @@ int vmufs_file_write(maple_device_t * dev, vmu_root_t * root, uint16 * fat,
         return -4;
     }
 
-    out = (uint8 *)filebuf;
-
     /* Don't even start if there isn't enough room to write the whole file */
     vmuspaceleft = vmufs_fat_free(root, fat);
 
@@ -366,33 +456,33 @@ int vmufs_file_write(maple_device_t * dev, vmu_root_t * root, uint16 * fat,
         return -2;  /* Same error as is returned if a block can not be found below */
     }
 
+    /* Gather up the blocks of the file, so they can be written all at once */
+    blocks = (uint16 *)malloc(size * sizeof(uint16));
+
+    if(!blocks) {
+        dbglog(DBG_ERROR, "vmufs_file_write: can't alloc block list on device %c%c\n",
+               dev->port + 'A', dev->unit + '0');
+        return -5;
+    }
+
     /* Find ourselves an open slot for the first block */
     curblk = newdirent->firstblk = vmufs_find_block(root, fat, newdirent);
 
-    if(curblk < 0)
+    if(curblk < 0) {
+        free(blocks);
         return curblk;
+    }
 
     /* And the blocks remaining */
-    blkleft = newdirent->filesize = size;
-
-    /* While we've got stuff remaining... */
-    while(blkleft > 0) {
-        /* Write the block */
-        rv = vmu_block_write(dev, curblk, (uint8 *)out);
-
-        if(rv != 0) {
-            dbglog(DBG_ERROR, "vmufs_file_write: can't write block %d on device %c%c (error %d)\n",
-                   curblk, dev->port + 'A', dev->unit + '0', rv);
-            return -5;
-        }
+    newdirent->filesize = size;
 
-        /* Scoot our counters */
-        blkleft--;
-        out += 512;
+    /* Chain up all the blocks in the FAT */
+    for(blkcnt = 0; blkcnt < size; blkcnt++) {
+        blocks[blkcnt] = curblk;
 
         /* If we have blocks left, find another free block. Otherwise,
            write out a terminator. */
-        if(blkleft) {
+        if(blkcnt + 1 < size) {
             // Set the pointer to the terminator just in case:
             // a) vmufs_find_block() fails to find a block, AND
             // b) the calling code for some reason writes the FAT back out anyway.
@@ -401,8 +491,10 @@ int vmufs_file_write(maple_device_t * dev, vmu_root_t * root, uint16 * fat,
             fat[curblk] = 0xfffa;
             rv = vmufs_find_block(root, fat, newdirent);
 
-            if(rv < 0)
+            if(rv < 0) {
+                free(blocks);
                 return rv;
+            }
 
             fat[curblk] = rv;
             curblk = rv;
@@ -412,6 +504,16 @@ int vmufs_file_write(maple_device_t * dev, vmu_root_t * root, uint16 * fat,
         }
     }
 
+    /* Write the blocks */
+    rv = vmu_block_write_multi(dev, blocks, size, (const uint8 *)filebuf);
+    free(blocks);
+
+    if(rv != 0) {
+        dbglog(DBG_ERROR, "vmufs_file_write: can't write file on device %c%c (error %d)\n",
+               dev->port + 'A', dev->unit + '0', rv);
+        return -5;
+    }
+
     /* Add the entry to the directory */
     if(vmufs_dir_add(root, dir, newdirent) < 0) {
         dbglog(DBG_ERROR, "vmufs_file_write: can't find an open dirent on device %c%c\n",
@@ -498,9 +600,80 @@ int vmufs_mutex_unlock(void) {
 
 /* ****************** Higher level functions ******************** */
 
-/* Internal function gets everything setup for you */
-static int vmufs_setup(maple_device_t * dev, vmu_root_t * root, vmu_dir_t ** dir, int * dirsize,
-                       uint16 ** fat, int * fatsize) {
+/* Read the metadata of a card into its cache entry. Called with the mutex
+   held. */
+static int vmufs_meta_load(maple_device_t * dev, vmufs_meta_t * m) {
+    uint32 gen = m->gen;
+    int size;
+
+    m->valid = 0;
+    m->dev = dev;
+
+    /* Read its root block */
+    if(vmufs_root_read(dev, &m->root) < 0)
+        return -1;
+
+    /* (Re)alloc enough space for the whole dir */
+    size = vmufs_dir_blocks(&m->root);
+
+    if(size != m->dirsize) {
+        free(m->dir);
+        m->dirsize = 0;
+
+        if(!(m->dir = (vmu_dir_t *)malloc(size))) {
+            dbglog(DBG_ERROR, "vmufs_setup: can't alloc %d bytes for dir on device %c%c\n",
+                   size, dev->port + 'A', dev->unit + '0');
+            return -1;
+        }
+
+        m->dirsize = size;
+    }
+
+    /* Ensure that the dir is 0'd to avoid possible uninitialized reads */
+    memset(m->dir, 0, m->dirsize);
+
+    if(vmufs_dir_ops(dev, &m->root, m->dir, 0) < 0)
+        return -1;
+
+    /* Same thing for the fat */
+    size = vmufs_fat_blocks(&m->root);
+
+    if(size != m->fatsize) {
+        free(m->fat);
+        m->fatsize = 0;
+
+        if(!(m->fat = (uint16 *)malloc(size))) {
+            dbglog(DBG_ERROR, "vmufs_setup: can't alloc %d bytes for FAT on device %c%c\n",
+                   size, dev->port + 'A', dev->unit + '0');
+            return -1;
+        }
+
+        m->fatsize = size;
+    }
+
+    if(vmufs_fat_ops(dev, &m->root, m->fat, 0) < 0)
+        return -1;
+
+    /* Only trust what we read if the card didn't go away in the meantime */
+    if(m->gen == gen)
+        m->valid = 1;
+
+    return 0;
+}
+
+static void vmufs_meta_free(vmufs_meta_t * m) {
+    free(m->dir);
+    free(m->fat);
+    memset(m, 0, sizeof(vmufs_meta_t));
+}
+
+/* Internal function gets everything setup for you. The returned root, dir
+   and FAT are the cached copies for the card; anything that modifies them
+   must either write them through or call vmufs_teardown() with failed set. */
+static int vmufs_setup(maple_device_t * dev, vmu_root_t ** root, vmu_dir_t ** dir,
+                       uint16 ** fat) {
+    vmufs_meta_t *m;
+
     /* Check to make sure this is a valid device right now */
     if(!dev || !(dev->info.functions & MAPLE_FUNC_MEMCARD)) {
         if(!dev)
@@ -514,122 +687,81 @@ static int vmufs_setup(maple_device_t * dev, vmu_root_t * root, vmu_dir_t ** dir
 
     vmufs_mutex_lock();
 
-    /* Read its root block */
-    if(!root || vmufs_root_read(dev, root) < 0)
-        goto dead;
-
-    if(dir) {
-        /* Alloc enough space for the whole dir */
-        *dirsize = vmufs_dir_blocks(root);
-        *dir = (vmu_dir_t *)malloc(*dirsize);
-
-        if(!*dir) {
-            dbglog(DBG_ERROR, "vmufs_setup: can't alloc %d bytes for dir on device %c%c\n",
-                   *dirsize, dev->port + 'A', dev->unit + '0');
-            goto dead;
-        }
-
-        /* Ensure that the dir is 0'd to avoid possible uninitialized reads */
-        memset(*dir, 0, sizeof(*dirsize));
+    m = vmufs_meta(dev);
 
-        /* Read it */
-        if(vmufs_dir_read(dev, root, *dir) < 0) {
-            free(*dir);
-            *dir = NULL;
-            goto dead;
+    if(!m->valid || m->dev != dev) {
+        if(vmufs_meta_load(dev, m) < 0) {
+            m->valid = 0;
+            vmufs_mutex_unlock();
+            return -1;
         }
     }
 
-    if(fat) {
-        /* Alloc enough space for the fat */
-        *fatsize = vmufs_fat_blocks(root);
-        *fat = (uint16 *)malloc(*fatsize);
+    *root = &m->root;
 
-        if(!*fat) {
-            dbglog(DBG_ERROR, "vmufs_setup: can't alloc %d bytes for FAT on device %c%c\n",
-                   *fatsize, dev->port + 'A', dev->unit + '0');
-            if(dir)
-                free(*dir);
-            goto dead;
-        }
+    if(dir)
+        *dir = m->dir;
 
-        /* Read it */
-        if(vmufs_fat_read(dev, root, *fat) < 0) {
-            free(*fat);
-            if(dir)
-                free(*dir);
-            goto dead;
-        }
-    }
+    if(fat)
+        *fat = m->fat;
 
     /* Ok, everything's cool */
     return 0;
-
-dead:
-    vmufs_mutex_unlock();
-    return -1;
 }
 
-/* Internal function to tear everything down for you */
-static void vmufs_teardown(vmu_dir_t * dir, uint16 * fat) {
-    if(dir)
-        free(dir);
-
-    if(fat)
-        free(fat);
+/* Internal function to tear everything down for you. If the cached data may
+   not match what is on the card anymore, drop it. */
+static void vmufs_teardown(maple_device_t * dev, int failed) {
+    if(failed)
+        vmufs_invalidate(dev);
 
     vmufs_mutex_unlock();
 }
 
 int vmufs_readdir(maple_device_t * dev, vmu_dir_t ** outbuf, int * outcnt) {
-    vmu_root_t root;
+    vmu_root_t *root;
     vmu_dir_t *dir;
-    int dircnt, dirsize, rv = 0;
-    unsigned int i, j;
+    int dircnt, rv = 0;
+    unsigned int i;
 
     *outbuf = NULL;
     *outcnt = 0;
 
     /* Init everything */
-    if(vmufs_setup(dev, &root, &dir, &dirsize, NULL, NULL) < 0)
+    if(vmufs_setup(dev, &root, &dir, NULL) < 0)
         return -1;
 
-    /* Go through and move all entries to the lowest-numbered spots. */
+    /* Count the entries, so we know how much space is needed. */
     dircnt = 0;
 
-    for(i = 0; i < dirsize / sizeof(vmu_dir_t); i++) {
-        /* Skip blanks */
-        if(dir[i].filetype == 0)
-            continue;
-
-        /* Not a blank -- look for an earlier slot that's empty. If
-           we don't find one, just leave it alone. */
-        for(j = 0; j < i; j++) {
-            if(dir[j].filetype == 0) {
-                memcpy(dir + j, dir + i, sizeof(vmu_dir_t));
-                dir[i].filetype = 0;
-                break;
-            }
-        }
-
-        /* Update the entry count */
-        dircnt++;
+    for(i = 0; i < vmufs_dir_blocks(root) / sizeof(vmu_dir_t); i++) {
+        if(dir[i].filetype != 0)
+            dircnt++;
     }
 
-    /* Resize the buffer to match the number of entries */
-    *outcnt = dircnt;
-    *outbuf = (vmu_dir_t *)realloc(dir, dircnt * sizeof(vmu_dir_t));
+    if(!dircnt)
+        goto ex;
+
+    *outbuf = (vmu_dir_t *)malloc(dircnt * sizeof(vmu_dir_t));
 
-    if(!*outbuf && dircnt) {
-        dbglog(DBG_ERROR, "vmufs_readdir: can't realloc %d bytes for dir on device %c%c\n",
+    if(!*outbuf) {
+        dbglog(DBG_ERROR, "vmufs_readdir: can't alloc %d bytes for dir on device %c%c\n",
                dircnt * sizeof(vmu_dir_t), dev->port + 'A', dev->unit + '0');
-        free(dir);
         rv = -2;
         goto ex;
     }
 
+    /* Copy out all entries, skipping blanks. */
+    *outcnt = dircnt;
+    dircnt = 0;
+
+    for(i = 0; i < vmufs_dir_blocks(root) / sizeof(vmu_dir_t); i++) {
+        if(dir[i].filetype != 0)
+            memcpy(*outbuf + dircnt++, dir + i, sizeof(vmu_dir_t));
+    }
+
 ex:
-    vmufs_teardown(NULL, NULL);
+    vmufs_teardown(dev, 0);
     return rv;
 }
 
@@ -657,20 +789,20 @@ static int vmufs_read_common(maple_device_t * dev, vmu_dir_t * dirent, uint16 *
 }
 
 int vmufs_read(maple_device_t * dev, const char * fn, void ** outbuf, int * outsize) {
-    vmu_root_t  root;
-    vmu_dir_t   * dir = NULL;
-    uint16      * fat = NULL;
-    int     fatsize, dirsize, idx, rv = 0;
+    vmu_root_t  * root;
+    vmu_dir_t   * dir;
+    uint16      * fat;
+    int     idx, rv = 0;
 
     *outbuf = NULL;
     *outsize = 0;
 
     /* Init everything */
-    if(vmufs_setup(dev, &root, &dir, &dirsize, &fat, &fatsize) < 0)
+    if(vmufs_setup(dev, &root, &dir, &fat) < 0)
         return -1;
 
     /* Look for the file we want */
-    idx = vmufs_dir_find(&root, dir, fn);
+    idx = vmufs_dir_find(root, dir, fn);
 
     if(idx < 0) {
         //dbglog(DBG_ERROR, "vmufs_read: can't find file '%s' on device %c%c\n",
@@ -685,35 +817,35 @@ int vmufs_read(maple_device_t * dev, const char * fn, void ** outbuf, int * outs
     }
 
 ex:
-    vmufs_teardown(dir, fat);
+    vmufs_teardown(dev, rv == -3);
     return rv;
 }
 
 int vmufs_read_dirent(maple_device_t * dev, vmu_dir_t * dirent, void ** outbuf, int * outsize) {
-    vmu_root_t  root;
-    uint16      * fat = NULL;
-    int     fatsize, rv = 0;
+    vmu_root_t  * root;
+    uint16      * fat;
+    int     rv = 0;
 
     *outbuf = NULL;
     *outsize = 0;
 
     /* Init everything */
-    if(vmufs_setup(dev, &root, NULL, NULL, &fat, &fatsize) < 0)
+    if(vmufs_setup(dev, &root, NULL, &fat) < 0)
         return -1;
 
     if(vmufs_read_common(dev, dirent, fat, outbuf, outsize) < 0)
         rv = -2;
 
-    vmufs_teardown(NULL, fat);
+    vmufs_teardown(dev, rv < 0);
     return rv;
 }
 
 /* Returns 0 for success, -7 for 'not enough space', and other values for other errors. :-)  */
 int vmufs_write(maple_device_t * dev, const char * fn, void * inbuf, int insize, int flags) {
-    vmu_root_t  root;
-    vmu_dir_t   * dir = NULL, nd;
-    uint16      * fat = NULL;
-    int     oldinsize, fatsize, dirsize, idx, rv = 0, st, fnlength;
+    vmu_root_t  * root;
+    vmu_dir_t   * dir, nd;
+    uint16      * fat;
+    int     oldinsize, idx, rv = 0, st, fnlength;
 
     /* Round up the size if necessary */
     oldinsize = insize;
@@ -727,11 +859,11 @@ int vmufs_write(maple_device_t * dev, const char * fn, void * inbuf, int insize,
     }
 
     /* Init everything */
-    if(vmufs_setup(dev, &root, &dir, &dirsize, &fat, &fatsize) < 0)
+    if(vmufs_setup(dev, &root, &dir, &fat) < 0)
         return -1;
 
     /* Check if the file already exists */
-    idx = vmufs_dir_find(&root, dir, fn);
+    idx = vmufs_dir_find(root, dir, fn);
 
     if(idx >= 0) {
         if(!(flags & VMUFS_OVERWRITE)) {
@@ -741,7 +873,7 @@ int vmufs_write(maple_device_t * dev, const char * fn, void * inbuf, int insize,
             goto ex;
         }
         else {
-            if(vmufs_file_delete(&root, fat, dir, fn) < 0) {
+            if(vmufs_file_delete(root, fat, dir, fn) < 0) {
                 dbglog(DBG_ERROR, "vmufs_write: can't delete old file '%s' on device %c%c\n",
                        fn, dev->port + 'A', dev->unit + '0');
                 rv = -3;
@@ -771,7 +903,7 @@ int vmufs_write(maple_device_t * dev, const char * fn, void * inbuf, int insize,
     // If any of these fail, the action to take can be decided by the caller.
 
     /* Write out the data and update our structs */
-    if((st = vmufs_file_write(dev, &root, fat, dir, &nd, inbuf, insize / 512)) < 0) {
+    if((st = vmufs_file_write(dev, root, fat, dir, &nd, inbuf, insize / 512)) < 0) {
         if(st == -2)
             rv = -7;
         else
@@ -779,16 +911,11 @@ int vmufs_write(maple_device_t * dev, const char * fn, void * inbuf, int insize,
         goto ex;
     }
 
-    /* Ok, everything's looking good so far.. update the FAT */
-    if(vmufs_fat_write(dev, &root, fat) < 0) {
-        rv = -5;
-        goto ex;
-    }
-
-    /* This is the critical point. If the dir doesn't save correctly, then
+    /* Ok, everything's looking good so far.. update the FAT, then the dir.
+       This is the critical point. If the dir doesn't save correctly, then
        we may have an unusable card (until it's reformatted) or leaked
        blocks not attached to a file. Cross your fingers! */
-    if(vmufs_dir_write(dev, &root, dir) < 0) {
+    if(vmufs_meta_write(dev, root, dir, fat, 1) < 0) {
         /* doh! */
         dbglog(DBG_ERROR, "vmufs_write: warning, card may be corrupted or leaking blocks!\n");
         rv = -6;
@@ -797,59 +924,57 @@ int vmufs_write(maple_device_t * dev, const char * fn, void * inbuf, int insize,
 
     /* Looks like everything was good */
 ex:
-    vmufs_teardown(dir, fat);
+    /* The cached FAT and dir have been modified along the way, so they can't
+       be trusted anymore if anything failed past the initial checks. */
+    vmufs_teardown(dev, rv < -2);
     return rv;
 }
 
 int vmufs_delete(maple_device_t * dev, const char * fn) {
-    vmu_root_t  root;
-    vmu_dir_t   * dir = NULL;
-    uint16      * fat = NULL;
-    int     fatsize, dirsize, rv = 0;
+    vmu_root_t  * root;
+    vmu_dir_t   * dir;
+    uint16      * fat;
+    int     rv = 0;
 
     /* Init everything */
-    if(vmufs_setup(dev, &root, &dir, &dirsize, &fat, &fatsize) < 0)
+    if(vmufs_setup(dev, &root, &dir, &fat) < 0)
         return -2;
 
     /* Ok, try to delete the file */
-    rv = vmufs_file_delete(&root, fat, dir, fn);
+    rv = vmufs_file_delete(root, fat, dir, fn);
 
     if(rv < 0) goto ex;
 
-    /* If we succeeded, write back the dir and fat */
-    if(vmufs_dir_write(dev, &root, dir) < 0) {
-        rv = -2;
-        goto ex;
-    }
-
-    /* This is the critical point. If the fat doesn't save correctly, then
-       we may have an unusable card (until it's reformatted) or leaked
-       blocks not attached to a file. Cross your fingers! */
-    if(vmufs_fat_write(dev, &root, fat) < 0) {
+    /* If we succeeded, write back the dir and then the fat. This is the
+       critical point. If the fat doesn't save correctly, then we may have an
+       unusable card (until it's reformatted) or leaked blocks not attached
+       to a file. Cross your fingers! */
+    if(vmufs_meta_write(dev, root, dir, fat, 0) < 0) {
         /* doh! */
         dbglog(DBG_ERROR, "vmufs_delete: warning, card may be corrupted or leaking blocks!\n");
         rv = -2;
         goto ex;
     }
 
-    /* Looks like everything was good */
+    /* Looks like everything was good. A file that wasn't found doesn't change
+       anything, but a corrupt FAT might have been partially cleared. */
 ex:
-    vmufs_teardown(dir, fat);
+    vmufs_teardown(dev, rv < -1);
     return rv;
 }
 
 int vmufs_free_blocks(maple_device_t * dev) {
-    vmu_root_t  root;
-    uint16      * fat = NULL;
-    int     fatsize, rv = 0;
+    vmu_root_t  * root;
+    uint16      * fat;
+    int     rv = 0;
 
     /* Init everything */
-    if(vmufs_setup(dev, &root, NULL, NULL, &fat, &fatsize) < 0)
+    if(vmufs_setup(dev, &root, NULL, &fat) < 0)
         return -1;
 
-    rv = vmufs_fat_free(&root, fat);
+    rv = vmufs_fat_free(root, fat);
 
-    vmufs_teardown(NULL, fat);
+    vmufs_teardown(dev, 0);
     return rv;
 }
 
@@ -862,6 +987,13 @@ int vmufs_init(void) {
 }
 
 int vmufs_shutdown(void) {
+    int p, u;
+
+    for(p = 0; p < MAPLE_PORT_COUNT; p++) {
+        for(u = 0; u < MAPLE_UNIT_COUNT; u++)
+            vmufs_meta_free(&meta_cache[p][u]);
+    }
+
     mutex_destroy(&mutex);
     return 0;
 }
@@ -8,11 +8,14 @@
  */
 
 #include <arch/arch.h>
+#include <arch/irq.h>
+#include <arch/timer.h>
 #include <dc/maple.h>
 #include <dc/maple/controller.h>
 #include <kos/mutex.h>
 #include <kos/worker_thread.h>
 #include <assert.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <stdlib.h>
 #include <sys/queue.h>
@@ -24,6 +27,9 @@
 #define CONT_BTN_CALLBACK_THD_STACK_SIZE (8 * 1024)
 #endif
 
+_Static_assert(!(CONT_INPUT_RING_SIZE & (CONT_INPUT_RING_SIZE - 1)),
+               "CONT_INPUT_RING_SIZE must be a power of two");
+
 /* Raw controller condition structure */
 typedef struct cont_cond {
     uint16_t buttons;  /* buttons bitfield */
@@ -47,6 +53,21 @@ typedef struct cont_callback_params {
     TAILQ_ENTRY(cont_callback_params)  listent;
 } cont_callback_params_t;
 
+/* Private controller state. The ring is filled from the maple DMA interrupt
+   and drained by a single reader thread, so the indices are all that's
+   needed to keep them apart. */
+typedef struct cont_state_private {
+    cont_state_t base;
+
+    atomic_uint head;
+    atomic_uint tail;
+    uint32_t dropped;
+    cont_input_t ring[CONT_INPUT_RING_SIZE];
+} cont_state_private_t;
+
+static unsigned int poll_rate;
+static irq_cb_t old_tmu1_hnd;
+
 static TAILQ_HEAD(cont_btn_callback_list, cont_callback_params) btn_cbs;
 
 static mutex_t btn_cbs_mtx = MUTEX_INITIALIZER;
@@ -141,12 +162,13 @@ int cont_btn_callback(uint8_t addr, uint32_t btns, cont_btn_callback_t cb) {
 
 /* Response callback for the GETCOND Maple command. */
 static void cont_reply(maple_state_t *st, maple_frame_t *frm) {
-    (void)st;
-
     maple_response_t *resp;
     uint32_t         *respbuf;
     cont_cond_t      *raw;
     cont_state_t     *cooked;
+    cont_state_private_t *pstate;
+    cont_input_t     *ent;
+    unsigned int     head;
     cont_callback_params_t *c;
 
     /* Unlock the frame now (it's ok, we're in an IRQ) */
@@ -180,6 +202,23 @@ static void cont_reply(maple_state_t *st, maple_frame_t *frm) {
     cooked->joy2x = ((int)raw->joy2x) - 128;
     cooked->joy2y = ((int)raw->joy2y) - 128;
 
+    /* Keep a timestamped copy in the ring, if there's room for it */
+    pstate = (cont_state_private_t *)cooked;
+    head = atomic_load_explicit(&pstate->head, memory_order_relaxed);
+
+    if(head - atomic_load_explicit(&pstate->tail, memory_order_acquire)
+       >= CONT_INPUT_RING_SIZE) {
+        pstate->dropped++;
+    }
+    else {
+        ent = &pstate->ring[head & (CONT_INPUT_RING_SIZE - 1)];
+        ent->time = st->dma_time;
+        ent->dropped = pstate->dropped;
+        ent->state = *cooked;
+        pstate->dropped = 0;
+        atomic_store_explicit(&pstate->head, head + 1, memory_order_release);
+    }
+
     /* If someone is in the middle of modifying the list, don't process callbacks */
     if(mutex_trylock(&btn_cbs_mtx))
         return;
@@ -225,9 +264,78 @@ static maple_driver_t controller_drv = {
     .functions = MAPLE_FUNC_CONTROLLER,
     .name = "Controller Driver",
     .periodic = cont_periodic,
-    .status_size = sizeof(cont_state_t)
+    .status_size = sizeof(cont_state_private_t)
 };
 
+int cont_input_read(maple_device_t *dev, cont_input_t *buf, size_t count) {
+    cont_state_private_t *pstate;
+    unsigned int head, tail;
+    size_t n = 0;
+
+    if(!dev || dev->drv != &controller_drv ||
+       !(pstate = (cont_state_private_t *)maple_dev_status(dev)))
+        return -1;
+
+    tail = atomic_load_explicit(&pstate->tail, memory_order_relaxed);
+    head = atomic_load_explicit(&pstate->head, memory_order_acquire);
+
+    while(n < count && tail != head) {
+        buf[n++] = pstate->ring[tail & (CONT_INPUT_RING_SIZE - 1)];
+        tail++;
+    }
+
+    atomic_store_explicit(&pstate->tail, tail, memory_order_release);
+
+    return (int)n;
+}
+
+/* TMU1 interrupt handler, used to poll faster than once per frame. */
+static void cont_timer_hnd(irq_t source, irq_context_t *context, void *data) {
+    (void)source;
+    (void)context;
+    (void)data;
+
+    timer_clear(TMU1);
+
+    cont_periodic(&controller_drv);
+
+    /* Send the commands right away, rather than on the next vblank */
+    if(!maple_state.dma_in_progress)
+        maple_queue_flush();
+}
+
+int cont_set_poll_rate(unsigned int hz) {
+    if(hz > CONT_POLL_RATE_MAX)
+        return -1;
+
+    if(poll_rate) {
+        timer_stop(TMU1);
+
+        /* Give TMU1 back to whoever had it before us */
+        if(!hz)
+            irq_set_handler(EXC_TMU1_TUNI1, old_tmu1_hnd.hdl,
+                            old_tmu1_hnd.data);
+    }
+    else if(hz) {
+        old_tmu1_hnd = irq_get_handler(EXC_TMU1_TUNI1);
+        irq_set_handler(EXC_TMU1_TUNI1, cont_timer_hnd, NULL);
+    }
+
+    poll_rate = hz;
+
+    if(hz) {
+        timer_prime(TMU1, hz, 1);
+        timer_clear(TMU1);
+        timer_start(TMU1);
+    }
+
+    return 0;
+}
+
+unsigned int cont_get_poll_rate(void) {
+    return poll_rate;
+}
+
 /* Add the controller to the driver chain */
 void cont_init(void) {
     TAILQ_INIT(&btn_cbs);
@@ -235,6 +343,9 @@ void cont_init(void) {
 }
 
 void cont_shutdown(void) {
+    /* Go back to polling from the vblank handler */
+    cont_set_poll_rate(0);
+
     /* Empty the callback list */
     cont_btn_callback_del(NULL);
     maple_driver_unreg(&controller_drv);
@@ -14,6 +14,8 @@
 #include <dc/maple.h>
 #include <dc/memory.h>
 
+#include <arch/timer.h>
+
 #include <kos/irq.h>
 #include <kos/thread.h>
 
@@ -82,7 +84,9 @@ void maple_queue_flush(void) {
         assert(last != NULL);
         *last |= 0x80000000;
 
-        /* Start a DMA transfer */
+        /* Start a DMA transfer. Devices sample their inputs as they get
+           their command, so this is as close as we get to when they did. */
+        maple_state.dma_time = timer_us_gettime64();
         maple_dma_addr(maple_state.dma_buffer);
         maple_dma_start();
         maple_state.dma_in_progress = 1;
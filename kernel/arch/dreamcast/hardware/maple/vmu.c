@@ -14,8 +14,11 @@
  */
 
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <arch/cache.h>
+#include <kos/irq.h>
 #include <kos/thread.h>
 #include <kos/genwait.h>
 #include <kos/platform.h>
@@ -29,6 +32,14 @@
 
 #define VMU_BLOCK_WRITE_RETRY_TIME  100     /* time to sleep until retrying a failed write */
 
+/* Number of requests kept in flight by the multi-block transfers. A block
+   read response takes about 2ms on the bus, so this keeps a DMA round within
+   a frame. It is also exactly what a block write needs (4 phases + sync). */
+#define VMU_MULTI_FRAMES    5
+
+/* Extra frames used by the multi-block transfers, allocated on first use. */
+static maple_frame_t *vmu_multi_frames[MAPLE_PORT_COUNT][MAPLE_UNIT_COUNT];
+
 /* This is the value that official VMUs report for function_data[0]. Have not 
    found any official ones that report a different value nor any third party
    that report it.
@@ -164,11 +175,20 @@ static void vmu_periodic(maple_driver_t *drv) {
     maple_driver_foreach(drv, vmu_poll);
 }
 
+/* Whatever card gets plugged in next may not be the same one, so drop the
+   filesystem's cached copy of its metadata. This runs in interrupt context. */
+static void vmu_detach(maple_driver_t *drv, maple_device_t *dev) {
+    (void)drv;
+
+    vmufs_invalidate(dev);
+}
+
 /* Device Driver Struct */
 static maple_driver_t vmu_drv = {
     .functions = MAPLE_FUNC_MEMCARD | MAPLE_FUNC_LCD | MAPLE_FUNC_CLOCK,
     .name = "VMU Driver",
-    .status_size = sizeof(vmu_state_t)
+    .status_size = sizeof(vmu_state_t),
+    .detach = vmu_detach
 };
 
 /* Add the VMU to the driver chain */
@@ -177,7 +197,28 @@ void vmu_init(void) {
 }
 
 void vmu_shutdown(void) {
+    int p, u, i;
+    maple_frame_t *frames;
+
     maple_driver_unreg(&vmu_drv);
+
+    for(p = 0; p < MAPLE_PORT_COUNT; p++) {
+        for(u = 0; u < MAPLE_UNIT_COUNT; u++) {
+            if(!(frames = vmu_multi_frames[p][u]))
+                continue;
+
+            /* Don't pull the frames out from under a pending transfer */
+            for(i = 0; i < VMU_MULTI_FRAMES; i++) {
+                if(frames[i].queued)
+                    break;
+            }
+
+            if(i == VMU_MULTI_FRAMES) {
+                free(frames);
+                vmu_multi_frames[p][u] = NULL;
+            }
+        }
+    }
 }
 
 /* Dynamically add the periodic polling callback to the driver when button input is enabled. */
@@ -611,6 +652,311 @@ int vmu_block_write(maple_device_t *dev, uint16_t blocknum, const uint8_t *buffe
     return rv;
 }
 
+/* Multi-block transfers. These keep several commands queued to the same
+   device, so that they all go out in one DMA round, instead of waiting a
+   whole frame for each of them. The device's own frame is held the whole
+   time, which keeps anything else from talking to the device. */
+static void vmu_multi_callback(maple_state_t *st, maple_frame_t *frm) {
+    (void)st;
+
+    /* Wakey, wakey! */
+    genwait_wake_all(frm);
+}
+
+static maple_frame_t *vmu_multi_get_frames(maple_device_t *dev) {
+    maple_frame_t *frames = vmu_multi_frames[dev->port][dev->unit];
+    irq_mask_t irqs;
+    int i;
+
+    if(!frames) {
+        frames = aligned_alloc(32, sizeof(maple_frame_t) * VMU_MULTI_FRAMES);
+
+        if(!frames)
+            return NULL;
+
+        memset(frames, 0, sizeof(maple_frame_t) * VMU_MULTI_FRAMES);
+
+        /* The receive buffers are only accessed through P2 from now on, so
+           make sure nothing stale is left in the cache for them. */
+        dcache_purge_range((uintptr_t)frames,
+                           sizeof(maple_frame_t) * VMU_MULTI_FRAMES);
+
+        vmu_multi_frames[dev->port][dev->unit] = frames;
+        return frames;
+    }
+
+    /* A previous transfer may have given up on some frames. Let the ones on
+       the bus finish, and drop the others. */
+    irqs = irq_disable();
+
+    for(i = 0; i < VMU_MULTI_FRAMES; i++) {
+        while(frames[i].state == MAPLE_FRAME_SENT) {
+            irq_restore(irqs);
+            thd_sleep(10);
+            irqs = irq_disable();
+        }
+
+        if(frames[i].queued)
+            maple_queue_remove(frames + i);
+
+        frames[i].state = MAPLE_FRAME_VACANT;
+    }
+
+    irq_restore(irqs);
+
+    return frames;
+}
+
+static int vmu_multi_queue(maple_device_t *dev, maple_frame_t *frm, int cmd,
+                           uint32_t blkid, const uint8_t *data, size_t len) {
+    if(maple_frame_trylock(frm) < 0)
+        return -1;
+
+    maple_frame_init(frm);
+    frm->send_buf[0] = MAPLE_FUNC_MEMCARD;
+    frm->send_buf[1] = blkid;
+
+    if(len)
+        memcpy(frm->send_buf + 2, data, len);
+
+    frm->cmd = cmd;
+    frm->dst_port = dev->port;
+    frm->dst_unit = dev->unit;
+    frm->length = 2 + len / 4;
+    frm->callback = vmu_multi_callback;
+    maple_queue_frame(frm);
+
+    return 0;
+}
+
+/* Wait for all of the given frames to get their response. On timeout, pull
+   whatever wasn't sent yet off of the queue. */
+static int vmu_multi_wait(maple_frame_t *frames, int cnt, const char *msg) {
+    irq_mask_t irqs;
+    int i, rv = MAPLE_EOK;
+
+    irqs = irq_disable();
+
+    for(i = 0; i < cnt; i++) {
+        while(frames[i].state != MAPLE_FRAME_RESPONDED) {
+            if(genwait_wait(frames + i, msg, 100) < 0)
+                break;
+        }
+
+        if(frames[i].state == MAPLE_FRAME_RESPONDED)
+            continue;
+
+        rv = MAPLE_ETIMEOUT;
+
+        if(frames[i].state == MAPLE_FRAME_UNSENT) {
+            maple_queue_remove(frames + i);
+            frames[i].state = MAPLE_FRAME_VACANT;
+        }
+    }
+
+    irq_restore(irqs);
+
+    return rv;
+}
+
+static int vmu_multi_check_read(maple_frame_t *frm, uint32_t blkid,
+                                uint8_t *buffer) {
+    maple_response_t *resp = (maple_response_t *)frm->recv_buf;
+    uint32_t *recv_buf = (uint32_t *)resp->data;
+
+    if(resp->response != MAPLE_RESPONSE_DATATRF
+            || recv_buf[0] != MAPLE_FUNC_MEMCARD
+            || recv_buf[1] != blkid)
+        return MAPLE_EFAIL;
+
+    memcpy(buffer, recv_buf + 2, (resp->data_len - 2) * 4);
+
+    return MAPLE_EOK;
+}
+
+int vmu_block_read_multi(maple_device_t *dev, const uint16_t *blocks,
+                         size_t count, uint8_t *buffer) {
+    maple_frame_t   *frames;
+    irq_mask_t      irqs;
+    uint32_t        blkid[VMU_MULTI_FRAMES];
+    size_t          i, j, n;
+    int             rv = MAPLE_EOK;
+
+    assert(dev != NULL);
+
+    maple_frame_lock(&dev->frame);
+
+    if(!(frames = vmu_multi_get_frames(dev))) {
+        dev->frame.state = MAPLE_FRAME_VACANT;
+
+        /* Do it the slow way then */
+        for(i = 0; i < count && rv == MAPLE_EOK; i++)
+            rv = vmu_block_read(dev, blocks[i], buffer + i * 512);
+
+        return rv;
+    }
+
+    for(i = 0; i < count; i += n) {
+        n = count - i < VMU_MULTI_FRAMES ? count - i : VMU_MULTI_FRAMES;
+
+        /* Queue them all at once, so they all go out in the same round */
+        irqs = irq_disable();
+
+        for(j = 0; j < n; j++) {
+            blkid[j] = ((blocks[i + j] & 0xff) << 24) |
+                       ((blocks[i + j] >> 8) << 16);
+
+            if(vmu_multi_queue(dev, frames + j, MAPLE_COMMAND_BREAD, blkid[j],
+                               NULL, 0) < 0)
+                break;
+        }
+
+        irq_restore(irqs);
+
+        if(!(n = j)) {
+            rv = MAPLE_EFAIL;
+            break;
+        }
+
+        if((rv = vmu_multi_wait(frames, n, "vmu_block_read_multi")) != MAPLE_EOK) {
+            dbglog(DBG_ERROR, "vmu_block_read_multi: timeout to unit %c%c, block %d\n",
+                   dev->port + 'A', dev->unit + '0', (int)blocks[i]);
+            break;
+        }
+
+        for(j = 0; j < n; j++) {
+            if(frames[j].state != MAPLE_FRAME_RESPONDED ||
+               vmu_multi_check_read(frames + j, blkid[j],
+                                    buffer + (i + j) * 512) != MAPLE_EOK) {
+                dbglog(DBG_ERROR, "vmu_block_read_multi: can't read block %d on unit %c%c\n",
+                       (int)blocks[i + j], dev->port + 'A', dev->unit + '0');
+                rv = MAPLE_EFAIL;
+            }
+
+            if(frames[j].state == MAPLE_FRAME_RESPONDED)
+                frames[j].state = MAPLE_FRAME_VACANT;
+        }
+
+        if(rv != MAPLE_EOK)
+            break;
+    }
+
+    dev->frame.state = MAPLE_FRAME_VACANT;
+
+    return rv;
+}
+
+/* Queue the four phases of a block write, preceded by the sync of the
+   previous block (if any). Returns the number of frames queued. */
+static int vmu_multi_queue_write(maple_device_t *dev, maple_frame_t *frames,
+                                 int prev, int blocknum,
+                                 const uint8_t *buffer) {
+    irq_mask_t irqs;
+    int cnt = 0, phase;
+    uint32_t blkid;
+
+    irqs = irq_disable();
+
+    if(prev >= 0) {
+        blkid = ((prev & 0xff) << 24) | (((prev >> 8) & 0xff) << 16) | (4 << 8);
+
+        if(vmu_multi_queue(dev, frames + cnt, MAPLE_COMMAND_BSYNC, blkid,
+                           NULL, 0) == 0)
+            cnt++;
+    }
+
+    for(phase = 0; blocknum >= 0 && phase < 4; phase++) {
+        blkid = ((blocknum & 0xff) << 24) | ((blocknum >> 8) << 16) | (phase << 8);
+
+        if(vmu_multi_queue(dev, frames + cnt, MAPLE_COMMAND_BWRITE, blkid,
+                           buffer + 128 * phase, 128) < 0)
+            break;
+
+        cnt++;
+    }
+
+    irq_restore(irqs);
+
+    return cnt;
+}
+
+int vmu_block_write_multi(maple_device_t *dev, const uint16_t *blocks,
+                          size_t count, const uint8_t *buffer) {
+    maple_frame_t   *frames;
+    maple_response_t *resp;
+    size_t          i;
+    int             cnt, j, prev = -1, rv = MAPLE_EOK, ok;
+
+    assert(dev != NULL);
+
+    maple_frame_lock(&dev->frame);
+
+    if(!(frames = vmu_multi_get_frames(dev))) {
+        dev->frame.state = MAPLE_FRAME_VACANT;
+
+        /* Do it the slow way then */
+        for(i = 0; i < count && rv == MAPLE_EOK; i++)
+            rv = vmu_block_write(dev, blocks[i], buffer + i * 512);
+
+        return rv;
+    }
+
+    /* Each round syncs the previous block and writes the phases of the next
+       one, so the sync only ever goes out once all of the phases of its block
+       have been accepted. */
+    for(i = 0; i <= count; i++) {
+        cnt = vmu_multi_queue_write(dev, frames, prev,
+                                    i < count ? blocks[i] : -1,
+                                    buffer + i * 512);
+        ok = vmu_multi_wait(frames, cnt, "vmu_block_write_multi") == MAPLE_EOK;
+        ok = ok && cnt == (prev >= 0) + (i < count ? 4 : 0);
+
+        for(j = 0; j < cnt; j++) {
+            if(frames[j].state != MAPLE_FRAME_RESPONDED)
+                continue;
+
+            resp = (maple_response_t *)frames[j].recv_buf;
+
+            if(resp->response != MAPLE_RESPONSE_OK)
+                ok = 0;
+
+            frames[j].state = MAPLE_FRAME_VACANT;
+        }
+
+        if(ok) {
+            prev = i < count ? blocks[i] : -1;
+            continue;
+        }
+
+        /* Something went wrong, so redo the previous block (including its
+           sync) and this one through the regular path, which retries a few
+           times on its own. */
+        dev->frame.state = MAPLE_FRAME_VACANT;
+
+        if(prev >= 0 &&
+           (rv = vmu_block_write(dev, prev, buffer + (i - 1) * 512)) != MAPLE_EOK)
+            break;
+
+        if(i < count &&
+           (rv = vmu_block_write(dev, blocks[i], buffer + i * 512)) != MAPLE_EOK)
+            break;
+
+        prev = -1;
+        maple_frame_lock(&dev->frame);
+        vmu_multi_get_frames(dev);
+    }
+
+    if(rv != MAPLE_EOK) {
+        dbglog(DBG_ERROR, "vmu_block_write_multi: can't write to unit %c%c\n",
+               dev->port + 'A', dev->unit + '0');
+        return rv;
+    }
+
+    dev->frame.state = MAPLE_FRAME_VACANT;
+
+    return rv;
+}
+
 int vmu_set_datetime(maple_device_t *dev, time_t unix) {
     struct tm *btime;
 
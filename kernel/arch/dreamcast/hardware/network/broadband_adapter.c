@@ -609,8 +609,8 @@ static int rx_enq(int ring_offset, size_t pkt_size) {
         return 1;
 }
 
-/* Transmit a single packet */
-static int bba_rtx(const uint8_t *pkt, int len, int wait)
+/* Wait until the current TX buffer is free */
+static int bba_tx_wait(int wait)
 {
     if(!link_stable) {
         if(wait == BBA_TX_WAIT) {
@@ -635,24 +635,86 @@ static int bba_rtx(const uint8_t *pkt, int len, int wait)
         }
     }
 
-    /* Copy the packet out to RTL memory */
-    /* XXX could use store queues or memcpy8 here */
+    return BBA_TX_OK;
+}
+
+/* Packets are written out to the current TX buffer 32 bits at a time, which
+   is a lot faster over G2 than 8 or 16 bits at a time. The pieces of a packet
+   rarely start on a 32-bit boundary though (the headers are usually 42 or 54
+   bytes long, for instance), so the bytes at either end of each piece are put
+   together into whole words, and whatever is in the middle goes through a
+   small aligned buffer if the piece itself isn't aligned. Nothing is ever read
+   past the end of a piece. */
+#define TX_BOUNCE_SIZE  256
+
+typedef struct {
+    uint32_t dst;       /* Where the next word goes in the TX buffer */
+    uint32_t word;      /* Bytes that don't make up a whole word yet */
+    int fill;           /* How many of those there are */
+} bba_tx_state_t;
+
+static void bba_tx_begin(bba_tx_state_t *s)
+{
+    s->dst = txdesc[rtl.cur_tx];
+    s->word = 0;
+    s->fill = 0;
+}
+
+/* Copy a piece of a packet out to the TX buffer, after the previous ones */
+static void bba_tx_copy(bba_tx_state_t *s, const uint8_t *pkt, int len)
+{
+    uint32_t bounce[TX_BOUNCE_SIZE / 4];
+    int n;
 
-    //g2_write_block_8(pkt, txdesc[rtl.cur_tx], len);
+    /* Finish off the word that the previous piece started */
+    while(s->fill && len) {
+        s->word |= (uint32_t)*pkt++ << (s->fill * 8);
+        --len;
 
-    /* Check alignment of the packet, if its 32-bit aligned, use
-       g2_write_block_32, if its 16-bit aligned, use g2_write_block_16,
-       otherwise, use g2_write_block_8. */
-    if(!((uint32_t)pkt & 0x03)) {
-        g2_write_block_32((uint32_t *) pkt, txdesc[rtl.cur_tx], (len + 3) >> 2);
+        if(++s->fill == 4) {
+            g2_write_32(s->dst, s->word);
+            s->dst += 4;
+            s->word = 0;
+            s->fill = 0;
+        }
     }
-    else if(!((uint32_t)pkt & 0x01)) {
-        g2_write_block_16((uint16_t *) pkt, txdesc[rtl.cur_tx], (len + 1) >> 1);
+
+    /* Then write all of the whole words in one go */
+    n = len & ~3;
+    len &= 3;
+
+    if(!((uintptr_t)pkt & 0x03)) {
+        g2_write_block_32((const uint32_t *)pkt, s->dst, n >> 2);
+        s->dst += n;
+        pkt += n;
     }
     else {
-        g2_write_block_8(pkt, txdesc[rtl.cur_tx], len);
+        while(n) {
+            int chunk = n < TX_BOUNCE_SIZE ? n : TX_BOUNCE_SIZE;
+
+            memcpy(bounce, pkt, chunk);
+            g2_write_block_32(bounce, s->dst, chunk >> 2);
+            s->dst += chunk;
+            pkt += chunk;
+            n -= chunk;
+        }
     }
 
+    /* And keep whatever's left for the next piece */
+    while(len--)
+        s->word |= (uint32_t)*pkt++ << (s->fill++ * 8);
+}
+
+/* Write out the last partial word of the packet, if there is one */
+static void bba_tx_end(bba_tx_state_t *s)
+{
+    if(s->fill)
+        g2_write_32(s->dst, s->word);
+}
+
+/* Send off the packet in the current TX buffer */
+static void bba_tx_kick(int len)
+{
     /* All packets must be at least 60 bytes, pad them with null bytes if
        they are not already of an appropriate size. */
     if(len < 60) {
@@ -665,6 +727,44 @@ static int bba_rtx(const uint8_t *pkt, int len, int wait)
 
     /* Go to the next TX buffer */
     rtl.cur_tx = (rtl.cur_tx + 1) % TX_NB_BUFFERS;
+}
+
+/* Transmit a single packet */
+static int bba_rtx(const uint8_t *pkt, int len, int wait)
+{
+    bba_tx_state_t s;
+    int rv;
+
+    if((rv = bba_tx_wait(wait)) != BBA_TX_OK)
+        return rv;
+
+    bba_tx_begin(&s);
+    bba_tx_copy(&s, pkt, len);
+    bba_tx_end(&s);
+    bba_tx_kick(len);
+
+    return BBA_TX_OK;
+}
+
+/* Transmit a single packet, gathered from several pieces straight into the
+   TX buffer */
+static int bba_rtxv(const struct iovec *iov, int iovcnt, int wait)
+{
+    bba_tx_state_t s;
+    int rv, i, len = 0;
+
+    if((rv = bba_tx_wait(wait)) != BBA_TX_OK)
+        return rv;
+
+    bba_tx_begin(&s);
+
+    for(i = 0; i < iovcnt; ++i) {
+        bba_tx_copy(&s, (const uint8_t *)iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+
+    bba_tx_end(&s);
+    bba_tx_kick(len);
 
     return BBA_TX_OK;
 }
@@ -690,6 +790,25 @@ int bba_tx(const uint8_t *pkt, int len, int wait) {
     return res;
 }
 
+static int bba_txv(const struct iovec *iov, int iovcnt, int wait) {
+    int res;
+
+    if(!__is_defined(TX_SEMA))
+        return bba_rtxv(iov, iovcnt, wait);
+
+    if(irq_inside_int()) {
+        if(sem_trywait(&tx_sema))
+            return BBA_TX_OK;
+    }
+    else
+        sem_wait(&tx_sema);
+
+    res = bba_rtxv(iov, iovcnt, wait);
+    sem_signal(&tx_sema);
+
+    return res;
+}
+
 void bba_lock(void) {
     //sem_wait(&bba_rx_sema2);
     //asic_evt_disable(ASIC_EVT_EXP_PCI, BBA_ASIC_IRQ);
@@ -977,6 +1096,19 @@ static int bba_if_tx(netif_t *self, const uint8_t *data, int len, int blocking)
     return 0;
 }
 
+static int bba_if_tx_iov(netif_t *self, const struct iovec *iov, int iovcnt,
+                         int blocking) {
+    (void)self;
+
+    if(!(bba_if.flags & NETIF_RUNNING))
+        return -1;
+
+    if(bba_txv(iov, iovcnt, blocking) != BBA_TX_OK)
+        return -1;
+
+    return 0;
+}
+
 /* We'll auto-commit for now */
 static int bba_if_tx_commit(netif_t *self) {
     (void)self;
@@ -1142,6 +1274,7 @@ int bba_init(void) {
     bba_if.if_rx_poll = bba_if_rx_poll;
     bba_if.if_set_flags = bba_if_set_flags;
     bba_if.if_set_mc = bba_if_set_mc;
+    bba_if.if_tx_iov = bba_if_tx_iov;
 
     /* Attempt to set up our IP address et al from the flashrom */
     bba_set_ispcfg();
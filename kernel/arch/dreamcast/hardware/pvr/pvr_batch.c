@@ -0,0 +1,213 @@
+/* KallistiOS ##version##
+
+   pvr_batch.c
+*/
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <kos/dbglog.h>
+#include <dc/pvr.h>
+#include "pvr_internal.h"
+
+/*
+
+   Primitive batching
+
+   Please see ../../include/dc/pvr/pvr_batch.h for more info on this API!
+
+*/
+
+/* Modifier volumes are grouped by their headers, so leave those alone. */
+static inline int batch_can_merge(pvr_list_t list) {
+    return list != PVR_LIST_OP_MOD && list != PVR_LIST_TR_MOD;
+}
+
+int pvr_batch_init(pvr_batch_t *batch, pvr_list_t list, size_t max_hdrs,
+                   size_t vtx_size) {
+    memset(batch, 0, sizeof(*batch));
+
+    batch->list = list;
+    batch->rec_max = max_hdrs;
+    batch->vtx_size = vtx_size & ~31;
+
+    batch->recs = aligned_alloc(32, max_hdrs * sizeof(pvr_batch_rec_t));
+    batch->order = malloc(max_hdrs * sizeof(pvr_batch_rec_t *));
+    batch->vtx = aligned_alloc(32, batch->vtx_size);
+
+    if(!batch->recs || !batch->order || !batch->vtx) {
+        pvr_batch_shutdown(batch);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    pvr_batch_begin(batch);
+
+    return 0;
+}
+
+void pvr_batch_shutdown(pvr_batch_t *batch) {
+    free(batch->recs);
+    free(batch->order);
+    free(batch->vtx);
+
+    batch->recs = NULL;
+    batch->order = NULL;
+    batch->vtx = NULL;
+    batch->rec_max = batch->vtx_size = 0;
+    pvr_batch_begin(batch);
+}
+
+void pvr_batch_set_sort(pvr_batch_t *batch, int sort) {
+    batch->sort = sort;
+}
+
+void pvr_batch_begin(pvr_batch_t *batch) {
+    batch->rec_count = 0;
+    batch->vtx_ptr = 0;
+    batch->hdrs_in = 0;
+    batch->sortable = 1;
+}
+
+/* Whether things drawn with this header end up the same no matter what order
+   they're drawn in (as long as nothing overlaps at the same depth). */
+static int batch_hdr_sortable(const pvr_poly_hdr_t *hdr) {
+    /* Anything other than a polygon or sprite header changes how whatever
+       comes after it is drawn, so we can't move things around it. */
+    if(hdr->m0.hdr_type != PVR_HDR_POLY && hdr->m0.hdr_type != PVR_HDR_SPRITE)
+        return 0;
+
+    /* Without depth writes, or when equal depths pass, the last one drawn
+       wins. EQUAL and NOTEQUAL depend on what was drawn before. */
+    if(hdr->m1.depth_write_dis)
+        return 0;
+
+    return hdr->m1.depth_cmp == PVR_DEPTHCMP_GREATER ||
+           hdr->m1.depth_cmp == PVR_DEPTHCMP_LESS ||
+           hdr->m1.depth_cmp == PVR_DEPTHCMP_NEVER;
+}
+
+int pvr_batch_hdr(pvr_batch_t *batch, const pvr_poly_hdr_t *hdr) {
+    pvr_batch_rec_t *rec;
+
+    ++batch->hdrs_in;
+
+    /* Same as the last one? Then just keep adding to its run. */
+    if(batch->rec_count && batch_can_merge(batch->list)) {
+        rec = batch->recs + batch->rec_count - 1;
+
+        if(!memcmp(&rec->hdr, hdr, sizeof(pvr_poly_hdr_t)))
+            return 0;
+    }
+
+    if(batch->rec_count == batch->rec_max) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    if(!batch_hdr_sortable(hdr))
+        batch->sortable = 0;
+
+    rec = batch->recs + batch->rec_count;
+    memcpy(&rec->hdr, hdr, sizeof(pvr_poly_hdr_t));
+    rec->vtx_off = batch->vtx_ptr;
+    rec->vtx_len = 0;
+    rec->seq = batch->rec_count++;
+
+    return 0;
+}
+
+int pvr_batch_prim(pvr_batch_t *batch, const void *data, size_t size) {
+    pvr_batch_rec_t *rec;
+
+    /* Ensure data size is multiple of 32-bytes. */
+    assert(!(size & 31));
+
+    /* Vertices have to go along with a header. */
+    assert(batch->rec_count);
+
+    if(batch->vtx_ptr + size > batch->vtx_size) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    memcpy(batch->vtx + batch->vtx_ptr, data, size);
+    batch->vtx_ptr += size;
+
+    rec = batch->recs + batch->rec_count - 1;
+    rec->vtx_len += size;
+
+    return 0;
+}
+
+/* Order records by their headers, with the texture first, as that's the most
+   expensive thing to switch, and then the rest of the state. Records with the
+   same header stay in the order they were submitted in. */
+static int batch_cmp(const void *a, const void *b) {
+    static const int words[8] = { 3, 2, 0, 1, 4, 5, 6, 7 };
+    const pvr_batch_rec_t *r1 = *(pvr_batch_rec_t * const *)a;
+    const pvr_batch_rec_t *r2 = *(pvr_batch_rec_t * const *)b;
+    const uint32_t *h1 = (const uint32_t *)&r1->hdr;
+    const uint32_t *h2 = (const uint32_t *)&r2->hdr;
+    int i;
+
+    for(i = 0; i < 8; ++i) {
+        if(h1[words[i]] != h2[words[i]])
+            return h1[words[i]] < h2[words[i]] ? -1 : 1;
+    }
+
+    return r1->seq < r2->seq ? -1 : 1;
+}
+
+static void batch_send(pvr_batch_t *batch, int dma, const void *data,
+                       size_t size) {
+    if(dma)
+        pvr_list_prim(batch->list, data, size);
+    else
+        pvr_prim(data, size);
+}
+
+int pvr_batch_finish(pvr_batch_t *batch) {
+    const pvr_batch_rec_t *rec, *last = NULL;
+    int dma, merge;
+    size_t i;
+
+    dma = pvr_state.dma_mode &&
+          pvr_state.dma_buffers[pvr_state.ram_target].base[batch->list];
+
+    if(!dma && pvr_state.list_reg_open != (int)batch->list) {
+        dbglog(DBG_WARNING, "pvr_batch_finish: batch's list is not open\n");
+        return -1;
+    }
+
+    for(i = 0; i < batch->rec_count; ++i)
+        batch->order[i] = batch->recs + i;
+
+    if(batch->sort && batch->sortable && batch->rec_count > 1 &&
+       (batch->list == PVR_LIST_OP_POLY || batch->list == PVR_LIST_PT_POLY))
+        qsort(batch->order, batch->rec_count, sizeof(pvr_batch_rec_t *),
+              batch_cmp);
+
+    /* Send each header once for everything that uses it in a row. */
+    merge = batch_can_merge(batch->list);
+    batch->hdrs_out = 0;
+
+    for(i = 0; i < batch->rec_count; ++i) {
+        rec = batch->order[i];
+
+        if(!last || !merge ||
+           memcmp(&last->hdr, &rec->hdr, sizeof(pvr_poly_hdr_t))) {
+            batch_send(batch, dma, &rec->hdr, sizeof(pvr_poly_hdr_t));
+            ++batch->hdrs_out;
+        }
+
+        if(rec->vtx_len)
+            batch_send(batch, dma, batch->vtx + rec->vtx_off, rec->vtx_len);
+
+        last = rec;
+    }
+
+    return 0;
+}
@@ -9,6 +9,7 @@
    http://www.boob.co.uk
  */
 
+#include <assert.h>
 #include <stdio.h>
 #include <errno.h>
 #include <arch/dmac.h>
@@ -17,6 +18,7 @@
 #include <dc/sq.h>
 #include <kos/thread.h>
 #include <kos/sem.h>
+#include <kos/genwait.h>
 #include <kos/dbglog.h>
 
 #include "pvr_internal.h"
@@ -32,6 +34,27 @@ static void *dma_cbdata;
 /* DMA registers */
 static volatile uint32_t *const pvr_dma = (volatile uint32_t *)0xa05f6800;
 
+/* Upload queue. Jobs are run from the DMA completion interrupt, one chunk at
+   a time, so that TA list DMA never has to wait for more than one chunk to
+   finish before it can have the channel. */
+#define UPLOAD_QUEUE_LEN    64
+#define UPLOAD_CHUNK        (64 * 1024)
+
+typedef struct upload_job {
+    dma_addr_t      src;
+    uintptr_t       dest;
+    size_t          count;
+    pvr_dma_fence_t fence;      /* Last fence that this job covers */
+} upload_job_t;
+
+static upload_job_t upload_jobs[UPLOAD_QUEUE_LEN];
+static unsigned int upload_head, upload_tail;
+static size_t upload_len;               /* Size of the chunk in flight */
+static bool upload_active;              /* True if the queue holds dma_lock */
+static pvr_dma_fence_t upload_queued;   /* Last fence handed out */
+static volatile pvr_dma_fence_t upload_done;  /* Last fence completed */
+static volatile bool ta_waiting;        /* TA list DMA wants the channel */
+
 /* PVR Dma registers - Offset by 0xA05F6800 */
 #define PVR_STATE   0x00
 #define PVR_LEN     0x04/4
@@ -39,6 +62,8 @@ static volatile uint32_t *const pvr_dma = (volatile uint32_t *)0xa05f6800;
 #define PVR_LMMODE0 0x84/4
 #define PVR_LMMODE1 0x88/4
 
+static void upload_kick(void);
+
 static void pvr_dma_irq_hnd(uint32_t code, void *data) {
     (void)code;
     (void)data;
@@ -65,6 +90,9 @@ static void pvr_dma_irq_hnd(uint32_t code, void *data) {
         thd_schedule(true);
         dma_blocking = false;
     }
+
+    /* Start up the upload queue, if the channel was left free. */
+    upload_kick();
 }
 
 static uintptr_t pvr_dest_addr(uintptr_t dest, pvr_dma_type_t type) {
@@ -104,6 +132,24 @@ static const dma_config_t pvr_dma_config = {
     .transmit_mode = DMA_TRANSMITMODE_BURST,
 };
 
+/* Start a transfer. Interrupts must be disabled, and the channel idle. */
+static int pvr_dma_start(dma_addr_t src_addr, uintptr_t dest_addr,
+                         size_t count, bool block,
+                         pvr_dma_callback_t callback, void *cbdata) {
+    if(dma_transfer(&pvr_dma_config, 0, src_addr, count, NULL))
+        return -1;
+
+    dma_blocking = block;
+    dma_callback = callback;
+    dma_cbdata = cbdata;
+
+    pvr_dma[PVR_STATE] = dest_addr;
+    pvr_dma[PVR_LEN] = count;
+    pvr_dma[PVR_DST] = 0x1;
+
+    return 0;
+}
+
 int pvr_dma_transfer(const void *src, uintptr_t dest, size_t count,
                      pvr_dma_type_t type, bool block,
                      pvr_dma_callback_t callback, void *cbdata) {
@@ -125,17 +171,10 @@ int pvr_dma_transfer(const void *src, uintptr_t dest, size_t count,
         return -1;
     }
 
-    if(dma_transfer(&pvr_dma_config, 0, src_addr, count, NULL))
+    if(pvr_dma_start(src_addr, pvr_dest_addr(dest, type), count, block,
+                     callback, cbdata))
         return -1;
 
-    dma_blocking = block;
-    dma_callback = callback;
-    dma_cbdata = cbdata;
-
-    pvr_dma[PVR_STATE] = pvr_dest_addr(dest, type);
-    pvr_dma[PVR_LEN] = count;
-    pvr_dma[PVR_DST] = 0x1;
-
     /* Wait for us to be signaled */
     if(block)
         sem_wait(&dma_done);
@@ -164,6 +203,157 @@ bool pvr_dma_ready(void) {
     return pvr_dma[PVR_DST] == 0;
 }
 
+void pvr_dma_lock(bool ta) {
+    /* Have the upload queue stop after its current chunk. */
+    if(ta)
+        ta_waiting = true;
+
+    sem_wait((semaphore_t *)&pvr_state.dma_lock);
+    ta_waiting = false;
+}
+
+void pvr_dma_unlock(void) {
+    irq_disable_scoped();
+
+    sem_signal((semaphore_t *)&pvr_state.dma_lock);
+    upload_kick();
+}
+
+static inline bool upload_fence_done(pvr_dma_fence_t fence) {
+    return (int32_t)(upload_done - fence) >= 0;
+}
+
+/* Retire the chunk that just went out, and send the next one, unless there's
+   nothing left to do or the TA is waiting for its turn. This is called from
+   the DMA completion interrupt. */
+static void upload_next(void *data) {
+    upload_job_t *job = upload_jobs + upload_head;
+    size_t n;
+
+    (void)data;
+
+    if(upload_len) {
+        job->src += upload_len;
+        job->dest += upload_len;
+        job->count -= upload_len;
+        upload_len = 0;
+
+        if(!job->count) {
+            upload_done = job->fence;
+            upload_head = (upload_head + 1) % UPLOAD_QUEUE_LEN;
+            job = upload_jobs + upload_head;
+
+            genwait_wake_all((void *)&upload_done);
+            genwait_wake_all(upload_jobs);
+        }
+    }
+
+    if(upload_head != upload_tail && !ta_waiting) {
+        n = job->count < UPLOAD_CHUNK ? job->count : UPLOAD_CHUNK;
+
+        if(!pvr_dma_start(job->src, pvr_dest_addr(job->dest, PVR_DMA_VRAM64),
+                          n, false, upload_next, NULL)) {
+            upload_len = n;
+            return;
+        }
+
+        dbglog(DBG_ERROR, "pvr_dma: can't start queued upload\n");
+    }
+
+    upload_active = false;
+    sem_signal((semaphore_t *)&pvr_state.dma_lock);
+}
+
+/* Start running the upload queue, if it has anything in it and the channel is
+   free. Interrupts must be disabled. */
+static void upload_kick(void) {
+    if(upload_active || upload_head == upload_tail || ta_waiting ||
+       !pvr_dma_ready())
+        return;
+
+    if(sem_trywait((semaphore_t *)&pvr_state.dma_lock) < 0)
+        return;
+
+    upload_active = true;
+    upload_next(NULL);
+}
+
+int pvr_txr_queue_dma(const void *src, pvr_ptr_t dest, size_t count,
+                      pvr_dma_fence_t *fence) {
+    dma_addr_t src_addr = dma_map_src(src, count);
+    upload_job_t *job;
+    unsigned int next;
+
+    if((src_addr & 0x1F) || ((uintptr_t)dest & 0x1F)) {
+        dbglog(DBG_ERROR, "pvr_txr_queue_dma: src or dest is not 32-byte "
+               "aligned\n");
+        errno = EFAULT;
+        return -1;
+    }
+
+    if(count & 0x1F) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    irq_disable_scoped();
+
+    if(!count)
+        goto out;
+
+    /* If this picks up right where the last job leaves off, just make that
+       one longer. That's fine even if it's partway through already. */
+    if(upload_head != upload_tail) {
+        job = upload_jobs + (upload_tail + UPLOAD_QUEUE_LEN - 1) %
+              UPLOAD_QUEUE_LEN;
+
+        if(job->src + job->count == src_addr &&
+           job->dest + job->count == (uintptr_t)dest) {
+            job->count += count;
+            job->fence = ++upload_queued;
+            goto out;
+        }
+    }
+
+    /* Wait for room, if need be. */
+    while((next = (upload_tail + 1) % UPLOAD_QUEUE_LEN) == upload_head) {
+        if(irq_inside_int()) {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        genwait_wait(upload_jobs, "pvr_txr_queue_dma", 0);
+    }
+
+    job = upload_jobs + upload_tail;
+    job->src = src_addr;
+    job->dest = (uintptr_t)dest;
+    job->count = count;
+    job->fence = ++upload_queued;
+    upload_tail = next;
+
+    upload_kick();
+
+out:
+    if(fence)
+        *fence = upload_queued;
+
+    return 0;
+}
+
+bool pvr_dma_fence_done(pvr_dma_fence_t fence) {
+    return upload_fence_done(fence);
+}
+
+void pvr_dma_fence_wait(pvr_dma_fence_t fence) {
+    assert(!irq_inside_int());
+
+    irq_disable_scoped();
+
+    while(!upload_fence_done(fence))
+        genwait_wait((void *)&upload_done, "pvr_dma_fence_wait", 0);
+}
+
 void pvr_dma_init(void) {
     /* Create an initially blocked semaphore */
     sem_init(&dma_done, 0);
@@ -171,6 +361,11 @@ void pvr_dma_init(void) {
     dma_callback = NULL;
     dma_cbdata = 0;
 
+    upload_head = upload_tail = 0;
+    upload_len = 0;
+    upload_active = false;
+    ta_waiting = false;
+
     /* Use 2x32-bit TA->VRAM buses for PVR_TA_TEX_MEM */
     pvr_dma[PVR_LMMODE0] = 0;
 
@@ -183,11 +378,24 @@ void pvr_dma_init(void) {
 }
 
 void pvr_dma_shutdown(void) {
+    irq_mask_t old;
+
     /* Need to ensure that no DMA is in progress */
     if(!pvr_dma_ready()) {
         pvr_dma[PVR_DST] = 0;
     }
 
+    /* Drop anything left in the upload queue, and let go of anyone waiting
+       on it. */
+    old = irq_disable();
+    upload_head = upload_tail;
+    upload_len = 0;
+    upload_active = false;
+    upload_done = upload_queued;
+    genwait_wake_all((void *)&upload_done);
+    genwait_wake_all(upload_jobs);
+    irq_restore(old);
+
     /* Clean up */
     asic_evt_disable(ASIC_EVT_PVR_DMA, ASIC_IRQ_DEFAULT);
     asic_evt_remove_handler(ASIC_EVT_PVR_DMA);
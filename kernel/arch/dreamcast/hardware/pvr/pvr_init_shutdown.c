@@ -216,6 +216,9 @@ int pvr_shutdown(void) {
     if(!pvr_state.valid)
         return -1;
 
+    /* Stop the texture cache, if it's running */
+    pvr_txr_cache_shutdown();
+
     /* Set us invalid */
     pvr_state.valid = 0;
 
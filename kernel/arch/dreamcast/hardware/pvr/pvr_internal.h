@@ -128,6 +128,8 @@ typedef struct {
     uint8_t     *base[PVR_OPB_COUNT];  // DMA buffers, if assigned
     uint32_t    ptr[PVR_OPB_COUNT];    // DMA buffer write pointer, if used
     uint32_t    size[PVR_OPB_COUNT];   // DMA buffer sizes, or zero if none
+    struct pvr_cmdbuf *cmdbufs[PVR_OPB_COUNT];     // Command buffers to send after each list
+    struct pvr_cmdbuf *cmdbufs_tail[PVR_OPB_COUNT];    // Last of those, to append to
     int         ready;                 // >0 if these buffers are ready to be DMAed
 } pvr_dma_buffers_t;
 
@@ -161,6 +163,8 @@ typedef struct {
     uint32_t  lists_closed;             // (1 << idx) for each list which the SH4 has lost interest in
     uint32_t  lists_transferred;        // (1 << idx) for each list which has completely transferred to the TA
     uint32_t  lists_dmaed;              // (1 << idx) for each list which has been DMA'd (DMA mode only)
+    struct pvr_cmdbuf *dma_cmdbuf;      // Next command buffer to DMA for the current list, if any
+    uint8_t   *dma_eol;                 // End-of-list marker to DMA after the command buffers, if any
 
     semaphore_t         dma_lock;       // Locked if a DMA is in progress (vertex or texture)
     int     ta_checked_ready;           // >0 if the TA has been checked to be ready for the new scene
@@ -294,4 +298,28 @@ void pvr_vblank_handler(uint32_t code, void *data);
 
 void pvr_start_dma(void);
 
+/**** pvr_dma.c *******************************************************/
+
+/* Take the DMA channel (dma_lock). If ta is set, the upload queue is asked to
+   hand the channel over as soon as it can. */
+void pvr_dma_lock(bool ta);
+
+/* Give the DMA channel back, and start the upload queue if it has work to
+   do. This may be called from an interrupt. */
+void pvr_dma_unlock(void);
+
+
+/**** pvr_mem_handle.c ************************************************/
+
+/* Forget about the handle arena (the pool it lived in was reset) */
+void pvr_mem_handles_reset(void);
+
+/* Print statistics about the handle arena, if there is one */
+void pvr_mem_handles_stats(void);
+
+/**** pvr_txr_cache.c *************************************************/
+
+/* Start a new frame for the texture cache, and queue up its uploads */
+void pvr_txr_cache_scene_begin(void);
+
 #endif
@@ -30,8 +30,24 @@
 // nothing. Otherwise, start the DMA and chain back to us upon completion.
 static void dma_next_list(void *thread) {
     volatile pvr_dma_buffers_t * b;
+    pvr_cmdbuf_t *cb;
+    uint8_t *eol;
     unsigned int i;
 
+    // If we're partway through a list that had command buffers submitted to
+    // it, send the next one of those, and then the end-of-list marker.
+    if((cb = pvr_state.dma_cmdbuf)) {
+        pvr_state.dma_cmdbuf = cb->next;
+        pvr_dma_load_ta(cb->base, cb->ptr, 0, dma_next_list, thread);
+        return;
+    }
+
+    if((eol = pvr_state.dma_eol)) {
+        pvr_state.dma_eol = NULL;
+        pvr_dma_load_ta(eol, 32, 0, dma_next_list, thread);
+        return;
+    }
+
     // Get the buffers for this frame.
     b = pvr_state.dma_buffers + (pvr_state.ram_target ^ 1);
 
@@ -51,6 +67,22 @@ static void dma_next_list(void *thread) {
             // Mark this list as processed.
             pvr_state.lists_dmaed |= BIT(i);
 
+            // If there are command buffers to go along with this list, hold
+            // back the end-of-list marker until they've all been sent.
+            if(b->cmdbufs[i]) {
+                pvr_state.dma_cmdbuf = b->cmdbufs[i];
+                pvr_state.dma_eol = b->base[i] + b->ptr[i] - 32;
+
+                // Nothing in the vertex buffer itself? Skip right to them.
+                if(b->ptr[i] == 32)
+                    dma_next_list(thread);
+                else
+                    pvr_dma_load_ta(b->base[i], b->ptr[i] - 32, 0,
+                                    dma_next_list, thread);
+
+                return;
+            }
+
             // Start the DMA transfer, chaining to ourselves.
             pvr_dma_load_ta(b->base[i], b->ptr[i], 0, dma_next_list, thread);
             return;
@@ -61,7 +93,7 @@ static void dma_next_list(void *thread) {
     pvr_state.lists_dmaed = 0;
 
     // Unlock
-    sem_signal((semaphore_t *)&pvr_state.dma_lock);
+    pvr_dma_unlock();
 
     // Buffers are now empty again
     pvr_state.dma_buffers[pvr_state.ram_target ^ 1].ready = 0;
@@ -70,7 +102,7 @@ static void dma_next_list(void *thread) {
 void pvr_start_dma(void) {
     pvr_sync_stats(PVR_SYNC_REGSTART);
 
-    sem_wait((semaphore_t *)&pvr_state.dma_lock);
+    pvr_dma_lock(true);
 
     // Begin DMAing the first list.
     dma_next_list(thd_get_current());
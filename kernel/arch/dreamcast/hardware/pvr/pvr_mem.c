@@ -193,12 +193,36 @@ void pvr_mem_reset(void) {
         pvr_mem_base = (pvr_ptr_t)(PVR_RAM_INT_BASE + pvr_state.texture_base);
         pvr_int_mem_reset();
     }
+
+    /* The handle arena lived in the pool, so it's gone too. */
+    pvr_mem_handles_reset();
 }
 
 /* Print some statistics (like mallocstats) */
 void pvr_mem_stats(void) {
+    struct mallinfo mi;
+    size_t avail, top;
+
     printf("pvr_mem_stats():\n");
     pvr_int_malloc_stats();
     printf("max sbrk base: %08lx\n", (uint32_t)pvr_mem_base);
+
+    /* Everything past the top of the pool (and whatever's free at the very
+       top of it) is in one piece. Anything else that's free is in holes left
+       between allocated blocks. */
+    if(pvr_mem_base) {
+        mi = pvr_int_mallinfo();
+        avail = pvr_mem_available();
+        top = mi.keepcost + (PVR_RAM_INT_TOP - (size_t)pvr_mem_base);
+
+        printf("available: %lu bytes, at least %lu contiguous\n",
+               (unsigned long)avail, (unsigned long)top);
+
+        if(avail)
+            printf("fragmentation: at most %lu%%\n",
+                   (unsigned long)(100 - top * 100 / avail));
+    }
+
+    pvr_mem_handles_stats();
     pvr_mem_print_list();
 }
@@ -0,0 +1,382 @@
+/* KallistiOS ##version##
+
+   pvr_mem_handle.c
+*/
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <kos/dbglog.h>
+#include <dc/pvr.h>
+#include <dc/sq.h>
+#include "pvr_internal.h"
+
+/*
+
+This module provides handle-based allocation of texture memory, on top of the
+regular pvr_mem_malloc() pool.
+
+An arena is carved out of the regular pool when it's set up, and blocks are
+handed out from it with a binary buddy allocator, so every block has a power
+of two size and is aligned on that size (relative to the start of the arena).
+That suits textures well, as most of them are powers of two in size anyway.
+
+All of the bookkeeping is kept in main RAM. Nobody outside of here ever holds
+on to the address of a block for long, only to its handle, so blocks can be
+moved around to defragment the arena. Whenever two free blocks of the same
+size can't be merged because their buddies are both in use, one of those
+buddies is moved into the other free block, and the block it moved out of gets
+merged with its own buddy.
+
+*/
+
+/* Smallest block size (256 bytes) and largest (all of VRAM) */
+#define MIN_ORDER       8
+#define MAX_ORDER       23
+
+/* End of a free list */
+#define NIL             0xFFFF
+
+/* Block state, stored for the first unit of each block */
+#define BLK_USED        0x80
+#define BLK_ORDER       0x1F
+
+#define UNIT(off)       ((off) >> MIN_ORDER)
+
+typedef struct hblock {
+    uint32_t    off;            /* Offset in the arena, or next free handle */
+    uint8_t     order;          /* Size of the block, or 0 if the handle's free */
+} hblock_t;
+
+static struct {
+    uint8_t     *base;          /* Start of the arena */
+    int         top_order;      /* Size of the arena */
+
+    uint8_t     *blk;           /* Order and state of the block at each unit */
+    uint16_t    *next;          /* Free list links (or owner if it's in use) */
+    uint16_t    *prev;
+    uint16_t    free_head[MAX_ORDER + 1];
+
+    hblock_t    *handles;
+    size_t      handle_count;
+    uint32_t    handle_free;    /* First free handle, or NIL */
+
+    pvr_mem_moved_cb_t  moved;
+    void        *moved_data;
+} hp;
+
+static void free_push(uint32_t off, int order) {
+    uint16_t u = UNIT(off), head = hp.free_head[order];
+
+    hp.blk[u] = order;
+    hp.next[u] = head;
+    hp.prev[u] = NIL;
+
+    if(head != NIL)
+        hp.prev[head] = u;
+
+    hp.free_head[order] = u;
+}
+
+static void free_remove(uint32_t off, int order) {
+    uint16_t u = UNIT(off);
+
+    if(hp.prev[u] != NIL)
+        hp.next[hp.prev[u]] = hp.next[u];
+    else
+        hp.free_head[order] = hp.next[u];
+
+    if(hp.next[u] != NIL)
+        hp.prev[hp.next[u]] = hp.prev[u];
+}
+
+/* Take a block of the given order out of the free lists, splitting a bigger
+   one if need be. Returns its offset, or -1 if there's no room. */
+static int32_t block_alloc(int order) {
+    uint32_t off;
+    int i;
+
+    for(i = order; i <= hp.top_order; ++i) {
+        if(hp.free_head[i] != NIL)
+            break;
+    }
+
+    if(i > hp.top_order)
+        return -1;
+
+    off = (uint32_t)hp.free_head[i] << MIN_ORDER;
+    free_remove(off, i);
+
+    /* Split it down to size, putting the upper halves back. */
+    while(i > order) {
+        --i;
+        free_push(off + (1 << i), i);
+    }
+
+    hp.blk[UNIT(off)] = order | BLK_USED;
+
+    return off;
+}
+
+/* Give a block back, merging it with its buddy for as long as that's free. */
+static void block_free(uint32_t off, int order) {
+    uint32_t buddy;
+
+    while(order < hp.top_order) {
+        buddy = off ^ (1 << order);
+
+        if(hp.blk[UNIT(buddy)] != order)
+            break;
+
+        free_remove(buddy, order);
+        off &= ~(1 << order);
+        ++order;
+    }
+
+    free_push(off, order);
+}
+
+static void handles_clear(void) {
+    free(hp.blk);
+    free(hp.next);
+    free(hp.prev);
+    free(hp.handles);
+    memset(&hp, 0, sizeof(hp));
+}
+
+int pvr_mem_handles_init(size_t size, size_t max_handles,
+                         pvr_mem_moved_cb_t moved, void *data) {
+    size_t units, i;
+    int order;
+
+    assert(!hp.base);
+
+    if(max_handles >= NIL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* The arena has to be a power of two in size. */
+    for(order = MAX_ORDER; order >= MIN_ORDER; --order) {
+        if(size >= (1U << order))
+            break;
+    }
+
+    if(order < MIN_ORDER) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    units = 1 << (order - MIN_ORDER);
+    hp.top_order = order;
+    hp.blk = calloc(units, sizeof(uint8_t));
+    hp.next = malloc(units * sizeof(uint16_t));
+    hp.prev = malloc(units * sizeof(uint16_t));
+    hp.handles = malloc(max_handles * sizeof(hblock_t));
+
+    if(!hp.blk || !hp.next || !hp.prev || !hp.handles) {
+        handles_clear();
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if(!(hp.base = (uint8_t *)pvr_mem_malloc(1 << order))) {
+        handles_clear();
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for(i = 0; i <= MAX_ORDER; ++i)
+        hp.free_head[i] = NIL;
+
+    free_push(0, order);
+
+    /* Chain all of the handles together on the free list. */
+    for(i = 0; i < max_handles; ++i) {
+        hp.handles[i].off = i + 1 < max_handles ? i + 1 : NIL;
+        hp.handles[i].order = 0;
+    }
+
+    hp.handle_count = max_handles;
+    hp.handle_free = max_handles ? 0 : NIL;
+    hp.moved = moved;
+    hp.moved_data = data;
+
+    return 0;
+}
+
+void pvr_mem_handles_shutdown(void) {
+    if(!hp.base)
+        return;
+
+    pvr_mem_free(hp.base);
+    handles_clear();
+}
+
+/* Called by pvr_mem_reset(), which takes the arena away along with everything
+   else in the pool. */
+void pvr_mem_handles_reset(void) {
+    handles_clear();
+}
+
+pvr_mem_handle_t pvr_mem_halloc(size_t size) {
+    hblock_t *hb;
+    uint32_t h;
+    int32_t off;
+    int order;
+
+    assert(hp.base);
+
+    if(hp.handle_free == NIL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for(order = MIN_ORDER; order <= hp.top_order; ++order) {
+        if(size <= (1U << order))
+            break;
+    }
+
+    if(order > hp.top_order || (off = block_alloc(order)) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    h = hp.handle_free;
+    hb = hp.handles + h;
+    hp.handle_free = hb->off;
+
+    hb->off = off;
+    hb->order = order;
+    hp.next[UNIT(off)] = h;
+
+    return (pvr_mem_handle_t)h;
+}
+
+void pvr_mem_hfree(pvr_mem_handle_t h) {
+    hblock_t *hb;
+
+    if(h < 0)
+        return;
+
+    assert((size_t)h < hp.handle_count);
+    hb = hp.handles + h;
+    assert(hb->order);
+
+    block_free(hb->off, hb->order);
+
+    hb->order = 0;
+    hb->off = hp.handle_free;
+    hp.handle_free = h;
+}
+
+pvr_ptr_t pvr_mem_hptr(pvr_mem_handle_t h) {
+    assert(h >= 0 && (size_t)h < hp.handle_count && hp.handles[h].order);
+
+    return (pvr_ptr_t)(hp.base + hp.handles[h].off);
+}
+
+/* Find two free blocks of the given order, where the buddy of the one higher
+   up in the arena is in use as a whole, and move that buddy down into the
+   other one. Returns the number of bytes moved, or 0 if there's nothing to do
+   at this order. */
+static size_t compact_order(int order) {
+    uint32_t dst, src = 0, off, buddy;
+    uint16_t u, owner;
+    hblock_t *hb;
+    pvr_ptr_t old_ptr;
+
+    if(hp.free_head[order] == NIL)
+        return 0;
+
+    /* Move things towards the bottom of the arena. */
+    dst = (uint32_t)hp.free_head[order] << MIN_ORDER;
+
+    for(u = hp.free_head[order]; u != NIL; u = hp.next[u]) {
+        if(((uint32_t)u << MIN_ORDER) < dst)
+            dst = (uint32_t)u << MIN_ORDER;
+    }
+
+    for(u = hp.free_head[order]; u != NIL; u = hp.next[u]) {
+        off = (uint32_t)u << MIN_ORDER;
+        buddy = off ^ (1 << order);
+
+        if(buddy > dst && buddy > src && off != dst &&
+           hp.blk[UNIT(buddy)] == (order | BLK_USED))
+            src = buddy;
+    }
+
+    if(!src)
+        return 0;
+
+    owner = hp.next[UNIT(src)];
+    hb = hp.handles + owner;
+    old_ptr = (pvr_ptr_t)(hp.base + src);
+
+    sq_cpy(hp.base + dst, hp.base + src, 1 << order);
+
+    free_remove(dst, order);
+    hp.blk[UNIT(dst)] = order | BLK_USED;
+    hp.next[UNIT(dst)] = owner;
+    hb->off = dst;
+
+    block_free(src, order);
+
+    if(hp.moved)
+        hp.moved(owner, old_ptr, (pvr_ptr_t)(hp.base + dst), hp.moved_data);
+
+    return 1 << order;
+}
+
+size_t pvr_mem_compact(size_t max_bytes) {
+    size_t moved = 0, n;
+    int order;
+
+    if(!hp.base)
+        return 0;
+
+    /* Moving a block only ever frees up space at the same or a bigger size,
+       so one pass from the smallest size up is enough. */
+    for(order = MIN_ORDER; order < hp.top_order && moved < max_bytes; ) {
+        if((n = compact_order(order)))
+            moved += n;
+        else
+            ++order;
+    }
+
+    return moved;
+}
+
+void pvr_mem_handles_stats(void) {
+    size_t free_bytes = 0, largest = 0, blocks = 0, n;
+    uint16_t u;
+    int order;
+
+    if(!hp.base)
+        return;
+
+    for(order = MIN_ORDER; order <= hp.top_order; ++order) {
+        n = 0;
+
+        for(u = hp.free_head[order]; u != NIL; u = hp.next[u])
+            ++n;
+
+        if(n)
+            largest = 1 << order;
+
+        free_bytes += n << order;
+        blocks += n;
+    }
+
+    printf("handle arena: %lu bytes at %08lx\n",
+           (unsigned long)(1 << hp.top_order), (unsigned long)hp.base);
+    printf("  free: %lu bytes in %lu blocks, largest %lu bytes\n",
+           (unsigned long)free_bytes, (unsigned long)blocks,
+           (unsigned long)largest);
+
+    if(free_bytes)
+        printf("  fragmentation: %lu%%\n",
+               (unsigned long)(100 - largest * 100 / free_bytes));
+}
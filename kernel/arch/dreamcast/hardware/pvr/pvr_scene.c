@@ -128,6 +128,7 @@ void pvr_scene_begin(void) {
     if(pvr_state.dma_mode) {
         for(i = 0; i < PVR_OPB_COUNT; i++) {
             pvr_state.dma_buffers[pvr_state.ram_target].ptr[i] = 0;
+            pvr_state.dma_buffers[pvr_state.ram_target].cmdbufs[i] = NULL;
         }
 
         pvr_sync_stats(PVR_SYNC_BUFSTART);
@@ -136,6 +137,9 @@ void pvr_scene_begin(void) {
         // We assume registration is starting immediately
         pvr_sync_stats(PVR_SYNC_REGSTART);
     }
+
+    // Let the texture cache know about the new frame.
+    pvr_txr_cache_scene_begin();
 }
 
 /* Begin collecting data for a frame of 3D output to the specified texture;
@@ -281,6 +285,74 @@ int pvr_list_prim(pvr_list_t list, const void *data, size_t size) {
     return 0;
 }
 
+void pvr_cmdbuf_init(pvr_cmdbuf_t *cb, void *buffer, size_t len) {
+    /* Make sure the buffer parameters are valid. */
+    assert(__is_aligned(buffer, 32));
+    assert(!(len & 31));
+
+    cb->base = (uint8_t *)buffer;
+    cb->size = len;
+    cb->ptr = 0;
+    cb->next = NULL;
+}
+
+void pvr_cmdbuf_reset(pvr_cmdbuf_t *cb) {
+    cb->ptr = 0;
+    cb->next = NULL;
+}
+
+int pvr_cmdbuf_prim(pvr_cmdbuf_t *cb, const void *data, size_t size) {
+    /* Same rules as for pvr_list_prim() apply here. */
+    assert(!(size & 31));
+    assert(!((uintptr_t)data & 0x3));
+    assert(cb->ptr + size <= cb->size);
+
+    memcpy(cb->base + cb->ptr, data, size);
+    cb->ptr += size;
+
+    return 0;
+}
+
+void *pvr_cmdbuf_tail(pvr_cmdbuf_t *cb) {
+    return cb->base + cb->ptr;
+}
+
+void pvr_cmdbuf_written(pvr_cmdbuf_t *cb, size_t amt) {
+    assert(!(amt & 31));
+    assert(cb->ptr + amt <= cb->size);
+
+    cb->ptr += amt;
+}
+
+int pvr_cmdbuf_submit(pvr_list_t list, pvr_cmdbuf_t *cb) {
+    volatile pvr_dma_buffers_t *b;
+
+    /* The list's end-of-list marker goes in its vertex buffer, so there has to
+       be one. */
+    assert(pvr_state.dma_mode);
+    assert(pvr_state.dma_buffers[0].base[list]);
+
+    /* Nothing to send? Then don't bother. */
+    if(!cb->ptr)
+        return 0;
+
+    cb->next = NULL;
+
+    /* Other threads may be submitting to the same list. */
+    irq_disable_scoped();
+
+    b = pvr_state.dma_buffers + pvr_state.ram_target;
+
+    if(b->cmdbufs[list])
+        b->cmdbufs_tail[list]->next = cb;
+    else
+        b->cmdbufs[list] = cb;
+
+    b->cmdbufs_tail[list] = cb;
+
+    return 0;
+}
+
 int pvr_list_flush(pvr_list_t list) {
     (void)list;
 
@@ -320,8 +392,9 @@ int pvr_scene_finish(void) {
             if(!b->base[i])
                 continue;
 
-            // Make sure there's at least one primitive in each.
-            if(b->ptr[i] == 0) {
+            // Make sure there's at least one primitive in each. Any command
+            // buffers submitted to the list count for that.
+            if(b->ptr[i] == 0 && !b->cmdbufs[i]) {
                 pvr_blank_polyhdr_buf(i, (pvr_poly_hdr_t*)(b->base[i]));
                 b->ptr[i] += 32;
             }
@@ -209,10 +209,10 @@ void pvr_txr_load_kimg(const kos_img_t *img, pvr_ptr_t dst, uint32_t flags) {
             /* We only enable DMA here for now since it sort of changes things
                to have to allocate an intermediary buffer. */
             if(flags & PVR_TXRLOAD_DMA) {
-                sem_wait((semaphore_t *)&pvr_state.dma_lock);
+                pvr_dma_lock(false);
                 pvr_txr_load_dma(img->data, dst, img->byte_count,
                                  (flags & PVR_TXRLOAD_NONBLOCK) ? 1 : 0, NULL, 0);
-                sem_signal((semaphore_t *)&pvr_state.dma_lock);
+                pvr_dma_unlock();
             }
             else if(flags & PVR_TXRLOAD_SQ) {
                 pvr_txr_load(img->data, dst, img->byte_count);
@@ -0,0 +1,529 @@
+/* KallistiOS ##version##
+
+   pvr_txr_cache.c
+*/
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <kos/dbglog.h>
+#include <kos/fs.h>
+#include <kos/mutex.h>
+#include <kos/thread.h>
+#include <kos/worker_thread.h>
+#include <dc/pvr.h>
+#include "pvr_internal.h"
+
+/*
+
+   Streaming texture cache
+
+   Please see ../../include/dc/pvr/pvr_txr_cache.h for more info on this API!
+
+   Each texture the cache knows about has an entry, which is kept in a hash
+   table by ID, and sits on one of these lists:
+     - The load queue, while it's waiting to be read in by the worker thread,
+       and then for texture memory to be set aside for it.
+     - The upload list, once it has texture memory, while it waits for the
+       worker thread to DMA it over.
+     - The LRU list, once it's in texture memory. Entries get moved to the end
+       whenever they're used, so the ones at the front are the ones to throw
+       out first.
+     - The failed list, for textures that couldn't be loaded. These stay in
+       the hash table, so that they don't get tried over and over again, but
+       get recycled (oldest first) when a new texture needs an entry and no
+       resident texture can be thrown out.
+     - The free list, for unused entries.
+
+   The pvr_mem_* functions aren't thread-safe, so all of the allocating and
+   freeing of texture memory is done on the thread that renders (from
+   pvr_scene_begin() and pvr_txr_cache_get()), and the worker thread only
+   reads files and uploads.
+
+*/
+
+/* Defaults for the parameters */
+#define TXC_DEFAULT_TEXTURES    256
+#define TXC_MIN_KEEP            3
+
+/* How much to read ahead of the uploads, if there's no per-frame budget */
+#define TXC_READ_AHEAD          (512 * 1024)
+
+typedef enum txc_state {
+    TXC_FREE,
+    TXC_QUEUED,                 /* Waiting to be read in */
+    TXC_LOADING,                /* Being read in */
+    TXC_LOADED,                 /* Waiting for texture memory */
+    TXC_UPLOADING,              /* Waiting to be (or being) uploaded */
+    TXC_RESIDENT,               /* In texture memory */
+    TXC_FAILED                  /* Couldn't be loaded */
+} txc_state_t;
+
+typedef struct txc_entry {
+    TAILQ_ENTRY(txc_entry) list;
+    struct txc_entry *hnext;    /* Next in the hash bucket */
+
+    uint32_t    id;
+    txc_state_t state;
+    char        *path;
+    void        *buf;           /* Texture data in main RAM */
+    size_t      size;           /* Rounded up to 32 bytes */
+    pvr_ptr_t   txr;
+    uint32_t    last_used;      /* Frame it was last used in */
+} txc_entry_t;
+
+TAILQ_HEAD(txc_list, txc_entry);
+
+static struct {
+    txc_entry_t     *entries;
+    txc_entry_t     **buckets;
+    uint32_t        bucket_mask;
+
+    struct txc_list free, queue, upload, lru, failed;
+    size_t          loaded_bytes;   /* Read in, but not uploaded yet */
+
+    mutex_t         lock;
+    kthread_worker_t *worker;
+    bool            quit;
+
+    pvr_txr_cache_params_t params;
+    uint32_t        frame;
+
+    pvr_txr_cache_stats_t stats;
+} txc;
+
+static inline txc_entry_t **txc_bucket(uint32_t id) {
+    id ^= id >> 16;
+    id *= 0x45d9f3b;
+    id ^= id >> 16;
+
+    return txc.buckets + (id & txc.bucket_mask);
+}
+
+static txc_entry_t *txc_lookup(uint32_t id) {
+    txc_entry_t *e;
+
+    for(e = *txc_bucket(id); e; e = e->hnext) {
+        if(e->id == id)
+            return e;
+    }
+
+    return NULL;
+}
+
+static void txc_unhash(txc_entry_t *e) {
+    txc_entry_t **p;
+
+    for(p = txc_bucket(e->id); *p != e; p = &(*p)->hnext)
+        ;
+
+    *p = e->hnext;
+}
+
+/* Give up on an entry that's been taken off of its list. */
+static void txc_fail(txc_entry_t *e) {
+    dbglog(DBG_WARNING, "pvr_txr_cache: can't load %s\n", e->path);
+
+    free(e->buf);
+    free(e->path);
+    e->buf = NULL;
+    e->path = NULL;
+    e->state = TXC_FAILED;
+    TAILQ_INSERT_TAIL(&txc.failed, e, list);
+
+    ++txc.stats.failures;
+}
+
+/* Forget about the texture that failed to load the longest time ago, so that
+   its entry can be used for something else. */
+static bool txc_recycle_failed(void) {
+    txc_entry_t *e = TAILQ_FIRST(&txc.failed);
+
+    if(!e)
+        return false;
+
+    TAILQ_REMOVE(&txc.failed, e, list);
+    txc_unhash(e);
+
+    e->state = TXC_FREE;
+    TAILQ_INSERT_TAIL(&txc.free, e, list);
+
+    return true;
+}
+
+/* Throw out the least recently used texture, if it's been long enough since
+   it was used that the PVR can't still be reading from it. */
+static bool txc_evict_one(void) {
+    txc_entry_t *e = TAILQ_FIRST(&txc.lru);
+
+    if(!e || txc.frame - e->last_used < txc.params.keep_frames)
+        return false;
+
+    TAILQ_REMOVE(&txc.lru, e, list);
+    txc_unhash(e);
+
+    pvr_mem_free(e->txr);
+    free(e->path);
+    e->path = NULL;
+    e->txr = NULL;
+    e->state = TXC_FREE;
+    TAILQ_INSERT_TAIL(&txc.free, e, list);
+
+    txc.stats.vram_used -= e->size;
+    --txc.stats.resident;
+    ++txc.stats.evictions;
+
+    return true;
+}
+
+/* Set aside texture memory for an entry, throwing other textures out until
+   there's room. */
+static bool txc_alloc(txc_entry_t *e) {
+    size_t budget = txc.params.vram_budget;
+
+    do {
+        if(!budget || txc.stats.vram_used + e->size <= budget) {
+            if((e->txr = pvr_mem_malloc(e->size))) {
+                txc.stats.vram_used += e->size;
+                return true;
+            }
+        }
+    } while(txc_evict_one());
+
+    return false;
+}
+
+/* Read in the file for an entry. This is called without the lock held. */
+static int txc_load(txc_entry_t *e) {
+    file_t fd;
+    ssize_t size;
+
+    if((fd = fs_open(e->path, O_RDONLY)) < 0)
+        return -1;
+
+    if((size = fs_total(fd)) <= 0) {
+        fs_close(fd);
+        return -1;
+    }
+
+    e->size = (size + 31) & ~31;
+
+    if(!(e->buf = aligned_alloc(32, e->size)) ||
+       fs_read(fd, e->buf, size) != size) {
+        fs_close(fd);
+        return -1;
+    }
+
+    fs_close(fd);
+
+    return 0;
+}
+
+/* Upload the texture data for a batch of entries, all queued up at once so
+   that they go out back to back. This is called without the lock held. */
+static void txc_upload(struct txc_list *batch) {
+    pvr_dma_fence_t fence;
+    txc_entry_t *e;
+    bool queued = false;
+
+    TAILQ_FOREACH(e, batch, list) {
+        /* Fall back on the store queues if the DMA can't be queued. */
+        if(pvr_txr_queue_dma(e->buf, e->txr, e->size, &fence) < 0)
+            pvr_txr_load(e->buf, e->txr, e->size);
+        else
+            queued = true;
+    }
+
+    if(queued)
+        pvr_dma_fence_wait(fence);
+}
+
+static void txc_worker(void *data) {
+    struct txc_list batch;
+    size_t limit;
+    txc_entry_t *e;
+    int rv;
+
+    (void)data;
+
+    limit = txc.params.frame_budget ? txc.params.frame_budget : TXC_READ_AHEAD;
+
+    mutex_lock(&txc.lock);
+
+    while(!txc.quit) {
+        /* Uploads come first, since there's already memory set aside for
+           them in this frame's budget. */
+        if(!TAILQ_EMPTY(&txc.upload)) {
+            TAILQ_INIT(&batch);
+
+            while((e = TAILQ_FIRST(&txc.upload))) {
+                TAILQ_REMOVE(&txc.upload, e, list);
+                TAILQ_INSERT_TAIL(&batch, e, list);
+            }
+
+            mutex_unlock(&txc.lock);
+            txc_upload(&batch);
+            mutex_lock(&txc.lock);
+
+            while((e = TAILQ_FIRST(&batch))) {
+                TAILQ_REMOVE(&batch, e, list);
+                free(e->buf);
+                e->buf = NULL;
+                e->state = TXC_RESIDENT;
+                e->last_used = txc.frame;
+                TAILQ_INSERT_TAIL(&txc.lru, e, list);
+
+                txc.loaded_bytes -= e->size;
+                ++txc.stats.uploads;
+                txc.stats.upload_bytes += e->size;
+                ++txc.stats.resident;
+            }
+
+            continue;
+        }
+
+        /* Then read ahead, up to about a frame's worth. */
+        if(txc.loaded_bytes >= limit)
+            break;
+
+        TAILQ_FOREACH(e, &txc.queue, list) {
+            if(e->state == TXC_QUEUED)
+                break;
+        }
+
+        if(!e)
+            break;
+
+        e->state = TXC_LOADING;
+
+        mutex_unlock(&txc.lock);
+        rv = txc_load(e);
+        mutex_lock(&txc.lock);
+
+        if(rv < 0) {
+            TAILQ_REMOVE(&txc.queue, e, list);
+            --txc.stats.queued;
+            txc_fail(e);
+            continue;
+        }
+
+        e->state = TXC_LOADED;
+        txc.loaded_bytes += e->size;
+        ++txc.stats.loads;
+    }
+
+    mutex_unlock(&txc.lock);
+}
+
+/* Called by pvr_scene_begin() at the start of every frame. */
+void pvr_txr_cache_scene_begin(void) {
+    size_t bytes = 0, budget = txc.params.frame_budget;
+    txc_entry_t *e;
+
+    if(!txc.worker)
+        return;
+
+    mutex_lock_scoped(&txc.lock);
+
+    ++txc.frame;
+
+    /* Set aside texture memory for whatever has been read in, as far as this
+       frame's budget goes. The queue is read in order, so anything that has
+       been read in is at the front. */
+    while((e = TAILQ_FIRST(&txc.queue)) && e->state == TXC_LOADED) {
+        if(budget && bytes && bytes + e->size > budget)
+            break;
+
+        if(!txc_alloc(e)) {
+            /* If there's nothing else in the cache at all, this one is never
+               going to fit, so give up on it. Otherwise, wait for something
+               to get old enough to be thrown out. */
+            if(!TAILQ_EMPTY(&txc.lru) || !TAILQ_EMPTY(&txc.upload))
+                break;
+
+            TAILQ_REMOVE(&txc.queue, e, list);
+            txc.loaded_bytes -= e->size;
+            --txc.stats.queued;
+            txc_fail(e);
+            continue;
+        }
+
+        TAILQ_REMOVE(&txc.queue, e, list);
+        --txc.stats.queued;
+        e->state = TXC_UPLOADING;
+        TAILQ_INSERT_TAIL(&txc.upload, e, list);
+
+        bytes += e->size;
+    }
+
+    if(!TAILQ_EMPTY(&txc.queue) || !TAILQ_EMPTY(&txc.upload))
+        thd_worker_wakeup(txc.worker);
+}
+
+int pvr_txr_cache_init(const pvr_txr_cache_params_t *params) {
+    const kthread_attr_t attr = {
+        .prio = PRIO_DEFAULT,
+        .label = "pvr_txr_cache"
+    };
+    unsigned int min_keep;
+    size_t i, buckets;
+
+    if(txc.entries) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    txc.params = *params;
+
+    if(!txc.params.max_textures)
+        txc.params.max_textures = TXC_DEFAULT_TEXTURES;
+
+    /* Vertex DMA adds another frame to the pipeline. */
+    min_keep = TXC_MIN_KEEP + (pvr_state.dma_mode ? 1 : 0);
+
+    if(txc.params.keep_frames < min_keep)
+        txc.params.keep_frames = min_keep;
+
+    for(buckets = 1; buckets < txc.params.max_textures; buckets <<= 1)
+        ;
+
+    txc.entries = calloc(txc.params.max_textures, sizeof(txc_entry_t));
+    txc.buckets = calloc(buckets, sizeof(txc_entry_t *));
+
+    if(!txc.entries || !txc.buckets)
+        goto fail;
+
+    txc.bucket_mask = buckets - 1;
+
+    TAILQ_INIT(&txc.free);
+    TAILQ_INIT(&txc.queue);
+    TAILQ_INIT(&txc.upload);
+    TAILQ_INIT(&txc.lru);
+    TAILQ_INIT(&txc.failed);
+
+    for(i = 0; i < txc.params.max_textures; ++i)
+        TAILQ_INSERT_TAIL(&txc.free, txc.entries + i, list);
+
+    mutex_init(&txc.lock, MUTEX_TYPE_NORMAL);
+
+    if(!(txc.worker = thd_worker_create_ex(&attr, txc_worker, NULL))) {
+        mutex_destroy(&txc.lock);
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    free(txc.entries);
+    free(txc.buckets);
+    memset(&txc, 0, sizeof(txc));
+    errno = ENOMEM;
+    return -1;
+}
+
+void pvr_txr_cache_shutdown(void) {
+    txc_entry_t *e;
+    size_t i;
+
+    if(!txc.entries)
+        return;
+
+    mutex_lock(&txc.lock);
+    txc.quit = true;
+    mutex_unlock(&txc.lock);
+
+    thd_worker_destroy(txc.worker);
+
+    for(i = 0; i < txc.params.max_textures; ++i) {
+        e = txc.entries + i;
+
+        if(e->state == TXC_UPLOADING || e->state == TXC_RESIDENT)
+            pvr_mem_free(e->txr);
+
+        free(e->buf);
+        free(e->path);
+    }
+
+    mutex_destroy(&txc.lock);
+    free(txc.entries);
+    free(txc.buckets);
+    memset(&txc, 0, sizeof(txc));
+}
+
+/* Start tracking a new texture, and queue it to be loaded. */
+static void txc_add(uint32_t id, const char *path) {
+    txc_entry_t *e;
+
+    /* If every entry is in use, recycle the oldest texture's, or failing
+       that, the oldest failed one's. */
+    if(TAILQ_EMPTY(&txc.free) && !txc_evict_one() && !txc_recycle_failed())
+        return;
+
+    e = TAILQ_FIRST(&txc.free);
+
+    if(!(e->path = strdup(path)))
+        return;
+
+    TAILQ_REMOVE(&txc.free, e, list);
+
+    e->id = id;
+    e->state = TXC_QUEUED;
+    e->buf = NULL;
+    e->size = 0;
+    e->txr = NULL;
+
+    e->hnext = *txc_bucket(id);
+    *txc_bucket(id) = e;
+
+    TAILQ_INSERT_TAIL(&txc.queue, e, list);
+    ++txc.stats.queued;
+
+    thd_worker_wakeup(txc.worker);
+}
+
+pvr_ptr_t pvr_txr_cache_get(uint32_t id, const char *path, bool *resident) {
+    pvr_ptr_t txr = txc.params.placeholder;
+    txc_entry_t *e;
+    bool found = false;
+
+    assert(txc.entries);
+
+    mutex_lock(&txc.lock);
+
+    if(!(e = txc_lookup(id))) {
+        txc_add(id, path);
+    }
+    else if(e->state == TXC_RESIDENT) {
+        TAILQ_REMOVE(&txc.lru, e, list);
+        TAILQ_INSERT_TAIL(&txc.lru, e, list);
+        e->last_used = txc.frame;
+
+        txr = e->txr;
+        found = true;
+    }
+
+    if(found)
+        ++txc.stats.hits;
+    else
+        ++txc.stats.misses;
+
+    mutex_unlock(&txc.lock);
+
+    if(resident)
+        *resident = found;
+
+    return txr;
+}
+
+int pvr_txr_cache_get_stats(pvr_txr_cache_stats_t *stats) {
+    if(!txc.entries)
+        return -1;
+
+    mutex_lock_scoped(&txc.lock);
+    *stats = txc.stats;
+
+    return 0;
+}
@@ -425,6 +425,9 @@ typedef struct maple_state_str {
 
     /** \brief  The vertical position of the lightgun signal. */
     int                         gun_y;
+
+    /** \brief  Time the last DMA was started, in microseconds. */
+    volatile uint64_t           dma_time;
 } maple_state_t;
 
 /** \brief   Maple DMA buffer size.
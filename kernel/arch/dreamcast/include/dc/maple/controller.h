@@ -27,6 +27,7 @@
 #include <kos/cdefs.h>
 __BEGIN_DECLS
 
+#include <stddef.h>
 #include <stdint.h>
 #include <kos/regfield.h>
 
@@ -218,6 +219,90 @@ typedef void (*cont_btn_callback_t)(uint8_t addr, uint32_t btns);
 */
 int cont_btn_callback(uint8_t addr, uint32_t btns, cont_btn_callback_t cb);
 
+/* Forward declaration */
+struct maple_device;
+
+/** \brief   Timestamped controller state.
+    \ingroup controller_inputs
+
+    Every controller keeps a ring of the states it reported, along with the
+    time at which they were sampled, which can be retrieved with
+    cont_input_read(). This makes it possible to know exactly when a button
+    was pressed, even if the controller is polled several times per frame.
+
+    \sa cont_input_read, cont_set_poll_rate
+*/
+typedef struct cont_input {
+    uint64_t     time;      /**< \brief Time of the sample, in microseconds
+                                         since startup. */
+    uint32_t     dropped;   /**< \brief Number of samples dropped right before
+                                         this one, because the ring was full. */
+    cont_state_t state;     /**< \brief State of the controller. */
+} cont_input_t;
+
+/** \brief   Size of the per-controller state ring.
+    \ingroup controller_inputs
+
+    This must be a power of two.
+*/
+#ifndef CONT_INPUT_RING_SIZE
+#define CONT_INPUT_RING_SIZE    64
+#endif
+
+/** \brief   Maximum controller polling rate, in Hz.
+    \ingroup controller_inputs
+*/
+#define CONT_POLL_RATE_MAX      1000
+
+/** \brief   Retrieve the timestamped states of a controller.
+    \ingroup controller_inputs
+
+    This function drains the oldest states from the controller's ring, in the
+    order they were sampled. The ring is filled every time the controller is
+    polled, so it should be drained regularly (i.e, once per frame); once it
+    is full, new samples are dropped until room is made.
+
+    There must only be one thread reading from a given controller.
+
+    \param  dev             The controller to read from.
+    \param  buf             Where to store the states.
+    \param  count           The maximum number of states to retrieve.
+
+    \return                 The number of states stored in buf, or -1 if the
+                            device is not a valid controller.
+
+    \sa cont_set_poll_rate
+*/
+int cont_input_read(struct maple_device *dev, cont_input_t *buf, size_t count);
+
+/** \brief   Set the controller polling rate.
+    \ingroup controller_inputs
+
+    By default, controllers are polled once per frame, from the vertical
+    blank interrupt. This function sets up the SH4's TMU1 timer channel to
+    poll them (and send the maple commands right away) at a higher rate, for
+    lower input latency and finer timing of the states in the ring.
+
+    \warning
+    TMU1 must not be used for anything else while this is enabled.
+
+    \param  hz              The polling rate, in Hz, up to
+                            CONT_POLL_RATE_MAX. Pass 0 to go back to
+                            polling once per frame.
+
+    \retval 0               On success.
+    \retval -1              If the rate is out of range.
+*/
+int cont_set_poll_rate(unsigned int hz);
+
+/** \brief   Get the controller polling rate.
+    \ingroup controller_inputs
+
+    \return                 The polling rate set with cont_set_poll_rate(), or
+                            0 if controllers are polled once per frame.
+*/
+unsigned int cont_get_poll_rate(void);
+
 /** \defgroup controller_query_caps Querying Capabilities
     \brief    API used to query for a controller's capabilities
     \ingroup  controller
@@ -316,9 +401,6 @@ int cont_btn_callback(uint8_t addr, uint32_t btns, cont_btn_callback_t cb);
 #define CONT_CAPABILITIES_DUAL_ANALOG         (CONT_CAPABILITIES_ANALOG | \
                                                CONT_CAPABILITIES_SECONDARY_ANALOG)
 
-/* Forward declaration */
-struct maple_device;
-
 /** \brief   Check for controller capabilities
     \ingroup controller_query_caps
 
@@ -372,6 +372,51 @@ int vmu_block_read(maple_device_t *dev, uint16_t blocknum, uint8_t *buffer);
 */
 int vmu_block_write(maple_device_t *dev, uint16_t blocknum, const uint8_t *buffer);
 
+/** \brief   Read several blocks from a memory card.
+    \ingroup maple_memcard
+
+    This function reads a list of blocks, keeping several requests in flight
+    at once so that they go out on the bus in the same DMA round. This is
+    much faster than calling vmu_block_read() for each block, which takes a
+    whole frame per block.
+
+    \param  dev             The device to read from.
+    \param  blocks          The block numbers to read.
+    \param  count           The number of blocks to read.
+    \param  buffer          The buffer to read into (512 bytes per block, in
+                            the same order as blocks).
+
+    \retval MAPLE_EOK       On success.
+    \retval MAPLE_ETIMEOUT  If the command timed out while blocking.
+    \retval MAPLE_EFAIL     On errors other than timeout.
+
+    \sa vmu_block_write_multi
+*/
+int vmu_block_read_multi(maple_device_t *dev, const uint16_t *blocks,
+                         size_t count, uint8_t *buffer);
+
+/** \brief   Write several blocks to a memory card.
+    \ingroup maple_memcard
+
+    This function writes a list of blocks, sending all of the phases of a
+    block (along with the sync of the previous one) in the same DMA round.
+    Blocks that fail are written again with vmu_block_write().
+
+    \param  dev             The device to write to.
+    \param  blocks          The block numbers to write.
+    \param  count           The number of blocks to write.
+    \param  buffer          The buffer to write from (512 bytes per block, in
+                            the same order as blocks).
+
+    \retval MAPLE_EOK       On success.
+    \retval MAPLE_ETIMEOUT  If the command timed out while blocking.
+    \retval MAPLE_EFAIL     On errors other than timeout.
+
+    \sa vmu_block_read_multi
+*/
+int vmu_block_write_multi(maple_device_t *dev, const uint16_t *blocks,
+                          size_t count, const uint8_t *buffer);
+
 /** \defgroup maple_clock Clock Function
     \brief    API for features of the Clock Maple Function
     \ingroup  vmu
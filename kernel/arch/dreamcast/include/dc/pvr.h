@@ -863,6 +863,110 @@ void *pvr_vertbuf_tail(pvr_list_t list);
 */
 void pvr_vertbuf_written(pvr_list_t list, size_t amt);
 
+/** \brief   Private command buffer for recording part of a list.
+    \ingroup pvr_vertex_dma
+
+    Command buffers let several threads record primitives for the same list and
+    the same frame at once, without any locking, each into its own buffer. Once
+    a thread is done, it submits its buffer with pvr_cmdbuf_submit(), and the
+    buffer is sent to the TA right after the list's own vertex buffer, with no
+    copying involved.
+
+    Each command buffer is sent as-is, so it should start with a polygon header
+    of its own: it can't rely on whatever was sent before it.
+
+    \headerfile dc/pvr.h
+*/
+typedef struct pvr_cmdbuf {
+    uint8_t *base;              /**< \brief Start of the buffer */
+    size_t size;                /**< \brief Size of the buffer, in bytes */
+    size_t ptr;                 /**< \brief How much has been recorded */
+    struct pvr_cmdbuf *next;    /**< \brief Next buffer in the list (internal) */
+} pvr_cmdbuf_t;
+
+/** \brief   Set up a command buffer.
+    \ingroup pvr_vertex_dma
+
+    \param  cb              The command buffer to set up.
+    \param  buffer          Where to record data to, in main RAM. This must be
+                            aligned to a 32-byte boundary.
+    \param  len             The length of the buffer. This must be a multiple of
+                            32.
+*/
+void pvr_cmdbuf_init(pvr_cmdbuf_t *cb, void *buffer, size_t len);
+
+/** \brief   Empty out a command buffer, to start recording into it again.
+    \ingroup pvr_vertex_dma
+
+    \warning
+    A command buffer that has been submitted must not be touched until the
+    frame it was submitted for has been sent to the TA. As with the buffers
+    given to pvr_set_vertbuf(), the simplest way to go about that is to have
+    two of them, and to alternate between them every frame.
+
+    \param  cb              The command buffer to reset.
+*/
+void pvr_cmdbuf_reset(pvr_cmdbuf_t *cb);
+
+/** \brief   Record a primitive into a command buffer.
+    \ingroup pvr_vertex_dma
+
+    This is the command buffer version of pvr_list_prim(). It may be called from
+    any thread, as long as no other thread uses the same command buffer.
+
+    \param  cb              The command buffer to record into.
+    \param  data            The primitive to record.
+    \param  size            The size of the primitive in bytes. This must be a
+                            multiple of 32.
+
+    \retval 0               On success.
+    \retval -1              On error.
+*/
+int pvr_cmdbuf_prim(pvr_cmdbuf_t *cb, const void *data, size_t size);
+
+/** \brief   Retrieve a pointer to the current output location in a command
+             buffer.
+    \ingroup pvr_vertex_dma
+
+    This is the command buffer version of pvr_vertbuf_tail(). Make sure to call
+    pvr_cmdbuf_written() after writing data here directly.
+
+    \param  cb              The command buffer to get the tail of.
+
+    \return                 The tail of the command buffer.
+*/
+void *pvr_cmdbuf_tail(pvr_cmdbuf_t *cb);
+
+/** \brief   Notify the PVR system that data have been written into a command
+             buffer.
+    \ingroup pvr_vertex_dma
+
+    \param  cb              The command buffer that was modified.
+    \param  amt             Number of bytes written. Must be a multiple of 32.
+*/
+void pvr_cmdbuf_written(pvr_cmdbuf_t *cb, size_t amt);
+
+/** \brief   Add a command buffer to a list of the current frame.
+    \ingroup pvr_vertex_dma
+
+    The command buffer will be sent to the TA after the list's vertex buffer,
+    and after any command buffers that were submitted to the same list before
+    it. This may be called from any thread, but it must be done between
+    pvr_scene_begin() and pvr_scene_finish(), so make sure all of the threads
+    recording for a frame are done before finishing it.
+
+    Vertex DMA must be enabled, and the list must have a vertex buffer, as
+    that's where its end-of-list marker goes.
+
+    \param  list            The primitive list to add the command buffer to.
+    \param  cb              The command buffer to add. Submitting an empty
+                            command buffer does nothing.
+
+    \retval 0               On success.
+    \retval -1              On error.
+*/
+int pvr_cmdbuf_submit(pvr_list_t list, pvr_cmdbuf_t *cb);
+
 /** \brief   Begin collecting data for a frame of 3D output to the off-screen
              frame buffer.
     \ingroup pvr_scene_mgmt
@@ -1283,6 +1387,8 @@ pvr_ptr_t pvr_get_back_buffer(void);
 #include "pvr/pvr_pal.h"
 #include "pvr/pvr_txr.h"
 #include "pvr/pvr_legacy.h"
+#include "pvr/pvr_batch.h"
+#include "pvr/pvr_txr_cache.h"
 
 __END_DECLS
 
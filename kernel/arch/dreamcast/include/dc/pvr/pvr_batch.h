@@ -0,0 +1,176 @@
+/* KallistiOS ##version##
+
+   dc/pvr/pvr_batch.h
+*/
+
+/** \file       dc/pvr/pvr_batch.h
+    \brief      Polygon header batching for the PowerVR
+    \ingroup    pvr_batch
+*/
+
+#ifndef __DC_PVR_PVR_BATCH_H
+#define __DC_PVR_PVR_BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <kos/cdefs.h>
+__BEGIN_DECLS
+
+/** \defgroup pvr_batch     Batching
+    \brief                  Merging and sorting of primitives by render state
+    \ingroup                pvr_list_mgmt
+
+    A batch collects the headers and vertices for one list, instead of sending
+    them on right away, so that they can be submitted in a better order once
+    the whole list is known:
+        - A header that is identical to the one before it is dropped.
+        - If sorting is turned on with pvr_batch_set_sort(), everything on the
+          opaque and punch-through polygon lists that uses the same header
+          (same texture, same blending, and so on) is grouped together, so
+          each header only gets sent once.
+
+    Sorting is off by default, as the order things are drawn in still matters
+    on those lists when primitives overlap at the same depth: with the usual
+    depth compare modes, whichever comes first (or last) wins. Only turn it on
+    if that never happens, or if it doesn't matter which one ends up on top.
+    Even then, a batch is never reordered if any of its headers use the
+    ALWAYS, EQUAL, NOTEQUAL, LEQUAL or GEQUAL depth compare modes, or have
+    depth writes disabled, as the result then depends on the order in any
+    case.
+
+    On the translucent polygon list, the order is kept as it is, and only the
+    duplicate headers are dropped. On the modifier volume lists, everything is
+    kept as it is.
+
+    Each header starts a run of vertices that goes along with it. Runs get moved
+    around as a whole, so they must only contain complete strips (i.e, the last
+    vertex of a run must have the end-of-strip flag set). Only polygon and
+    sprite headers are supported for sorting: a batch with any other kind of
+    header in it (such as a user clip header) is never reordered.
+
+    @{
+*/
+
+/** \brief   One header and the vertices that go along with it.
+    \note    This is internal to the batching code.
+*/
+typedef struct pvr_batch_rec {
+    pvr_poly_hdr_t hdr;         /**< \brief The header */
+    uint32_t vtx_off;           /**< \brief Offset of the vertices */
+    uint32_t vtx_len;           /**< \brief Size of the vertices, in bytes */
+    uint32_t seq;               /**< \brief Submission order */
+} pvr_batch_rec_t;
+
+/** \brief   Primitive batch.
+
+    Set one of these up with pvr_batch_init() for each list you want to batch,
+    and reuse it every frame.
+
+    \headerfile dc/pvr/pvr_batch.h
+*/
+typedef struct pvr_batch {
+    pvr_list_t list;            /**< \brief List this batch goes into */
+    int sort;                   /**< \brief Non-zero if sorting is wanted */
+    int sortable;               /**< \brief Non-zero if it may be reordered */
+
+    pvr_batch_rec_t *recs;      /**< \brief Header records */
+    pvr_batch_rec_t **order;    /**< \brief Records in the order to send them */
+    size_t rec_count;           /**< \brief Number of records in use */
+    size_t rec_max;             /**< \brief Number of records available */
+
+    uint8_t *vtx;               /**< \brief Vertex data */
+    size_t vtx_ptr;             /**< \brief Amount of vertex data in use */
+    size_t vtx_size;            /**< \brief Size of the vertex buffer */
+
+    size_t hdrs_in;             /**< \brief Headers submitted since begin */
+    size_t hdrs_out;            /**< \brief Headers sent by the last finish */
+} pvr_batch_t;
+
+/** \brief   Set up a primitive batch.
+
+    \param  batch           The batch to set up.
+    \param  list            The list the batch will be submitted to.
+    \param  max_hdrs        How many headers it should be able to hold.
+    \param  vtx_size        How many bytes of vertex data it should be able
+                            to hold.
+
+    \retval 0               On success.
+    \retval -1              If memory could not be allocated.
+*/
+int pvr_batch_init(pvr_batch_t *batch, pvr_list_t list, size_t max_hdrs,
+                   size_t vtx_size);
+
+/** \brief   Free the memory used by a primitive batch.
+
+    \param  batch           The batch to clean up.
+*/
+void pvr_batch_shutdown(pvr_batch_t *batch);
+
+/** \brief   Turn sorting of a batch on or off.
+
+    Sorting is off when a batch is set up. Only turn it on if none of the
+    primitives in the batch overlap at the same depth, as the order they're
+    drawn in would decide which one ends up on top. This has no effect on
+    batches for the translucent polygon and modifier volume lists.
+
+    \param  batch           The batch to change.
+    \param  sort            Non-zero to sort the batch when it's submitted.
+*/
+void pvr_batch_set_sort(pvr_batch_t *batch, int sort);
+
+/** \brief   Empty out a batch, to start collecting a new frame's worth.
+
+    \param  batch           The batch to reset.
+*/
+void pvr_batch_begin(pvr_batch_t *batch);
+
+/** \brief   Add a header to a batch.
+
+    Vertices added after this (up until the next header) are drawn with this
+    header. If the header is identical to the previous one, it is dropped, and
+    the vertices are simply added to the previous run.
+
+    \param  batch           The batch to add to.
+    \param  hdr             The header to add (polygon, sprite or modifier
+                            volume header, as compiled by the usual
+                            functions).
+
+    \retval 0               On success.
+    \retval -1              If the batch is full (errno is set to ENOSPC).
+*/
+int pvr_batch_hdr(pvr_batch_t *batch, const pvr_poly_hdr_t *hdr);
+
+/** \brief   Add vertex data to a batch.
+
+    \param  batch           The batch to add to.
+    \param  data            The vertices to add. A header must have been added
+                            before this.
+    \param  size            The size of the data in bytes. This must be a
+                            multiple of 32.
+
+    \retval 0               On success.
+    \retval -1              If the batch is full (errno is set to ENOSPC).
+*/
+int pvr_batch_prim(pvr_batch_t *batch, const void *data, size_t size);
+
+/** \brief   Submit everything in a batch.
+
+    This sorts the batch (if sorting is on and its list and headers allow for
+    it), and sends it on. In DMA
+    mode, it goes into the list's vertex buffer, as with pvr_list_prim().
+    Otherwise, the batch's list must currently be open, and it is sent with
+    pvr_prim().
+
+    \param  batch           The batch to submit.
+
+    \retval 0               On success.
+    \retval -1              On error.
+*/
+int pvr_batch_finish(pvr_batch_t *batch);
+
+/** @} */
+
+__END_DECLS
+
+#endif /* __DC_PVR_PVR_BATCH_H */
@@ -29,6 +29,7 @@
 #ifndef __DC_PVR_PVR_DMA_H
 #define __DC_PVR_PVR_DMA_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -176,6 +177,65 @@ int pvr_dma_yuv_conv(const void *src, size_t count, bool block,
 */
 bool pvr_dma_ready(void);
 
+/** \brief   Fence for queued uploads.
+    \ingroup pvr_dma
+
+    Each upload queued with pvr_txr_queue_dma() gets one of these, which can
+    be used to find out when it (and everything queued before it) is done.
+*/
+typedef uint32_t pvr_dma_fence_t;
+
+/** \brief   Queue up a texture upload using TA DMA.
+    \ingroup pvr_dma
+
+    Unlike pvr_txr_load_dma(), this doesn't have to wait for the DMA channel
+    to be free. The upload is added to a queue, which is run from the DMA
+    completion interrupt, with each transfer starting as soon as the last one
+    is done. Uploads that pick up exactly where the one before left off (in
+    both main RAM and texture memory) get merged into one.
+
+    The queue shares the DMA channel with vertex DMA, and big uploads are sent
+    a piece at a time, so that a frame's lists never have to wait long for
+    their turn.
+
+    The source data must stay around, unchanged, until the upload is done.
+
+    \param  src             Where to copy from. Must be 32-byte aligned.
+    \param  dest            Where to copy to. Must be 32-byte aligned.
+    \param  count           The number of bytes to copy. Must be a multiple of
+                            32.
+    \param  fence           Set to the fence for this upload. May be NULL.
+    \retval 0               On success.
+    \retval -1              On failure. Sets errno as appropriate.
+
+    \par    Error Conditions:
+    \em     EFAULT - src or dest is not 32-byte aligned \n
+    \em     EINVAL - count is not a multiple of 32 \n
+    \em     EAGAIN - the queue is full, and this was called from an
+                     interrupt (otherwise, this waits for room)
+*/
+int pvr_txr_queue_dma(const void *src, pvr_ptr_t dest, size_t count,
+                      pvr_dma_fence_t *fence);
+
+/** \brief   Check whether queued uploads are done.
+    \ingroup pvr_dma
+
+    \param  fence           The fence to check.
+    \return                 True if the upload the fence came from, and
+                            everything queued before it, is done.
+*/
+bool pvr_dma_fence_done(pvr_dma_fence_t fence);
+
+/** \brief   Wait for queued uploads to be done.
+    \ingroup pvr_dma
+
+    This blocks until pvr_dma_fence_done() would return true. It may not be
+    called from an interrupt.
+
+    \param  fence           The fence to wait for.
+*/
+void pvr_dma_fence_wait(pvr_dma_fence_t fence);
+
 /** \brief   Initialize TA/PVR DMA. 
     \ingroup pvr_dma
  */
@@ -100,11 +100,122 @@ void pvr_mem_print_list(void);
 /** \brief   Print statistics about the PVR RAM pool.
     \ingroup pvr_mem_mgmt
 
-    This prints out statistics like what malloc_stats() provides. Also, if
-    KM_DBG is enabled in pvr_mem.c, it prints the list of allocated blocks.
+    This prints out statistics like what malloc_stats() provides, along with
+    how much of the free space is in one piece, for both the pool and the
+    handle arena (if set up). Also, if KM_DBG is enabled in pvr_mem.c, it
+    prints the list of allocated blocks.
 */
 void pvr_mem_stats(void);
 
+/** \defgroup pvr_mem_handles  Handles
+    \brief                     Relocatable VRAM allocations
+    \ingroup                   pvr_vram
+
+    Blocks allocated with pvr_mem_malloc() stay where they are until they're
+    freed, so over time (and especially after loading and unloading a few
+    levels' worth of textures), the free space in VRAM can end up in pieces that
+    are each too small to be of any use.
+
+    As an alternative, an arena can be set aside in the PVR RAM pool, where
+    blocks are referred to by handle, and so can be moved around to keep the
+    free space in one piece. Blocks in the arena are always a power of two in
+    size (the smallest being 256 bytes), which fits textures well.
+
+    Call pvr_mem_compact() every once in a while, such as on frames where there
+    is time to spare, to have blocks moved around. The addresses of the blocks
+    that have moved will need to be updated in any polygon headers that used
+    them, so a callback can be given to be notified of each move.
+
+    @{
+*/
+
+/** \brief   Handle to a block in the handle arena.
+
+    Negative values are invalid.
+*/
+typedef int pvr_mem_handle_t;
+
+/** \brief   Block moved callback.
+
+    \param  h               The handle of the block that was moved.
+    \param  old_ptr         Where the block used to be.
+    \param  new_ptr         Where the block is now.
+    \param  data            The user data given to pvr_mem_handles_init().
+*/
+typedef void (*pvr_mem_moved_cb_t)(pvr_mem_handle_t h, pvr_ptr_t old_ptr,
+                                   pvr_ptr_t new_ptr, void *data);
+
+/** \brief   Set up the handle arena.
+
+    This allocates the arena from the PVR RAM pool, so it will be freed along
+    with everything else by pvr_mem_reset().
+
+    \param  size            The size of the arena. This is rounded down to a
+                            power of two.
+    \param  max_handles     How many blocks may be allocated at once (less than
+                            65535).
+    \param  moved           Function to call whenever a block is moved, or
+                            NULL.
+    \param  data            User data to pass to the callback.
+
+    \retval 0               On success.
+    \retval -1              On error (errno is set to EINVAL or ENOMEM).
+*/
+int pvr_mem_handles_init(size_t size, size_t max_handles,
+                         pvr_mem_moved_cb_t moved, void *data);
+
+/** \brief   Free the handle arena, and everything allocated in it. */
+void pvr_mem_handles_shutdown(void);
+
+/** \brief   Allocate a block from the handle arena.
+
+    \param  size            The amount of memory to allocate. This is rounded
+                            up to a power of two.
+
+    \return                 A handle to the block, or -1 if there is no room
+                            (errno is set to ENOMEM).
+*/
+pvr_mem_handle_t pvr_mem_halloc(size_t size);
+
+/** \brief   Free a block in the handle arena.
+
+    \param  h               The handle to free. Passing -1 does nothing.
+*/
+void pvr_mem_hfree(pvr_mem_handle_t h);
+
+/** \brief   Get the current address of a block in the handle arena.
+
+    \warning
+    The address is only good until the next call to pvr_mem_compact().
+
+    \param  h               The handle to look up.
+
+    \return                 The address of the block.
+*/
+pvr_ptr_t pvr_mem_hptr(pvr_mem_handle_t h);
+
+/** \brief   Defragment the handle arena.
+
+    This moves blocks that keep free blocks from being merged together. The
+    moves are done by the CPU, through the store queues.
+
+    \warning
+    A block that is moved is freed up right away, so this must only be called
+    at a point where no scene that is still to be rendered uses any of the
+    blocks in the arena, such as right after pvr_wait_render_done() and before
+    the next scene is begun.
+
+    \param  max_bytes       Stop once about this many bytes have been moved.
+                            This is checked after each move, so it may be
+                            exceeded by up to one block.
+
+    \return                 The number of bytes moved. Zero means there was
+                            nothing left to do.
+*/
+size_t pvr_mem_compact(size_t max_bytes);
+
+/** @} */
+
 __END_DECLS
 
 #endif /* __DC_PVR_PVR_MEM_H */
@@ -0,0 +1,163 @@
+/* KallistiOS ##version##
+
+   dc/pvr/pvr_txr_cache.h
+*/
+
+/** \file       dc/pvr/pvr_txr_cache.h
+    \brief      Streaming texture cache for the PowerVR
+    \ingroup    pvr_txr_cache
+*/
+
+#ifndef __DC_PVR_PVR_TXR_CACHE_H
+#define __DC_PVR_PVR_TXR_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <kos/cdefs.h>
+__BEGIN_DECLS
+
+/** \defgroup pvr_txr_cache Texture Cache
+    \brief                  Streaming of textures in and out of texture memory
+    \ingroup                pvr_txr_mgmt
+
+    The texture cache keeps track of a set of textures by ID, and loads them
+    into texture memory as they get used, so that there can be a lot more
+    texture data around than will fit in texture memory at once.
+
+    Every frame, ask for each texture you're about to draw, with
+    pvr_txr_cache_get(). If the texture is in texture memory, you get its
+    address. If not, you get a placeholder for now, and the texture is queued
+    to be read in from the given file by a worker thread, then uploaded with
+    DMA. Files can be on any filesystem (romdisk, CD, SD card and so on), and
+    have to contain the texture data exactly as it should go into texture
+    memory (twiddled, VQ compressed, or whatever the polygon header says).
+
+    To keep loads from causing hitches, only so many bytes are uploaded per
+    frame, and the rest waits for the next one. When texture memory runs out,
+    the textures that have gone the longest without being used are thrown
+    out, as long as they haven't been used in the last few frames (the PVR may
+    still be rendering from them).
+
+    Frames are counted by pvr_scene_begin(), so nothing needs to be done for
+    that.
+
+    @{
+*/
+
+/** \brief   Texture cache parameters.
+
+    Pass one of these to pvr_txr_cache_init(). Fields left as 0 get a sensible
+    default.
+
+    \headerfile dc/pvr/pvr_txr_cache.h
+*/
+typedef struct pvr_txr_cache_params {
+    /** \brief   Most textures to keep track of at once.
+
+        This includes textures that are queued or failed to load, not just the
+        ones in texture memory. Textures that failed to load are forgotten
+        about (and so get tried again if asked for) when their entries are
+        needed for new textures and none of the textures in texture memory
+        can be thrown out yet.
+    */
+    size_t max_textures;
+
+    /** \brief   Most bytes of texture memory to use (0 for no limit). */
+    size_t vram_budget;
+
+    /** \brief   Most bytes to upload per frame (0 for no limit).
+
+        A texture that's bigger than this by itself still gets uploaded, on a
+        frame of its own.
+    */
+    size_t frame_budget;
+
+    /** \brief   How many frames to keep a texture after its last use.
+
+        This can't be less than 3 (4 in vertex DMA mode), as that's how long
+        the PVR may keep reading from it.
+    */
+    unsigned int keep_frames;
+
+    /** \brief   Texture to hand out while the real one is loading.
+
+        This may be NULL, in which case pvr_txr_cache_get() returns NULL for
+        textures that aren't in texture memory yet.
+    */
+    pvr_ptr_t placeholder;
+} pvr_txr_cache_params_t;
+
+/** \brief   Texture cache statistics.
+
+    All of the counters are totals since pvr_txr_cache_init().
+
+    \headerfile dc/pvr/pvr_txr_cache.h
+*/
+typedef struct pvr_txr_cache_stats {
+    uint32_t hits;              /**< \brief Lookups that found the texture */
+    uint32_t misses;            /**< \brief Lookups that got the placeholder */
+    uint32_t loads;             /**< \brief Files read in */
+    uint32_t uploads;           /**< \brief Textures uploaded */
+    uint32_t upload_bytes;      /**< \brief Bytes uploaded */
+    uint32_t evictions;         /**< \brief Textures thrown out */
+    uint32_t failures;          /**< \brief Textures that couldn't be loaded */
+    uint32_t resident;          /**< \brief Textures in texture memory now */
+    uint32_t queued;            /**< \brief Textures waiting to be loaded now */
+    size_t vram_used;           /**< \brief Bytes of texture memory in use now */
+} pvr_txr_cache_stats_t;
+
+/** \brief   Set up the texture cache.
+
+    The PVR must be initialized first.
+
+    \param  params          The parameters to use.
+
+    \retval 0               On success.
+    \retval -1              On error (errno is set to ENOMEM or EBUSY).
+*/
+int pvr_txr_cache_init(const pvr_txr_cache_params_t *params);
+
+/** \brief   Shut down the texture cache.
+
+    This waits for the worker thread to finish whatever it's doing, and frees
+    all of the textures in the cache. pvr_shutdown() calls this, if need be.
+*/
+void pvr_txr_cache_shutdown(void);
+
+/** \brief   Look up a texture in the cache.
+
+    If the texture isn't in texture memory, it gets queued to be loaded, and
+    the placeholder texture is returned for now. The address of a texture may
+    change after it has been thrown out and loaded back in again, so call this
+    every frame for each texture you use, rather than holding on to the
+    address (or a polygon header with it in it).
+
+    This may free up texture memory, so call it from the same thread that
+    does your other pvr_mem_* calls.
+
+    \param  id              The ID of the texture. This is up to you, and only
+                            has to be unique.
+    \param  path            The file to load the texture from, if need be.
+    \param  resident        Set to whether the texture is in texture memory.
+                            May be NULL.
+
+    \return                 The address of the texture, or the placeholder.
+*/
+pvr_ptr_t pvr_txr_cache_get(uint32_t id, const char *path, bool *resident);
+
+/** \brief   Get the texture cache statistics.
+
+    \param  stats           Where to put the statistics.
+
+    \retval 0               On success.
+    \retval -1              If the texture cache isn't set up.
+*/
+int pvr_txr_cache_get_stats(pvr_txr_cache_stats_t *stats);
+
+/** @} */
+
+__END_DECLS
+
+#endif /* __DC_PVR_PVR_TXR_CACHE_H */
@@ -298,6 +298,23 @@ int vmufs_mutex_lock(void);
 */
 int vmufs_mutex_unlock(void);
 
+/** \brief  Drop the cached metadata of a VMU.
+
+    The higher level functions below keep a copy of the root block, FAT and
+    directory of each memory card, so that they don't need to be read from the
+    card on every call. That copy is dropped automatically when the card is
+    unplugged (by the VMU driver, so maple detach callbacks set with
+    maple_detach_callback() are free for your own use) and when
+    vmufs_root_write(), vmufs_dir_write() or vmufs_fat_write() are used. If
+    you modify the card in any other way (i.e, with vmu_block_write()), call
+    this function so that the changes are picked up.
+
+    This function may be called from an interrupt.
+
+    \param  dev             The VMU whose metadata should be dropped.
+*/
+void vmufs_invalidate(maple_device_t * dev);
+
 
 /* ****************** Higher level functions ******************** */
 
@@ -198,6 +198,9 @@ int  __weak_symbol arch_auto_init(void) {
 
     thd_init();
 
+    if(__kos_init_flags & INIT_THD_TICKLESS)
+        thd_set_mode(THD_MODE_TICKLESS);
+
     nmmgr_init();
 
     KOS_INIT_FLAG_CALL(fs_init);          /* VFS */
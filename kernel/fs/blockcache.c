@@ -0,0 +1,400 @@
+/* KallistiOS ##version##
+
+   blockcache.c
+*/
+
+/* This is a block cache shared by the filesystems. It replaces the per-
+   filesystem LRU arrays that used to be scanned linearly (and shuffled
+   around) on every access. Blocks are found through a hash table, the LRU
+   order is kept in a doubly linked list, and dirty blocks are kept on their
+   own list so that a write-back doesn't need to look at clean ones. All of
+   the common operations are thus constant time, no matter how big the cache
+   is. */
+
+#include <kos/blockcache.h>
+#include <kos/blockdev.h>
+
+#include <sys/queue.h>
+
+#include <errno.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCKCACHE_FLAG_VALID   1
+#define BLOCKCACHE_FLAG_DIRTY   2
+
+typedef struct blockcache_ent {
+    TAILQ_ENTRY(blockcache_ent) lru;
+    LIST_ENTRY(blockcache_ent) hash;
+    LIST_ENTRY(blockcache_ent) dirty;
+    uint64_t block;
+    uint32_t flags;
+    uint8_t *data;
+} blockcache_ent_t;
+
+LIST_HEAD(blockcache_list, blockcache_ent);
+
+struct kos_blockcache {
+    /* Entries, least recently used first. Invalid entries are always kept at
+       the head of the list. */
+    TAILQ_HEAD(blockcache_lru, blockcache_ent) lru;
+    struct blockcache_list dirty;
+
+    struct blockcache_list *hash;
+    uint32_t hash_mask;
+
+    blockcache_ent_t *ents;
+    uint8_t *data;
+    size_t count;
+    uint32_t block_size;
+
+    /* Either a block device (with the shift from cache blocks to device
+       blocks), or a pair of callbacks. */
+    kos_blockdev_t *dev;
+    uint32_t dev_shift;
+
+    blockcache_read_t rd;
+    blockcache_write_t wr;
+    void *cb_data;
+
+    blockcache_stats_t stats;
+};
+
+static inline struct blockcache_list *bucket(const kos_blockcache_t *c,
+                                             uint64_t block) {
+    uint32_t h = (uint32_t)(block ^ (block >> 32)) * 0x9E3779B1;
+
+    return &c->hash[(h ^ (h >> 16)) & c->hash_mask];
+}
+
+static blockcache_ent_t *find(const kos_blockcache_t *c, uint64_t block) {
+    blockcache_ent_t *ent;
+
+    LIST_FOREACH(ent, bucket(c, block), hash) {
+        if(ent->block == block)
+            return ent;
+    }
+
+    return NULL;
+}
+
+static inline void make_mru(kos_blockcache_t *c, blockcache_ent_t *ent) {
+    TAILQ_REMOVE(&c->lru, ent, lru);
+    TAILQ_INSERT_TAIL(&c->lru, ent, lru);
+}
+
+static inline void make_dirty(kos_blockcache_t *c, blockcache_ent_t *ent) {
+    if(!(ent->flags & BLOCKCACHE_FLAG_DIRTY)) {
+        ent->flags |= BLOCKCACHE_FLAG_DIRTY;
+        LIST_INSERT_HEAD(&c->dirty, ent, dirty);
+    }
+}
+
+static int read_ent(kos_blockcache_t *c, blockcache_ent_t *ent) {
+    if(!c->dev)
+        return c->rd(c->cb_data, ent->block, ent->data);
+
+    if(c->dev->read_blocks(c->dev, ent->block << c->dev_shift,
+                           1 << c->dev_shift, ent->data))
+        return -EIO;
+
+    return 0;
+}
+
+static int write_ent(kos_blockcache_t *c, blockcache_ent_t *ent) {
+    int rv = 0;
+
+    if(c->dev) {
+        if(c->dev->write_blocks(c->dev, ent->block << c->dev_shift,
+                                1 << c->dev_shift, ent->data))
+            rv = -EIO;
+    }
+    else if(c->wr) {
+        rv = c->wr(c->cb_data, ent->block, ent->data);
+    }
+    else {
+        rv = -EROFS;
+    }
+
+    if(rv)
+        return rv;
+
+    ent->flags &= ~BLOCKCACHE_FLAG_DIRTY;
+    LIST_REMOVE(ent, dirty);
+    ++c->stats.writebacks;
+
+    return 0;
+}
+
+/* Drop an entry from the cache, and move it to the LRU end of the list. */
+static void drop_ent(kos_blockcache_t *c, blockcache_ent_t *ent) {
+    if(!(ent->flags & BLOCKCACHE_FLAG_VALID))
+        return;
+
+    if(ent->flags & BLOCKCACHE_FLAG_DIRTY)
+        LIST_REMOVE(ent, dirty);
+
+    LIST_REMOVE(ent, hash);
+    ent->flags = 0;
+
+    TAILQ_REMOVE(&c->lru, ent, lru);
+    TAILQ_INSERT_HEAD(&c->lru, ent, lru);
+}
+
+/* Grab the least recently used entry and assign it to the given block, writing
+   its old contents back first if needed. */
+static blockcache_ent_t *evict(kos_blockcache_t *c, uint64_t block,
+                               int *err) {
+    blockcache_ent_t *ent = TAILQ_FIRST(&c->lru);
+    int rv;
+
+    if(ent->flags & BLOCKCACHE_FLAG_DIRTY) {
+        if((rv = write_ent(c, ent))) {
+            *err = rv < 0 ? -rv : EIO;
+            return NULL;
+        }
+    }
+
+    drop_ent(c, ent);
+
+    ent->block = block;
+    ent->flags = BLOCKCACHE_FLAG_VALID;
+    LIST_INSERT_HEAD(bucket(c, block), ent, hash);
+    make_mru(c, ent);
+
+    return ent;
+}
+
+static kos_blockcache_t *blockcache_alloc(uint32_t block_size, size_t count) {
+    kos_blockcache_t *c;
+    size_t i, buckets;
+
+    if(!block_size || !count) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if(!(c = (kos_blockcache_t *)calloc(1, sizeof(kos_blockcache_t)))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    for(buckets = 1; buckets < count; buckets <<= 1)
+        ;
+
+    c->hash = (struct blockcache_list *)malloc(sizeof(*c->hash) * buckets);
+    c->ents = (blockcache_ent_t *)malloc(sizeof(blockcache_ent_t) * count);
+    c->data = (uint8_t *)memalign(32, (size_t)block_size * count);
+
+    if(!c->hash || !c->ents || !c->data) {
+        free(c->hash);
+        free(c->ents);
+        free(c->data);
+        free(c);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    c->hash_mask = buckets - 1;
+    c->count = count;
+    c->block_size = block_size;
+
+    for(i = 0; i < buckets; ++i)
+        LIST_INIT(&c->hash[i]);
+
+    TAILQ_INIT(&c->lru);
+    LIST_INIT(&c->dirty);
+
+    for(i = 0; i < count; ++i) {
+        c->ents[i].flags = 0;
+        c->ents[i].data = c->data + i * block_size;
+        TAILQ_INSERT_TAIL(&c->lru, &c->ents[i], lru);
+    }
+
+    return c;
+}
+
+kos_blockcache_t *blockcache_create_ex(uint32_t block_size, size_t count,
+                                       blockcache_read_t rd,
+                                       blockcache_write_t wr, void *data) {
+    kos_blockcache_t *c;
+
+    if(!rd) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if(!(c = blockcache_alloc(block_size, count)))
+        return NULL;
+
+    c->rd = rd;
+    c->wr = wr;
+    c->cb_data = data;
+
+    return c;
+}
+
+kos_blockcache_t *blockcache_create(kos_blockdev_t *dev, uint32_t block_size,
+                                    size_t count) {
+    kos_blockcache_t *c;
+    uint32_t shift = 0;
+
+    /* The cache block size must be a power of two multiple of the device's
+       block size. */
+    if(block_size & (block_size - 1)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    while((1U << (dev->l_block_size + shift)) < block_size)
+        ++shift;
+
+    if((1U << (dev->l_block_size + shift)) != block_size) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if(!(c = blockcache_alloc(block_size, count)))
+        return NULL;
+
+    c->dev = dev;
+    c->dev_shift = shift;
+
+    return c;
+}
+
+void blockcache_destroy(kos_blockcache_t *c) {
+    if(!c)
+        return;
+
+    free(c->data);
+    free(c->ents);
+    free(c->hash);
+    free(c);
+}
+
+uint8_t *blockcache_read(kos_blockcache_t *c, uint64_t block, int *err) {
+    blockcache_ent_t *ent;
+    int rv;
+
+    if((ent = find(c, block))) {
+        ++c->stats.hits;
+        make_mru(c, ent);
+        return ent->data;
+    }
+
+    ++c->stats.misses;
+
+    if(!(ent = evict(c, block, err)))
+        return NULL;
+
+    if((rv = read_ent(c, ent))) {
+        drop_ent(c, ent);
+        *err = rv < 0 ? -rv : EIO;
+        return NULL;
+    }
+
+    return ent->data;
+}
+
+uint8_t *blockcache_get(kos_blockcache_t *c, uint64_t block, int *err) {
+    blockcache_ent_t *ent;
+
+    if((ent = find(c, block))) {
+        ++c->stats.hits;
+        make_mru(c, ent);
+    }
+    else if(!(ent = evict(c, block, err))) {
+        return NULL;
+    }
+
+    make_dirty(c, ent);
+
+    return ent->data;
+}
+
+uint8_t *blockcache_lookup(kos_blockcache_t *c, uint64_t block) {
+    blockcache_ent_t *ent;
+
+    if(!(ent = find(c, block)))
+        return NULL;
+
+    make_mru(c, ent);
+
+    return ent->data;
+}
+
+int blockcache_insert(kos_blockcache_t *c, uint64_t block, const void *buf) {
+    blockcache_ent_t *ent;
+    int err;
+
+    /* Never replace what's in the cache, it may be newer than the data that
+       was read from the device. */
+    if(find(c, block))
+        return 0;
+
+    if(!(ent = evict(c, block, &err)))
+        return -err;
+
+    memcpy(ent->data, buf, c->block_size);
+
+    return 0;
+}
+
+int blockcache_mark_dirty(kos_blockcache_t *c, uint64_t block) {
+    blockcache_ent_t *ent;
+
+    if(!(ent = find(c, block)))
+        return -EINVAL;
+
+    make_dirty(c, ent);
+    make_mru(c, ent);
+
+    return 0;
+}
+
+int blockcache_writeback(kos_blockcache_t *c) {
+    blockcache_ent_t *ent;
+    int rv;
+
+    while((ent = LIST_FIRST(&c->dirty))) {
+        if((rv = write_ent(c, ent)))
+            return rv;
+    }
+
+    return 0;
+}
+
+int blockcache_writeback_range(kos_blockcache_t *c, uint64_t first,
+                               size_t count) {
+    blockcache_ent_t *ent, *next;
+    int rv;
+
+    for(ent = LIST_FIRST(&c->dirty); ent; ent = next) {
+        next = LIST_NEXT(ent, dirty);
+
+        if(ent->block >= first && ent->block - first < count) {
+            if((rv = write_ent(c, ent)))
+                return rv;
+        }
+    }
+
+    return 0;
+}
+
+void blockcache_invalidate(kos_blockcache_t *c) {
+    size_t i;
+
+    for(i = 0; i < c->count; ++i)
+        drop_ent(c, &c->ents[i]);
+}
+
+size_t blockcache_size(const kos_blockcache_t *c) {
+    return c->count;
+}
+
+void blockcache_get_stats(const kos_blockcache_t *c,
+                          blockcache_stats_t *stats) {
+    *stats = c->stats;
+}
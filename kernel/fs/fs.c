@@ -341,6 +341,9 @@ static fs_hnd_t *fs_map_hnd(file_t fd) {
     return fd_table[fd];
 }
 
+/* In poll.c */
+extern void __poll_fd_closed(int fd);
+
 /* Close a file and clean up the handle */
 int fs_close(file_t fd) {
     int retval;
@@ -348,6 +351,9 @@ int fs_close(file_t fd) {
 
     if(!h) return -1;
 
+    /* Stop watching it in any epoll instances */
+    __poll_fd_closed(fd);
+
     /* Deref it and remove it from our table */
     retval = fs_hnd_unref(h);
 
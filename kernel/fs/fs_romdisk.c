@@ -21,6 +21,7 @@ on sunsite.unc.edu in /pub/Linux/system/recovery/, or as a package under Debian
 #include <kos/fs_romdisk.h>
 #include <kos/opts.h>
 #include <kos/dbglog.h>
+#include <kos/slab.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -108,6 +109,9 @@ typedef struct rd_fd {
 
 static TAILQ_HEAD(rd_fd_queue, rd_fd) rd_fd_queue;
 
+/* Object cache for the file handles */
+static kmem_cache_t *fd_cache;
+
 #define FH_INDEX_FREE 0
 #define FH_INDEX_RESERVED -1
 
@@ -242,7 +246,7 @@ static void * romdisk_open(vfs_handler_t *vfs, const char *fn, int mode) {
     }
 
     /* Allocate the fd */
-    fd = malloc(sizeof(rd_fd_t));
+    fd = kmem_cache_alloc(fd_cache);
     if(!fd) {
         errno = ENOMEM;
         return NULL;
@@ -271,7 +275,7 @@ static int romdisk_close(void *h) {
     /* Lock before modifying the queue. */
     mutex_lock_scoped(&fh_mutex);
     TAILQ_REMOVE(&rd_fd_queue, fd, next);
-    free(fd);
+    kmem_cache_free(fd_cache, fd);
 
     return 0;
 }
@@ -657,6 +661,12 @@ void fs_romdisk_init(void) {
 
     /* Init the list of file descriptors */
     TAILQ_INIT(&rd_fd_queue);
+    fd_cache = kmem_cache_create("rd_fd", sizeof(rd_fd_t), 0, 0);
+
+    if(!fd_cache) {
+        dbglog(DBG_ERROR, "fs_romdisk: can't create the file handle cache\n");
+        return;
+    }
 
     /* Init thread mutexes */
     mutex_init(&fh_mutex, MUTEX_TYPE_NORMAL);
@@ -688,6 +698,9 @@ void fs_romdisk_shutdown(void) {
         romdisk_close(i);
     }
 
+    kmem_cache_destroy(fd_cache);
+    fd_cache = NULL;
+
     /* Free mutex */
     mutex_destroy(&fh_mutex);
 }
@@ -9,10 +9,12 @@
 #include <kos/fs.h>
 #include <kos/fs_socket.h>
 #include <kos/net.h>
+#include <kos/timer.h>
 
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <sys/queue.h>
 #include <sys/socket.h>
@@ -505,6 +507,246 @@ ssize_t sendto(int sock, const void *message, size_t length, int flags,
                                  dest_len);
 }
 
+static ssize_t sock_sendmsg(net_socket_t *hnd, const struct msghdr *message,
+                            int flags) {
+    size_t len = 0, pos = 0;
+    uint8_t *buf;
+    ssize_t rv;
+    int i;
+
+    if(message == NULL || (message->msg_iovlen && !message->msg_iov)) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if(message->msg_iovlen < 0 || message->msg_iovlen > IOV_MAX) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if(hnd->protocol->sendmsg)
+        return hnd->protocol->sendmsg(hnd, message, flags);
+
+    /* The protocol doesn't know how to deal with more than one buffer, so
+       gather everything up into one. */
+    for(i = 0; i < message->msg_iovlen; ++i)
+        len += message->msg_iov[i].iov_len;
+
+    if(!(buf = (uint8_t *)malloc(len ? len : 1))) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    for(i = 0; i < message->msg_iovlen; ++i) {
+        memcpy(buf + pos, message->msg_iov[i].iov_base,
+               message->msg_iov[i].iov_len);
+        pos += message->msg_iov[i].iov_len;
+    }
+
+    rv = hnd->protocol->sendto(hnd, buf, len, flags,
+                               (const struct sockaddr *)message->msg_name,
+                               message->msg_namelen);
+    free(buf);
+
+    return rv;
+}
+
+static ssize_t sock_recvmsg(net_socket_t *hnd, struct msghdr *message,
+                            int flags) {
+    struct sockaddr *addr;
+    socklen_t *addr_len;
+    size_t len = 0, pos = 0, n;
+    uint8_t *buf;
+    ssize_t rv;
+    int i;
+
+    if(message == NULL || (message->msg_iovlen && !message->msg_iov)) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if(message->msg_iovlen < 0 || message->msg_iovlen > IOV_MAX) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    addr = (struct sockaddr *)message->msg_name;
+    addr_len = addr ? &message->msg_namelen : NULL;
+    message->msg_controllen = 0;
+    message->msg_flags = 0;
+
+    if(hnd->protocol->recvmsg)
+        return hnd->protocol->recvmsg(hnd, message, flags);
+
+    /* With only one buffer, there's nothing to scatter. */
+    if(message->msg_iovlen == 1)
+        return hnd->protocol->recvfrom(hnd, message->msg_iov[0].iov_base,
+                                       message->msg_iov[0].iov_len, flags,
+                                       addr, addr_len);
+
+    for(i = 0; i < message->msg_iovlen; ++i)
+        len += message->msg_iov[i].iov_len;
+
+    if(!(buf = (uint8_t *)malloc(len ? len : 1))) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    rv = hnd->protocol->recvfrom(hnd, buf, len, flags, addr, addr_len);
+
+    for(i = 0; rv > 0 && i < message->msg_iovlen && pos < (size_t)rv; ++i) {
+        n = message->msg_iov[i].iov_len;
+
+        if(n > (size_t)rv - pos)
+            n = (size_t)rv - pos;
+
+        memcpy(message->msg_iov[i].iov_base, buf + pos, n);
+        pos += n;
+    }
+
+    free(buf);
+
+    return rv;
+}
+
+ssize_t sendmsg(int sock, const struct msghdr *message, int flags) {
+    net_socket_t *hnd;
+
+    hnd = (net_socket_t *)fs_get_handle(sock);
+
+    if(hnd == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* Make sure this is actually a socket. */
+    if(fs_get_handler(sock) != &vh) {
+        errno = ENOTSOCK;
+        return -1;
+    }
+
+    return sock_sendmsg(hnd, message, flags);
+}
+
+ssize_t recvmsg(int sock, struct msghdr *message, int flags) {
+    net_socket_t *hnd;
+
+    hnd = (net_socket_t *)fs_get_handle(sock);
+
+    if(hnd == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* Make sure this is actually a socket. */
+    if(fs_get_handler(sock) != &vh) {
+        errno = ENOTSOCK;
+        return -1;
+    }
+
+    return sock_recvmsg(hnd, message, flags);
+}
+
+int sendmmsg(int sock, struct mmsghdr *msgvec, unsigned int vlen, int flags) {
+    net_socket_t *hnd;
+    unsigned int i;
+    ssize_t rv;
+    int err;
+
+    hnd = (net_socket_t *)fs_get_handle(sock);
+
+    if(hnd == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* Make sure this is actually a socket. */
+    if(fs_get_handler(sock) != &vh) {
+        errno = ENOTSOCK;
+        return -1;
+    }
+
+    if(msgvec == NULL && vlen) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    err = errno;
+
+    for(i = 0; i < vlen; ++i) {
+        if((rv = sock_sendmsg(hnd, &msgvec[i].msg_hdr, flags)) < 0) {
+            /* Only report the error if nothing was sent at all. */
+            if(!i)
+                return -1;
+
+            errno = err;
+            break;
+        }
+
+        msgvec[i].msg_len = rv;
+    }
+
+    return i;
+}
+
+int recvmmsg(int sock, struct mmsghdr *msgvec, unsigned int vlen, int flags,
+             struct timespec *timeout) {
+    net_socket_t *hnd;
+    uint64_t deadline = 0;
+    unsigned int i;
+    ssize_t rv;
+    int err;
+
+    hnd = (net_socket_t *)fs_get_handle(sock);
+
+    if(hnd == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* Make sure this is actually a socket. */
+    if(fs_get_handler(sock) != &vh) {
+        errno = ENOTSOCK;
+        return -1;
+    }
+
+    if(msgvec == NULL && vlen) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if(timeout) {
+        deadline = timer_ms_gettime64() + timeout->tv_sec * 1000 +
+                   timeout->tv_nsec / 1000000;
+    }
+
+    err = errno;
+
+    for(i = 0; i < vlen; ++i) {
+        if((rv = sock_recvmsg(hnd, &msgvec[i].msg_hdr, flags)) < 0) {
+            /* Only report the error if nothing was received at all. */
+            if(!i)
+                return -1;
+
+            errno = err;
+            break;
+        }
+
+        msgvec[i].msg_len = rv;
+
+        /* Don't wait for any more after the first one, if asked not to. */
+        if(flags & MSG_WAITFORONE)
+            flags |= MSG_DONTWAIT;
+
+        if(timeout && timer_ms_gettime64() >= deadline) {
+            ++i;
+            break;
+        }
+    }
+
+    return i;
+}
+
 int shutdown(int sock, int how) {
     net_socket_t *hnd;
 
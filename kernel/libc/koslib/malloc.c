@@ -25,6 +25,7 @@
 #include <kos/dbglog.h>
 #include <kos/opts.h>
 #include <kos/spinlock.h>
+#include <kos/thread.h>
 
 #undef DEBUG
 
@@ -1780,12 +1781,144 @@ int mem_check_block_int(memctl_t *ctl, int source) {
 
 #endif  /* KM_DEBUG */
 
+/************************** Thread Caches **************************/
+
+/* Small allocations are served from per-thread caches of free chunks, so
+   that they don't need to take the global lock (and can't get stalled by a
+   thread preempted while holding it). Each thread keeps a singly-linked list
+   of free chunks per size class, threaded through the chunks themselves.
+   Class n holds chunks of at least (n + 1) * 16 bytes. Lists are refilled
+   from and returned to the core allocator in batches, under a single lock.
+
+   The caches are never touched from IRQ context (as the interrupted thread
+   might be in the middle of updating its own), nor before threads are up. */
+
+#ifndef KM_DBG
+
+#define TCACHE_STEP     16
+#define TCACHE_MAX      (TCACHE_STEP * KTHREAD_MALLOC_CLASSES)
+#define TCACHE_BATCH    8
+#define TCACHE_LIMIT    16
+
+/* Size of the chunk holding an allocated block, as found in its header. */
+#define TCACHE_CHUNKSIZE(m) (((INTERNAL_SIZE_T *)(m))[-1] & ~MALLOC_ALIGN_MASK)
+
+static inline kthread_t *tcache_thread(void) {
+    if(__predict_false(!thd_current || irq_inside_int()))
+        return NULL;
+
+    return thd_current;
+}
+
+static Void_t *tcache_alloc(kthread_t *thd, size_t bytes) {
+    size_t cs = (bytes + SIZE_SZ + MALLOC_ALIGN_MASK) & ~MALLOC_ALIGN_MASK;
+    unsigned int cls = (cs - 1) / TCACHE_STEP;
+    void **block;
+    unsigned int i;
+
+    if(!thd->malloc_cache.count[cls]) {
+        /* Refill the list with a batch of chunks of the class size. */
+        if(MALLOC_PREACTION != 0)
+            return NULL;
+
+        for(i = 0; i < TCACHE_BATCH; i++) {
+            block = mALLOc((cls + 1) * TCACHE_STEP - SIZE_SZ);
+
+            if(!block)
+                break;
+
+            *block = thd->malloc_cache.blocks[cls];
+            thd->malloc_cache.blocks[cls] = block;
+        }
+
+        if(MALLOC_POSTACTION != 0) {
+        }
+
+        if(!i)
+            return NULL;
+
+        thd->malloc_cache.count[cls] = i;
+    }
+
+    block = thd->malloc_cache.blocks[cls];
+    thd->malloc_cache.blocks[cls] = *block;
+    thd->malloc_cache.count[cls]--;
+
+    return block;
+}
+
+static void tcache_free(kthread_t *thd, Void_t *m, size_t cs) {
+    unsigned int cls = cs / TCACHE_STEP - 1;
+    void **block;
+    unsigned int i;
+
+    if(thd->malloc_cache.count[cls] >= TCACHE_LIMIT) {
+        /* Hand a batch back to the core allocator. */
+        if(MALLOC_PREACTION != 0)
+            return;
+
+        for(i = 0; i < TCACHE_BATCH; i++) {
+            block = thd->malloc_cache.blocks[cls];
+            thd->malloc_cache.blocks[cls] = *block;
+            fREe(block);
+        }
+
+        if(MALLOC_POSTACTION != 0) {
+        }
+
+        thd->malloc_cache.count[cls] -= TCACHE_BATCH;
+    }
+
+    block = (void **)m;
+    *block = thd->malloc_cache.blocks[cls];
+    thd->malloc_cache.blocks[cls] = block;
+    thd->malloc_cache.count[cls]++;
+}
+
+#endif  /* !KM_DBG */
+
+void malloc_thread_cache_flush(kthread_t *thd) {
+#ifndef KM_DBG
+    void **block;
+    unsigned int cls;
+
+    if(!thd) {
+        if(!(thd = tcache_thread()))
+            return;
+    }
+
+    if(MALLOC_PREACTION != 0)
+        return;
+
+    for(cls = 0; cls < KTHREAD_MALLOC_CLASSES; cls++) {
+        while((block = thd->malloc_cache.blocks[cls])) {
+            thd->malloc_cache.blocks[cls] = *block;
+            fREe(block);
+        }
+
+        thd->malloc_cache.count[cls] = 0;
+    }
+
+    if(MALLOC_POSTACTION != 0) {
+    }
+#else
+    (void)thd;
+#endif
+}
+
 Void_t* public_mALLOc(size_t bytes) {
     Void_t* m;
 
 #ifdef KM_DBG
     uint32_t rv = arch_get_ret_addr(), *nt1, *nt2, i, rs;
     memctl_t * ctl;
+#else
+    kthread_t *thd;
+
+    if(bytes <= TCACHE_MAX - SIZE_SZ && (thd = tcache_thread())) {
+        if((m = tcache_alloc(thd, bytes)))
+            return m;
+    }
 #endif
 
     if(MALLOC_PREACTION != 0) {
@@ -1843,12 +1976,24 @@ void public_fREe(Void_t* m) {
 #ifdef KM_DBG_VERBOSE
     uint32_t rv = arch_get_ret_addr();
 #endif
+#else
+    kthread_t *thd;
+    size_t cs;
 #endif
 
     /* standard C says if block is NULL, do not try to free it */
     if(m == NULL)
         return;
 
+#ifndef KM_DBG
+    cs = TCACHE_CHUNKSIZE(m);
+
+    if(cs <= TCACHE_MAX && (thd = tcache_thread())) {
+        tcache_free(thd, m, cs);
+        return;
+    }
+#endif
+
     if(MALLOC_PREACTION != 0) {
         return;
     }
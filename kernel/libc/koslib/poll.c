@@ -5,133 +5,655 @@
 
 */
 
+/* This is the event notification core behind epoll(), poll() and select().
+
+   An interest set (an "instance") holds one item per watched file descriptor.
+   Each item is also linked on a list hanging off of its file descriptor, so
+   that an event only has to look at the items that are actually interested in
+   that file descriptor, and items that get an event are queued on the ready
+   list of their instance, so that waiting only has to look at those. epoll()
+   instances are persistent, while poll() builds a temporary one on its stack.
+
+   The handlers' poll functions are never called with the mutex held: the
+   network stack calls __poll_event_trigger() with its own locks held, and takes
+   those same locks in its poll functions. */
+
 #include <poll.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
 #include <sys/queue.h>
 
 #include <kos/fs.h>
 #include <kos/irq.h>
 #include <kos/mutex.h>
 #include <kos/cond.h>
+#include <kos/opts.h>
+#include <arch/timer.h>
+
+/* Events that are reported, whether they were asked for or not. */
+#define EPOLL_ALWAYS        (POLLERR | POLLHUP | POLLNVAL)
+#define EPOLL_EVENT_MASK    0xffff
+
+/* Maximum number of items handled in one pass of epoll_collect(). */
+#define EPOLL_BATCH         64
+
+/* Number of items poll() keeps on the stack, rather than allocating. */
+#define POLL_STACK_ITEMS    16
+
+/* Item flags */
+#define EPOLL_ITEM_ALLOC    0x1     /* Allocated with malloc() */
+#define EPOLL_ITEM_READY    0x2     /* On the ready list */
+#define EPOLL_ITEM_DEAD     0x4     /* Removed from its instance */
+#define EPOLL_ITEM_DISABLED 0x8     /* One-shot item that already fired */
+#define EPOLL_ITEM_CLOSED   0x10    /* Its fd was closed during poll() */
 
-struct poll_int {
-    LIST_ENTRY(poll_int) entry;
-    struct pollfd *fds;
-    nfds_t nfds;
-    int nmatched;
+/* Instance flags */
+#define EPOLL_INST_POLL     0x1     /* Temporary instance used by poll() */
+
+struct epoll_inst;
+
+typedef struct epoll_item {
+    LIST_ENTRY(epoll_item) fd_entry;
+    LIST_ENTRY(epoll_item) inst_entry;
+    TAILQ_ENTRY(epoll_item) rdy_entry;
+    struct epoll_inst *inst;
+    int fd;
+    uint32_t events;
+    short revents;
+    uint16_t flags;
+    int refcnt;
+    epoll_data_t data;
+} epoll_item_t;
+
+LIST_HEAD(epoll_itemlist, epoll_item);
+
+typedef struct epoll_inst {
+    TAILQ_HEAD(epoll_rdylist, epoll_item) ready;
+    struct epoll_itemlist items;
     condvar_t cv;
-};
+    int flags;
+} epoll_inst_t;
 
-LIST_HEAD(polllist, poll_int) poll_list;
+/* The items watching each file descriptor. */
+static struct epoll_itemlist watchers[FD_SETSIZE];
 
 static mutex_t mutex = MUTEX_INITIALIZER;
 
+static vfs_handler_t epoll_vh;
+
+static inline short epoll_mask(const epoll_item_t *it) {
+    return (it->events & EPOLL_EVENT_MASK) | EPOLL_ALWAYS;
+}
+
+/* Check the current state of the file descriptor of an item. Called without
+   the mutex held. */
+static short epoll_query(const epoll_item_t *it) {
+    vfs_handler_t *hndl = fs_get_handler(it->fd);
+    void *hnd = fs_get_handle(it->fd);
+    short events = it->events & EPOLL_EVENT_MASK;
+
+    if(!hndl || !hnd || (it->flags & EPOLL_ITEM_CLOSED))
+        return POLLNVAL;
+
+    /* Assume its a regular file if there's no poll method in the handler. */
+    if(!hndl->poll)
+        return (POLLRDNORM | POLLWRNORM) & events;
+
+    return hndl->poll(hnd, events);
+}
+
+/* Queue an item on the ready list of its instance. Called with the mutex
+   held. */
+static void epoll_make_ready(epoll_item_t *it, short revents) {
+    it->revents |= revents;
+
+    if(!(it->flags & EPOLL_ITEM_READY)) {
+        it->flags |= EPOLL_ITEM_READY;
+        TAILQ_INSERT_TAIL(&it->inst->ready, it, rdy_entry);
+    }
+
+    cond_signal(&it->inst->cv);
+}
+
+static void epoll_item_put(epoll_item_t *it) {
+    if(!--it->refcnt && (it->flags & EPOLL_ITEM_ALLOC))
+        free(it);
+}
+
+/* Remove an item from its instance. Called with the mutex held. */
+static void epoll_item_unlink(epoll_item_t *it) {
+    if(it->flags & EPOLL_ITEM_DEAD)
+        return;
+
+    if(it->flags & EPOLL_ITEM_READY)
+        TAILQ_REMOVE(&it->inst->ready, it, rdy_entry);
+
+    LIST_REMOVE(it, fd_entry);
+    LIST_REMOVE(it, inst_entry);
+    it->flags = (it->flags & EPOLL_ITEM_ALLOC) | EPOLL_ITEM_DEAD;
+    epoll_item_put(it);
+}
+
+/* Add an item to an instance, watching the given handle. The item is added
+   with an extra reference, to be dropped by epoll_item_arm(). Called with the
+   mutex held. */
+static void epoll_item_add(epoll_inst_t *ep, epoll_item_t *it, int fd,
+                           uint32_t events, epoll_data_t data) {
+    it->inst = ep;
+    it->fd = fd;
+    it->events = events;
+    it->revents = 0;
+    it->flags &= EPOLL_ITEM_ALLOC;
+    it->refcnt = 2;
+    it->data = data;
+
+    LIST_INSERT_HEAD(&watchers[fd], it, fd_entry);
+    LIST_INSERT_HEAD(&ep->items, it, inst_entry);
+}
+
+/* Queue an item if its file descriptor is already ready, and drop the
+   reference taken when it was added or modified. Called with the mutex held,
+   with the result of epoll_query(). */
+static void epoll_item_arm(epoll_item_t *it, short revents) {
+    if(!(it->flags & (EPOLL_ITEM_DEAD | EPOLL_ITEM_DISABLED)) &&
+       (revents &= epoll_mask(it)))
+        epoll_make_ready(it, revents);
+
+    epoll_item_put(it);
+}
+
 void __poll_event_trigger(int fd, short event) {
-    struct poll_int *i;
-    nfds_t j;
-    int gotone = 0;
+    epoll_item_t *it;
     short mask;
 
+    if(fd < 0 || fd >= FD_SETSIZE)
+        return;
+
     if(mutex_lock_irqsafe(&mutex))
         /* XXXX: Uhh... this is bad... */
         return;
 
-    /* Look through the list of poll fds for any that match */
-    LIST_FOREACH(i, &poll_list, entry) {
-        for(j = 0; j < i->nfds; ++j) {
-            if(i->fds[j].fd == fd) {
-                mask = i->fds[j].events | POLLERR | POLLHUP | POLLNVAL;
-                if(event & mask) {
-                    i->fds[j].revents |= event & mask;
-                    ++i->nmatched;
-                    gotone = 1;
+    /* Only look at the items interested in this fd. */
+    LIST_FOREACH(it, &watchers[fd], fd_entry) {
+        if(it->flags & EPOLL_ITEM_DISABLED)
+            continue;
+
+        mask = epoll_mask(it);
+
+        if(event & mask)
+            epoll_make_ready(it, event & mask);
+    }
+
+    mutex_unlock(&mutex);
+}
+
+/* Called by fs_close() before a file descriptor goes away. Its items are
+   removed from their epoll instances, so that nothing carries over to the
+   next file opened with the same fd. poll() reports it as POLLNVAL instead. */
+void __poll_fd_closed(int fd) {
+    epoll_item_t *it, *next;
+
+    if(fd < 0 || fd >= FD_SETSIZE)
+        return;
+
+    if(mutex_lock_irqsafe(&mutex))
+        return;
+
+    for(it = LIST_FIRST(&watchers[fd]); it; it = next) {
+        next = LIST_NEXT(it, fd_entry);
+
+        if(it->inst->flags & EPOLL_INST_POLL) {
+            it->flags |= EPOLL_ITEM_CLOSED;
+            epoll_make_ready(it, POLLNVAL);
+        }
+        else {
+            epoll_item_unlink(it);
+        }
+    }
+
+    mutex_unlock(&mutex);
+}
+
+/* Wait for ready items on an instance, and report up to maxevents of them. */
+static int epoll_collect(epoll_inst_t *ep, struct epoll_event *events,
+                         int maxevents, int timeout) {
+    epoll_item_t *batch[EPOLL_BATCH], *it;
+    short pending[EPOLL_BATCH], cur[EPOLL_BATCH], rev;
+    uint64_t deadline = 0, now;
+    int n, cnt, i, rv, err;
+
+    if(maxevents > EPOLL_BATCH)
+        maxevents = EPOLL_BATCH;
+
+    if(timeout > 0)
+        deadline = timer_ms_gettime64() + timeout;
+
+    for(;;) {
+        if(mutex_lock_irqsafe(&mutex))
+            return -1;
+
+        /* Take the items off of the ready list, holding a reference to each of
+           them while the mutex isn't held. */
+        for(n = 0; n < maxevents && (it = TAILQ_FIRST(&ep->ready)); ++n) {
+            TAILQ_REMOVE(&ep->ready, it, rdy_entry);
+            it->flags &= ~EPOLL_ITEM_READY;
+            ++it->refcnt;
+            batch[n] = it;
+            pending[n] = it->revents;
+            it->revents = 0;
+        }
+
+        if(!n) {
+            if(!timeout) {
+                mutex_unlock(&mutex);
+                return 0;
+            }
+
+            /* We can't actually wait while we're in an interrupt. */
+            if(irq_inside_int()) {
+                mutex_unlock(&mutex);
+                errno = EPERM;
+                return -1;
+            }
+
+            /* Map to the value used by cond_wait_timed() */
+            if(timeout < 0) {
+                rv = 0;
+            }
+            else {
+                now = timer_ms_gettime64();
+
+                if(now >= deadline) {
+                    mutex_unlock(&mutex);
+                    return 0;
                 }
+
+                rv = (int)(deadline - now);
+            }
+
+            err = errno;
+            rv = cond_wait_timed(&ep->cv, &mutex, rv);
+            mutex_unlock(&mutex);
+
+            if(rv) {
+                if(errno != ETIMEDOUT)
+                    return -1;
+
+                errno = err;
+                return 0;
             }
+
+            continue;
         }
 
-        /* If we got any events, signal the waiting thread to wake it up. */
-        if(gotone) {
-            cond_signal(&i->cv);
-            gotone = 0;
+        mutex_unlock(&mutex);
+
+        for(i = 0; i < n; ++i)
+            cur[i] = epoll_query(batch[i]);
+
+        if(mutex_lock_irqsafe(&mutex)) {
+            /* Leak the references rather than touching the lists unlocked. */
+            return -1;
+        }
+
+        for(cnt = 0, i = 0; i < n; ++i) {
+            it = batch[i];
+
+            if(!(it->flags & (EPOLL_ITEM_DEAD | EPOLL_ITEM_DISABLED))) {
+                /* Edge-triggered items report what happened, level-triggered
+                   ones what is true right now. */
+                if(it->events & EPOLLET)
+                    rev = (pending[i] | cur[i]) & epoll_mask(it);
+                else
+                    rev = cur[i] & epoll_mask(it);
+
+                if((cur[i] & POLLNVAL) && !(ep->flags & EPOLL_INST_POLL)) {
+                    /* The fd went away without going through fs_close(),
+                       forget about it silently. */
+                    epoll_item_unlink(it);
+                }
+                else if(rev) {
+                    events[cnt].events = (uint16_t)rev;
+                    events[cnt].data = it->data;
+                    ++cnt;
+
+                    if(it->events & EPOLLONESHOT)
+                        it->flags |= EPOLL_ITEM_DISABLED;
+                    else if(!(it->events & (EPOLLET | EPOLLONESHOT)) &&
+                            !(it->flags & EPOLL_ITEM_READY) &&
+                            !(ep->flags & EPOLL_INST_POLL)) {
+                        /* Still ready, check it again on the next wait. */
+                        it->flags |= EPOLL_ITEM_READY;
+                        TAILQ_INSERT_TAIL(&ep->ready, it, rdy_entry);
+                    }
+                }
+            }
+
+            epoll_item_put(it);
         }
+
+        mutex_unlock(&mutex);
+
+        /* If all of the items turned out to not be ready after all, go back to
+           waiting. */
+        if(cnt || !timeout)
+            return cnt;
     }
+}
+
+static void epoll_inst_init(epoll_inst_t *ep, int flags) {
+    TAILQ_INIT(&ep->ready);
+    LIST_INIT(&ep->items);
+    cond_init(&ep->cv);
+    ep->flags = flags;
+}
+
+static void epoll_inst_clear(epoll_inst_t *ep) {
+    epoll_item_t *it;
+
+    mutex_lock(&mutex);
+
+    while((it = LIST_FIRST(&ep->items)))
+        epoll_item_unlink(it);
 
     mutex_unlock(&mutex);
+    cond_destroy(&ep->cv);
 }
 
-int poll(struct pollfd fds[], nfds_t nfds, int timeout) {
-    struct poll_int p = { { 0 }, fds, nfds, 0, COND_INITIALIZER };
-    int tmp;
-    nfds_t i;
-    vfs_handler_t *hndl;
-    void *hnd;
+static int epoll_close(void *hnd) {
+    epoll_inst_t *ep = (epoll_inst_t *)hnd;
 
-    if(mutex_lock_irqsafe(&mutex))
+    epoll_inst_clear(ep);
+    free(ep);
+
+    return 0;
+}
+
+static epoll_inst_t *epoll_get(int epfd) {
+    if(epfd < 0 || epfd >= FD_SETSIZE || fs_get_handler(epfd) != &epoll_vh) {
+        errno = EBADF;
+        return NULL;
+    }
+
+    return (epoll_inst_t *)fs_get_handle(epfd);
+}
+
+int epoll_create1(int flags) {
+    epoll_inst_t *ep;
+    int fd;
+
+    if(flags & ~EPOLL_CLOEXEC) {
+        errno = EINVAL;
         return -1;
+    }
 
-    /* Check if any of the fds already match */
-    for(i = 0; i < nfds; ++i) {
-        hndl = fs_get_handler(fds[i].fd);
-        hnd = fs_get_handle(fds[i].fd);
-        fds[i].revents = 0;
-
-        /* If we didn't get one of these, then assume its a bad fd. */
-        if(!hndl || !hnd) {
-            fds[i].revents = POLLNVAL;
-            ++p.nmatched;
-            continue;
-        }
+    if(!(ep = (epoll_inst_t *)malloc(sizeof(epoll_inst_t)))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    epoll_inst_init(ep, 0);
+
+    if((fd = fs_open_handle(&epoll_vh, ep)) < 0) {
+        cond_destroy(&ep->cv);
+        free(ep);
+        return -1;
+    }
+
+    return fd;
+}
+
+int epoll_create(int size) {
+    if(size <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return epoll_create1(0);
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
+    epoll_inst_t *ep;
+    epoll_item_t *it, *newit = NULL;
+    short rv;
 
-        if(!hndl->poll) {
-            /* Assume its a regular file if there's no poll method in the
-               handler. */
-            if(fds[i].events & (POLLRDNORM | POLLWRNORM)) {
-                fds[i].revents |= (POLLRDNORM | POLLWRNORM) & fds[i].events;
-                ++p.nmatched;
+    if(!(ep = epoll_get(epfd)))
+        return -1;
+
+    if(fd == epfd || (op != EPOLL_CTL_DEL && !event)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(fd < 0 || fd >= FD_SETSIZE || !fs_get_handle(fd)) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if(op == EPOLL_CTL_ADD &&
+       !(newit = (epoll_item_t *)malloc(sizeof(epoll_item_t)))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if(mutex_lock_irqsafe(&mutex)) {
+        free(newit);
+        return -1;
+    }
+
+    LIST_FOREACH(it, &watchers[fd], fd_entry) {
+        if(it->inst == ep)
+            break;
+    }
+
+    switch(op) {
+        case EPOLL_CTL_ADD:
+            if(it) {
+                mutex_unlock(&mutex);
+                free(newit);
+                errno = EEXIST;
+                return -1;
             }
-        }
-        else {
-            if((fds[i].revents = hndl->poll(hnd, fds[i].events))) {
-                ++p.nmatched;
+
+            it = newit;
+            it->flags = EPOLL_ITEM_ALLOC;
+            epoll_item_add(ep, it, fd, event->events, event->data);
+            break;
+
+        case EPOLL_CTL_MOD:
+            if(!it) {
+                mutex_unlock(&mutex);
+                errno = ENOENT;
+                return -1;
             }
+
+            it->events = event->events;
+            it->data = event->data;
+            it->revents = 0;
+            it->flags &= ~EPOLL_ITEM_DISABLED;
+            ++it->refcnt;
+            break;
+
+        case EPOLL_CTL_DEL:
+            if(!it) {
+                mutex_unlock(&mutex);
+                errno = ENOENT;
+                return -1;
+            }
+
+            epoll_item_unlink(it);
+            mutex_unlock(&mutex);
+            return 0;
+
+        default:
+            mutex_unlock(&mutex);
+            errno = EINVAL;
+            return -1;
+    }
+
+    mutex_unlock(&mutex);
+
+    /* Catch up on anything that happened before the fd was watched. */
+    rv = epoll_query(it);
+
+    if(mutex_lock_irqsafe(&mutex))
+        return -1;
+
+    epoll_item_arm(it, rv);
+    mutex_unlock(&mutex);
+
+    return 0;
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+               int timeout) {
+    epoll_inst_t *ep;
+
+    if(!(ep = epoll_get(epfd)))
+        return -1;
+
+    if(!events || maxevents <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return epoll_collect(ep, events, maxevents, timeout);
+}
+
+int poll(struct pollfd fds[], nfds_t nfds, int timeout) {
+    epoll_item_t stack_items[POLL_STACK_ITEMS], *items = stack_items;
+    struct epoll_event evs[EPOLL_BATCH];
+    epoll_inst_t p;
+    epoll_data_t data;
+    int nmatched = 0, rv, i;
+    nfds_t j;
+
+    if(nfds > POLL_STACK_ITEMS) {
+        if(!(items = (epoll_item_t *)malloc(nfds * sizeof(epoll_item_t)))) {
+            errno = ENOMEM;
+            return -1;
         }
     }
 
-    /* If the user specified a 0 timeout, or we've already matched something,
-       bail out now. */
-    if(p.nmatched || !timeout) {
-        mutex_unlock(&mutex);
-        return p.nmatched;
+    epoll_inst_init(&p, EPOLL_INST_POLL);
+
+    if(mutex_lock_irqsafe(&mutex)) {
+        nmatched = -1;
+        goto out;
     }
 
-    /* We can't actually wait while we're in an interrupt, so if we got this far
-       it is an error. */
-    if(irq_inside_int()) {
-        mutex_unlock(&mutex);
-        errno = EPERM;
-        return -1;
+    /* Watch all of the fds first, so that nothing can be missed between
+       checking them and waiting. */
+    for(j = 0; j < nfds; ++j) {
+        fds[j].revents = 0;
+        items[j].flags = 0;
+        data.u32 = j;
+
+        /* If we didn't get a handle, then assume its a bad fd. */
+        if(fds[j].fd < 0 || fds[j].fd >= FD_SETSIZE ||
+           !fs_get_handle(fds[j].fd)) {
+            items[j].flags = EPOLL_ITEM_DEAD;
+            fds[j].revents = POLLNVAL;
+            ++nmatched;
+            continue;
+        }
+
+        epoll_item_add(&p, &items[j], fds[j].fd, (uint16_t)fds[j].events,
+                       data);
     }
 
-    /* Map to the value used by cond_wait_timed() */
-    if(timeout == -1)
-        timeout = 0;
+    mutex_unlock(&mutex);
 
-    /* Add this instance to the list */
-    LIST_INSERT_HEAD(&poll_list, &p, entry);
+    /* Check if any of the fds already match */
+    for(j = 0; j < nfds; ++j) {
+        if(!(items[j].flags & EPOLL_ITEM_DEAD))
+            items[j].revents = epoll_query(&items[j]);
+    }
 
-    tmp = errno;
-    if(cond_wait_timed(&p.cv, &mutex, timeout)) {
-        errno = tmp;
-        tmp = 0;
+    if(mutex_lock_irqsafe(&mutex)) {
+        nmatched = -1;
         goto out;
     }
 
-    tmp = p.nmatched;
+    for(j = 0; j < nfds; ++j) {
+        if(!(items[j].flags & EPOLL_ITEM_DEAD)) {
+            rv = items[j].revents;
+            items[j].revents = 0;
+            epoll_item_arm(&items[j], rv);
+        }
+    }
+
+    mutex_unlock(&mutex);
+
+    /* Gather the results. If the user specified a 0 timeout, or we've already
+       matched something, only take what is already there. */
+    do {
+        rv = epoll_collect(&p, evs, EPOLL_BATCH, nmatched ? 0 : timeout);
+
+        if(rv < 0) {
+            nmatched = -1;
+            break;
+        }
+
+        for(i = 0; i < rv; ++i) {
+            j = evs[i].data.u32;
+
+            if(!fds[j].revents)
+                ++nmatched;
+
+            fds[j].revents |= evs[i].events;
+        }
+    }
+    while(rv == EPOLL_BATCH);
 
 out:
-    /* Remove this instance from the list */
-    LIST_REMOVE(&p, entry);
+    epoll_inst_clear(&p);
 
-    mutex_unlock(&mutex);
-    return tmp;
+    if(items != stack_items)
+        free(items);
+
+    return nmatched;
 }
+
+/* VFS handler for epoll instances */
+static vfs_handler_t epoll_vh = {
+    /* Name handler */
+    {
+        "/epoll",       /* Name */
+        0,              /* tbfi */
+        0x00010000,     /* Version 1.0 */
+        0,              /* Flags */
+        NMMGR_TYPE_VFS,
+        NMMGR_LIST_INIT,
+    },
+
+    0, NULL,        /* No cache, privdata */
+
+    NULL,            /* open */
+    epoll_close,     /* close */
+    NULL,            /* read */
+    NULL,            /* write */
+    NULL,            /* seek */
+    NULL,            /* tell */
+    NULL,            /* total */
+    NULL,            /* readdir */
+    NULL,            /* ioctl */
+    NULL,            /* rename */
+    NULL,            /* unlink */
+    NULL,            /* mmap */
+    NULL,            /* complete */
+    NULL,            /* stat */
+    NULL,            /* mkdir */
+    NULL,            /* rmdir */
+    NULL,            /* fcntl */
+    NULL,            /* poll */
+    NULL,            /* link */
+    NULL,            /* symlink */
+    NULL,            /* seek64 */
+    NULL,            /* tell64 */
+    NULL,            /* total64 */
+    NULL,            /* readlink */
+    NULL,            /* rewinddir */
+    NULL             /* fstat */
+};
@@ -63,7 +63,8 @@ int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds,
     if(timeout)
         tmout = timeout->tv_sec * 1000 + timeout->tv_usec / 1000;
 
-    /* Poll for a response */
+    /* Poll for a response. poll() only looks at the fds that get events while
+       it waits, so this doesn't depend on how many fds are in the sets. */
     if((rv = poll(pollfds, j, tmout)) < 0) {
         return rv;
     }
@@ -83,18 +84,18 @@ int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds,
 
         if(pollfds[i].revents & POLLIN) {
             FD_SET(pollfds[i].fd, readfds);
-            ++j;
+            ++rv;
         }
         if(pollfds[i].revents & POLLOUT) {
             FD_SET(pollfds[i].fd, writefds);
-            ++j;
+            ++rv;
         }
         if((pollfds[i].events & POLLPRI) &&
            (pollfds[i].revents & (POLLPRI | POLLERR | POLLHUP))) {
             FD_SET(pollfds[i].fd, errorfds);
-            ++j;
+            ++rv;
         }
     }
 
-    return j;
+    return rv;
 }
@@ -0,0 +1,340 @@
+/* KallistiOS ##version##
+
+   slab.c
+*/
+
+/* This is a simple slab allocator, in the spirit of the one described by
+   Jeff Bonwick for SunOS. Each cache hands out objects of a single size,
+   carved out of "slabs" allocated from the main heap. Each object has a
+   pointer to the slab that owns it stored right after it (usually in what
+   would have been padding anyway), so slabs only need to be aligned as much
+   as the objects themselves, which the heap can do without wasting memory
+   around them. Each slab keeps a list of its own free objects, and the cache keeps its slabs in three lists (partially
+   used, full and empty), so that allocating and freeing are both constant
+   time operations.
+
+   The lists are protected by disabling interrupts, which keeps the critical
+   sections short and allows using the caches from interrupt handlers. New
+   slabs are allocated with interrupts enabled (if they were enabled to begin
+   with), and never from an interrupt if malloc() is not safe to call. */
+
+#include <kos/slab.h>
+#include <kos/irq.h>
+#include <kos/dbglog.h>
+
+#include <sys/queue.h>
+
+#include <errno.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Default object alignment, and alignment used with KMEM_CACHE_HWALIGN. */
+#define KMEM_ALIGN_DEFAULT  8
+#define KMEM_ALIGN_HW       32
+
+/* Slabs are at least that big, and hold at least that many objects. */
+#define KMEM_SLAB_MIN_SIZE  4096
+#define KMEM_SLAB_MIN_OBJS  8
+
+/* Number of empty slabs kept around by each cache. */
+#define KMEM_MAX_EMPTY      1
+
+typedef struct kmem_slab {
+    LIST_ENTRY(kmem_slab) list;
+    void *free;
+    uint32_t in_use;
+} kmem_slab_t;
+
+LIST_HEAD(kmem_slab_list, kmem_slab);
+
+struct kmem_cache {
+    LIST_ENTRY(kmem_cache) list;
+    const char *name;
+    unsigned int flags;
+    size_t size;
+    size_t align;
+    size_t header_size;
+    size_t owner_off;
+
+    struct kmem_slab_list partial;
+    struct kmem_slab_list full;
+    struct kmem_slab_list empty;
+    uint32_t nr_empty;
+
+    kmem_cache_stats_t stats;
+};
+
+/* All of the caches in the system, for kmem_cache_pslist(). */
+static LIST_HEAD(kmem_cache_list, kmem_cache) caches =
+    LIST_HEAD_INITIALIZER(caches);
+
+static inline size_t align_up(size_t val, size_t align) {
+    return (val + align - 1) & ~(align - 1);
+}
+
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align,
+                                unsigned int flags) {
+    kmem_cache_t *cache;
+    size_t slab_size;
+
+    if(!size || (align & (align - 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if(align < KMEM_ALIGN_DEFAULT)
+        align = KMEM_ALIGN_DEFAULT;
+
+    if((flags & KMEM_CACHE_HWALIGN) && align < KMEM_ALIGN_HW)
+        align = KMEM_ALIGN_HW;
+
+    cache = calloc(1, sizeof(*cache));
+    if(!cache) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    cache->name = name;
+    cache->flags = flags;
+    cache->size = size;
+    cache->align = align;
+    cache->header_size = align_up(sizeof(kmem_slab_t), align);
+
+    /* The owning slab goes after the object, past the free list link. */
+    cache->owner_off = align_up(size < sizeof(void *) ? sizeof(void *) : size,
+                                sizeof(kmem_slab_t *));
+    cache->stats.obj_size = align_up(cache->owner_off + sizeof(kmem_slab_t *),
+                                     align);
+
+    slab_size = KMEM_SLAB_MIN_SIZE;
+
+    while((slab_size - cache->header_size) / cache->stats.obj_size
+          < KMEM_SLAB_MIN_OBJS)
+        slab_size <<= 1;
+
+    cache->stats.slab_size = slab_size;
+    cache->stats.objs_per_slab =
+        (slab_size - cache->header_size) / cache->stats.obj_size;
+
+    LIST_INIT(&cache->partial);
+    LIST_INIT(&cache->full);
+    LIST_INIT(&cache->empty);
+
+    irq_disable_scoped();
+    LIST_INSERT_HEAD(&caches, cache, list);
+
+    return cache;
+}
+
+static void kmem_slab_list_free(struct kmem_slab_list *list) {
+    kmem_slab_t *slab;
+
+    while((slab = LIST_FIRST(list))) {
+        LIST_REMOVE(slab, list);
+        free(slab);
+    }
+}
+
+void kmem_cache_destroy(kmem_cache_t *cache) {
+    irq_mask_t irqs;
+
+    if(!cache)
+        return;
+
+    if(cache->stats.in_use)
+        dbglog(DBG_WARNING, "kmem_cache_destroy: %s still has %lu objects "
+               "in use\n", cache->name, (unsigned long)cache->stats.in_use);
+
+    irqs = irq_disable();
+    LIST_REMOVE(cache, list);
+    irq_restore(irqs);
+
+    kmem_slab_list_free(&cache->partial);
+    kmem_slab_list_free(&cache->full);
+    kmem_slab_list_free(&cache->empty);
+    free(cache);
+}
+
+/* Allocate and set up a new slab. Called with interrupts in the caller's
+   original state. */
+static kmem_slab_t *kmem_slab_new(kmem_cache_t *cache) {
+    kmem_slab_t *slab;
+    uint8_t *obj;
+    uint32_t i;
+
+    if(irq_inside_int() && !malloc_irq_safe())
+        return NULL;
+
+    slab = aligned_alloc(cache->align, cache->stats.slab_size);
+    if(!slab)
+        return NULL;
+
+    slab->in_use = 0;
+    slab->free = NULL;
+
+    /* Chain the objects together, the first one at the head of the list. */
+    obj = (uint8_t *)slab + cache->header_size;
+    obj += (cache->stats.objs_per_slab - 1) * cache->stats.obj_size;
+
+    for(i = 0; i < cache->stats.objs_per_slab; i++) {
+        *(kmem_slab_t **)(obj + cache->owner_off) = slab;
+        *(void **)obj = slab->free;
+        slab->free = obj;
+        obj -= cache->stats.obj_size;
+    }
+
+    return slab;
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+    kmem_slab_t *slab;
+    irq_mask_t irqs;
+    void *obj;
+
+    irqs = irq_disable();
+
+    if(!(slab = LIST_FIRST(&cache->partial))) {
+        if((slab = LIST_FIRST(&cache->empty))) {
+            LIST_REMOVE(slab, list);
+            cache->nr_empty--;
+        }
+        else {
+            irq_restore(irqs);
+            slab = kmem_slab_new(cache);
+            irqs = irq_disable();
+
+            if(!slab) {
+                cache->stats.failures++;
+                irq_restore(irqs);
+                return NULL;
+            }
+
+            cache->stats.slabs++;
+        }
+
+        LIST_INSERT_HEAD(&cache->partial, slab, list);
+    }
+
+    obj = slab->free;
+    slab->free = *(void **)obj;
+
+    if(++slab->in_use == cache->stats.objs_per_slab) {
+        LIST_REMOVE(slab, list);
+        LIST_INSERT_HEAD(&cache->full, slab, list);
+    }
+
+    cache->stats.allocs++;
+
+    if(++cache->stats.in_use > cache->stats.peak_in_use)
+        cache->stats.peak_in_use = cache->stats.in_use;
+
+    irq_restore(irqs);
+
+    if(cache->flags & KMEM_CACHE_ZERO)
+        memset(obj, 0, cache->size);
+
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj) {
+    kmem_slab_t *slab, *release = NULL;
+    irq_mask_t irqs;
+
+    if(!obj)
+        return;
+
+    slab = *(kmem_slab_t **)((uint8_t *)obj + cache->owner_off);
+
+    irqs = irq_disable();
+
+    *(void **)obj = slab->free;
+    slab->free = obj;
+
+    if(slab->in_use-- == cache->stats.objs_per_slab) {
+        /* The slab was full, it now has room for one object. */
+        LIST_REMOVE(slab, list);
+
+        if(slab->in_use)
+            LIST_INSERT_HEAD(&cache->partial, slab, list);
+    }
+    else if(!slab->in_use) {
+        LIST_REMOVE(slab, list);
+    }
+
+    if(!slab->in_use) {
+        /* Keep a few empty slabs around to avoid thrashing, and never call
+           free() from an interrupt. */
+        if(cache->nr_empty < KMEM_MAX_EMPTY || irq_inside_int()) {
+            LIST_INSERT_HEAD(&cache->empty, slab, list);
+            cache->nr_empty++;
+        }
+        else {
+            cache->stats.slabs--;
+            release = slab;
+        }
+    }
+
+    cache->stats.frees++;
+    cache->stats.in_use--;
+
+    irq_restore(irqs);
+
+    if(release)
+        free(release);
+}
+
+size_t kmem_cache_shrink(kmem_cache_t *cache) {
+    struct kmem_slab_list list;
+    irq_mask_t irqs;
+    size_t released;
+
+    irqs = irq_disable();
+
+    /* Steal the empty list, then release it with interrupts enabled. */
+    list = cache->empty;
+
+    if(LIST_FIRST(&list))
+        LIST_FIRST(&list)->list.le_prev = &LIST_FIRST(&list);
+
+    LIST_INIT(&cache->empty);
+
+    released = cache->nr_empty * cache->stats.slab_size;
+    cache->stats.slabs -= cache->nr_empty;
+    cache->nr_empty = 0;
+
+    irq_restore(irqs);
+
+    kmem_slab_list_free(&list);
+
+    return released;
+}
+
+void kmem_cache_get_stats(const kmem_cache_t *cache,
+                          kmem_cache_stats_t *stats) {
+    irq_disable_scoped();
+    *stats = cache->stats;
+}
+
+int kmem_cache_pslist(int (*pf)(const char *fmt, ...)) {
+    const kmem_cache_t *cache;
+    kmem_cache_stats_t st;
+
+    pf("Object caches:\n");
+    pf("name\t\t  objsize\t    slabs\t   in_use\t     peak\t failures\n");
+
+    irq_disable_scoped();
+
+    LIST_FOREACH(cache, &caches, list) {
+        st = cache->stats;
+
+        pf("%-16s", cache->name);
+        pf("%9lu\t%9lu\t%9lu\t%9lu\t%9lu\n", (unsigned long)st.obj_size,
+           (unsigned long)st.slabs, (unsigned long)st.in_use,
+           (unsigned long)st.peak_in_use, (unsigned long)st.failures);
+    }
+
+    pf("--end of list--\n");
+
+    return 0;
+}
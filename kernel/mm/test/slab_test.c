@@ -0,0 +1,274 @@
+/* KallistiOS ##version##
+
+   slab_test.c
+
+   Host-side test of the object cache allocator (../slab.c), built against
+   stand-ins for the interrupt API (stubs/). This checks that objects are
+   aligned and don't overlap, that the statistics add up, that slabs get
+   released as they empty out, and that nothing gets allocated from inside
+   an interrupt when malloc() isn't safe to call there.
+*/
+
+#include <kos/slab.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int irq_disabled;
+bool irq_in_int;
+bool irq_malloc_safe;
+
+#define OBJECTS         2000
+
+static void *objs[OBJECTS];
+static int failures;
+
+#define CHECK(cond, ...) do { \
+        if(!(cond)) { \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+            ++failures; \
+        } \
+    } while(0)
+
+static kmem_cache_stats_t stats(kmem_cache_t *cache) {
+    kmem_cache_stats_t st;
+
+    kmem_cache_get_stats(cache, &st);
+    return st;
+}
+
+static void test_create(void) {
+    kmem_cache_t *cache;
+
+    errno = 0;
+    CHECK(!kmem_cache_create("bad", 0, 0, 0) && errno == EINVAL,
+          "zero sized cache created");
+
+    errno = 0;
+    CHECK(!kmem_cache_create("bad", 16, 12, 0) && errno == EINVAL,
+          "cache with bad alignment created");
+
+    cache = kmem_cache_create("ok", 1, 0, 0);
+    CHECK(cache, "cache not created");
+
+    if(cache) {
+        /* Room for the free list link and the pointer to the slab */
+        CHECK(stats(cache).obj_size == ((2 * sizeof(void *) + 7) & ~7),
+              "obj_size %zu", stats(cache).obj_size);
+        CHECK(stats(cache).objs_per_slab >= 8, "too few objects per slab");
+        kmem_cache_destroy(cache);
+    }
+
+    /* Big objects still get a few to a slab */
+    cache = kmem_cache_create("big", 3000, 0, 0);
+    CHECK(cache && stats(cache).objs_per_slab >= 8,
+          "too few big objects per slab");
+    kmem_cache_destroy(cache);
+
+    CHECK(!irq_disabled, "interrupts left disabled");
+}
+
+/* Lots of objects, across many slabs: all aligned, all distinct, and none
+   of them stepping on the others. */
+static void test_alloc(size_t size, size_t align, unsigned int flags,
+                       size_t want_align) {
+    kmem_cache_t *cache;
+    kmem_cache_stats_t st;
+    unsigned int i, j;
+    bool ok = true;
+
+    cache = kmem_cache_create("test", size, align, flags);
+    CHECK(cache, "cache not created");
+
+    if(!cache)
+        return;
+
+    for(i = 0; i < OBJECTS; i++) {
+        objs[i] = kmem_cache_alloc(cache);
+
+        if(!objs[i] || ((uintptr_t)objs[i] & (want_align - 1))) {
+            ok = false;
+            break;
+        }
+
+        if((flags & KMEM_CACHE_ZERO)) {
+            for(j = 0; j < size; j++) {
+                if(((uint8_t *)objs[i])[j])
+                    ok = false;
+            }
+        }
+
+        memset(objs[i], i & 0xff, size);
+    }
+
+    CHECK(ok, "size %zu: bad object %u", size, i);
+
+    if(!ok) {
+        kmem_cache_destroy(cache);
+        return;
+    }
+
+    for(i = 0; i < OBJECTS && ok; i++) {
+        for(j = 0; j < size; j++) {
+            if(((uint8_t *)objs[i])[j] != (i & 0xff)) {
+                ok = false;
+                break;
+            }
+        }
+    }
+
+    CHECK(ok, "size %zu: object %u was overwritten", size, i - 1);
+
+    st = stats(cache);
+    CHECK(st.in_use == OBJECTS && st.allocs == OBJECTS,
+          "size %zu: in_use %u, allocs %u", size, (unsigned)st.in_use,
+          (unsigned)st.allocs);
+    CHECK(st.slabs == (OBJECTS + st.objs_per_slab - 1) / st.objs_per_slab,
+          "size %zu: %u slabs", size, (unsigned)st.slabs);
+
+    for(i = 0; i < OBJECTS; i++)
+        kmem_cache_free(cache, objs[i]);
+
+    /* Only one empty slab should be kept around, and shrinking gets rid of
+       it. */
+    st = stats(cache);
+    CHECK(st.in_use == 0 && st.frees == OBJECTS && st.peak_in_use == OBJECTS,
+          "size %zu: bad stats after freeing", size);
+    CHECK(st.slabs == 1, "size %zu: %u slabs left", size,
+          (unsigned)st.slabs);
+    CHECK(kmem_cache_shrink(cache) == st.slab_size,
+          "size %zu: shrink didn't release the slab", size);
+    CHECK(stats(cache).slabs == 0, "size %zu: slabs left after shrink", size);
+
+    kmem_cache_destroy(cache);
+
+    CHECK(!irq_disabled, "interrupts left disabled");
+}
+
+/* Inside an interrupt, a cache can only hand out what it already has, unless
+   malloc() is safe to call there, and frees never release slabs. */
+static void test_irq(void) {
+    kmem_cache_t *cache;
+    kmem_cache_stats_t st;
+    uint32_t i, per_slab;
+
+    cache = kmem_cache_create("irq", 64, 0, 0);
+    CHECK(cache, "cache not created");
+
+    if(!cache)
+        return;
+
+    per_slab = stats(cache).objs_per_slab;
+
+    /* Grow the cache to a single slab */
+    kmem_cache_free(cache, kmem_cache_alloc(cache));
+
+    irq_in_int = true;
+    irq_malloc_safe = false;
+
+    for(i = 0; i < per_slab; i++) {
+        objs[i] = kmem_cache_alloc(cache);
+        CHECK(objs[i], "allocation from an existing slab failed");
+    }
+
+    CHECK(!kmem_cache_alloc(cache), "slab allocated inside an interrupt");
+    CHECK(stats(cache).failures == 1, "failure not counted");
+
+    irq_malloc_safe = true;
+    objs[per_slab] = kmem_cache_alloc(cache);
+    CHECK(objs[per_slab], "allocation failed with malloc() safe");
+
+    for(i = 0; i <= per_slab; i++)
+        kmem_cache_free(cache, objs[i]);
+
+    st = stats(cache);
+    CHECK(st.slabs == 2 && st.in_use == 0,
+          "slabs freed inside an interrupt (%u left)", (unsigned)st.slabs);
+
+    irq_in_int = false;
+    irq_malloc_safe = false;
+
+    kmem_cache_destroy(cache);
+
+    CHECK(!irq_disabled, "interrupts left disabled");
+}
+
+/* Random allocations and frees, checking that each object keeps its contents
+   until it's freed. */
+static void test_random(void) {
+    kmem_cache_t *cache;
+    unsigned int i, n, errors = 0, live = 0;
+
+    cache = kmem_cache_create("random", 24, 0, 0);
+    CHECK(cache, "cache not created");
+
+    if(!cache)
+        return;
+
+    memset(objs, 0, sizeof(objs));
+    srand(1234);
+
+    for(n = 0; n < 200000 && !errors; n++) {
+        i = rand() % OBJECTS;
+
+        if(!objs[i]) {
+            if(!(objs[i] = kmem_cache_alloc(cache))) {
+                ++errors;
+                break;
+            }
+
+            memset(objs[i], i & 0xff, 24);
+            ++live;
+        }
+        else {
+            if(((uint8_t *)objs[i])[0] != (i & 0xff) ||
+               ((uint8_t *)objs[i])[23] != (i & 0xff)) {
+                printf("FAIL: object %u was overwritten\n", i);
+                ++errors;
+            }
+
+            kmem_cache_free(cache, objs[i]);
+            objs[i] = NULL;
+            --live;
+        }
+    }
+
+    CHECK(!errors, "random test failed");
+    CHECK(stats(cache).in_use == live, "in_use %u, expected %u",
+          (unsigned)stats(cache).in_use, live);
+
+    for(i = 0; i < OBJECTS; i++)
+        kmem_cache_free(cache, objs[i]);
+
+    CHECK(stats(cache).in_use == 0 && stats(cache).slabs <= 1,
+          "objects or slabs left over");
+
+    kmem_cache_destroy(cache);
+}
+
+int main(void) {
+    test_create();
+
+    test_alloc(1, 0, 0, 8);
+    test_alloc(24, 0, KMEM_CACHE_ZERO, 8);
+    test_alloc(40, 0, KMEM_CACHE_HWALIGN, 32);
+    test_alloc(100, 64, 0, 64);
+    test_alloc(3000, 0, KMEM_CACHE_ZERO, 8);
+
+    test_irq();
+    test_random();
+
+    if(failures) {
+        printf("%d failure(s)\n", failures);
+        return EXIT_FAILURE;
+    }
+
+    printf("All object cache tests passed\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,17 @@
+/* KallistiOS ##version##
+
+   kos/dbglog.h
+
+   Host stand-in for the kernel's debug log.
+*/
+
+#ifndef __KOS_DBGLOG_H
+#define __KOS_DBGLOG_H
+
+#include <stdio.h>
+
+#define DBG_WARNING 3
+
+#define dbglog(level, ...) ((void)(level), fprintf(stderr, __VA_ARGS__))
+
+#endif /* __KOS_DBGLOG_H */
@@ -0,0 +1,46 @@
+/* KallistiOS ##version##
+
+   kos/irq.h
+
+   Host stand-ins for the bits of the interrupt API (and of KOS's malloc.h)
+   that slab.c uses. There are no interrupts on the host, so these only keep
+   track of whether they'd be disabled, for the tests to check.
+*/
+
+#ifndef __KOS_IRQ_H
+#define __KOS_IRQ_H
+
+#include <stdbool.h>
+
+typedef int irq_mask_t;
+
+extern int irq_disabled;
+extern bool irq_in_int;
+extern bool irq_malloc_safe;
+
+static inline irq_mask_t irq_disable(void) {
+    return irq_disabled++;
+}
+
+static inline void irq_restore(irq_mask_t old) {
+    irq_disabled = old;
+}
+
+static inline int irq_inside_int(void) {
+    return irq_in_int;
+}
+
+static inline void __irq_scoped_cleanup(irq_mask_t *state) {
+    irq_restore(*state);
+}
+
+#define ___irq_disable_scoped(l) \
+    irq_mask_t __scoped_irq_##l __attribute__((cleanup(__irq_scoped_cleanup))) = irq_disable()
+#define __irq_disable_scoped(l) ___irq_disable_scoped(l)
+#define irq_disable_scoped() __irq_disable_scoped(__LINE__)
+
+static inline int malloc_irq_safe(void) {
+    return irq_malloc_safe;
+}
+
+#endif /* __KOS_IRQ_H */
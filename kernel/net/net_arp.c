@@ -164,9 +164,10 @@ int net_arp_insert(netif_t *nif, const uint8_t mac[6], const uint8_t ip[4],
    query will be sent and an error will be returned. Thus your packet send
    should also fail. Later when the transmit retries, hopefully the answer
    will have arrived. */
-int net_arp_lookup(netif_t *nif, const uint8_t ip_in[4], uint8_t mac_out[6],
-                   const ip_hdr_t *pkt, const uint8_t *data, int data_size) {
+int net_arp_lookup_pkt(netif_t *nif, const uint8_t ip_in[4],
+                       uint8_t mac_out[6], const net_pkt_t *pkt) {
     netarp_t *cur;
+    size_t data_size;
 
     /* Garbage collect expired entries */
     net_arp_gc(nif);
@@ -199,8 +200,11 @@ int net_arp_lookup(netif_t *nif, const uint8_t ip_in[4], uint8_t mac_out[6],
     memcpy(cur->ip, ip_in, 4);
     cur->timestamp = timer_ms_gettime64();
 
-    /* Copy our packet if we have one to copy. */
-    if(pkt && data && data_size) {
+    /* Copy our packet if we have one to copy. This is the only place where
+       an outgoing packet has to be flattened out, since it has to outlive the
+       buffers it points at. */
+    if(pkt && net_pkt_len(pkt) > sizeof(ip_hdr_t)) {
+        data_size = net_pkt_len(pkt) - sizeof(ip_hdr_t);
         cur->data = (uint8_t *)malloc(data_size);
 
         if(cur->data) {
@@ -211,8 +215,8 @@ int net_arp_lookup(netif_t *nif, const uint8_t ip_in[4], uint8_t mac_out[6],
                 cur->data = NULL;
             }
             else {
-                memcpy(cur->pkt, pkt, sizeof(ip_hdr_t));
-                memcpy(cur->data, data, data_size);
+                net_pkt_copy(pkt, 0, sizeof(ip_hdr_t), (uint8_t *)cur->pkt);
+                net_pkt_copy(pkt, sizeof(ip_hdr_t), data_size, cur->data);
                 cur->data_size = data_size;
             }
         }
@@ -228,6 +232,20 @@ int net_arp_lookup(netif_t *nif, const uint8_t ip_in[4], uint8_t mac_out[6],
     return -2;
 }
 
+int net_arp_lookup(netif_t *nif, const uint8_t ip_in[4], uint8_t mac_out[6],
+                   const ip_hdr_t *pkt, const uint8_t *data, int data_size) {
+    net_pkt_t p;
+
+    if(!pkt || !data || !data_size)
+        return net_arp_lookup_pkt(nif, ip_in, mac_out, NULL);
+
+    net_pkt_init(&p);
+    memcpy(net_pkt_push(&p, sizeof(ip_hdr_t)), pkt, sizeof(ip_hdr_t));
+    net_pkt_add(&p, data, data_size);
+
+    return net_arp_lookup_pkt(nif, ip_in, mac_out, &p);
+}
+
 /* Do a reverse ARP lookup: look for an IP for a given mac address; note
    that if this fails, you have no recourse. */
 int net_arp_revlookup(netif_t *nif, uint8_t ip_out[4], const uint8_t mac_in[6]) {
@@ -19,6 +19,7 @@
 #include "net_thd.h"
 #include "net_ipv4.h"
 #include "net_ipv6.h"
+#include "net_lo.h"
 
 /*
 
@@ -153,9 +154,13 @@ int net_init(uint32_t ip) {
     if(net_initted)
         return 0;
 
-    /* Detect and potentially initialize devices */
+    /* Detect and potentially initialize devices. Even if there aren't any,
+       keep going, so that the loopback device can be used. */
     if(net_dev_init() < 0)
-        return -1;
+        rv = -1;
+
+    /* Bring up the loopback device */
+    net_lo_init();
 
     /* Initialize the network thread. */
     net_thd_init();
@@ -260,6 +265,10 @@ void net_shutdown(void) {
             cur->if_shutdown(cur);
     }
 
+    /* The loopback device was stopped along with the rest, so all that's left
+       is to take it off of the list. */
+    net_lo_shutdown();
+
     net_set_default(NULL);
     net_initted = 0;
 }
@@ -33,6 +33,13 @@
 
 #define DHCP_MIN_OPTIONS_SIZE 64
 
+/* How often to check for replies while waiting on any (in milliseconds). */
+#define DHCP_POLL_PERIOD 50
+
+/* How often the callback runs when there's nothing to wait for, other than
+   the lease needing to be renewed (in milliseconds). */
+#define DHCP_IDLE_PERIOD 60000
+
 
 static int dhcp_sock = -1;
 struct sockaddr_in srv_addr;
@@ -271,6 +278,9 @@ int net_dhcp_request(uint32_t required_address) {
     state = DHCP_STATE_SELECTING;
     mutex_unlock(&dhcp_lock);
 
+    /* Get the DHCPDISCOVER out there right away. */
+    net_thd_schedule(dhcp_cbid, 0);
+
     /* We need to wait til we're either bound to an IP address, or until we give
        up all hope of doing so (give us 60 seconds). */
     if(!net_thd_is_current()) {
@@ -618,6 +628,13 @@ static void net_dhcp_thd(void *obj) {
             qpkt->next_delay <<= 1;
         }
     }
+
+    /* Keep checking for replies while we're waiting on any. Otherwise, there's
+       nothing to do until it's time to renew the lease. */
+    if(!STAILQ_EMPTY(&dhcp_pkts))
+        net_thd_schedule(dhcp_cbid, now + DHCP_POLL_PERIOD);
+    else if(state == DHCP_STATE_BOUND)
+        net_thd_schedule(dhcp_cbid, renew_time);
 }
 
 int net_dhcp_init(void) {
@@ -650,7 +667,7 @@ int net_dhcp_init(void) {
     fs_fcntl(dhcp_sock, F_SETFL, O_NONBLOCK);
 
     /* Create the callback for processing DHCP packets */
-    dhcp_cbid = net_thd_add_callback(&net_dhcp_thd, NULL, 50);
+    dhcp_cbid = net_thd_add_callback(&net_dhcp_thd, NULL, DHCP_IDLE_PERIOD);
 
     return 0;
 }
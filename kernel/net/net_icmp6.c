@@ -17,6 +17,7 @@
 #include "net_icmp6.h"
 #include "net_ipv6.h"
 #include "net_ipv4.h"   /* For net_ipv4_checksum() */
+#include "net_lo.h"
 
 #if __GNUC__ >= 9
 #pragma GCC diagnostic push
@@ -485,10 +486,8 @@ int net_icmp6_send_echo(netif_t *net, const struct in6_addr *dst, uint16_t ident
     uint64_t t;
     uint16_t sz = sizeof(icmp6_echo_hdr_t) + size + 8;
 
-    if(!net) {
-        if(!(net = net_default_dev)) {
-            return -1;
-        }
+    if(!(net = net_lo_route6(net, dst))) {
+        return -1;
     }
 
     /* If we're sending to the loopback, set that as our source too */
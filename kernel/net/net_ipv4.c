@@ -24,6 +24,7 @@
 
 #include "net_ipv4.h"
 #include "net_icmp.h"
+#include "net_lo.h"
 
 static net_ipv4_stats_t ipv4_stats = { 0 };
 
@@ -78,49 +79,28 @@ static int __pure is_broadcast(const uint8_t dest[4], const uint8_t bc[4]) {
     return 1;
 }
 
-/* Send a packet on the specified network adapter */
-int net_ipv4_send_packet(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
-                         size_t size) {
+/* Send a packet whose headers start with its IP header on the specified
+   network adapter. */
+static int net_ipv4_tx_pkt(netif_t *net, net_pkt_t *pkt) {
+    const ip_hdr_t *hdr = (const ip_hdr_t *)pkt->hdr;
     uint8_t dest_ip[4];
     uint8_t dest_mac[6];
-    uint8_t pkt[size + sizeof(ip_hdr_t) + sizeof(eth_hdr_t)];
     eth_hdr_t *ehdr;
     int err;
 
-    if(net == NULL) {
-        net = net_default_dev;
-
-        if(!net) {
-            errno = ENETDOWN;
-            return -1;
-        }
+    /* Loopback addresses (127/8) go to the loopback device. */
+    if(!(net = net_lo_route4(net, hdr->dest))) {
+        errno = ENETDOWN;
+        return -1;
     }
 
     net_ipv4_parse_address(ntohl(hdr->dest), dest_ip);
 
-    /* Is this a loopback address (127/8)? */
-    if(dest_ip[0] == 0x7F) {
-        /* Put the IP header / data into our packet */
-        memcpy(pkt, hdr, 4 * (hdr->version_ihl & 0x0f));
-        memcpy(pkt + 4 * (hdr->version_ihl & 0x0f), data, size);
-
-        ++ipv4_stats.pkt_sent;
-
-        /* Send it "away" */
-        net_ipv4_input(NULL, pkt, 4 * (hdr->version_ihl & 0x0f) + size, NULL);
-
-        return 0;
-    }
-    else if(net->flags & NETIF_NOETH) {
-        /* Put the IP header / data into our packet */
-        memcpy(pkt, hdr, 4 * (hdr->version_ihl & 0x0f));
-        memcpy(pkt + 4 * (hdr->version_ihl & 0x0f), data, size);
-
+    if(net->flags & NETIF_NOETH) {
         ++ipv4_stats.pkt_sent;
 
         /* Send it away */
-        return net->if_tx(net, pkt, 4 * (hdr->version_ihl & 0x0f) + size,
-                          NETIF_BLOCK);
+        return net_pkt_tx(net, pkt, NETIF_BLOCK);
     }
 
     /* Are we sending a broadcast packet? */
@@ -137,7 +117,7 @@ int net_ipv4_send_packet(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
         /* Get our destination's MAC address. If we do not have the MAC address
            cached, return a distinguished error to the upper-level protocol so
            that it can decide what to do. */
-        err = net_arp_lookup(net, dest_ip, dest_mac, hdr, data, size);
+        err = net_arp_lookup_pkt(net, dest_ip, dest_mac, pkt);
 
         if(err == -1) {
             errno = ENETUNREACH;
@@ -152,26 +132,33 @@ int net_ipv4_send_packet(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
     }
 
     /* Fill in the ethernet header */
-    ehdr = (eth_hdr_t *)pkt;
+    ehdr = (eth_hdr_t *)net_pkt_push(pkt, sizeof(eth_hdr_t));
     memcpy(ehdr->dest, dest_mac, 6);
     memcpy(ehdr->src, net->mac_addr, 6);
     ehdr->type[0] = 0x08;
     ehdr->type[1] = 0x00;
 
-    /* Put the IP header / data into our ethernet packet */
-    memcpy(pkt + sizeof(eth_hdr_t), hdr, 4 * (hdr->version_ihl & 0x0f));
-    memcpy(pkt + sizeof(eth_hdr_t) + 4 * (hdr->version_ihl & 0x0f), data,
-           size);
-
     ++ipv4_stats.pkt_sent;
 
     /* Send it away */
-    net->if_tx(net, pkt, sizeof(ip_hdr_t) + size + sizeof(eth_hdr_t),
-               NETIF_BLOCK);
+    net_pkt_tx(net, pkt, NETIF_BLOCK);
 
     return 0;
 }
 
+/* Send a packet on the specified network adapter */
+int net_ipv4_send_packet(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
+                         size_t size) {
+    net_pkt_t pkt;
+
+    net_pkt_init(&pkt);
+    memcpy(net_pkt_push(&pkt, 4 * (hdr->version_ihl & 0x0f)), hdr,
+           4 * (hdr->version_ihl & 0x0f));
+    net_pkt_add(&pkt, data, size);
+
+    return net_ipv4_tx_pkt(net, &pkt);
+}
+
 int net_ipv4_send(netif_t *net, const uint8_t *data, size_t size, int id, int ttl,
                   int proto, uint32_t src, uint32_t dst) {
     ip_hdr_t hdr;
@@ -289,3 +276,51 @@ uint16_t __pure net_ipv4_checksum_pseudo(in_addr_t src, in_addr_t dst, uint8_t p
 net_ipv4_stats_t net_ipv4_get_stats(void) {
     return ipv4_stats;
 }
+
+int net_ipv4_send_pkt(netif_t *net, net_pkt_t *pkt, int id, int ttl, int proto,
+                      uint32_t src, uint32_t dst) {
+    size_t size = net_pkt_len(pkt);
+    ip_hdr_t *hdr;
+    uint8_t *buf;
+    int rv;
+
+    if(!(net = net_lo_route4(net, dst))) {
+        errno = ENETDOWN;
+        return -1;
+    }
+
+    if(id == -1) {
+        id = rand() & 0xFFFF;
+    }
+
+    /* Packets that need to be fragmented go the slow way. */
+    if(size + sizeof(ip_hdr_t) >= (size_t)net->mtu) {
+        if(!(buf = (uint8_t *)malloc(size))) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        net_pkt_copy(pkt, 0, size, buf);
+        rv = net_ipv4_send(net, buf, size, id, ttl, proto, src, dst);
+        free(buf);
+
+        return rv;
+    }
+
+    /* Fill in the IPv4 Header */
+    hdr = (ip_hdr_t *)net_pkt_push(pkt, sizeof(ip_hdr_t));
+    hdr->version_ihl = 0x45;
+    hdr->tos = 0;
+    hdr->length = htons(size + 20);
+    hdr->packet_id = id;
+    hdr->flags_frag_offs = 0;
+    hdr->ttl = ttl;
+    hdr->protocol = proto;
+    hdr->checksum = 0;
+    hdr->src = src;
+    hdr->dest = dst;
+
+    hdr->checksum = net_ipv4_checksum((uint8_t *)hdr, sizeof(ip_hdr_t), 0);
+
+    return net_ipv4_tx_pkt(net, pkt);
+}
@@ -10,6 +10,8 @@
 
 #include <kos/net.h>
 
+#include "net_pkt.h"
+
 /* These structs are from AndrewK's dcload-ip. */
 typedef struct {
     uint8_t   dest[6];
@@ -30,6 +32,8 @@ int net_ipv4_send_packet(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
                          size_t size);
 int net_ipv4_send(netif_t *net, const uint8_t *data, size_t size, int id, int ttl,
                   int proto, uint32_t src, uint32_t dst);
+int net_ipv4_send_pkt(netif_t *net, net_pkt_t *pkt, int id, int ttl, int proto,
+                      uint32_t src, uint32_t dst);
 int net_ipv4_input(netif_t *src, const uint8_t *pkt, size_t pktsize,
                    const eth_hdr_t *eth);
 int net_ipv4_input_proto(netif_t *net, const ip_hdr_t *ip, const uint8_t *data);
@@ -37,6 +41,10 @@ int net_ipv4_input_proto(netif_t *net, const ip_hdr_t *ip, const uint8_t *data);
 uint16_t __pure net_ipv4_checksum_pseudo(in_addr_t src, in_addr_t dst, uint8_t proto,
                                 uint16_t len);
 
+/* In net_arp.c */
+int net_arp_lookup_pkt(netif_t *nif, const uint8_t ip_in[4],
+                       uint8_t mac_out[6], const net_pkt_t *pkt);
+
 /* In net_ipv4_frag.c */
 int net_ipv4_frag_send(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
                        size_t size);
@@ -17,6 +17,7 @@
 
 #include "net_ipv4.h"
 #include "net_thd.h"
+#include "net_lo.h"
 
 #define MAX(a, b) a > b ? a : b;
 
@@ -200,8 +201,10 @@ int net_ipv4_frag_send(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
     ip_hdr_t newhdr;
     int nfb, ds;
 
-    if(net == NULL)
-        net = net_default_dev;
+    if(!(net = net_lo_route4(net, hdr->dest))) {
+        errno = ENETDOWN;
+        return -1;
+    }
 
     /* If the packet doesn't need to be fragmented, send it away as is. */
     if(total < net->mtu) {
@@ -15,6 +15,7 @@
 #include "net_ipv6.h"
 #include "net_icmp6.h"
 #include "net_ipv4.h"
+#include "net_lo.h"
 
 #if __GNUC__ >= 9
 #pragma GCC diagnostic push
@@ -60,44 +61,26 @@ static int __pure is_in_network(netif_t *net, const struct in6_addr *ip) {
     return 0;
 }
 
-/* Send a packet on the specified network adapter */
-int net_ipv6_send_packet(netif_t *net, ipv6_hdr_t *hdr, const uint8_t *data,
-                         size_t data_size) {
-    uint8_t pkt[data_size + sizeof(ipv6_hdr_t) + sizeof(eth_hdr_t)];
+/* Send a packet whose headers start with its IPv6 header on the specified
+   network adapter. */
+static int net_ipv6_tx_pkt(netif_t *net, net_pkt_t *pkt) {
+    const ipv6_hdr_t *hdr = (const ipv6_hdr_t *)pkt->hdr;
     uint8_t dst_mac[6];
     int err;
     struct in6_addr dst = hdr->dst_addr;
     eth_hdr_t *ehdr;
 
-    if(!net) {
-        net = net_default_dev;
-
-        if(!net) {
-            errno = ENETDOWN;
-            return -1;
-        }
-    }
-
-    /* Are we sending a packet to loopback? */
-    if(IN6_IS_ADDR_LOOPBACK(&hdr->dst_addr)) {
-        memcpy(pkt, hdr, sizeof(ipv6_hdr_t));
-        memcpy(pkt + sizeof(ipv6_hdr_t), data, data_size);
-
-        ++ipv6_stats.pkt_sent;
-
-        /* Send the packet "away" */
-        net_ipv6_input(NULL, pkt, sizeof(ipv6_hdr_t) + data_size, NULL);
-        return 0;
+    /* Packets to ::1 go to the loopback device. */
+    if(!(net = net_lo_route6(net, &hdr->dst_addr))) {
+        errno = ENETDOWN;
+        return -1;
     }
-    else if(net->flags & NETIF_NOETH) {
-        memcpy(pkt, hdr, sizeof(ipv6_hdr_t));
-        memcpy(pkt + sizeof(ipv6_hdr_t), data, data_size);
 
+    if(net->flags & NETIF_NOETH) {
         ++ipv6_stats.pkt_sent;
 
         /* Send the packet away */
-        return net->if_tx(net, pkt, sizeof(ipv6_hdr_t) + data_size,
-                          NETIF_BLOCK);
+        return net_pkt_tx(net, pkt, NETIF_BLOCK);
     }
     else if(IN6_IS_ADDR_MULTICAST(&hdr->dst_addr)) {
         dst_mac[0] = dst_mac[1] = 0x33;
@@ -111,7 +94,7 @@ int net_ipv6_send_packet(netif_t *net, ipv6_hdr_t *hdr, const uint8_t *data,
             dst = net->ip6_gateway;
         }
 
-        err = net_ndp_lookup(net, &dst, dst_mac, hdr, data, data_size);
+        err = net_ndp_lookup_pkt(net, &dst, dst_mac, pkt);
 
         if(err == -1) {
             errno = ENETUNREACH;
@@ -124,37 +107,40 @@ int net_ipv6_send_packet(netif_t *net, ipv6_hdr_t *hdr, const uint8_t *data,
     }
 
     /* Fill in the ethernet header */
-    ehdr = (eth_hdr_t *)pkt;
+    ehdr = (eth_hdr_t *)net_pkt_push(pkt, sizeof(eth_hdr_t));
     memcpy(ehdr->dest, dst_mac, 6);
     memcpy(ehdr->src, net->mac_addr, 6);
     ehdr->type[0] = 0x86;
     ehdr->type[1] = 0xDD;
 
-    /* Put the IP header / data into our ethernet packet */
-    memcpy(pkt + sizeof(eth_hdr_t), hdr, sizeof(ipv6_hdr_t));
-    memcpy(pkt + sizeof(eth_hdr_t) + sizeof(ipv6_hdr_t), data, data_size);
-
     ++ipv6_stats.pkt_sent;
 
     /* Send it away */
-    net->if_tx(net, pkt, sizeof(ipv6_hdr_t) + data_size + sizeof(eth_hdr_t),
-               NETIF_BLOCK);
+    net_pkt_tx(net, pkt, NETIF_BLOCK);
 
     return 0;
 }
 
+/* Send a packet on the specified network adapter */
+int net_ipv6_send_packet(netif_t *net, ipv6_hdr_t *hdr, const uint8_t *data,
+                         size_t data_size) {
+    net_pkt_t pkt;
+
+    net_pkt_init(&pkt);
+    memcpy(net_pkt_push(&pkt, sizeof(ipv6_hdr_t)), hdr, sizeof(ipv6_hdr_t));
+    net_pkt_add(&pkt, data, data_size);
+
+    return net_ipv6_tx_pkt(net, &pkt);
+}
+
 int net_ipv6_send(netif_t *net, const uint8_t *data, size_t data_size,
                   int hop_limit, int proto, const struct in6_addr *src,
                   const struct in6_addr *dst) {
     ipv6_hdr_t hdr;
 
-    if(!net) {
-        net = net_default_dev;
-
-        if(!net) {
-            errno = ENETDOWN;
-            return -1;
-        }
+    if(!(net = net_lo_route6(net, dst))) {
+        errno = ENETDOWN;
+        return -1;
     }
 
     /* Set up the hop limit. We need to do this here, in case we end up passing
@@ -193,6 +179,48 @@ int net_ipv6_send(netif_t *net, const uint8_t *data, size_t data_size,
     return net_ipv6_send_packet(net, &hdr, data, data_size);
 }
 
+int net_ipv6_send_pkt(netif_t *net, net_pkt_t *pkt, int hop_limit, int proto,
+                      const struct in6_addr *src, const struct in6_addr *dst) {
+    ipv6_hdr_t *hdr;
+    size_t data_size = net_pkt_len(pkt);
+
+    if(!(net = net_lo_route6(net, dst))) {
+        errno = ENETDOWN;
+        return -1;
+    }
+
+    /* See net_ipv6_send() above. */
+    if(!hop_limit) {
+        if(net->hop_limit)
+            hop_limit = net->hop_limit;
+        else
+            hop_limit = 255;
+    }
+
+    if(IN6_IS_ADDR_V4MAPPED(src) && IN6_IS_ADDR_V4MAPPED(dst)) {
+        return net_ipv4_send_pkt(net, pkt, -1, hop_limit, proto,
+                                 src->__s6_addr.__s6_addr32[3],
+                                 dst->__s6_addr.__s6_addr32[3]);
+    }
+    else if(IN6_IS_ADDR_V4MAPPED(src) || IN6_IS_ADDR_V4MAPPED(dst) ||
+            IN6_IS_ADDR_V4COMPAT(src) || IN6_IS_ADDR_V4COMPAT(dst)) {
+        return -1;
+    }
+
+    hdr = (ipv6_hdr_t *)net_pkt_push(pkt, sizeof(ipv6_hdr_t));
+    hdr->version_lclass = 0x60;
+    hdr->hclass_lflow = 0;
+    hdr->lclass = 0;
+    hdr->length = ntohs(data_size);
+    hdr->next_header = proto;
+    hdr->hop_limit = hop_limit;
+    hdr->src_addr = *src;
+    hdr->dst_addr = *dst;
+
+    /* XXXX: Handle fragmentation... */
+    return net_ipv6_tx_pkt(net, pkt);
+}
+
 int net_ipv6_input(netif_t *src, const uint8_t *pkt, size_t pktsize,
                    const eth_hdr_t *eth) {
     ipv6_hdr_t *ip;
@@ -286,11 +314,13 @@ int net_ipv6_init(void) {
 
     /* Also register for the one for our link-local address' solicited nodes
        group (which will do the same for all our other addresses too). */
-    mac[2] = 0xFF;
-    mac[3] = net_default_dev->ip6_lladdr.s6_addr[13];
-    mac[4] = net_default_dev->ip6_lladdr.s6_addr[14];
-    mac[5] = net_default_dev->ip6_lladdr.s6_addr[15];
-    net_multicast_add(mac);
+    if(net_default_dev) {
+        mac[2] = 0xFF;
+        mac[3] = net_default_dev->ip6_lladdr.s6_addr[13];
+        mac[4] = net_default_dev->ip6_lladdr.s6_addr[14];
+        mac[5] = net_default_dev->ip6_lladdr.s6_addr[15];
+        net_multicast_add(mac);
+    }
 
     return 0;
 }
@@ -302,11 +332,13 @@ void net_ipv6_shutdown(void) {
     net_multicast_del(mac);
 
     /* ... and our solicited nodes multicast group */
-    mac[2] = 0xFF;
-    mac[3] = net_default_dev->ip6_lladdr.s6_addr[13];
-    mac[4] = net_default_dev->ip6_lladdr.s6_addr[14];
-    mac[5] = net_default_dev->ip6_lladdr.s6_addr[15];
-    net_multicast_del(mac);
+    if(net_default_dev) {
+        mac[2] = 0xFF;
+        mac[3] = net_default_dev->ip6_lladdr.s6_addr[13];
+        mac[4] = net_default_dev->ip6_lladdr.s6_addr[14];
+        mac[5] = net_default_dev->ip6_lladdr.s6_addr[15];
+        net_multicast_del(mac);
+    }
 }
 
 #if __GNUC__ >= 9
@@ -40,12 +40,18 @@ int net_ipv6_send_packet(netif_t *net, ipv6_hdr_t *hdr, const uint8_t *data,
 int net_ipv6_send(netif_t *net, const uint8_t *data, size_t data_size,
                   int hop_limit, int proto, const struct in6_addr *src,
                   const struct in6_addr *dst);
+int net_ipv6_send_pkt(netif_t *net, net_pkt_t *pkt, int hop_limit, int proto,
+                      const struct in6_addr *src, const struct in6_addr *dst);
 int net_ipv6_input(netif_t *src, const uint8_t *pkt, size_t pktsize,
                    const eth_hdr_t *eth);
 uint16_t net_ipv6_checksum_pseudo(const struct in6_addr *src,
                                 const struct in6_addr *dst,
                                 uint32_t upper_len, uint8_t next_hdr);
 
+/* In net_ndp.c */
+int net_ndp_lookup_pkt(netif_t *net, const struct in6_addr *ip,
+                       uint8_t mac_out[6], const net_pkt_t *pkt);
+
 extern const struct in6_addr in6addr_linklocal_allnodes;
 extern const struct in6_addr in6addr_linklocal_allrouters;
 
@@ -0,0 +1,319 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_lo.c
+
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <kos/net.h>
+#include <kos/irq.h>
+#include <kos/mutex.h>
+#include <kos/sem.h>
+#include <kos/thread.h>
+
+#include "net_ipv4.h"
+#include "net_ipv6.h"
+#include "net_lo.h"
+
+/* This is the loopback device, which everything sent to 127.0.0.0/8 or ::1
+   goes through. Packets sent on it are queued up, and fed back into the stack
+   by a thread of its own, so that the stack is never reentered from the middle
+   of a send (with whatever locks the sender is holding). When the queue is
+   full, packets are dropped, just like a real device would.
+
+   Most programs never send anything to themselves, so the queue and the
+   thread are only set up on the first packet sent. The queue holds a few
+   default-sized TCP windows worth of data. */
+
+#define LO_QUEUE_SIZE   (64 * 1024)
+#define LO_MTU          16384
+
+/* Each packet in the queue is a 32-bit length, followed by the packet, padded
+   to a multiple of 4 bytes. Packets never wrap around the end of the queue;
+   LO_WRAP marks the point where the rest of the queue is skipped. */
+#define LO_WRAP         0xFFFFFFFF
+#define LO_REC_SIZE(n)  ((sizeof(uint32_t) + (n) + 3) & ~3)
+
+static uint8_t *lo_queue;
+static uint32_t lo_head, lo_tail, lo_used;
+static mutex_t lo_mutex = MUTEX_INITIALIZER;
+static semaphore_t lo_sem = SEM_INITIALIZER(0);
+static kthread_t *lo_thd;
+static volatile int lo_done;
+
+/* Make room for a packet at the end of the queue. lo_mutex must be held. */
+static uint8_t *lo_alloc(uint32_t len) {
+    uint32_t need = LO_REC_SIZE(len);
+    uint8_t *rv;
+
+    if(!lo_used)
+        lo_head = lo_tail = 0;
+
+    if(lo_used && lo_tail <= lo_head) {
+        if(lo_head - lo_tail < need)
+            return NULL;
+    }
+    else if(LO_QUEUE_SIZE - lo_tail < need) {
+        if(lo_head < need)
+            return NULL;
+
+        if(LO_QUEUE_SIZE - lo_tail >= sizeof(uint32_t))
+            *(uint32_t *)(lo_queue + lo_tail) = LO_WRAP;
+
+        lo_used += LO_QUEUE_SIZE - lo_tail;
+        lo_tail = 0;
+    }
+
+    rv = lo_queue + lo_tail;
+    *(uint32_t *)rv = len;
+    lo_tail += need;
+    lo_used += need;
+
+    if(lo_tail == LO_QUEUE_SIZE)
+        lo_tail = 0;
+
+    return rv + sizeof(uint32_t);
+}
+
+static void *lo_thd_fn(void *data);
+
+/* Set up the queue and the thread, if they aren't already. lo_mutex must be
+   held. This can't be done from an interrupt, so the packets sent from one
+   before anything else was are dropped. */
+static int lo_queue_init(void) {
+    if(lo_queue)
+        return 0;
+
+    if(irq_inside_int())
+        return -1;
+
+    if(!(lo_queue = (uint8_t *)malloc(LO_QUEUE_SIZE)))
+        return -1;
+
+    lo_head = lo_tail = lo_used = 0;
+
+    if(!(lo_thd = thd_create(0, &lo_thd_fn, NULL))) {
+        free(lo_queue);
+        lo_queue = NULL;
+        return -1;
+    }
+
+    thd_set_label(lo_thd, "[net_lo]");
+
+    return 0;
+}
+
+static int lo_if_tx_iov(netif_t *self, const struct iovec *iov, int iovcnt,
+                        int blocking) {
+    uint32_t len = 0;
+    uint8_t *buf;
+    int i;
+
+    (void)blocking;
+
+    if(!(self->flags & NETIF_RUNNING))
+        return NETIF_TX_ERROR;
+
+    for(i = 0; i < iovcnt; ++i)
+        len += iov[i].iov_len;
+
+    if(mutex_lock_irqsafe(&lo_mutex))
+        return NETIF_TX_AGAIN;
+
+    if(lo_queue_init() || !(buf = lo_alloc(len))) {
+        mutex_unlock(&lo_mutex);
+        return NETIF_TX_AGAIN;
+    }
+
+    for(i = 0; i < iovcnt; ++i) {
+        memcpy(buf, iov[i].iov_base, iov[i].iov_len);
+        buf += iov[i].iov_len;
+    }
+
+    mutex_unlock(&lo_mutex);
+    sem_signal(&lo_sem);
+
+    return NETIF_TX_OK;
+}
+
+static int lo_if_tx(netif_t *self, const uint8_t *data, int len,
+                    int blocking) {
+    struct iovec iov = { (void *)data, len };
+
+    return lo_if_tx_iov(self, &iov, 1, blocking);
+}
+
+static void *lo_thd_fn(void *data) {
+    uint32_t len;
+    uint8_t *pkt;
+
+    (void)data;
+
+    for(;;) {
+        sem_wait(&lo_sem);
+
+        if(lo_done)
+            break;
+
+        mutex_lock(&lo_mutex);
+
+        if(LO_QUEUE_SIZE - lo_head < sizeof(uint32_t) ||
+           *(uint32_t *)(lo_queue + lo_head) == LO_WRAP) {
+            lo_used -= LO_QUEUE_SIZE - lo_head;
+            lo_head = 0;
+        }
+
+        pkt = lo_queue + lo_head;
+        mutex_unlock(&lo_mutex);
+
+        /* Hand the packet back to the stack, straight from the queue. */
+        len = *(uint32_t *)pkt;
+        pkt += sizeof(uint32_t);
+
+        if((pkt[0] >> 4) == 4)
+            net_ipv4_input(&net_lo_if, pkt, len, NULL);
+        else if((pkt[0] >> 4) == 6)
+            net_ipv6_input(&net_lo_if, pkt, len, NULL);
+
+        mutex_lock(&lo_mutex);
+        lo_head += LO_REC_SIZE(len);
+        lo_used -= LO_REC_SIZE(len);
+
+        if(lo_head == LO_QUEUE_SIZE)
+            lo_head = 0;
+
+        mutex_unlock(&lo_mutex);
+    }
+
+    return NULL;
+}
+
+static int lo_if_detect(netif_t *self) {
+    self->flags |= NETIF_DETECTED;
+    return 0;
+}
+
+static int lo_if_init(netif_t *self) {
+    if(self->flags & NETIF_INITIALIZED)
+        return 0;
+
+    self->flags |= NETIF_INITIALIZED;
+
+    return 0;
+}
+
+static int lo_if_shutdown(netif_t *self) {
+    if(!(self->flags & NETIF_INITIALIZED))
+        return 0;
+
+    self->flags &= ~NETIF_INITIALIZED;
+
+    return 0;
+}
+
+static int lo_if_start(netif_t *self) {
+    if(self->flags & NETIF_RUNNING)
+        return 0;
+
+    lo_done = 0;
+    sem_init(&lo_sem, 0);
+    self->flags |= NETIF_RUNNING;
+
+    return 0;
+}
+
+static int lo_if_stop(netif_t *self) {
+    if(!(self->flags & NETIF_RUNNING))
+        return 0;
+
+    self->flags &= ~NETIF_RUNNING;
+
+    if(lo_thd) {
+        lo_done = 1;
+        sem_signal(&lo_sem);
+        thd_join(lo_thd, NULL);
+        lo_thd = NULL;
+    }
+
+    sem_destroy(&lo_sem);
+
+    /* Anything still queued is gone, so start the next run afresh. */
+    free(lo_queue);
+    lo_queue = NULL;
+
+    return 0;
+}
+
+static int lo_if_tx_commit(netif_t *self) {
+    (void)self;
+    return 0;
+}
+
+static int lo_if_rx_poll(netif_t *self) {
+    (void)self;
+    return 0;
+}
+
+static int lo_if_set_flags(netif_t *self, uint32_t flags_and,
+                           uint32_t flags_or) {
+    self->flags = (self->flags & flags_and) | flags_or;
+    return 0;
+}
+
+static int lo_if_set_mc(netif_t *self, const uint8_t *list, int count) {
+    (void)self;
+    (void)list;
+    (void)count;
+    return 0;
+}
+
+netif_t net_lo_if = {
+    .name = "lo",
+    .descr = "Loopback",
+    .flags = NETIF_NOETH,
+    .ip_addr = { 127, 0, 0, 1 },
+    .netmask = { 255, 0, 0, 0 },
+    .broadcast = { 127, 255, 255, 255 },
+    .mtu = LO_MTU,
+    .ip6_lladdr = IN6ADDR_LOOPBACK_INIT,
+    .mtu6 = LO_MTU,
+    .if_detect = lo_if_detect,
+    .if_init = lo_if_init,
+    .if_shutdown = lo_if_shutdown,
+    .if_start = lo_if_start,
+    .if_stop = lo_if_stop,
+    .if_tx = lo_if_tx,
+    .if_tx_commit = lo_if_tx_commit,
+    .if_rx_poll = lo_if_rx_poll,
+    .if_set_flags = lo_if_set_flags,
+    .if_set_mc = lo_if_set_mc,
+    .if_tx_iov = lo_if_tx_iov
+};
+
+int net_lo_init(void) {
+    netif_t *lo = &net_lo_if;
+
+    if(lo->if_detect(lo) < 0 || lo->if_init(lo) < 0)
+        return -1;
+
+    if(lo->if_start(lo) < 0) {
+        lo->if_shutdown(lo);
+        return -1;
+    }
+
+    return net_reg_device(lo);
+}
+
+void net_lo_shutdown(void) {
+    netif_t *lo = &net_lo_if;
+
+    lo->if_stop(lo);
+    lo->if_shutdown(lo);
+
+    if(lo->flags & NETIF_REGISTERED)
+        net_unreg_device(lo);
+}
@@ -0,0 +1,45 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_lo.h
+
+*/
+
+#ifndef __LOCAL_NET_LO_H
+#define __LOCAL_NET_LO_H
+
+#include <kos/cdefs.h>
+__BEGIN_DECLS
+
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <kos/net.h>
+
+extern netif_t net_lo_if;
+
+int net_lo_init(void);
+void net_lo_shutdown(void);
+
+/* Pick the device to send a packet to the given address on. Loopback addresses
+   always go to the loopback device, no matter what device was asked for.
+   Everything else goes to the device asked for, or the default one. */
+static inline netif_t *net_lo_route4(netif_t *net, uint32_t dst) {
+    if((ntohl(dst) >> 24) == 127)
+        return &net_lo_if;
+
+    return net ? net : net_default_dev;
+}
+
+static inline netif_t *net_lo_route6(netif_t *net,
+                                     const struct in6_addr *dst) {
+    if(IN6_IS_ADDR_LOOPBACK(dst))
+        return &net_lo_if;
+    else if(IN6_IS_ADDR_V4MAPPED(dst))
+        return net_lo_route4(net, dst->__s6_addr.__s6_addr32[3]);
+
+    return net ? net : net_default_dev;
+}
+
+__END_DECLS
+
+#endif /* !__LOCAL_NET_LO_H */
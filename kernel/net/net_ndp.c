@@ -157,9 +157,10 @@ static void net_ndp_send_sol(netif_t *net, const struct in6_addr *ip) {
     net_icmp6_send_nsol(net, &dst, ip, 0);
 }
 
-int net_ndp_lookup(netif_t *net, const struct in6_addr *ip, uint8_t mac_out[6],
-                   const ipv6_hdr_t *pkt, const uint8_t *data, int data_size) {
+int net_ndp_lookup_pkt(netif_t *net, const struct in6_addr *ip,
+                       uint8_t mac_out[6], const net_pkt_t *pkt) {
     ndp_entry_t *i;
+    size_t data_size;
     uint64_t now = timer_ms_gettime64();
 
     /* Garbage collect, so we don't end up returning really stale entries */
@@ -192,7 +193,8 @@ int net_ndp_lookup(netif_t *net, const struct in6_addr *ip, uint8_t mac_out[6],
     i->state = NDP_STATE_INCOMPLETE;
 
     /* Copy our packet if we have one to copy. */
-    if(pkt && data && data_size) {
+    if(pkt && net_pkt_len(pkt) > sizeof(ipv6_hdr_t)) {
+        data_size = net_pkt_len(pkt) - sizeof(ipv6_hdr_t);
         i->data = (uint8_t *)malloc(data_size);
 
         if(i->data) {
@@ -203,8 +205,8 @@ int net_ndp_lookup(netif_t *net, const struct in6_addr *ip, uint8_t mac_out[6],
                 i->data = NULL;
             }
             else {
-                memcpy(i->pkt, pkt, sizeof(ipv6_hdr_t));
-                memcpy(i->data, data, data_size);
+                net_pkt_copy(pkt, 0, sizeof(ipv6_hdr_t), (uint8_t *)i->pkt);
+                net_pkt_copy(pkt, sizeof(ipv6_hdr_t), data_size, i->data);
                 i->data_size = data_size;
             }
         }
@@ -218,6 +220,20 @@ int net_ndp_lookup(netif_t *net, const struct in6_addr *ip, uint8_t mac_out[6],
     return -2;
 }
 
+int net_ndp_lookup(netif_t *net, const struct in6_addr *ip, uint8_t mac_out[6],
+                   const ipv6_hdr_t *pkt, const uint8_t *data, int data_size) {
+    net_pkt_t p;
+
+    if(!pkt || !data || !data_size)
+        return net_ndp_lookup_pkt(net, ip, mac_out, NULL);
+
+    net_pkt_init(&p);
+    memcpy(net_pkt_push(&p, sizeof(ipv6_hdr_t)), pkt, sizeof(ipv6_hdr_t));
+    net_pkt_add(&p, data, data_size);
+
+    return net_ndp_lookup_pkt(net, ip, mac_out, &p);
+}
+
 int net_ndp_init(void) {
     return 0;
 }
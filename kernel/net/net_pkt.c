@@ -0,0 +1,129 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_pkt.c
+
+*/
+
+#include <string.h>
+#include <stdint.h>
+#include <kos/net.h>
+
+#include "net_pkt.h"
+
+void net_pkt_copy(const net_pkt_t *pkt, size_t off, size_t len, uint8_t *out) {
+    const uint8_t *src;
+    size_t n;
+    int i;
+
+    for(i = 0; i <= pkt->data_cnt && len; ++i) {
+        if(i) {
+            src = (const uint8_t *)pkt->iov[i].iov_base;
+            n = pkt->iov[i].iov_len;
+        }
+        else {
+            src = pkt->hdr;
+            n = net_pkt_hdr_len(pkt);
+        }
+
+        if(off >= n) {
+            off -= n;
+            continue;
+        }
+
+        src += off;
+        n -= off;
+        off = 0;
+
+        if(n > len)
+            n = len;
+
+        memcpy(out, src, n);
+        out += n;
+        len -= n;
+    }
+}
+
+/* Sum up a piece of the packet, 16 bits at a time, as if it started on an even
+   byte. */
+static uint32_t sum_piece(const uint8_t *data, size_t len) {
+    uint32_t sum = 0;
+    uint16_t tmp;
+
+    if(!((uintptr_t)data & 1)) {
+        for(; len > 1; len -= 2, data += 2)
+            sum += *(const uint16_t *)data;
+    }
+    else {
+        for(; len > 1; len -= 2, data += 2) {
+            memcpy(&tmp, data, 2);
+            sum += tmp;
+        }
+    }
+
+    if(len) {
+        tmp = 0;
+        memcpy(&tmp, data, 1);
+        sum += tmp;
+    }
+
+    return sum;
+}
+
+static inline uint32_t fold(uint32_t sum) {
+    while(sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+
+    return sum;
+}
+
+uint16_t net_pkt_checksum(const net_pkt_t *pkt, size_t len, uint16_t sum) {
+    uint32_t total = sum, part;
+    const uint8_t *src;
+    size_t n, pos = 0;
+    int i;
+
+    for(i = 0; i <= pkt->data_cnt && len; ++i) {
+        if(i) {
+            src = (const uint8_t *)pkt->iov[i].iov_base;
+            n = pkt->iov[i].iov_len;
+        }
+        else {
+            src = pkt->hdr;
+            n = net_pkt_hdr_len(pkt);
+        }
+
+        if(n > len)
+            n = len;
+
+        part = fold(sum_piece(src, n));
+
+        /* A piece that starts on an odd byte of the packet has all of its
+           bytes in the wrong half of each word, which is fixed by swapping
+           the halves of its sum (RFC 1071, section 2). */
+        if(pos & 1)
+            part = ((part & 0xFF) << 8) | (part >> 8);
+
+        total += part;
+        pos += n;
+        len -= n;
+    }
+
+    return ~fold(total);
+}
+
+int net_pkt_tx(netif_t *net, net_pkt_t *pkt, int blocking) {
+    size_t len = net_pkt_len(pkt);
+
+    pkt->iov[0].iov_base = pkt->hdr;
+    pkt->iov[0].iov_len = net_pkt_hdr_len(pkt);
+
+    if(net->if_tx_iov)
+        return net->if_tx_iov(net, pkt->iov, pkt->data_cnt + 1, blocking);
+
+    {
+        uint8_t buf[len] __attribute__((aligned(4)));
+
+        net_pkt_copy(pkt, 0, len, buf);
+        return net->if_tx(net, buf, len, blocking);
+    }
+}
@@ -0,0 +1,96 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_pkt.h
+
+*/
+
+#ifndef __LOCAL_NET_PKT_H
+#define __LOCAL_NET_PKT_H
+
+#include <kos/cdefs.h>
+__BEGIN_DECLS
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <kos/net.h>
+
+/* Outgoing packets are described with one of these, all the way from the
+   protocol that builds them down to the network device. The headers are built
+   back to front in the headroom, each layer prepending its own header to the
+   ones above it, so that they always end up in one contiguous block. The
+   payload itself is never copied, the packet only points at it, so it must
+   stay valid until the packet has been handed to the device. */
+
+/* Enough for an ethernet header, an IPv6 header and a TCP header with the
+   largest possible options. */
+#define NET_PKT_HEADROOM    128
+
+/* Maximum number of pieces of payload in a packet. */
+#define NET_PKT_MAX_DATA    7
+
+typedef struct net_pkt {
+    uint8_t *hdr;
+    size_t data_len;
+    int data_cnt;
+
+    /* The first entry always points at the headers, the rest at the pieces of
+       the payload. */
+    struct iovec iov[NET_PKT_MAX_DATA + 1];
+
+    uint8_t headroom[NET_PKT_HEADROOM] __attribute__((aligned(4)));
+} net_pkt_t;
+
+static inline void net_pkt_init(net_pkt_t *pkt) {
+    pkt->hdr = pkt->headroom + NET_PKT_HEADROOM;
+    pkt->data_len = 0;
+    pkt->data_cnt = 0;
+}
+
+/* Make room for a header in front of the current ones, and return where it
+   goes. */
+static inline void *net_pkt_push(net_pkt_t *pkt, size_t len) {
+    pkt->hdr -= len;
+    return pkt->hdr;
+}
+
+static inline size_t net_pkt_hdr_len(const net_pkt_t *pkt) {
+    return pkt->headroom + NET_PKT_HEADROOM - pkt->hdr;
+}
+
+static inline size_t net_pkt_len(const net_pkt_t *pkt) {
+    return net_pkt_hdr_len(pkt) + pkt->data_len;
+}
+
+/* Add a piece of payload to the end of the packet. Returns -1 if there's no
+   room left for it. */
+static inline int net_pkt_add(net_pkt_t *pkt, const void *data, size_t len) {
+    if(!len)
+        return 0;
+
+    if(pkt->data_cnt == NET_PKT_MAX_DATA)
+        return -1;
+
+    ++pkt->data_cnt;
+    pkt->iov[pkt->data_cnt].iov_base = (void *)data;
+    pkt->iov[pkt->data_cnt].iov_len = len;
+    pkt->data_len += len;
+
+    return 0;
+}
+
+/* Copy len bytes of the packet, starting at off bytes past the start of the
+   headers, to a flat buffer. */
+void net_pkt_copy(const net_pkt_t *pkt, size_t off, size_t len, uint8_t *out);
+
+/* Compute an IP-style checksum over the first len bytes of the packet, like
+   net_ipv4_checksum() does for a flat buffer. */
+uint16_t net_pkt_checksum(const net_pkt_t *pkt, size_t len, uint16_t sum);
+
+/* Hand a fully built packet to a network device, either as is if the driver
+   can deal with that, or flattened out otherwise. */
+int net_pkt_tx(netif_t *net, net_pkt_t *pkt, int blocking);
+
+__END_DECLS
+
+#endif /* !__LOCAL_NET_PKT_H */
@@ -20,6 +20,7 @@
 #include <kos/mutex.h>
 #include <kos/thread.h>
 #include <kos/rwsem.h>
+#include <kos/slab.h>
 #include <kos/fs_socket.h>
 
 #include <kos/timer.h>
@@ -29,6 +30,7 @@
 #include "net_ipv4.h"
 #include "net_ipv6.h"
 #include "net_thd.h"
+#include "net_lo.h"
 
 /* Since some of this is a bit odd in its implementation, here's a few notes on
    what my thinking was while writing all of this...
@@ -74,21 +76,37 @@
    real socket created for them until they are accept()ed.
 
    On matching sockets:
-   All new sockets (including those created by accept()) are added to the head
-   of the list. Since we cannot bind a socket to an already used port for
-   listening, that means that any fully-created sockets should appear in the
-   list in front of those created for listening to a port (and thus that are
-   only partially-created). This simplifies the procedure for finding matching
-   sockets for incoming packets, since this makes sure that the fully-created
-   socket will be found first if it exists when simply iterating through the
-   list of sockets.
+   Besides the list of all sockets, there are three hash tables, all protected
+   by the same reader/writer semaphore as the list. Sockets that have a remote
+   address (those that have called connect() and those created by accept())
+   are hashed by the remote address and both ports. All other sockets that
+   have a local port are hashed by that port alone, and every socket with a
+   local port is also on a third table used to find free ports in bind() and
+   connect(). Incoming packets are first matched against the connected socket
+   table, and only if nothing is found there against the listening sockets, so
+   that the fully-created socket is always found first if it exists. Either
+   way, only the sockets in one bucket are looked at, no matter how many
+   sockets are open.
 
    On what's actually here:
-   I didn't bother implementing any TCP extensions beyond RFC 793. That means
-   that I just ignore things like the timestamp option and the selective
-   acknowledgement option. That also means that the window size maxes out at
-   65535. Some extensions may be implemented in the future, if I see fit to do
-   so. That all said, everything in here works just fine over IPv4 or IPv6, and
+   On top of RFC 793, this implements slow start, congestion avoidance, fast
+   retransmit and fast recovery (RFC 5681, with the NewReno changes from RFC
+   6582), the retransmission timer calculation from RFC 6298, window scaling
+   and timestamps (RFC 7323), and selective acknowledgements (RFC 2018). Each
+   of these can be turned off per socket with setsockopt(), which is useful
+   when talking to broken peers. Window scaling, timestamps and SACK are only
+   used if both sides agree to them while opening the connection.
+
+   Out-of-order segments are written straight to their place in the receive
+   buffer (past the data that the user can read), and the ranges that have
+   been received are kept in the list of SACK blocks that we report back to
+   the peer. When the missing data arrives, those ranges become readable
+   without any copying. On the sending side, the SACK blocks reported by the
+   peer are kept in a small scoreboard, which is used to pick what to resend
+   during fast recovery. The scoreboard is dropped on a retransmission timeout,
+   as RFC 6675 asks for.
+
+   That all said, everything in here works just fine over IPv4 or IPv6, and
    can be used just fine to communicate with "normal" TCP/IP implementations.
 */
 
@@ -113,18 +131,23 @@ struct lsock {
     uint32_t isn;
     uint32_t wnd;
     uint16_t mss;
+    uint8_t wscale;
+    uint32_t ext;
+    uint32_t tsval;
 };
 
 /* Send/receive variables... */
 struct sndrec {
     uint32_t una;
     uint32_t nxt;
+    uint32_t max;
     uint32_t wnd;
     uint32_t up;
     uint32_t wl1;
     uint32_t wl2;
     uint32_t iss;
     uint16_t mss;
+    uint8_t wscale;
 };
 
 struct rcvrec {
@@ -132,10 +155,39 @@ struct rcvrec {
     uint32_t wnd;
     uint32_t up;
     uint32_t irs;
+    uint8_t wscale;
 };
 
+/* A range of sequence numbers, used for SACK blocks */
+struct seqrange {
+    uint32_t start;
+    uint32_t end;
+};
+
+/* Congestion control and retransmission timer variables. The smoothed RTT and
+   its variation are kept in milliseconds, scaled by 8 and 4 respectively. */
+struct ccrec {
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t recover;
+    uint32_t rexmt;
+    uint32_t rto;
+    int32_t srtt;
+    int32_t rttvar;
+    uint32_t rtt_seq;
+    uint64_t rtt_time;
+    int dupacks;
+    int flags;
+};
+
+/* Maximum number of SACK blocks tracked for either direction. */
+#define TCP_MAX_SACK        4
+#define TCP_MAX_SACK_SB     8
+
 struct tcp_sock {
     LIST_ENTRY(tcp_sock) sock_list;
+    LIST_ENTRY(tcp_sock) hash_list;
+    LIST_ENTRY(tcp_sock) bind_list;
     struct sockaddr_in6 local_addr;
     struct sockaddr_in6 remote_addr;
 
@@ -148,6 +200,7 @@ struct tcp_sock {
     int hop_limit;
     uint32_t rcvbuf_sz;
     uint32_t sndbuf_sz;
+    uint32_t ext;
 
     union {
         struct {
@@ -168,12 +221,25 @@ struct tcp_sock {
             uint32_t rcvbuf_tail;
             uint8_t *sndbuf;
             uint32_t sndbuf_cur_sz;
-            uint32_t sndbuf_head;
             uint32_t sndbuf_acked;
             uint32_t sndbuf_tail;
             uint64_t timer;
             condvar_t send_cv;
             condvar_t recv_cv;
+
+            /* Extensions in use on the connection */
+            uint32_t ext;
+            struct ccrec cc;
+            uint32_t ts_recent;
+            uint32_t last_ack_sent;
+
+            /* Out-of-order data we have, most recently received first */
+            int rcv_nsack;
+            struct seqrange rcv_sack[TCP_MAX_SACK];
+
+            /* Data the peer has told us it has, in sequence order */
+            int snd_nsack;
+            struct seqrange snd_sack[TCP_MAX_SACK_SB];
         } data;
     };
 };
@@ -181,7 +247,15 @@ struct tcp_sock {
 LIST_HEAD(tcp_sock_list, tcp_sock);
 
 static struct tcp_sock_list tcp_socks = LIST_HEAD_INITIALIZER(0);
+
+/* Hash tables for matching sockets, see the comment at the top of the file. */
+#define TCP_HASH_SIZE       128
+
+static struct tcp_sock_list tcp_conn_hash[TCP_HASH_SIZE];
+static struct tcp_sock_list tcp_port_hash[TCP_HASH_SIZE];
+static struct tcp_sock_list tcp_bind_hash[TCP_HASH_SIZE];
 static rw_semaphore_t tcp_sem = RWSEM_INITIALIZER;
+static kmem_cache_t *tcp_sock_cache;
 static int thd_cb_id = 0;
 
 /* Default starting window size for connections. This should be big enough as a
@@ -195,8 +269,31 @@ static int thd_cb_id = 0;
    to be 15 seconds, since that's what Mac OS X does. */
 #define TCP_DEFAULT_MSL     15000
 
-/* Default retransmission timeout (in milliseconds). */
-#define TCP_DEFAULT_RTTO    2000
+/* Initial retransmission timeout (in milliseconds), as per RFC 6298. */
+#define TCP_DEFAULT_RTTO    1000
+
+/* Bounds on the retransmission timeout (in milliseconds). RFC 6298 asks for a
+   minimum of one second, but like most other stacks we go lower than that,
+   since that is far too long on the local networks that most of the machines
+   running this live on. */
+#define TCP_MIN_RTO         200
+#define TCP_MAX_RTO         60000
+
+/* Granularity of the retransmission timer (in milliseconds). The callback in
+   the network thread is scheduled for when each timer expires, so this only
+   needs to cover how late it might get around to running. */
+#define TCP_TIMER_GRANULARITY   10
+
+/* How often the callback in the network thread runs when no timers are
+   pending (in milliseconds). */
+#define TCP_THD_PERIOD          1000
+
+/* Largest send or receive buffer, when window scaling is enabled. Without it,
+   the buffers are limited to 65535 bytes. */
+#define TCP_MAX_BUFFER      (256 * 1024)
+
+/* Largest window scale shift allowed by RFC 7323 */
+#define TCP_MAX_WSCALE      14
 
 /* Default hop limit (or ttl for IPv4) for new sockets */
 #define TCP_DEFAULT_HOPS    64
@@ -235,6 +332,43 @@ static int thd_cb_id = 0;
 #define TCP_OPT_EOL             0
 #define TCP_OPT_NOP             1
 #define TCP_OPT_MSS             2
+#define TCP_OPT_WSCALE          3
+#define TCP_OPT_SACK_PERM       4
+#define TCP_OPT_SACK            5
+#define TCP_OPT_TIMESTAMP       8
+
+/* Maximum size of the options in a header */
+#define TCP_MAX_OPTS            40
+
+/* Size of the timestamp option, padded with NOPs */
+#define TCP_TS_OPT_LEN          12
+
+/* Extensions that can be used on a socket. Congestion control has nothing to
+   negotiate, the rest are only used if both sides ask for them. */
+#define TCP_EXT_CC              0x00000001
+#define TCP_EXT_WSCALE          0x00000002
+#define TCP_EXT_TIMESTAMP       0x00000004
+#define TCP_EXT_SACK            0x00000008
+#define TCP_EXT_ALL             0x0000000F
+
+/* Options seen in a segment, beyond the extensions above */
+#define TCP_OPTSEEN_MSS         0x00010000
+
+/* Congestion control flags */
+#define TCP_CC_RECOVERY         0x00000001
+#define TCP_CC_RTT_VALID        0x00000002
+#define TCP_CC_TIMING           0x00000004
+
+/* Options parsed out of an incoming segment */
+struct tcp_optvals {
+    uint32_t seen;
+    uint16_t mss;
+    uint8_t wscale;
+    uint32_t tsval;
+    uint32_t tsecr;
+    int nsack;
+    struct seqrange sack[TCP_MAX_SACK];
+};
 
 /* A few macros for comparing sequence numbers */
 #define SEQ_LT(x, y)    (((int32_t)((x) - (y))) < 0)
@@ -243,6 +377,7 @@ static int thd_cb_id = 0;
 #define SEQ_GE(x, y)    (((int32_t)((x) - (y))) >= 0)
 
 #define MAX(x, y)       ((x) > (y) ? (x) : (y))
+#define MIN(x, y)       ((x) < (y) ? (x) : (y))
 
 /* Forward declarations */
 static fs_socket_proto_t proto;
@@ -254,6 +389,90 @@ static int tcp_send_syn(struct tcp_sock *sock, int ack);
 static void tcp_send_ack(struct tcp_sock *sock);
 static void tcp_send_data(struct tcp_sock *sock, int resend);
 static void tcp_send_fin_ack(struct tcp_sock *sock);
+static uint8_t tcp_wscale(uint32_t bufsz);
+static void tcp_cc_init(struct tcp_sock *sock);
+static void tcp_rtt_init(struct tcp_sock *sock);
+static void tcp_timer_start(struct tcp_sock *sock);
+
+/* Socket hash tables. All of these must be called with tcp_sem locked. */
+static inline uint32_t tcp_port_bucket(uint16_t port) {
+    uint32_t h = port * 0x9E3779B1;
+
+    return (h ^ (h >> 16)) & (TCP_HASH_SIZE - 1);
+}
+
+static inline uint32_t tcp_conn_bucket(const struct in6_addr *raddr,
+                                       uint16_t rport, uint16_t lport) {
+    uint32_t h = raddr->__s6_addr.__s6_addr32[0] ^
+                 raddr->__s6_addr.__s6_addr32[1] ^
+                 raddr->__s6_addr.__s6_addr32[2] ^
+                 raddr->__s6_addr.__s6_addr32[3];
+
+    h = (h ^ ((uint32_t)rport << 16) ^ lport) * 0x9E3779B1;
+    return (h ^ (h >> 16)) & (TCP_HASH_SIZE - 1);
+}
+
+static void tcp_unhash(struct tcp_sock *sock) {
+    if(sock->hash_list.le_prev) {
+        LIST_REMOVE(sock, hash_list);
+        sock->hash_list.le_prev = NULL;
+    }
+
+    if(sock->bind_list.le_prev) {
+        LIST_REMOVE(sock, bind_list);
+        sock->bind_list.le_prev = NULL;
+    }
+}
+
+/* (Re-)insert a socket into the hash tables, after its addresses have been
+   changed. This requires the write lock. */
+static void tcp_hash(struct tcp_sock *sock) {
+    uint16_t lport = sock->local_addr.sin6_port;
+    struct tcp_sock_list *head;
+
+    tcp_unhash(sock);
+
+    if(!lport)
+        return;
+
+    LIST_INSERT_HEAD(&tcp_bind_hash[tcp_port_bucket(lport)], sock, bind_list);
+
+    if(IN6_IS_ADDR_UNSPECIFIED(&sock->remote_addr.sin6_addr))
+        head = &tcp_port_hash[tcp_port_bucket(lport)];
+    else
+        head = &tcp_conn_hash[tcp_conn_bucket(&sock->remote_addr.sin6_addr,
+                                              sock->remote_addr.sin6_port,
+                                              lport)];
+
+    LIST_INSERT_HEAD(head, sock, hash_list);
+}
+
+/* See if a port (in network byte order) is used by any socket other than the
+   one given. Addresses are only ever changed with the write lock held, so the
+   caller must hold it, but the sockets themselves don't need to be locked. */
+static int tcp_port_used(const struct tcp_sock *sock, uint16_t port) {
+    struct tcp_sock *iter;
+
+    LIST_FOREACH(iter, &tcp_bind_hash[tcp_port_bucket(port)], bind_list) {
+        if(iter != sock && iter->local_addr.sin6_port == port)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Grab the first unused port >= 1024, in network byte order. Returns 0 if
+   they're all taken. */
+static uint16_t tcp_alloc_port(const struct tcp_sock *sock) {
+    uint32_t port;
+
+    for(port = 1024; port <= 0xFFFF; ++port) {
+        if(!tcp_port_used(sock, htons(port)))
+            return htons(port);
+    }
+
+    return 0;
+}
 
 /* Sockets interface... */
 static int net_tcp_socket(net_socket_t *hnd, int domain, int type, int proto) {
@@ -262,16 +481,14 @@ static int net_tcp_socket(net_socket_t *hnd, int domain, int type, int proto) {
     (void)type;
     (void)proto;
 
-    if(!(sock = (struct tcp_sock *)malloc(sizeof(struct tcp_sock)))) {
+    if(!(sock = (struct tcp_sock *)kmem_cache_alloc(tcp_sock_cache))) {
         errno = ENOMEM;
         return -1;
     }
 
-    memset(sock, 0, sizeof(struct tcp_sock));
-
     if(mutex_init(&sock->mutex, MUTEX_TYPE_NORMAL)) {
         errno = ENOMEM;
-        free(sock);
+        kmem_cache_free(tcp_sock_cache, sock);
         return -1;
     }
 
@@ -280,9 +497,10 @@ static int net_tcp_socket(net_socket_t *hnd, int domain, int type, int proto) {
     sock->hop_limit = TCP_DEFAULT_HOPS;
     sock->rcvbuf_sz = TCP_DEFAULT_WINDOW;
     sock->sndbuf_sz = TCP_DEFAULT_WINDOW;
+    sock->ext = TCP_EXT_ALL;
 
     if(rwsem_write_lock_irqsafe(&tcp_sem)) {
-        free(sock);
+        kmem_cache_free(tcp_sock_cache, sock);
         return -1;
     }
 
@@ -408,7 +626,7 @@ retry:
             /* Don't have to worry about queued packets, since we don't allow
                any queueing until after the connection is established. */
             tcp_send_fin_ack(sock);
-            ++sock->data.snd.nxt;
+            sock->data.snd.max = ++sock->data.snd.nxt;
             sock->state = TCP_STATE_FIN_WAIT_1;
             goto ret_no_remove;
 
@@ -420,7 +638,7 @@ retry:
             }
 
             tcp_send_fin_ack(sock);
-            ++sock->data.snd.nxt;
+            sock->data.snd.max = ++sock->data.snd.nxt;
             sock->state = TCP_STATE_CLOSING;
             goto ret_no_remove;
 
@@ -441,9 +659,10 @@ retry:
 
 ret_remove:
     LIST_REMOVE(sock, sock_list);
+    tcp_unhash(sock);
     mutex_unlock(&sock->mutex);
     mutex_destroy(&sock->mutex);
-    free(sock);
+    kmem_cache_free(tcp_sock_cache, sock);
 
     rwsem_write_unlock(&tcp_sem);
     return;
@@ -459,7 +678,9 @@ ret_no_remove:
     sock->sock = -1;
 
     /* Don't free anything here, it will be dealt with later on in the
-       net_thd callback. */
+       net_thd callback. Make sure that happens soon, rather than whenever it
+       would otherwise wake up next. */
+    net_thd_schedule(thd_cb_id, 0);
     mutex_unlock(&sock->mutex);
     rwsem_write_unlock(&tcp_sem);
     return;
@@ -516,9 +737,10 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
             free(sock->listen.queue);
             cond_destroy(&sock->listen.cv);
             LIST_REMOVE(sock, sock_list);
+            tcp_unhash(sock);
             mutex_unlock(&sock->mutex);
             mutex_destroy(&sock->mutex);
-            free(sock);
+            kmem_cache_free(tcp_sock_cache, sock);
 
             rwsem_write_unlock(&tcp_sem);
 
@@ -536,18 +758,16 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
         sock->listen.head = 0;
 
     /* Allocate the memory we will need... */
-    if(!(sock2 = (struct tcp_sock *)malloc(sizeof(struct tcp_sock)))) {
+    if(!(sock2 = (struct tcp_sock *)kmem_cache_alloc(tcp_sock_cache))) {
         mutex_unlock(&sock->mutex);
         errno = ENOMEM;
         return -1;
     }
 
-    memset(sock2, 0, sizeof(struct tcp_sock));
-
     if(mutex_init(&sock2->mutex, MUTEX_TYPE_NORMAL)) {
         mutex_unlock(&sock->mutex);
         errno = ENOMEM;
-        free(sock2);
+        kmem_cache_free(tcp_sock_cache, sock2);
         return -1;
     }
 
@@ -555,7 +775,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
         errno = ENOMEM;
         mutex_unlock(&sock->mutex);
         mutex_destroy(&sock2->mutex);
-        free(sock2);
+        kmem_cache_free(tcp_sock_cache, sock2);
         return -1;
     }
 
@@ -564,7 +784,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
         mutex_unlock(&sock->mutex);
         free(sock2->data.rcvbuf);
         mutex_destroy(&sock2->mutex);
-        free(sock2);
+        kmem_cache_free(tcp_sock_cache, sock2);
         return -1;
     }
 
@@ -574,7 +794,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
         free(sock2->data.sndbuf);
         free(sock2->data.rcvbuf);
         mutex_destroy(&sock2->mutex);
-        free(sock2);
+        kmem_cache_free(tcp_sock_cache, sock2);
         return -1;
     }
 
@@ -585,7 +805,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
         free(sock2->data.sndbuf);
         free(sock2->data.rcvbuf);
         mutex_destroy(&sock2->mutex);
-        free(sock2);
+        kmem_cache_free(tcp_sock_cache, sock2);
         return -1;
     }
 
@@ -597,7 +817,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
         free(sock2->data.sndbuf);
         free(sock2->data.rcvbuf);
         mutex_destroy(&sock2->mutex);
-        free(sock2);
+        kmem_cache_free(tcp_sock_cache, sock2);
         return -1;
     }
 
@@ -610,8 +830,19 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
     sock2->hop_limit = sock->hop_limit;
     sock2->rcvbuf_sz = sock->rcvbuf_sz;
     sock2->sndbuf_sz = sock->sndbuf_sz;
+    sock2->ext = sock->ext;
     sock2->data.rcv.wnd = sock->rcvbuf_sz;
 
+    /* Use whatever extensions both sides asked for. */
+    sock2->data.ext = sock->ext & (lsock.ext | TCP_EXT_CC);
+
+    if(sock2->data.ext & TCP_EXT_WSCALE) {
+        sock2->data.snd.wscale = lsock.wscale;
+        sock2->data.rcv.wscale = tcp_wscale(sock2->rcvbuf_sz);
+    }
+
+    sock2->data.ts_recent = lsock.tsval;
+
     /* Fill in the address, if they asked for it. */
     if(addr != NULL) {
         if(sock2->domain == AF_INET) {
@@ -661,7 +892,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
             free(sock2->data.sndbuf);
             free(sock2->data.rcvbuf);
             mutex_destroy(&sock2->mutex);
-            free(sock2);
+            kmem_cache_free(tcp_sock_cache, sock2);
             errno = EWOULDBLOCK;
             return -1;
         }
@@ -705,21 +936,25 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
        by the wording of the RFC... */
     sock2->data.snd.iss = (uint32_t)(timer_us_gettime64() >> 2);
     sock2->data.snd.nxt = sock2->data.snd.iss + 1;
+    sock2->data.snd.max = sock2->data.snd.nxt;
     sock2->data.snd.una = sock2->data.snd.iss;
     sock2->data.snd.wnd = lsock.wnd;
     sock2->data.snd.wl1 = sock2->data.snd.iss;
     sock2->data.snd.mss = lsock.mss;
     sock2->data.rcv.nxt = lsock.isn + 1;
     sock2->data.rcv.irs = lsock.isn;
+    tcp_rtt_init(sock2);
+    tcp_cc_init(sock2);
 
     /* Since nothing else has a pointer to this socket, this will not fail. */
     mutex_trylock(&sock2->mutex);
 
     /* Send the <SYN,ACK> packet now, add it to the list, and clean up. */
     tcp_send_syn(sock2, 1);
-    sock2->data.timer = timer_ms_gettime64();
+    tcp_timer_start(sock2);
     fd = sock2->sock;
     LIST_INSERT_HEAD(&tcp_socks, sock2, sock_list);
+    tcp_hash(sock2);
     mutex_unlock(&sock2->mutex);
 
     sock->state &= ~TCP_STATE_ACCEPTING;
@@ -731,7 +966,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
 
 static int net_tcp_bind(net_socket_t *hnd, const struct sockaddr *addr,
                         socklen_t addr_len) {
-    struct tcp_sock *sock, *iter;
+    struct tcp_sock *sock;
     struct sockaddr_in *realaddr4;
     struct sockaddr_in6 realaddr6;
 
@@ -818,59 +1053,28 @@ static int net_tcp_bind(net_socket_t *hnd, const struct sockaddr *addr,
     if(realaddr6.sin6_port != 0) {
         /* Make sure we don't already have a socket bound to the port
            specified */
-        LIST_FOREACH(iter, &tcp_socks, sock_list) {
-            if(iter == sock)
-                continue;
-
-            if(mutex_lock_irqsafe(&iter->mutex)) {
-                mutex_unlock(&sock->mutex);
-                rwsem_write_unlock(&tcp_sem);
-                return -1;
-            }
-
-            if(iter->local_addr.sin6_port == realaddr6.sin6_port) {
-                mutex_unlock(&iter->mutex);
-                mutex_unlock(&sock->mutex);
-                rwsem_write_unlock(&tcp_sem);
-                errno = EADDRINUSE;
-                return -1;
-            }
-
-            mutex_unlock(&iter->mutex);
+        if(tcp_port_used(sock, realaddr6.sin6_port)) {
+            mutex_unlock(&sock->mutex);
+            rwsem_write_unlock(&tcp_sem);
+            errno = EADDRINUSE;
+            return -1;
         }
 
         sock->local_addr = realaddr6;
     }
     else {
-        uint16_t port = 1024, tmp = 0;
-
-        /* Grab the first unused port >= 1024. This is, unfortunately, O(n^2) */
-        while(tmp != port) {
-            tmp = port;
-
-            LIST_FOREACH(iter, &tcp_socks, sock_list) {
-                if(iter == sock)
-                    continue;
-
-                if(mutex_lock_irqsafe(&iter->mutex)) {
-                    mutex_unlock(&sock->mutex);
-                    rwsem_write_unlock(&tcp_sem);
-                    return -1;
-                }
-
-                if(iter->local_addr.sin6_port == port) {
-                    ++port;
-                    break;
-                }
-
-                mutex_unlock(&iter->mutex);
-            }
+        if(!(realaddr6.sin6_port = tcp_alloc_port(sock))) {
+            mutex_unlock(&sock->mutex);
+            rwsem_write_unlock(&tcp_sem);
+            errno = EADDRINUSE;
+            return -1;
         }
 
         sock->local_addr = realaddr6;
-        sock->local_addr.sin6_port = htons(port);
     }
 
+    tcp_hash(sock);
+
     /* Release the locks, we're done */
     mutex_unlock(&sock->mutex);
     rwsem_write_unlock(&tcp_sem);
@@ -880,20 +1084,16 @@ static int net_tcp_bind(net_socket_t *hnd, const struct sockaddr *addr,
 
 static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
                            socklen_t addr_len) {
-    struct tcp_sock *sock, *iter;
+    struct tcp_sock *sock;
     struct sockaddr_in *realaddr4;
     struct sockaddr_in6 realaddr6;
+    netif_t *net;
 
     if(addr == NULL) {
         errno = EDESTADDRREQ;
         return -1;
     }
 
-    if(!net_default_dev) {
-        errno = ENETDOWN;
-        return -1;
-    }
-
     switch(addr->sa_family) {
         case AF_INET:
 
@@ -933,6 +1133,11 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
             return -1;
     }
 
+    if(!(net = net_lo_route6(NULL, &realaddr6.sin6_addr))) {
+        errno = ENETDOWN;
+        return -1;
+    }
+
     if(!(sock = net_tcp_write_lock_and_get_sock(hnd, &tcp_sem)))
         return -1;
 
@@ -973,43 +1178,27 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
 
     /* See if the socket is already bound to a local port */
     if(!sock->local_addr.sin6_port) {
-        uint16_t port = 1024, tmp = 0;
-
-        /* Grab the first unused port >= 1024. This is, unfortunately, O(n^2) */
-        while(tmp != port) {
-            tmp = port;
-
-            LIST_FOREACH(iter, &tcp_socks, sock_list) {
-                if(iter == sock)
-                    continue;
-
-                if(mutex_lock_irqsafe(&iter->mutex)) {
-                    mutex_unlock(&sock->mutex);
-                    rwsem_write_unlock(&tcp_sem);
-                    return -1;
-                }
-
-                if(iter->local_addr.sin6_port == port) {
-                    ++port;
-                    break;
-                }
-
-                mutex_unlock(&iter->mutex);
-            }
+        if(!(sock->local_addr.sin6_port = tcp_alloc_port(sock))) {
+            mutex_unlock(&sock->mutex);
+            rwsem_write_unlock(&tcp_sem);
+            errno = EADDRNOTAVAIL;
+            return -1;
         }
 
-        sock->local_addr.sin6_port = htons(port);
-
         if(addr->sa_family == AF_INET) {
             sock->local_addr.sin6_addr.__s6_addr.__s6_addr16[5] = 0xFFFF;
             sock->local_addr.sin6_addr.__s6_addr.__s6_addr32[3] =
-                htonl(net_ipv4_address(net_default_dev->ip_addr));
+                htonl(net_ipv4_address(net->ip_addr));
+        }
+        else if(net == &net_lo_if) {
+            sock->local_addr.sin6_addr = in6addr_loopback;
         }
     }
 
     /* Set the remote address on the socket and go to the SYN-SENT state (this
        includes setting up all the data we need for that). */
     sock->remote_addr = realaddr6;
+    tcp_hash(sock);
 
     if(!(sock->data.rcvbuf = (uint8_t *)malloc(sock->rcvbuf_sz))) {
         errno = ENOBUFS;
@@ -1047,12 +1236,21 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
 
     sock->data.rcv.wnd = sock->rcvbuf_sz;
     sock->data.rcvbuf_head = sock->data.rcvbuf_tail = 0;
-    sock->data.net = net_default_dev;
+    sock->data.net = net;
     sock->data.snd.iss = timer_us_gettime64() >> 2;
     sock->data.snd.una = sock->data.snd.iss;
     sock->data.snd.nxt = sock->data.snd.iss + 1;
+    sock->data.snd.max = sock->data.snd.nxt;
     sock->state = TCP_STATE_SYN_SENT;
 
+    /* Offer all of the extensions enabled on the socket. Whatever the other
+       side doesn't support gets turned off when its <SYN,ACK> comes in. */
+    sock->data.ext = sock->ext;
+    sock->data.rcv.wscale = (sock->ext & TCP_EXT_WSCALE) ?
+        tcp_wscale(sock->rcvbuf_sz) : 0;
+    tcp_rtt_init(sock);
+    tcp_timer_start(sock);
+
     /* Send a <SYN> packet */
     if(tcp_send_syn(sock, 0) == -1) {
         rwsem_write_unlock(&tcp_sem);
@@ -1252,10 +1450,19 @@ static ssize_t net_tcp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
 
     rb = sock->data.rcvbuf + sock->data.rcvbuf_head;
 
-    /* Advance the window if we're pulling data out of the queue. */
+    /* Advance the window if we're pulling data out of the queue. If it was
+       too small for the other side to send anything, let it know right away
+       rather than waiting for it to probe the window. */
     if(!(flags & MSG_PEEK)) {
+        tmp = sock->data.rcv.wnd < sock->data.snd.mss;
         sock->data.rcv.wnd += size;
         sock->data.rcvbuf_cur_sz -= size;
+
+        if(tmp && sock->data.rcv.wnd >= sock->data.snd.mss &&
+           (sock->state == TCP_STATE_ESTABLISHED ||
+            sock->state == TCP_STATE_FIN_WAIT_1 ||
+            sock->state == TCP_STATE_FIN_WAIT_2))
+            tcp_send_ack(sock);
     }
 
     if(sock->data.rcvbuf_head + size <= sock->rcvbuf_sz) {
@@ -1277,8 +1484,9 @@ static ssize_t net_tcp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
             sock->data.rcvbuf_head = size - tmp;
     }
 
-    /* If we've got nothing left, move the pointers back to the beginning */
-    if(!sock->data.rcvbuf_cur_sz) {
+    /* If we've got nothing left, move the pointers back to the beginning. We
+       can't do that if there's out-of-order data past the tail, though. */
+    if(!sock->data.rcvbuf_cur_sz && !sock->data.rcv_nsack) {
         sock->data.rcvbuf_head = sock->data.rcvbuf_tail = 0;
     }
 
@@ -1412,8 +1620,7 @@ static ssize_t net_tcp_sendto(net_socket_t *hnd, const void *message,
 
     /* Reset the pointers if there's nothing in the buffer */
     if(sock->data.sndbuf_cur_sz == 0)
-        sock->data.sndbuf_head = sock->data.sndbuf_acked =
-                                     sock->data.sndbuf_tail = 0;
+        sock->data.sndbuf_acked = sock->data.sndbuf_tail = 0;
 
     /* Figure out how much we can copy in */
     bsz = sock->sndbuf_sz - sock->data.sndbuf_cur_sz;
@@ -1448,6 +1655,34 @@ out:
     return size;
 }
 
+/* Each buffer goes straight into the send buffer, so there's no need to gather
+   them up first. */
+static ssize_t net_tcp_sendmsg(net_socket_t *hnd, const struct msghdr *msg,
+                               int flags) {
+    ssize_t total = 0, rv;
+    int i;
+
+    for(i = 0; i < msg->msg_iovlen; ++i) {
+        if(!msg->msg_iov[i].iov_len)
+            continue;
+
+        rv = net_tcp_sendto(hnd, msg->msg_iov[i].iov_base,
+                            msg->msg_iov[i].iov_len, flags,
+                            (const struct sockaddr *)msg->msg_name,
+                            msg->msg_namelen);
+
+        if(rv < 0)
+            return total ? total : -1;
+
+        total += rv;
+
+        if((size_t)rv < msg->msg_iov[i].iov_len)
+            break;
+    }
+
+    return total;
+}
+
 static int net_tcp_shutdownsock(net_socket_t *hnd, int how) {
     struct tcp_sock *sock;
 
@@ -1542,6 +1777,22 @@ static int net_tcp_getsockopt(net_socket_t *hnd, int level, int option_name,
                 case TCP_NODELAY:
                     tmp = 1;
                     goto copy_int;
+
+                case TCP_CONGESTION_CONTROL:
+                    tmp = !!(sock->ext & TCP_EXT_CC);
+                    goto copy_int;
+
+                case TCP_WINDOW_SCALING:
+                    tmp = !!(sock->ext & TCP_EXT_WSCALE);
+                    goto copy_int;
+
+                case TCP_TIMESTAMPS:
+                    tmp = !!(sock->ext & TCP_EXT_TIMESTAMP);
+                    goto copy_int;
+
+                case TCP_SACK:
+                    tmp = !!(sock->ext & TCP_EXT_SACK);
+                    goto copy_int;
             }
 
             break;
@@ -1601,10 +1852,14 @@ static int net_tcp_setsockopt(net_socket_t *hnd, int level, int option_name,
                         goto ret_inval;
 
                     tmp = *(uint32_t *)option_value;
-                    /* Receive buffer size must be in the range 256 - 65535 */
+                    /* Receive buffer size must be in the range 256 - 65535,
+                       unless the window can be scaled. */
                     if(tmp < 256)
                         tmp = 256;
-                    else if(tmp > 65535)
+                    else if(tmp > TCP_MAX_BUFFER)
+                        tmp = TCP_MAX_BUFFER;
+
+                    if(tmp > 65535 && !(sock->ext & TCP_EXT_WSCALE))
                         tmp = 65535;
 
                     new_ptr = realloc(sock->data.rcvbuf, tmp);
@@ -1620,10 +1875,14 @@ static int net_tcp_setsockopt(net_socket_t *hnd, int level, int option_name,
                         goto ret_inval;
 
                     tmp = *(uint32_t *)option_value;
-                    /* Send buffer size must be in the range 2048 - 65535 */
+                    /* Send buffer size must be in the range 2048 - 65535,
+                       unless the window can be scaled. */
                     if(tmp < 2048)
                         tmp = 2048;
-                    else if(tmp > 65535)
+                    else if(tmp > TCP_MAX_BUFFER)
+                        tmp = TCP_MAX_BUFFER;
+
+                    if(tmp > 65535 && !(sock->ext & TCP_EXT_WSCALE))
                         tmp = 65535;
 
                     new_ptr = realloc(sock->data.sndbuf, tmp);
@@ -1709,6 +1968,22 @@ static int net_tcp_setsockopt(net_socket_t *hnd, int level, int option_name,
                         goto ret_inval;
 
                     goto ret_success;
+
+                case TCP_CONGESTION_CONTROL:
+                    tmp = TCP_EXT_CC;
+                    goto set_ext;
+
+                case TCP_WINDOW_SCALING:
+                    tmp = TCP_EXT_WSCALE;
+                    goto set_ext;
+
+                case TCP_TIMESTAMPS:
+                    tmp = TCP_EXT_TIMESTAMP;
+                    goto set_ext;
+
+                case TCP_SACK:
+                    tmp = TCP_EXT_SACK;
+                    goto set_ext;
             }
 
             break;
@@ -1732,6 +2007,24 @@ ret_nomem:
     errno = ENOMEM;
     return -1;
 
+set_ext:
+    /* Everything but congestion control is negotiated when the connection is
+       opened, so changing them only affects connections opened later. */
+    if(option_len != sizeof(int))
+        goto ret_inval;
+
+    if(*((int *)option_value))
+        sock->ext |= tmp;
+    else
+        sock->ext &= ~tmp;
+
+    if(tmp == TCP_EXT_CC && sock->state != TCP_STATE_LISTEN) {
+        if(sock->ext & TCP_EXT_CC)
+            sock->data.ext |= TCP_EXT_CC;
+        else
+            sock->data.ext &= ~TCP_EXT_CC;
+    }
+
 ret_success:
     mutex_unlock(&sock->mutex);
     rwsem_read_unlock(&tcp_sem);
@@ -2056,177 +2349,721 @@ static void tcp_bpkt_rst(netif_t *net, const struct in6_addr *src,
                   dst, src);
 }
 
-static int tcp_send_syn(struct tcp_sock *sock, int ack) {
-    uint8_t rawpkt[sizeof(tcp_hdr_t) + 4];
-    tcp_hdr_t *hdr = (tcp_hdr_t *)rawpkt;
-    uint16_t cs;
+/* Pick the window scale to offer for a receive buffer of the given size. */
+static uint8_t tcp_wscale(uint32_t bufsz) {
+    uint8_t shift = 0;
 
-    /* Fill in the base packet */
-    hdr->src_port = sock->local_addr.sin6_port;
-    hdr->dst_port = sock->remote_addr.sin6_port;
-    hdr->seq = htonl(sock->data.snd.iss);
-    hdr->ack = htonl(sock->data.rcv.nxt);
+    while((bufsz >> shift) > 65535 && shift < TCP_MAX_WSCALE)
+        ++shift;
 
-    if(ack) {
-        hdr->off_flags = htons(TCP_FLAG_SYN | TCP_FLAG_ACK | TCP_OFFSET(6));
+    return shift;
+}
+
+/* Largest amount of data we put in a segment, leaving room for the options
+   that go on every segment. */
+static inline uint32_t tcp_smss(const struct tcp_sock *sock) {
+    uint32_t mss = sock->data.snd.mss - sizeof(tcp_hdr_t);
+
+    if(sock->data.ext & TCP_EXT_TIMESTAMP)
+        mss -= TCP_TS_OPT_LEN;
+
+    return mss;
+}
+
+static inline uint32_t tcp_now(void) {
+    return (uint32_t)timer_ms_gettime64();
+}
+
+/* Set up the congestion control state for a new connection, once the MSS is
+   known. */
+static void tcp_cc_init(struct tcp_sock *sock) {
+    struct ccrec *cc = &sock->data.cc;
+    uint32_t smss = tcp_smss(sock);
+
+    /* Initial window, as per RFC 5681 section 3.1. */
+    if(smss > 2190)
+        cc->cwnd = 2 * smss;
+    else if(smss > 1095)
+        cc->cwnd = 3 * smss;
+    else
+        cc->cwnd = 4 * smss;
+
+    cc->ssthresh = 0x7FFFFFFF;
+    cc->recover = sock->data.snd.iss;
+    cc->dupacks = 0;
+    cc->flags &= TCP_CC_RTT_VALID | TCP_CC_TIMING;
+    sock->data.rcv_nsack = sock->data.snd_nsack = 0;
+}
+
+/* Set up the retransmission timer for a new connection, and time the
+   handshake. */
+static void tcp_rtt_init(struct tcp_sock *sock) {
+    struct ccrec *cc = &sock->data.cc;
+
+    cc->rto = TCP_DEFAULT_RTTO;
+    cc->srtt = cc->rttvar = 0;
+    cc->flags = TCP_CC_TIMING;
+    cc->rtt_seq = sock->data.snd.iss + 1;
+    cc->rtt_time = timer_ms_gettime64();
+}
+
+/* Feed a round-trip time measurement (in milliseconds) into the estimate, and
+   recompute the retransmission timeout, as per RFC 6298 section 2. */
+static void tcp_rtt_sample(struct tcp_sock *sock, int32_t rtt) {
+    struct ccrec *cc = &sock->data.cc;
+    int32_t delta;
+
+    if(rtt < 0)
+        return;
+
+    if(!(cc->flags & TCP_CC_RTT_VALID)) {
+        cc->srtt = rtt << 3;
+        cc->rttvar = rtt << 1;
+        cc->flags |= TCP_CC_RTT_VALID;
     }
     else {
-        hdr->off_flags = htons(TCP_FLAG_SYN | TCP_OFFSET(6));
+        delta = rtt - (cc->srtt >> 3);
+        cc->srtt += delta;
+
+        if(delta < 0)
+            delta = -delta;
+
+        cc->rttvar += delta - (cc->rttvar >> 2);
     }
 
-    hdr->wnd = htons(sock->data.rcv.wnd);
+    cc->rto = (cc->srtt >> 3) + MAX(TCP_TIMER_GRANULARITY, cc->rttvar);
+
+    if(cc->rto < TCP_MIN_RTO)
+        cc->rto = TCP_MIN_RTO;
+    else if(cc->rto > TCP_MAX_RTO)
+        cc->rto = TCP_MAX_RTO;
+}
+
+/* Back off the retransmission timer after it expires. Anything that was being
+   timed has now been sent twice, so it can't be used (Karn's algorithm). */
+static void tcp_rto_backoff(struct tcp_sock *sock) {
+    struct ccrec *cc = &sock->data.cc;
+
+    cc->rto = MIN(cc->rto << 1, TCP_MAX_RTO);
+    cc->flags &= ~TCP_CC_TIMING;
+}
+
+/* Figure out when the socket's timer expires, based on what it's being used
+   for in the socket's current state. Returns 0 if it isn't running. */
+static uint64_t tcp_timer_expiry(const struct tcp_sock *sock) {
+    switch(sock->state) {
+        case TCP_STATE_SYN_SENT:
+        case TCP_STATE_SYN_RECEIVED:
+            return sock->data.timer + sock->data.cc.rto;
+
+        case TCP_STATE_ESTABLISHED:
+        case TCP_STATE_CLOSE_WAIT:
+            if(!sock->data.sndbuf_cur_sz)
+                return 0;
+
+            return sock->data.timer + sock->data.cc.rto;
+
+        case TCP_STATE_TIME_WAIT:
+            return sock->data.timer + 2 * TCP_DEFAULT_MSL;
+
+        default:
+            return 0;
+    }
+}
+
+/* (Re)start the socket's timer, and make sure the callback in the network
+   thread gets to look at the socket again when it expires. */
+static void tcp_timer_start(struct tcp_sock *sock) {
+    uint64_t expiry;
+
+    sock->data.timer = timer_ms_gettime64();
+
+    if((expiry = tcp_timer_expiry(sock)))
+        net_thd_schedule(thd_cb_id, expiry);
+}
+
+/* Build the options for a segment on a synchronized connection, using at most
+   room bytes. Returns the length of the options. */
+static int tcp_build_opts(struct tcp_sock *sock, uint8_t *opts, int room) {
+    int len = 0, i, n;
+    uint32_t tmp;
+
+    if(room > TCP_MAX_OPTS)
+        room = TCP_MAX_OPTS;
+
+    if((sock->data.ext & TCP_EXT_TIMESTAMP) && room >= TCP_TS_OPT_LEN) {
+        opts[0] = TCP_OPT_NOP;
+        opts[1] = TCP_OPT_NOP;
+        opts[2] = TCP_OPT_TIMESTAMP;
+        opts[3] = 10;
+        tmp = htonl(tcp_now());
+        memcpy(opts + 4, &tmp, 4);
+        tmp = htonl(sock->data.ts_recent);
+        memcpy(opts + 8, &tmp, 4);
+        len = TCP_TS_OPT_LEN;
+    }
+
+    if((sock->data.ext & TCP_EXT_SACK) && sock->data.rcv_nsack) {
+        n = (room - len - 4) / 8;
+
+        if(n > sock->data.rcv_nsack)
+            n = sock->data.rcv_nsack;
+
+        if(n > 0) {
+            opts[len++] = TCP_OPT_NOP;
+            opts[len++] = TCP_OPT_NOP;
+            opts[len++] = TCP_OPT_SACK;
+            opts[len++] = 2 + n * 8;
+
+            for(i = 0; i < n; ++i) {
+                tmp = htonl(sock->data.rcv_sack[i].start);
+                memcpy(opts + len, &tmp, 4);
+                tmp = htonl(sock->data.rcv_sack[i].end);
+                memcpy(opts + len + 4, &tmp, 4);
+                len += 8;
+            }
+        }
+    }
+
+    return len;
+}
+
+/* The window to put in outgoing segments (other than <SYN>s). */
+static inline uint16_t tcp_rcv_wnd(const struct tcp_sock *sock) {
+    uint32_t wnd = sock->data.rcv.wnd >> sock->data.rcv.wscale;
+
+    return wnd > 65535 ? 65535 : wnd;
+}
+
+/* Fill in the header of an outgoing segment on a synchronized connection,
+   including its options. Returns the size of the header. */
+static int tcp_fill_hdr(struct tcp_sock *sock, tcp_hdr_t *hdr, uint32_t seq,
+                        uint16_t flags, int room) {
+    int olen = tcp_build_opts(sock, hdr->options, room);
+
+    hdr->src_port = sock->local_addr.sin6_port;
+    hdr->dst_port = sock->remote_addr.sin6_port;
+    hdr->seq = htonl(seq);
+    hdr->ack = htonl(sock->data.rcv.nxt);
+    hdr->off_flags = htons(flags | TCP_OFFSET(5 + (olen >> 2)));
+    hdr->wnd = htons(tcp_rcv_wnd(sock));
     hdr->checksum = 0;
     hdr->urg = 0;
 
-    /* Fill in our SYN options. The only one we worry about right now is MSS. */
-    hdr->options[0] = TCP_OPT_MSS;
-    hdr->options[1] = 4;
-    hdr->options[2] = (TCP_DEFAULT_MSS >> 8) & 0xFF;
-    hdr->options[3] = TCP_DEFAULT_MSS & 0xFF;
+    sock->data.last_ack_sent = sock->data.rcv.nxt;
+
+    return sizeof(tcp_hdr_t) + olen;
+}
+
+/* Put the header in front of whatever data the packet already has, and send it
+   away. The data is only copied once, by the network device. */
+static int tcp_send_pkt(struct tcp_sock *sock, net_pkt_t *pkt,
+                        const uint8_t *rawhdr, int sz) {
+    tcp_hdr_t *hdr;
+    size_t len;
+    uint16_t cs;
+
+    hdr = (tcp_hdr_t *)net_pkt_push(pkt, sz);
+    memcpy(hdr, rawhdr, sz);
+    len = net_pkt_len(pkt);
 
     /* Calculate the real checksum */
     cs = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
-                                  &sock->remote_addr.sin6_addr,
-                                  sizeof(tcp_hdr_t) + 4, IPPROTO_TCP);
-    hdr->checksum = net_ipv4_checksum(rawpkt, sizeof(tcp_hdr_t) + 4, cs);
+                                  &sock->remote_addr.sin6_addr, len,
+                                  IPPROTO_TCP);
+    hdr->checksum = net_pkt_checksum(pkt, len, cs);
 
-    return net_ipv6_send(sock->data.net, rawpkt, sizeof(tcp_hdr_t) + 4,
-                         sock->hop_limit, IPPROTO_TCP,
-                         &sock->local_addr.sin6_addr,
-                         &sock->remote_addr.sin6_addr);
+    return net_ipv6_send_pkt(sock->data.net, pkt, sock->hop_limit,
+                             IPPROTO_TCP, &sock->local_addr.sin6_addr,
+                             &sock->remote_addr.sin6_addr);
 }
 
-static void tcp_send_fin_ack(struct tcp_sock *sock) {
-    uint8_t rawpkt[sizeof(tcp_hdr_t)];
+static int tcp_send_syn(struct tcp_sock *sock, int ack) {
+    uint8_t rawpkt[sizeof(tcp_hdr_t) + TCP_MAX_OPTS];
     tcp_hdr_t *hdr = (tcp_hdr_t *)rawpkt;
-    uint16_t cs;
+    net_pkt_t pkt;
+    uint32_t ext = sock->data.ext, tmp;
+    int olen = 0;
 
-    /* Fill in the base packet */
+    /* Fill in the base packet. The window is never scaled in a <SYN>. */
     hdr->src_port = sock->local_addr.sin6_port;
     hdr->dst_port = sock->remote_addr.sin6_port;
-    hdr->seq = htonl(sock->data.snd.nxt);
+    hdr->seq = htonl(sock->data.snd.iss);
     hdr->ack = htonl(sock->data.rcv.nxt);
-    hdr->off_flags = htons(TCP_FLAG_FIN | TCP_FLAG_ACK | TCP_OFFSET(5));
-    hdr->wnd = htons(sock->data.rcv.wnd);
+    hdr->wnd = htons(sock->data.rcv.wnd > 65535 ? 65535 : sock->data.rcv.wnd);
     hdr->checksum = 0;
     hdr->urg = 0;
 
-    /* Calculate the real checksum */
-    cs = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
-                                  &sock->remote_addr.sin6_addr,
-                                  sizeof(tcp_hdr_t), IPPROTO_TCP);
-    hdr->checksum = net_ipv4_checksum(rawpkt, sizeof(tcp_hdr_t), cs);
+    /* Fill in our SYN options. The MSS always goes in, the rest only if the
+       extensions are enabled (and, for a <SYN,ACK>, if the other side asked
+       for them too). */
+    hdr->options[olen++] = TCP_OPT_MSS;
+    hdr->options[olen++] = 4;
+    hdr->options[olen++] = (TCP_DEFAULT_MSS >> 8) & 0xFF;
+    hdr->options[olen++] = TCP_DEFAULT_MSS & 0xFF;
+
+    if(ext & TCP_EXT_WSCALE) {
+        hdr->options[olen++] = TCP_OPT_NOP;
+        hdr->options[olen++] = TCP_OPT_WSCALE;
+        hdr->options[olen++] = 3;
+        hdr->options[olen++] = sock->data.rcv.wscale;
+    }
+
+    if(ext & TCP_EXT_TIMESTAMP) {
+        if(ext & TCP_EXT_SACK) {
+            hdr->options[olen++] = TCP_OPT_SACK_PERM;
+            hdr->options[olen++] = 2;
+        }
+        else {
+            hdr->options[olen++] = TCP_OPT_NOP;
+            hdr->options[olen++] = TCP_OPT_NOP;
+        }
+
+        hdr->options[olen++] = TCP_OPT_TIMESTAMP;
+        hdr->options[olen++] = 10;
+        tmp = htonl(tcp_now());
+        memcpy(hdr->options + olen, &tmp, 4);
+        tmp = htonl(sock->data.ts_recent);
+        memcpy(hdr->options + olen + 4, &tmp, 4);
+        olen += 8;
+    }
+    else if(ext & TCP_EXT_SACK) {
+        hdr->options[olen++] = TCP_OPT_NOP;
+        hdr->options[olen++] = TCP_OPT_NOP;
+        hdr->options[olen++] = TCP_OPT_SACK_PERM;
+        hdr->options[olen++] = 2;
+    }
 
-    net_ipv6_send(sock->data.net, rawpkt, sizeof(tcp_hdr_t), sock->hop_limit,
-                  IPPROTO_TCP, &sock->local_addr.sin6_addr,
-                  &sock->remote_addr.sin6_addr);
+    if(ack) {
+        hdr->off_flags = htons(TCP_FLAG_SYN | TCP_FLAG_ACK |
+                               TCP_OFFSET(5 + (olen >> 2)));
+    }
+    else {
+        hdr->off_flags = htons(TCP_FLAG_SYN | TCP_OFFSET(5 + (olen >> 2)));
+    }
+
+    sock->data.last_ack_sent = sock->data.rcv.nxt;
+
+    net_pkt_init(&pkt);
+    return tcp_send_pkt(sock, &pkt, rawpkt, sizeof(tcp_hdr_t) + olen);
+}
+
+static void tcp_send_fin_ack(struct tcp_sock *sock) {
+    uint8_t rawpkt[sizeof(tcp_hdr_t) + TCP_MAX_OPTS];
+    net_pkt_t pkt;
+    int sz;
+
+    sz = tcp_fill_hdr(sock, (tcp_hdr_t *)rawpkt, sock->data.snd.nxt,
+                      TCP_FLAG_FIN | TCP_FLAG_ACK, TCP_MAX_OPTS);
+    net_pkt_init(&pkt);
+    tcp_send_pkt(sock, &pkt, rawpkt, sz);
 }
 
 static void tcp_send_ack(struct tcp_sock *sock) {
-    tcp_hdr_t hdr;
-    uint16_t c;
+    uint8_t rawpkt[sizeof(tcp_hdr_t) + TCP_MAX_OPTS];
+    net_pkt_t pkt;
+    int sz;
+
+    sz = tcp_fill_hdr(sock, (tcp_hdr_t *)rawpkt, sock->data.snd.nxt,
+                      TCP_FLAG_ACK, TCP_MAX_OPTS);
+    net_pkt_init(&pkt);
+    tcp_send_pkt(sock, &pkt, rawpkt, sz);
+}
 
-    /* Fill in the base packet */
-    hdr.src_port = sock->local_addr.sin6_port;
-    hdr.dst_port = sock->remote_addr.sin6_port;
-    hdr.seq = htonl(sock->data.snd.nxt);
-    hdr.ack = htonl(sock->data.rcv.nxt);
-    hdr.off_flags = htons(TCP_FLAG_ACK | TCP_OFFSET(5));
-    hdr.wnd = htons(sock->data.rcv.wnd);
-    hdr.checksum = 0;
-    hdr.urg = 0;
+/* Send one segment worth of data out of the send buffer, starting at the given
+   sequence number. The segment points straight into the send buffer (in one or
+   two pieces, depending on whether it wraps around). */
+static void tcp_send_segment(struct tcp_sock *sock, uint32_t seq,
+                             uint32_t len) {
+    uint8_t rawpkt[sizeof(tcp_hdr_t) + TCP_MAX_OPTS];
+    net_pkt_t pkt;
+    uint32_t pos, tmp;
+    int sz;
 
-    /* Calculate the real checksum */
-    c = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
-                                 &sock->remote_addr.sin6_addr,
-                                 sizeof(tcp_hdr_t), IPPROTO_TCP);
-    hdr.checksum = net_ipv4_checksum((const uint8_t *)&hdr, sizeof(tcp_hdr_t), c);
+    sz = tcp_fill_hdr(sock, (tcp_hdr_t *)rawpkt, seq, TCP_FLAG_ACK,
+                      sock->data.snd.mss - sizeof(tcp_hdr_t) - len);
+
+    pos = sock->data.sndbuf_acked + (seq - sock->data.snd.una);
 
-    net_ipv6_send(sock->data.net, (const uint8_t *)&hdr, sizeof(tcp_hdr_t),
-                  sock->hop_limit, IPPROTO_TCP, &sock->local_addr.sin6_addr,
-                  &sock->remote_addr.sin6_addr);
+    if(pos >= sock->sndbuf_sz)
+        pos -= sock->sndbuf_sz;
+
+    net_pkt_init(&pkt);
+
+    if(pos + len <= sock->sndbuf_sz) {
+        net_pkt_add(&pkt, sock->data.sndbuf + pos, len);
+    }
+    else {
+        tmp = sock->sndbuf_sz - pos;
+        net_pkt_add(&pkt, sock->data.sndbuf + pos, tmp);
+        net_pkt_add(&pkt, sock->data.sndbuf, len - tmp);
+    }
+
+    tcp_send_pkt(sock, &pkt, rawpkt, sz);
 }
 
+/* Send as much of the send buffer as the peer's window and the congestion
+   window allow. If resend is set, the retransmission timer went off, so go
+   back and start over from the oldest unacknowledged data. */
 static void tcp_send_data(struct tcp_sock *sock, int resend) {
-    uint32_t wnd = sock->data.snd.wnd, snd;
-    int sz = sizeof(tcp_hdr_t);
-    uint8_t rawpkt[1500];
-    tcp_hdr_t *hdr = (tcp_hdr_t *)rawpkt;
-    uint16_t cs;
-    uint8_t *sb, *buf;
-    uint32_t seq, unacked, head;
+    struct ccrec *cc = &sock->data.cc;
+    uint32_t smss = tcp_smss(sock), flight, unsent, limit, len;
+
+    /* Nothing gets sent until the connection is fully open. */
+    if(sock->state != TCP_STATE_ESTABLISHED &&
+       sock->state != TCP_STATE_CLOSE_WAIT)
+        return;
+
+    if(resend)
+        sock->data.snd.nxt = sock->data.snd.una;
 
-    if(!resend) {
-        seq = sock->data.snd.nxt;
-        unacked = sock->data.snd.nxt - sock->data.snd.una;
-        wnd -= unacked;
-        head = sock->data.sndbuf_head;
+    for(;;) {
+        flight = sock->data.snd.nxt - sock->data.snd.una;
+        unsent = sock->data.sndbuf_cur_sz - flight;
+
+        if(!unsent)
+            break;
+
+        limit = sock->data.snd.wnd;
+
+        if((sock->data.ext & TCP_EXT_CC) && limit > cc->cwnd)
+            limit = cc->cwnd;
+
+        if(flight >= limit) {
+            /* If the window is closed, probe it with a single byte when the
+               timer goes off. */
+            if(!resend || flight || limit)
+                break;
+
+            limit = 1;
+        }
+
+        len = MIN(smss, MIN(unsent, limit - flight));
+
+        /* Restart the timer if nothing was outstanding. Time one segment per
+           round-trip if we don't have timestamps to do it for us. */
+        if(!flight)
+            tcp_timer_start(sock);
+
+        if(sock->data.snd.nxt == sock->data.snd.max &&
+           !(sock->data.ext & TCP_EXT_TIMESTAMP) &&
+           !(cc->flags & TCP_CC_TIMING)) {
+            cc->flags |= TCP_CC_TIMING;
+            cc->rtt_seq = sock->data.snd.nxt + len;
+            cc->rtt_time = timer_ms_gettime64();
+        }
+
+        tcp_send_segment(sock, sock->data.snd.nxt, len);
+        sock->data.snd.nxt += len;
+
+        if(SEQ_GT(sock->data.snd.nxt, sock->data.snd.max))
+            sock->data.snd.max = sock->data.snd.nxt;
     }
-    else {
+
+    if(resend)
+        tcp_timer_start(sock);
+}
+
+/* Resend the first segment of the next hole in what the peer has, at or after
+   the given sequence number. Without SACK information, that's simply whatever
+   is at that point. Returns the sequence number following what was sent. */
+static uint32_t tcp_send_hole(struct tcp_sock *sock, uint32_t seq) {
+    uint32_t end = sock->data.snd.max, len;
+    int i;
+
+    if(SEQ_LT(seq, sock->data.snd.una))
         seq = sock->data.snd.una;
-        unacked = 0;
-        head = sock->data.sndbuf_acked;
+
+    for(i = 0; i < sock->data.snd_nsack; ++i) {
+        if(SEQ_LE(sock->data.snd_sack[i].end, seq))
+            continue;
+
+        if(SEQ_LE(sock->data.snd_sack[i].start, seq)) {
+            seq = sock->data.snd_sack[i].end;
+            continue;
+        }
+
+        end = sock->data.snd_sack[i].start;
+        break;
     }
 
-    if(!wnd)
-        wnd = 1;
+    /* Past the last SACK block, data may just still be in flight, so only the
+       first hole is resent. */
+    if(i == sock->data.snd_nsack && sock->data.snd_nsack &&
+       seq != sock->data.snd.una)
+        return seq;
 
-    /* Fill in the base packet */
-    hdr->src_port = sock->local_addr.sin6_port;
-    hdr->dst_port = sock->remote_addr.sin6_port;
-    hdr->ack = htonl(sock->data.rcv.nxt);
-    hdr->off_flags = htons(TCP_FLAG_ACK | TCP_OFFSET(5));
-    hdr->wnd = htons(sock->data.rcv.wnd);
-    hdr->urg = 0;
+    if(!SEQ_LT(seq, end))
+        return seq;
+
+    len = MIN(end - seq, tcp_smss(sock));
+    tcp_send_segment(sock, seq, len);
 
-    /* Put on some data if we should do so */
-    while(sock->data.sndbuf_cur_sz - unacked && wnd) {
-        hdr->seq = htonl(seq);
-        hdr->checksum = 0;
-        buf = rawpkt + sizeof(tcp_hdr_t);
-        sb = sock->data.sndbuf + head;
-        snd = wnd;
+    return seq + len;
+}
+
+/* Handle the retransmission timer going off with data outstanding. */
+static void tcp_timeout(struct tcp_sock *sock) {
+    struct ccrec *cc = &sock->data.cc;
+    uint32_t flight = sock->data.snd.max - sock->data.snd.una;
+
+    /* Don't treat probing a closed window as a loss. */
+    if(flight && (sock->data.ext & TCP_EXT_CC)) {
+        cc->ssthresh = MAX(flight / 2, 2 * tcp_smss(sock));
+        cc->cwnd = tcp_smss(sock);
+    }
+
+    cc->flags &= ~TCP_CC_RECOVERY;
+    cc->dupacks = 0;
+    cc->recover = sock->data.snd.max;
+
+    /* The peer is allowed to throw away data it has SACKed, so forget about
+       what it told us. */
+    sock->data.snd_nsack = 0;
+
+    tcp_rto_backoff(sock);
+    tcp_send_data(sock, 1);
+}
 
-        if(snd > sock->data.snd.mss - sizeof(tcp_hdr_t))
-            snd = sock->data.snd.mss - sizeof(tcp_hdr_t);
+/* Take a SACK block reported by the peer into account. */
+static void tcp_sack_snd_add(struct tcp_sock *sock, uint32_t start,
+                             uint32_t end) {
+    struct seqrange *sb = sock->data.snd_sack;
+    int i, j;
 
-        if(snd > sock->data.sndbuf_cur_sz - unacked)
-            snd = sock->data.sndbuf_cur_sz - unacked;
+    /* Ignore anything that doesn't make sense. */
+    if(!SEQ_LT(start, end) || SEQ_LE(start, sock->data.snd.una) ||
+       SEQ_GT(end, sock->data.snd.max))
+        return;
+
+    /* Find where the block goes, merging it with any it touches. */
+    for(i = 0; i < sock->data.snd_nsack; ++i) {
+        if(SEQ_GE(sb[i].end, start))
+            break;
+    }
 
-        /* Copy in the data */
-        if(head + snd <= sock->sndbuf_sz) {
-            memcpy(buf, sb, snd);
-            head += snd;
+    j = i;
+
+    while(j < sock->data.snd_nsack && SEQ_LE(sb[j].start, end)) {
+        if(SEQ_LT(sb[j].start, start))
+            start = sb[j].start;
+
+        if(SEQ_GT(sb[j].end, end))
+            end = sb[j].end;
+
+        ++j;
+    }
 
-            if(head == sock->sndbuf_sz)
-                head = 0;
+    if(j == i) {
+        /* Nothing to merge with, make room for it (dropping the last block if
+           we're full). */
+        if(sock->data.snd_nsack == TCP_MAX_SACK_SB) {
+            if(i == TCP_MAX_SACK_SB)
+                return;
+
+            --sock->data.snd_nsack;
+        }
+
+        memmove(sb + i + 1, sb + i,
+                (sock->data.snd_nsack - i) * sizeof(struct seqrange));
+        ++sock->data.snd_nsack;
+    }
+    else if(j > i + 1) {
+        memmove(sb + i + 1, sb + j,
+                (sock->data.snd_nsack - j) * sizeof(struct seqrange));
+        sock->data.snd_nsack -= j - i - 1;
+    }
+
+    sb[i].start = start;
+    sb[i].end = end;
+}
+
+/* Drop the SACK blocks that the cumulative ACK has caught up with. */
+static void tcp_sack_snd_prune(struct tcp_sock *sock) {
+    int i = 0;
+
+    while(i < sock->data.snd_nsack &&
+          SEQ_LE(sock->data.snd_sack[i].end, sock->data.snd.una))
+        ++i;
+
+    if(i) {
+        sock->data.snd_nsack -= i;
+        memmove(sock->data.snd_sack, sock->data.snd_sack + i,
+                sock->data.snd_nsack * sizeof(struct seqrange));
+    }
+
+    if(sock->data.snd_nsack &&
+       SEQ_LT(sock->data.snd_sack[0].start, sock->data.snd.una))
+        sock->data.snd_sack[0].start = sock->data.snd.una;
+}
+
+/* Record that we got an out-of-order range of data. The range goes first in
+   the list, as RFC 2018 wants the most recent block to be reported first. */
+static void tcp_sack_rcv_add(struct tcp_sock *sock, uint32_t start,
+                             uint32_t end) {
+    struct seqrange *sb = sock->data.rcv_sack;
+    int i = 0;
+
+    while(i < sock->data.rcv_nsack) {
+        if(SEQ_LE(sb[i].start, end) && SEQ_GE(sb[i].end, start)) {
+            if(SEQ_LT(sb[i].start, start))
+                start = sb[i].start;
+
+            if(SEQ_GT(sb[i].end, end))
+                end = sb[i].end;
+
+            memmove(sb + i, sb + i + 1,
+                    (--sock->data.rcv_nsack - i) * sizeof(struct seqrange));
         }
         else {
-            sz = sock->sndbuf_sz - head;
-            memcpy(buf, sb, sz);
-            memcpy(buf + sz, sock->data.sndbuf, snd - sz);
-            head = snd - sz;
+            ++i;
         }
+    }
+
+    if(sock->data.rcv_nsack == TCP_MAX_SACK)
+        --sock->data.rcv_nsack;
 
-        sz = snd + sizeof(tcp_hdr_t);
-        wnd -= snd;
-        seq += snd;
-        unacked += snd;
+    memmove(sb + 1, sb, sock->data.rcv_nsack * sizeof(struct seqrange));
+    sb[0].start = start;
+    sb[0].end = end;
+    ++sock->data.rcv_nsack;
+}
+
+/* Pull in the out-of-order data that follows the given sequence number.
+   Returns the end of the data that is now in order. */
+static uint32_t tcp_sack_rcv_consume(struct tcp_sock *sock, uint32_t seq) {
+    struct seqrange *sb = sock->data.rcv_sack;
+    int i = 0;
 
-        /* Calculate the checksum */
-        cs = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
-                                      &sock->remote_addr.sin6_addr, sz,
-                                      IPPROTO_TCP);
-        hdr->checksum = net_ipv4_checksum(rawpkt, sz, cs);
+    while(i < sock->data.rcv_nsack) {
+        if(SEQ_LE(sb[i].start, seq)) {
+            if(SEQ_GT(sb[i].end, seq))
+                seq = sb[i].end;
 
-        net_ipv6_send(sock->data.net, rawpkt, sz, sock->hop_limit, IPPROTO_TCP,
-                      &sock->local_addr.sin6_addr,
-                      &sock->remote_addr.sin6_addr);
+            memmove(sb + i, sb + i + 1,
+                    (--sock->data.rcv_nsack - i) * sizeof(struct seqrange));
+
+            /* The new end might catch up with a block we already passed. */
+            i = 0;
+        }
+        else {
+            ++i;
+        }
     }
 
-    sock->data.timer = timer_ms_gettime64();
-    sock->data.sndbuf_head = head;
-    sock->data.snd.nxt = seq;
+    return seq;
+}
+
+/* Store incoming data in the receive buffer, off bytes past its tail. */
+static void tcp_rcvbuf_put(struct tcp_sock *sock, uint32_t off,
+                           const uint8_t *buf, uint32_t len) {
+    uint32_t pos = sock->data.rcvbuf_tail + off, tmp;
+
+    if(pos >= sock->rcvbuf_sz)
+        pos -= sock->rcvbuf_sz;
+
+    if(pos + len <= sock->rcvbuf_sz) {
+        memcpy(sock->data.rcvbuf + pos, buf, len);
+    }
+    else {
+        tmp = sock->rcvbuf_sz - pos;
+        memcpy(sock->data.rcvbuf + pos, buf, tmp);
+        memcpy(sock->data.rcvbuf, buf + tmp, len - tmp);
+    }
+}
+
+/* Update the RTT estimate with an acknowledgement of new data. */
+static void tcp_rtt_ack(struct tcp_sock *sock, uint32_t ack,
+                        const struct tcp_optvals *o) {
+    struct ccrec *cc = &sock->data.cc;
+
+    if((sock->data.ext & TCP_EXT_TIMESTAMP) &&
+       (o->seen & TCP_EXT_TIMESTAMP) && o->tsecr) {
+        tcp_rtt_sample(sock, (int32_t)(tcp_now() - o->tsecr));
+    }
+    else if((cc->flags & TCP_CC_TIMING) && SEQ_GE(ack, cc->rtt_seq)) {
+        tcp_rtt_sample(sock,
+                       (int32_t)(timer_ms_gettime64() - cc->rtt_time));
+        cc->flags &= ~TCP_CC_TIMING;
+    }
+}
+
+/* Grow the congestion window for an acknowledgement of new data, or deal with
+   it if we're in fast recovery (RFC 5681 section 3.1 and 3.2, RFC 6582). */
+static void tcp_cc_ack(struct tcp_sock *sock, uint32_t ack, uint32_t acked) {
+    struct ccrec *cc = &sock->data.cc;
+    uint32_t smss = tcp_smss(sock), incr;
+
+    cc->dupacks = 0;
+
+    if(!(sock->data.ext & TCP_EXT_CC))
+        return;
+
+    if(cc->flags & TCP_CC_RECOVERY) {
+        if(SEQ_GE(ack, cc->recover)) {
+            /* Full acknowledgement, deflate the window and get out. */
+            cc->cwnd = MIN(cc->ssthresh,
+                           MAX(sock->data.snd.max - ack, smss) + smss);
+            cc->flags &= ~TCP_CC_RECOVERY;
+        }
+        else {
+            /* Partial acknowledgement, resend the next hole right away. */
+            cc->rexmt = tcp_send_hole(sock, ack);
+            cc->cwnd -= MIN(acked, cc->cwnd - smss);
+            cc->cwnd += smss;
+        }
+
+        return;
+    }
+
+    if(cc->cwnd < cc->ssthresh) {
+        /* Slow start */
+        cc->cwnd += MIN(acked, smss);
+    }
+    else {
+        /* Congestion avoidance */
+        incr = smss * smss / cc->cwnd;
+        cc->cwnd += incr ? incr : 1;
+    }
+}
+
+/* Deal with a duplicate acknowledgement (RFC 5681 section 3.2). */
+static void tcp_cc_dupack(struct tcp_sock *sock) {
+    struct ccrec *cc = &sock->data.cc;
+    uint32_t smss = tcp_smss(sock), flight;
+
+    if(!(sock->data.ext & TCP_EXT_CC))
+        return;
+
+    if(cc->flags & TCP_CC_RECOVERY) {
+        /* Every duplicate means a segment left the network. With SACK, we
+           also know what else is missing, so send that too. */
+        cc->cwnd += smss;
+
+        if(sock->data.ext & TCP_EXT_SACK)
+            cc->rexmt = tcp_send_hole(sock, cc->rexmt);
+
+        tcp_send_data(sock, 0);
+        return;
+    }
+
+    if(++cc->dupacks != 3)
+        return;
+
+    /* Don't go back into fast recovery for losses from before the last time
+       (RFC 6582 section 4.1). */
+    if(SEQ_LT(sock->data.snd.una, cc->recover))
+        return;
+
+    flight = sock->data.snd.max - sock->data.snd.una;
+    cc->ssthresh = MAX(flight / 2, 2 * smss);
+    cc->recover = sock->data.snd.max;
+    cc->flags |= TCP_CC_RECOVERY;
+    cc->flags &= ~TCP_CC_TIMING;
+
+    cc->rexmt = tcp_send_hole(sock, sock->data.snd.una);
+    cc->cwnd = cc->ssthresh + 3 * smss;
+    tcp_timer_start(sock);
 }
 
 #define ADDR_EQUAL(a1, a2) \
@@ -2235,6 +3072,36 @@ static void tcp_send_data(struct tcp_sock *sock, int resend) {
      ((a1).__s6_addr.__s6_addr32[2] == (a2).__s6_addr.__s6_addr32[2]) && \
      ((a1).__s6_addr.__s6_addr32[3] == (a2).__s6_addr.__s6_addr32[3]))
 
+/* See if a socket can take an incoming packet. */
+static int sock_matches(const struct tcp_sock *i, const struct in6_addr *src,
+                        const struct in6_addr *dst, uint16_t sport,
+                        uint16_t dport, int domain) {
+    /* Ignore any closed sockets */
+    if(i->state == TCP_STATE_CLOSED)
+        return 0;
+
+    /* Ignore any sockets that are IPv6 only when we have an incoming IPv4
+       packet, or any that are IPv4 only when we have an incoming IPv6
+       packet. */
+    if((domain == AF_INET && (i->flags & FS_SOCKET_V6ONLY)) ||
+            (domain == AF_INET6 && i->domain == AF_INET))
+        return 0;
+
+    /* See if the remote end matches what's in the socket */
+    if(!IN6_IS_ADDR_UNSPECIFIED(&i->remote_addr.sin6_addr) &&
+            (!ADDR_EQUAL(i->remote_addr.sin6_addr, *src) ||
+             i->remote_addr.sin6_port != sport))
+        return 0;
+
+    /* See if it matches the local end */
+    if((!IN6_IS_ADDR_UNSPECIFIED(&i->local_addr.sin6_addr) &&
+            !ADDR_EQUAL(i->local_addr.sin6_addr, *dst)) ||
+            i->local_addr.sin6_port != dport)
+        return 0;
+
+    return 1;
+}
+
 /* Match a socket to an incoming packet. If an actual socket is returned, it is
    the caller's responsibility  to release the socket's mutex when they're done
    with it. */
@@ -2243,44 +3110,120 @@ static struct tcp_sock *find_sock(const struct in6_addr *src,
                                   uint16_t sport, uint16_t dport, int domain) {
     struct tcp_sock *i;
 
-    LIST_FOREACH(i, &tcp_socks, sock_list) {
-        /* Ignore any closed sockets */
-        if(i->state == TCP_STATE_CLOSED)
-            continue;
+    /* Look for a connected socket first, then for one that is listening. See
+       the comment at the top of the file for more discussion of this, if
+       you're interested. */
+    LIST_FOREACH(i, &tcp_conn_hash[tcp_conn_bucket(src, sport, dport)],
+                 hash_list) {
+        if(sock_matches(i, src, dst, sport, dport, domain))
+            goto found;
+    }
 
-        /* Ignore any sockets that are IPv6 only when we have an incoming IPv4
-           packet, or any that are IPv4 only when we have an incoming IPv6
-           packet. */
-        if((domain == AF_INET && (i->flags & FS_SOCKET_V6ONLY)) ||
-                (domain == AF_INET6 && i->domain == AF_INET))
-            continue;
+    LIST_FOREACH(i, &tcp_port_hash[tcp_port_bucket(dport)], hash_list) {
+        if(sock_matches(i, src, dst, sport, dport, domain))
+            goto found;
+    }
 
-        /* See if the remote end matches what's in the socket */
-        if(!IN6_IS_ADDR_UNSPECIFIED(&i->remote_addr.sin6_addr) &&
-                (!ADDR_EQUAL(i->remote_addr.sin6_addr, *src) ||
-                 i->remote_addr.sin6_port != sport))
-            continue;
+    return NULL;
+
+found:
+    if(mutex_lock_irqsafe(&i->mutex))
+        return (struct tcp_sock *) -1;
+
+    return i;
+}
+
+extern void __poll_event_trigger(int fd, short event);
+
+/* Parse the options of an incoming segment. Returns -1 if they're malformed. */
+static int tcp_parse_opts(const tcp_hdr_t *tcp, uint16_t flags,
+                          struct tcp_optvals *o) {
+    int j = 0, end_of_opts, len, i;
+    const uint8_t *opt;
+    uint32_t tmp;
 
-        /* See if it matches the local end */
-        if((!IN6_IS_ADDR_UNSPECIFIED(&i->local_addr.sin6_addr) &&
-                !ADDR_EQUAL(i->local_addr.sin6_addr, *dst)) ||
-                i->local_addr.sin6_port != dport)
+    o->seen = 0;
+    o->nsack = 0;
+    end_of_opts = TCP_GET_OFFSET(flags) - 20;
+
+    while(j < end_of_opts) {
+        opt = tcp->options + j;
+
+        if(opt[0] == TCP_OPT_EOL)
+            break;
+
+        if(opt[0] == TCP_OPT_NOP) {
+            ++j;
             continue;
+        }
 
-        if(mutex_lock_irqsafe(&i->mutex))
-            return (struct tcp_sock *) -1;
+        /* Everything else has a length */
+        if(j + 2 > end_of_opts)
+            return -1;
 
-        /* Because we always add new sockets to the head of the list, this
-           should be sufficient to match the socket. See the comment at the top
-           of the file for more discussion of this, if you're interested. */
-        return i;
+        len = opt[1];
+
+        if(len < 2 || j + len > end_of_opts)
+            return -1;
+
+        switch(opt[0]) {
+            case TCP_OPT_MSS:
+                if(len != 4)
+                    return -1;
+
+                o->mss = (opt[2] << 8) | opt[3];
+                o->seen |= TCP_OPTSEEN_MSS;
+                break;
+
+            case TCP_OPT_WSCALE:
+                if(len != 3)
+                    return -1;
+
+                o->wscale = MIN(opt[2], TCP_MAX_WSCALE);
+                o->seen |= TCP_EXT_WSCALE;
+                break;
+
+            case TCP_OPT_SACK_PERM:
+                if(len != 2)
+                    return -1;
+
+                o->seen |= TCP_EXT_SACK;
+                break;
+
+            case TCP_OPT_SACK:
+                if((len - 2) % 8)
+                    return -1;
+
+                for(i = 0; i < (len - 2) / 8 && i < TCP_MAX_SACK; ++i) {
+                    memcpy(&tmp, opt + 2 + i * 8, 4);
+                    o->sack[i].start = ntohl(tmp);
+                    memcpy(&tmp, opt + 6 + i * 8, 4);
+                    o->sack[i].end = ntohl(tmp);
+                }
+
+                o->nsack = i;
+                break;
+
+            case TCP_OPT_TIMESTAMP:
+                if(len != 10)
+                    return -1;
+
+                memcpy(&tmp, opt + 2, 4);
+                o->tsval = ntohl(tmp);
+                memcpy(&tmp, opt + 6, 4);
+                o->tsecr = ntohl(tmp);
+                o->seen |= TCP_EXT_TIMESTAMP;
+                break;
+
+            /* Skip unknown options */
+        }
+
+        j += len;
     }
 
-    return NULL;
+    return 0;
 }
 
-extern void __poll_event_trigger(int fd, short event);
-
 /* This function is basically a direct implementation of the first two and a
    half steps of the SEGMENT ARRIVES event processing defined in RFC 793 on
    pages 65 and 66. There are a few parts that are omitted and some are put off
@@ -2289,8 +3232,9 @@ static int listen_pkt(netif_t *src, const struct in6_addr *srca,
                       const struct in6_addr *dsta, const tcp_hdr_t *tcp,
                       struct tcp_sock *s, uint16_t flags, int size) {
     int j = 0;
-    int end_of_opts;
     uint16_t mss = 576;
+    struct tcp_optvals o;
+    struct lsock *ls;
 
     (void)size;
 
@@ -2302,40 +3246,22 @@ static int listen_pkt(netif_t *src, const struct in6_addr *srca,
     if(flags & TCP_FLAG_ACK)
         return -1;
 
-    /* Parse options now, in case we need to update the max segment size. */
-    end_of_opts = TCP_GET_OFFSET(flags) - 20;
-
-    while(j < end_of_opts) {
-        switch(tcp->options[j]) {
-            case TCP_OPT_EOL:
-                j = end_of_opts;
-                break;
-
-            case TCP_OPT_NOP:
-                ++j;
-                break;
-
-            case TCP_OPT_MSS:
-                if(j + 4 > end_of_opts || tcp->options[j + 1] != 4)
-                    return -1;
-
-                mss = (tcp->options[j + 2] << 8) | tcp->options[j + 3];
-                j += 4;
-                break;
-
-            default:
-
-                /* Skip unknown options */
-                if(j + 1 > end_of_opts || j + tcp->options[j + 1] > end_of_opts)
-                    return -1;
+    /* Parse options now, in case we need to update the max segment size or
+       the other side wants to use any extensions. */
+    if(tcp_parse_opts(tcp, flags, &o))
+        return -1;
 
-                j += tcp->options[j + 1];
-        }
-    }
+    if(o.seen & TCP_OPTSEEN_MSS)
+        mss = o.mss;
 
     /* Silently cap the MSS... */
     if(mss > 1460)
         mss = 1460;
+    else if(mss < 64)
+        mss = 64;
+
+    /* Only keep track of the extensions the other side asked for. */
+    o.seen &= TCP_EXT_ALL;
 
     /* If the SYN bit is set, we should check the security/compartment. We just
        silently ignore them for now. We also ignore the precedence... Thus, the
@@ -2347,6 +3273,9 @@ static int listen_pkt(netif_t *src, const struct in6_addr *srca,
                 s->listen.queue[j].remote_addr.sin6_port == tcp->src_port) {
             s->listen.queue[j].isn = ntohl(tcp->seq);
             s->listen.queue[j].mss = mss;
+            s->listen.queue[j].ext = o.seen;
+            s->listen.queue[j].wscale = o.wscale;
+            s->listen.queue[j].tsval = o.tsval;
             return 0;
         }
     }
@@ -2365,6 +3294,10 @@ static int listen_pkt(netif_t *src, const struct in6_addr *srca,
     s->listen.queue[s->listen.tail].isn = ntohl(tcp->seq);
     s->listen.queue[s->listen.tail].mss = mss;
     s->listen.queue[s->listen.tail].wnd = ntohs(tcp->wnd);
+    ls = &s->listen.queue[s->listen.tail];
+    ls->ext = o.seen;
+    ls->wscale = o.wscale;
+    ls->tsval = o.tsval;
     ++s->listen.count;
     ++s->listen.tail;
 
@@ -2386,7 +3319,8 @@ static int synsent_pkt(netif_t *src, const struct in6_addr *srca,
                        struct tcp_sock *s, uint16_t flags, int size) {
     uint32_t ack, seq;
     int sz = size - TCP_GET_OFFSET(flags), gotack = 0;
-    int j = 0, end_of_opts, mss = 536;
+    int mss = 536;
+    struct tcp_optvals o;
 
     (void)src;
 
@@ -2422,43 +3356,31 @@ static int synsent_pkt(netif_t *src, const struct in6_addr *srca,
         s->data.rcv.nxt = seq + 1;
         s->data.rcv.irs = seq;
 
-        end_of_opts = TCP_GET_OFFSET(flags) - 20;
-
-        while(j < end_of_opts) {
-            switch(tcp->options[j]) {
-                case TCP_OPT_EOL:
-                    j = end_of_opts;
-                    break;
-
-                case TCP_OPT_NOP:
-                    ++j;
-                    break;
-
-                case TCP_OPT_MSS:
+        if(tcp_parse_opts(tcp, flags, &o))
+            return -1;
 
-                    if(j + 4 > end_of_opts || tcp->options[j + 1] != 4)
-                        return -1;
+        if(o.seen & TCP_OPTSEEN_MSS)
+            mss = o.mss;
 
-                    mss = (tcp->options[j + 2] << 8) | tcp->options[j + 3];
-                    j += 4;
-                    break;
+        s->data.snd.mss = mss > 1460 ? 1460 : (mss < 64 ? 64 : mss);
+        s->data.snd.wnd = htons(tcp->wnd);
 
-                default:
+        /* Turn off whatever the other side didn't agree to. */
+        s->data.ext &= o.seen | TCP_EXT_CC;
 
-                    /* Skip unknown options */
-                    if(j + 1 > end_of_opts ||
-                            j + tcp->options[j + 1] > end_of_opts)
-                        return -1;
+        if(s->data.ext & TCP_EXT_WSCALE)
+            s->data.snd.wscale = o.wscale;
+        else
+            s->data.rcv.wscale = 0;
 
-                    j += tcp->options[j + 1];
-            }
-        }
+        if(s->data.ext & TCP_EXT_TIMESTAMP)
+            s->data.ts_recent = o.tsval;
 
-        s->data.snd.mss = mss > 1460 ? 1460 : mss;
-        s->data.snd.wnd = htons(tcp->wnd);
+        tcp_cc_init(s);
 
         if(gotack) {
             s->data.snd.una = ack;
+            tcp_rtt_ack(s, ack, &o);
 
             /* If the ack covers our iss, then we've established the connection.
                Update the state and ack it. */
@@ -2485,11 +3407,11 @@ static int synsent_pkt(netif_t *src, const struct in6_addr *srca,
 static int process_pkt(netif_t *src, const struct in6_addr *srca,
                        const struct in6_addr *dsta, const tcp_hdr_t *tcp,
                        struct tcp_sock *s, uint16_t flags, size_t size) {
-    uint32_t seq, ack, up;
+    uint32_t seq, ack, up, off, end, wnd, acked;
     size_t sz;
-    int bad_pkt = 0, tmp, acksyn = 0;
+    int bad_pkt = 0, acksyn = 0, i;
     const uint8_t *buf = (const uint8_t *)tcp;
-    uint8_t *rb;
+    struct tcp_optvals o;
 
     (void)src;
 
@@ -2497,9 +3419,14 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
     seq = ntohl(tcp->seq);
     ack = ntohl(tcp->ack);
 
+    /* Drop anything with broken options. */
+    if(tcp_parse_opts(tcp, flags, &o))
+        return 0;
+
     /* Check the validity of the incoming segment's sequence number */
     sz = size - TCP_GET_OFFSET(flags);
     buf += TCP_GET_OFFSET(flags);
+    end = seq + sz;
 
     if(s->data.rcv.wnd == 0) {
         if(sz || seq != s->data.rcv.nxt)
@@ -2512,8 +3439,12 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
                 bad_pkt = 1;
         }
         else {
+            /* Accept segments that start before what we expect, as long as
+               they contain something new (RFC 793, page 69). */
             if(!(SEQ_GE(seq, s->data.rcv.nxt) &&
-                    SEQ_LT(seq, s->data.rcv.nxt + s->data.rcv.wnd)))
+                    SEQ_LT(seq, s->data.rcv.nxt + s->data.rcv.wnd)) &&
+               !(SEQ_GT(end, s->data.rcv.nxt) &&
+                    SEQ_LE(end, s->data.rcv.nxt + s->data.rcv.wnd)))
                 bad_pkt = 1;
         }
     }
@@ -2530,6 +3461,19 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
         return 0;
     }
 
+    /* With timestamps, drop old duplicates that made it through the sequence
+       check (RFC 7323 section 5.3), and remember the timestamp to echo. */
+    if((s->data.ext & TCP_EXT_TIMESTAMP) && (o.seen & TCP_EXT_TIMESTAMP)) {
+        if(!(flags & TCP_FLAG_RST) && s->data.ts_recent &&
+                SEQ_LT(o.tsval, s->data.ts_recent)) {
+            tcp_send_ack(s);
+            return 0;
+        }
+
+        if(SEQ_LE(seq, s->data.last_ack_sent))
+            s->data.ts_recent = o.tsval;
+    }
+
     /* See if we have a reset, and process it */
     if(flags & TCP_FLAG_RST) {
         if(s->state == TCP_STATE_SYN_SENT) {
@@ -2569,7 +3513,7 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
 
     /* The state changes how we handle the rest... */
     if(s->state == TCP_STATE_SYN_RECEIVED) {
-        if(SEQ_LE(s->data.snd.una, ack) && SEQ_LE(ack, s->data.snd.nxt)) {
+        if(SEQ_LE(s->data.snd.una, ack) && SEQ_LE(ack, s->data.snd.max)) {
             s->state = TCP_STATE_ESTABLISHED;
             acksyn = 1;
         }
@@ -2579,10 +3523,24 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
         }
     }
 
+    /* Take note of what the other side has told us it has. */
+    if(s->data.ext & TCP_EXT_SACK) {
+        for(i = 0; i < o.nsack; ++i)
+            tcp_sack_snd_add(s, o.sack[i].start, o.sack[i].end);
+    }
+
     /* Check the ack number for validity */
-    if(SEQ_LT(s->data.snd.una, ack) && SEQ_LE(ack, s->data.snd.nxt)) {
-        s->data.sndbuf_acked += (int32_t)(ack - s->data.snd.una - acksyn);
-        s->data.sndbuf_cur_sz -= (int32_t)(ack - s->data.snd.una - acksyn);
+    wnd = ntohs(tcp->wnd) << s->data.snd.wscale;
+
+    if(SEQ_LT(s->data.snd.una, ack) && SEQ_LE(ack, s->data.snd.max)) {
+        acked = ack - s->data.snd.una - acksyn;
+
+        /* Don't count our FIN as data. */
+        if(acked > s->data.sndbuf_cur_sz)
+            acked = s->data.sndbuf_cur_sz;
+
+        s->data.sndbuf_acked += acked;
+        s->data.sndbuf_cur_sz -= acked;
         s->data.snd.una = ack;
         __poll_event_trigger(s->sock, POLLWRNORM | POLLWRBAND);
         cond_signal(&s->data.send_cv);
@@ -2590,20 +3548,48 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
         if(s->data.sndbuf_acked >= s->sndbuf_sz)
             s->data.sndbuf_acked -= s->sndbuf_sz;
 
-        if(SEQ_LT(s->data.snd.wl1, seq) ||
-                (s->data.snd.wl1 == seq && SEQ_LE(s->data.snd.wl2, ack))) {
-            s->data.snd.wnd = ntohs(tcp->wnd);
-            s->data.snd.wl1 = seq;
-            s->data.snd.wl2 = ack;
-        }
+        /* After going back to resend everything, an ACK might cover more than
+           what we've sent again. */
+        if(SEQ_LT(s->data.snd.nxt, ack))
+            s->data.snd.nxt = ack;
+
+        tcp_sack_snd_prune(s);
+        tcp_rtt_ack(s, ack, &o);
+
+        /* Restart the retransmission timer for whatever is left. If close()
+           was waiting on everything to be acked, the FIN can go out now. */
+        tcp_timer_start(s);
+
+        if(!s->data.sndbuf_cur_sz && (s->intflags & TCP_IFLAG_QUEUEDCLOSE))
+            net_thd_schedule(thd_cb_id, 0);
+
+        if(acked)
+            tcp_cc_ack(s, ack, acked);
+    }
+    else if(ack == s->data.snd.una && !sz &&
+            !(flags & TCP_FLAG_FIN) && wnd == s->data.snd.wnd &&
+            s->data.snd.max != s->data.snd.una) {
+        /* A duplicate ACK, which means something might have gotten lost. */
+        tcp_cc_dupack(s);
     }
-    else if(SEQ_GT(ack, s->data.snd.nxt)) {
+    else if(SEQ_GT(ack, s->data.snd.max)) {
         /* This ACKs something we haven't sent, so try to correct the other side
            and return */
         tcp_send_ack(s);
         return 0;
     }
 
+    if(SEQ_LE(s->data.snd.una, ack) && (SEQ_LT(s->data.snd.wl1, seq) ||
+            (s->data.snd.wl1 == seq && SEQ_LE(s->data.snd.wl2, ack)))) {
+        s->data.snd.wnd = wnd;
+        s->data.snd.wl1 = seq;
+        s->data.snd.wl2 = ack;
+    }
+
+    /* Send whatever the ACK (or the window update) now allows for. */
+    if(s->data.sndbuf_cur_sz != s->data.snd.nxt - s->data.snd.una)
+        tcp_send_data(s, 0);
+
     /* We need to do a bit more processing in certain states... */
     switch(s->state) {
         case TCP_STATE_FIN_WAIT_1:
@@ -2620,7 +3606,7 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
             /* If the FIN has been acked, go to TIME-WAIT */
             if(ack == s->data.snd.nxt) {
                 s->state = TCP_STATE_TIME_WAIT;
-                s->data.timer = timer_ms_gettime64();
+                tcp_timer_start(s);
                 break;
             }
             else {
@@ -2639,7 +3625,7 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
 
         case TCP_STATE_TIME_WAIT:
             /* ACK the FIN again, and restart the timer */
-            s->data.timer = timer_ms_gettime64();
+            tcp_timer_start(s);
             tcp_send_ack(s);
             break;
     }
@@ -2656,36 +3642,49 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
 
     if(s->state == TCP_STATE_ESTABLISHED || s->state == TCP_STATE_FIN_WAIT_1 ||
             s->state == TCP_STATE_FIN_WAIT_2) {
+        /* Skip over anything at the start of the segment that we already
+           have. */
+        if(sz && SEQ_LT(seq, s->data.rcv.nxt)) {
+            off = s->data.rcv.nxt - seq;
+            buf += off;
+            sz -= off;
+            seq = s->data.rcv.nxt;
+        }
+
         /* Next, check the data size versus our window. If its more than the
            window, truncate the data and copy out what we can. */
-        if(sz > s->data.rcv.wnd) {
-            sz = s->data.rcv.wnd;
+        off = seq - s->data.rcv.nxt;
+
+        if(off + sz > s->data.rcv.wnd) {
+            sz = s->data.rcv.wnd - off;
             bad_pkt = 1;
         }
 
-        /* Copy the data out */
+        /* Copy the data out. Anything that isn't next in line is put where it
+           belongs in the buffer, and reported with SACK blocks until the hole
+           before it is filled in. */
         if(sz) {
-            rb = s->data.rcvbuf + s->data.rcvbuf_tail;
-            s->data.rcv.nxt += sz;
-            s->data.rcv.wnd -= sz;
-            s->data.rcvbuf_cur_sz += sz;
-
-            if(s->data.rcvbuf_tail + sz <= s->rcvbuf_sz) {
-                memcpy(rb, buf, sz);
-                s->data.rcvbuf_tail += sz;
+            tcp_rcvbuf_put(s, off, buf, sz);
+
+            if(!off) {
+                up = tcp_sack_rcv_consume(s, seq + sz) - s->data.rcv.nxt;
+                s->data.rcv.nxt += up;
+                s->data.rcv.wnd -= up;
+                s->data.rcvbuf_cur_sz += up;
+                s->data.rcvbuf_tail += up;
+
+                if(s->data.rcvbuf_tail >= s->rcvbuf_sz)
+                    s->data.rcvbuf_tail -= s->rcvbuf_sz;
+
+                /* Signal any waiting thread */
+                __poll_event_trigger(s->sock, POLLRDNORM);
+                cond_signal(&s->data.recv_cv);
             }
             else {
-                tmp = s->rcvbuf_sz - s->data.rcvbuf_tail;
-                memcpy(rb, buf, tmp);
-                sz -= tmp;
-                buf += tmp;
-                memcpy(s->data.rcvbuf, buf, sz);
-                s->data.rcvbuf_tail = sz;
+                tcp_sack_rcv_add(s, seq, seq + sz);
             }
 
-            /* Signal any waiting thread and send an ack for what we read */
-            __poll_event_trigger(s->sock, POLLRDNORM);
-            cond_signal(&s->data.recv_cv);
+            /* Send an ack for what we read */
             tcp_send_ack(s);
         }
     }
@@ -2696,8 +3695,8 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
     }
 
     /* Finally, check the FIN bit. We don't try to ack it if the packet had too
-       much data. */
-    if(!bad_pkt && (flags & TCP_FLAG_FIN)) {
+       much data, or if there's a hole before it. */
+    if(!bad_pkt && (flags & TCP_FLAG_FIN) && end == s->data.rcv.nxt) {
         /* ACK the FIN */
         ++s->data.rcv.nxt;
         tcp_send_ack(s);
@@ -2721,11 +3720,11 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
 
             case TCP_STATE_FIN_WAIT_2:
                 s->state = TCP_STATE_TIME_WAIT;
-                s->data.timer = timer_ms_gettime64();
+                tcp_timer_start(s);
                 break;
 
             case TCP_STATE_TIME_WAIT:
-                s->data.timer = timer_ms_gettime64();
+                tcp_timer_start(s);
                 break;
         }
     }
@@ -2837,7 +3836,7 @@ static int net_tcp_input(netif_t *src, int domain, const void *hdr,
 
 static void tcp_thd_cb(void *arg) {
     struct tcp_sock *i, *tmp;
-    uint64_t timer;
+    uint64_t timer, expiry;
 
     (void)arg;
 
@@ -2856,9 +3855,10 @@ static void tcp_thd_cb(void *arg) {
                 /* If our last <SYN> was sent more than one  retransmission
                    timeout period ago and we are still in the SYN-SENT state,
                    send another one. */
-                if(i->data.timer + TCP_DEFAULT_RTTO <= timer) {
+                if(i->data.timer + i->data.cc.rto <= timer) {
+                    tcp_rto_backoff(i);
                     tcp_send_syn(i, 0);
-                    i->data.timer = timer;
+                    tcp_timer_start(i);
                 }
 
                 break;
@@ -2868,9 +3868,10 @@ static void tcp_thd_cb(void *arg) {
                 /* If our last <SYN,ACK> was sent more than one  retransmission
                    timeout period ago and we are still in the SYN-RECEIVED
                    state, send another one. */
-                if(i->data.timer + TCP_DEFAULT_RTTO <= timer) {
+                if(i->data.timer + i->data.cc.rto <= timer) {
+                    tcp_rto_backoff(i);
                     tcp_send_syn(i, 1);
-                    i->data.timer = timer;
+                    tcp_timer_start(i);
                 }
 
                 break;
@@ -2889,8 +3890,8 @@ static void tcp_thd_cb(void *arg) {
             case TCP_STATE_CLOSE_WAIT:
 
                 if(i->data.sndbuf_cur_sz &&
-                        i->data.timer + TCP_DEFAULT_RTTO <= timer) {
-                    tcp_send_data(i, 1);
+                        i->data.timer + i->data.cc.rto <= timer) {
+                    tcp_timeout(i);
                 }
                 else if(!i->data.sndbuf_cur_sz &&
                         (i->intflags & TCP_IFLAG_QUEUEDCLOSE)) {
@@ -2902,11 +3903,16 @@ static void tcp_thd_cb(void *arg) {
                     }
 
                     tcp_send_fin_ack(i);
-                    ++i->data.snd.nxt;
+                    i->data.snd.max = ++i->data.snd.nxt;
                 }
 
                 break;
         }
+
+        /* Whatever woke us up might not have been this socket's timer (or it
+           might have been pushed back since), so check back when it's due. */
+        if((expiry = tcp_timer_expiry(i)))
+            net_thd_schedule(thd_cb_id, expiry);
     }
 
     rwsem_read_unlock(&tcp_sem);
@@ -2922,12 +3928,13 @@ static void tcp_thd_cb(void *arg) {
         if((i->intflags & TCP_IFLAG_CANBEDEL) &&
                 (i->state & 0x0F) == TCP_STATE_CLOSED) {
             LIST_REMOVE(i, sock_list);
+            tcp_unhash(i);
             cond_destroy(&i->data.send_cv);
             cond_destroy(&i->data.recv_cv);
             mutex_destroy(&i->mutex);
             free(i->data.sndbuf);
             free(i->data.rcvbuf);
-            free(i);
+            kmem_cache_free(tcp_sock_cache, i);
         }
 
         i = tmp;
@@ -2957,14 +3964,32 @@ static fs_socket_proto_t proto = {
     net_tcp_getsockname,                /* getsockname */
     net_tcp_getpeername,                /* getpeername */
     net_tcp_fcntl,                      /* fcntl */
-    net_tcp_poll                        /* poll */
+    net_tcp_poll,                       /* poll */
+    net_tcp_sendmsg                     /* sendmsg */
 };
 
 int net_tcp_init(void) {
-    if((thd_cb_id = net_thd_add_callback(tcp_thd_cb, NULL, 50)) < 0)
+    tcp_sock_cache = kmem_cache_create("tcp_sock", sizeof(struct tcp_sock),
+                                       0, KMEM_CACHE_ZERO);
+
+    if(!tcp_sock_cache)
         return -1;
 
-    return fs_socket_proto_add(&proto);
+    if((thd_cb_id = net_thd_add_callback(tcp_thd_cb, NULL, TCP_THD_PERIOD)) < 0)
+        goto out_cache;
+
+    if(fs_socket_proto_add(&proto))
+        goto out_cb;
+
+    return 0;
+
+out_cb:
+    net_thd_del_callback(thd_cb_id);
+    thd_cb_id = -1;
+out_cache:
+    kmem_cache_destroy(tcp_sock_cache);
+    tcp_sock_cache = NULL;
+    return -1;
 }
 
 void net_tcp_shutdown(void) {
@@ -2988,19 +4013,26 @@ void net_tcp_shutdown(void) {
         }
         else {
             LIST_REMOVE(i, sock_list);
+            tcp_unhash(i);
             cond_destroy(&i->data.send_cv);
             cond_destroy(&i->data.recv_cv);
             mutex_destroy(&i->mutex);
             free(i->data.sndbuf);
             free(i->data.rcvbuf);
-            free(i);
+            kmem_cache_free(tcp_sock_cache, i);
         }
 
         i = tmp;
     }
 
     LIST_INIT(&tcp_socks);
+    memset(tcp_conn_hash, 0, sizeof(tcp_conn_hash));
+    memset(tcp_port_hash, 0, sizeof(tcp_port_hash));
+    memset(tcp_bind_hash, 0, sizeof(tcp_bind_hash));
 
     /* Remove us from fs_socket and clean up the semaphore */
     fs_socket_proto_remove(&proto);
+
+    kmem_cache_destroy(tcp_sock_cache);
+    tcp_sock_cache = NULL;
 }
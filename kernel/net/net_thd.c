@@ -10,6 +10,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 
+#include <kos/genwait.h>
 #include <kos/thread.h>
 #include <kos/timer.h>
 #include "net_thd.h"
@@ -26,30 +27,81 @@ struct thd_cb {
 
 TAILQ_HEAD(thd_cb_queue, thd_cb);
 
+/* The callbacks, sorted by when they next need to run. The thread sleeps on
+   this queue until the one at the head is due. */
 static struct thd_cb_queue cbs;
 static kthread_t *thd;
-static int done = 0;
+static volatile int done = 0;
 static int cbid_top;
 
+/* Insert a callback into the queue, keeping it sorted. Must be called with
+   interrupts disabled. */
+static void cb_insert(struct thd_cb *newcb) {
+    struct thd_cb *cb;
+
+    /* Search from the end, since a callback that was just run will usually go
+       there (or close to it). */
+    TAILQ_FOREACH_REVERSE(cb, &cbs, thd_cb_queue, thds) {
+        if(cb->nextrun <= newcb->nextrun) {
+            TAILQ_INSERT_AFTER(&cbs, cb, newcb, thds);
+            break;
+        }
+    }
+
+    if(!cb)
+        TAILQ_INSERT_HEAD(&cbs, newcb, thds);
+
+    /* If it's the next one due now, the thread needs to know about it. */
+    if(TAILQ_FIRST(&cbs) == newcb)
+        genwait_wake_one(&cbs);
+}
+
 static void *net_thd_thd(void *data) {
     struct thd_cb *cb;
-    uint64_t now;
+    void (*func)(void *);
+    void *arg;
+    uint64_t now, delay;
+    int old;
 
     (void)data;
 
     while(!done) {
+        old = irq_disable();
+
+        /* net_thd_kill() may have run since the check above, in which case
+           its wakeup has already come and gone. */
+        if(done) {
+            irq_restore(old);
+            break;
+        }
+
         now = timer_ms_gettime64();
+        cb = TAILQ_FIRST(&cbs);
 
-        /* Run any callbacks that need to be run now. */
-        TAILQ_FOREACH(cb, &cbs, thds) {
-            if(now >= cb->nextrun) {
-                cb->cb(cb->data);
-                cb->nextrun = now + cb->timeout;
-            }
+        if(cb && cb->nextrun <= now) {
+            /* Put it back in line for its next period before running it, so
+               that it can ask to be run sooner with net_thd_schedule(). */
+            TAILQ_REMOVE(&cbs, cb, thds);
+            cb->nextrun = now + cb->timeout;
+            cb_insert(cb);
+
+            func = cb->cb;
+            arg = cb->data;
+            irq_restore(old);
+
+            func(arg);
+            continue;
         }
 
-        /* Go to sleep til we need to be run again. */
-        thd_sleep(50);
+        /* Go to sleep until the first callback is due, or until someone adds
+           or reschedules one to run before that. */
+        delay = cb ? cb->nextrun - now : 0;
+
+        if(delay > UINT32_MAX)
+            delay = UINT32_MAX;
+
+        genwait_wait(&cbs, "net_thd", (unsigned int)delay);
+        irq_restore(old);
     }
 
     return NULL;
@@ -66,6 +118,10 @@ int net_thd_add_callback(void (*cb)(void *), void *data, uint64_t timeout) {
         return -1;
     }
 
+    /* A zero period would keep the thread from ever sleeping. */
+    if(!timeout)
+        timeout = 1;
+
     newcb->cbid = cbid_top++;
     newcb->cb = cb;
     newcb->data = data;
@@ -75,11 +131,33 @@ int net_thd_add_callback(void (*cb)(void *), void *data, uint64_t timeout) {
     /* Disable interrupts, insert, and re-enable interrupts */
     irq_disable_scoped();
 
-    TAILQ_INSERT_TAIL(&cbs, newcb, thds);
+    cb_insert(newcb);
 
     return newcb->cbid;
 }
 
+int net_thd_schedule(int cbid, uint64_t when) {
+    struct thd_cb *cb;
+
+    irq_disable_scoped();
+
+    TAILQ_FOREACH(cb, &cbs, thds) {
+        if(cb->cbid == cbid) {
+            /* Only ever move it up. If it's already due before then, it'll
+               get to check on whatever it needs to at that point. */
+            if(when < cb->nextrun) {
+                TAILQ_REMOVE(&cbs, cb, thds);
+                cb->nextrun = when;
+                cb_insert(cb);
+            }
+
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
 int net_thd_del_callback(int cbid) {
     struct thd_cb *cb;
 
@@ -107,6 +185,7 @@ int net_thd_is_current(void) {
 void net_thd_kill(void) {
     /* Do things gracefully, if we can... Otherwise, punt. */
     done = 1;
+    genwait_wake_one(&cbs);
 
     if(!irq_inside_int()) {
         thd_join(thd, NULL);
@@ -16,6 +16,10 @@ __BEGIN_DECLS
 int net_thd_add_callback(void (*cb)(void *), void *data, uint64_t timeout);
 int net_thd_del_callback(int cbid);
 
+/* Make the callback run no later than the given time (in ms since boot). After
+   that, it goes back to running once per its timeout period. */
+int net_thd_schedule(int cbid, uint64_t when);
+
 int net_thd_is_current(void);
 
 void net_thd_kill(void);
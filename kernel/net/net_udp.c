@@ -23,6 +23,7 @@
 
 #include "net_ipv4.h"
 #include "net_ipv6.h"
+#include "net_lo.h"
 
 #if __GNUC__ >= 9
 #pragma GCC diagnostic push
@@ -39,20 +40,40 @@ typedef struct {
     uint16_t checksum __packed;
 } udp_hdr_t;
 
-struct udp_pkt {
-    TAILQ_ENTRY(udp_pkt) pkt_queue;
+/* Default and maximum sizes of the receive buffer of a socket. */
+#define UDP_DEFAULT_RCVBUF  16384
+#define UDP_MIN_RCVBUF      256
+#define UDP_MAX_RCVBUF      (256 * 1024)
+
+/* Received datagrams are kept in a ring buffer that is allocated along with the
+   socket, so that nothing has to be allocated when one comes in (which is
+   usually in an interrupt). Each one is stored as one of these, followed by the
+   data, padded to a multiple of 4 bytes. Datagrams never wrap around the end of
+   the buffer: if one doesn't fit in the space left at the end, that space is
+   skipped (and marked with UDP_REC_WRAP, if there's room for the marker). */
+struct udp_rec {
     struct sockaddr_in6 from;
-    uint8_t *data;
     uint16_t datasize;
+    uint16_t pad;
 };
 
-TAILQ_HEAD(udp_pkt_queue, udp_pkt);
+#define UDP_REC_WRAP        0xFFFF
+#define UDP_REC_SIZE(n)     ((sizeof(struct udp_rec) + (n) + 3) & ~3)
+
+struct udp_rcvq {
+    uint8_t *buf;
+    uint32_t size;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t used;
+};
 
 #define UDPSOCK_NO_CHECKSUM 0x00000001
 #define UDPSOCK_LITE_RCVCOV 0x00000002
 
 struct udp_sock {
     LIST_ENTRY(udp_sock) sock_list;
+    LIST_ENTRY(udp_sock) port_list;
     struct sockaddr_in6 local_addr;
     struct sockaddr_in6 remote_addr;
 
@@ -68,7 +89,7 @@ struct udp_sock {
         uint16_t recv_cscov;
     } udp_lite;
 
-    struct udp_pkt_queue packets;
+    struct udp_rcvq rcvq;
 };
 
 LIST_HEAD(udp_sock_list, udp_sock);
@@ -77,10 +98,148 @@ static struct udp_sock_list net_udp_sockets = LIST_HEAD_INITIALIZER(0);
 static mutex_t udp_mutex = MUTEX_INITIALIZER;
 static net_udp_stats_t udp_stats = { 0 };
 
+/* Sockets with a local port, hashed by that port. Since no two sockets can be
+   bound to the same port, this is all that's needed to find the socket for an
+   incoming packet without looking at all the others. Protected by udp_mutex,
+   like the list of sockets. */
+#define UDP_HASH_SIZE       64
+
+static struct udp_sock_list udp_port_hash[UDP_HASH_SIZE];
+
+static inline struct udp_sock_list *udp_port_bucket(uint16_t port) {
+    uint32_t h = port * 0x9E3779B1;
+
+    return &udp_port_hash[(h ^ (h >> 16)) & (UDP_HASH_SIZE - 1)];
+}
+
+/* Set the local port of a socket (in network byte order), moving it to the
+   right bucket. */
+static void udp_set_port(struct udp_sock *sock, uint16_t port) {
+    if(sock->port_list.le_prev) {
+        LIST_REMOVE(sock, port_list);
+        sock->port_list.le_prev = NULL;
+    }
+
+    sock->local_addr.sin6_port = port;
+
+    if(port)
+        LIST_INSERT_HEAD(udp_port_bucket(port), sock, port_list);
+}
+
+static int udp_port_used(const struct udp_sock *sock, uint16_t port) {
+    struct udp_sock *iter;
+
+    LIST_FOREACH(iter, udp_port_bucket(port), port_list) {
+        if(iter != sock && iter->local_addr.sin6_port == port)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Grab the first unused port >= 1024, in network byte order. Returns 0 if
+   they're all taken. */
+static uint16_t udp_alloc_port(const struct udp_sock *sock) {
+    uint32_t port;
+
+    for(port = 1024; port <= 0xFFFF; ++port) {
+        if(!udp_port_used(sock, htons(port)))
+            return htons(port);
+    }
+
+    return 0;
+}
+
+/* Make room for a datagram of the given size at the end of the receive
+   queue. Returns NULL if there isn't enough space left. */
+static struct udp_rec *udp_rcv_alloc(struct udp_rcvq *q, size_t len) {
+    uint32_t need = UDP_REC_SIZE(len);
+    struct udp_rec *rec;
+
+    if(!q->used)
+        q->head = q->tail = 0;
+
+    if(q->used && q->tail <= q->head) {
+        if(q->head - q->tail < need)
+            return NULL;
+    }
+    else if(q->size - q->tail < need) {
+        /* It doesn't fit at the end, see if it fits at the start. */
+        if(q->head < need)
+            return NULL;
+
+        if(q->size - q->tail >= sizeof(struct udp_rec))
+            ((struct udp_rec *)(q->buf + q->tail))->datasize = UDP_REC_WRAP;
+
+        q->used += q->size - q->tail;
+        q->tail = 0;
+    }
+
+    rec = (struct udp_rec *)(q->buf + q->tail);
+    rec->datasize = len;
+    q->tail += need;
+    q->used += need;
+
+    if(q->tail == q->size)
+        q->tail = 0;
+
+    return rec;
+}
+
+/* Get the oldest datagram in the receive queue, if any. */
+static struct udp_rec *udp_rcv_first(struct udp_rcvq *q) {
+    if(!q->used)
+        return NULL;
+
+    if(q->size - q->head < sizeof(struct udp_rec) ||
+       ((struct udp_rec *)(q->buf + q->head))->datasize == UDP_REC_WRAP) {
+        q->used -= q->size - q->head;
+        q->head = 0;
+    }
+
+    return (struct udp_rec *)(q->buf + q->head);
+}
+
+/* Remove the datagram returned by udp_rcv_first() from the receive queue. */
+static void udp_rcv_pop(struct udp_rcvq *q, const struct udp_rec *rec) {
+    uint32_t sz = UDP_REC_SIZE(rec->datasize);
+
+    q->head += sz;
+    q->used -= sz;
+
+    if(q->head == q->size)
+        q->head = 0;
+}
+
+/* Change the size of the receive buffer, keeping as many of the queued
+   datagrams as fit in the new one. */
+static int udp_rcv_resize(struct udp_rcvq *q, uint32_t size) {
+    struct udp_rcvq nq = { NULL, size, 0, 0, 0 };
+    struct udp_rec *rec, *nrec;
+
+    if(!(nq.buf = (uint8_t *)malloc(size)))
+        return -1;
+
+    while((rec = udp_rcv_first(q))) {
+        if((nrec = udp_rcv_alloc(&nq, rec->datasize)))
+            memcpy(nrec, rec, UDP_REC_SIZE(rec->datasize));
+        else
+            ++udp_stats.pkt_recv_dropped;
+
+        udp_rcv_pop(q, rec);
+    }
+
+    free(q->buf);
+    *q = nq;
+
+    return 0;
+}
+
 static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
-                            const struct sockaddr_in6 *dst, const uint8_t *data,
-                            size_t size, uint32_t flags, int hops,
-                            uint32_t iflags, int proto, uint16_t cscov);
+                            const struct sockaddr_in6 *dst,
+                            const struct iovec *iov, int iovcnt,
+                            uint32_t flags, int hops, uint32_t iflags,
+                            int proto, uint16_t cscov);
 
 static int net_udp_accept(net_socket_t *hnd, struct sockaddr *addr,
                           socklen_t *addr_len) {
@@ -93,7 +252,7 @@ static int net_udp_accept(net_socket_t *hnd, struct sockaddr *addr,
 
 static int net_udp_bind(net_socket_t *hnd, const struct sockaddr *addr,
                         socklen_t addr_len) {
-    struct udp_sock *udpsock, *iter;
+    struct udp_sock *udpsock;
     struct sockaddr_in *realaddr4;
     struct sockaddr_in6 realaddr6;
 
@@ -166,38 +325,21 @@ static int net_udp_bind(net_socket_t *hnd, const struct sockaddr *addr,
     if(realaddr6.sin6_port != 0) {
         /* Make sure we don't already have a socket bound to the port
            specified */
-        LIST_FOREACH(iter, &net_udp_sockets, sock_list) {
-            if(iter == udpsock)
-                continue;
-
-            if(iter->local_addr.sin6_port == realaddr6.sin6_port) {
-                mutex_unlock(&udp_mutex);
-                errno = EADDRINUSE;
-                return -1;
-            }
+        if(udp_port_used(udpsock, realaddr6.sin6_port)) {
+            mutex_unlock(&udp_mutex);
+            errno = EADDRINUSE;
+            return -1;
         }
-
-        udpsock->local_addr = realaddr6;
     }
-    else {
-        uint16_t port = 1024, tmp = 0;
-
-        /* Grab the first unused port >= 1024. This is, unfortunately, O(n^2) */
-        while(tmp != port) {
-            tmp = port;
-
-            LIST_FOREACH(iter, &net_udp_sockets, sock_list) {
-                if(iter->local_addr.sin6_port == port) {
-                    ++port;
-                    break;
-                }
-            }
-        }
-
-        udpsock->local_addr = realaddr6;
-        udpsock->local_addr.sin6_port = htons(port);
+    else if(!(realaddr6.sin6_port = udp_alloc_port(udpsock))) {
+        mutex_unlock(&udp_mutex);
+        errno = EADDRINUSE;
+        return -1;
     }
 
+    udpsock->local_addr = realaddr6;
+    udp_set_port(udpsock, realaddr6.sin6_port);
+
     udpsock->sock = hnd->fd;
 
     mutex_unlock(&udp_mutex);
@@ -304,11 +446,16 @@ static int net_udp_listen(net_socket_t *hnd, int backlog) {
     return -1;
 }
 
-static ssize_t net_udp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
-                                int flags, struct sockaddr *addr,
-                                socklen_t *addr_len) {
+/* Receive one datagram, scattered into the given buffers. If it doesn't fit,
+   the rest of it is dropped and MSG_TRUNC is set in *mflags. */
+static ssize_t net_udp_recvv(net_socket_t *hnd, const struct iovec *iov,
+                             int iovcnt, int flags, struct sockaddr *addr,
+                             socklen_t *addr_len, int *mflags) {
     struct udp_sock *udpsock;
-    struct udp_pkt *pkt;
+    struct udp_rec *pkt;
+    const uint8_t *data;
+    size_t length, n;
+    int i;
 
     if(mutex_lock_irqsafe(&udp_mutex))
         return -1;
@@ -326,13 +473,13 @@ static ssize_t net_udp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
         return 0;
     }
 
-    if(buffer == NULL || (addr != NULL && addr_len == NULL)) {
+    if(addr != NULL && addr_len == NULL) {
         mutex_unlock(&udp_mutex);
         errno = EFAULT;
         return -1;
     }
 
-    if(TAILQ_EMPTY(&udpsock->packets) &&
+    if(!udpsock->rcvq.used &&
        ((udpsock->flags & FS_SOCKET_NONBLOCK) || (flags & MSG_DONTWAIT) ||
         irq_inside_int())) {
         mutex_unlock(&udp_mutex);
@@ -340,20 +487,31 @@ static ssize_t net_udp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
         return -1;
     }
 
-    while(TAILQ_EMPTY(&udpsock->packets)) {
+    while(!udpsock->rcvq.used) {
         mutex_unlock(&udp_mutex);
         genwait_wait(udpsock, "net_udp_recvfrom", 0);
         mutex_lock(&udp_mutex);
     }
 
-    pkt = TAILQ_FIRST(&udpsock->packets);
+    pkt = udp_rcv_first(&udpsock->rcvq);
+    data = (const uint8_t *)(pkt + 1);
+
+    for(i = 0, length = 0; i < iovcnt && length < pkt->datasize; ++i) {
+        n = iov[i].iov_len;
 
-    if(pkt->datasize > length) {
-        memcpy(buffer, pkt->data, length);
+        if(n > pkt->datasize - length)
+            n = pkt->datasize - length;
+
+        memcpy(iov[i].iov_base, data + length, n);
+        length += n;
     }
-    else {
-        memcpy(buffer, pkt->data, pkt->datasize);
-        length = pkt->datasize;
+
+    if(length < pkt->datasize) {
+        *mflags |= MSG_TRUNC;
+
+        /* Report the real size of the datagram, if asked to. */
+        if(flags & MSG_TRUNC)
+            length = pkt->datasize;
     }
 
     if(addr != NULL) {
@@ -393,20 +551,43 @@ static ssize_t net_udp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
     }
 
     /* Remove the packet if we're pulling data out of the queue. */
-    if(!(flags & MSG_PEEK)) {
-        TAILQ_REMOVE(&udpsock->packets, pkt, pkt_queue);
-        free(pkt->data);
-        free(pkt);
-    }
+    if(!(flags & MSG_PEEK))
+        udp_rcv_pop(&udpsock->rcvq, pkt);
 
     mutex_unlock(&udp_mutex);
 
     return length;
 }
 
-static ssize_t net_udp_sendto(net_socket_t *hnd, const void *message,
-                              size_t length, int flags,
-                              const struct sockaddr *addr, socklen_t addr_len) {
+static ssize_t net_udp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
+                                int flags, struct sockaddr *addr,
+                                socklen_t *addr_len) {
+    struct iovec iov;
+    int mflags = 0;
+
+    if(buffer == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    iov.iov_base = buffer;
+    iov.iov_len = length;
+
+    return net_udp_recvv(hnd, &iov, 1, flags, addr, addr_len, &mflags);
+}
+
+static ssize_t net_udp_recvmsg(net_socket_t *hnd, struct msghdr *msg,
+                               int flags) {
+    return net_udp_recvv(hnd, msg->msg_iov, msg->msg_iovlen, flags,
+                         (struct sockaddr *)msg->msg_name,
+                         msg->msg_name ? &msg->msg_namelen : NULL,
+                         &msg->msg_flags);
+}
+
+/* Send one datagram gathered from the given buffers. */
+static ssize_t net_udp_sendv(net_socket_t *hnd, const struct iovec *iov,
+                             int iovcnt, const struct sockaddr *addr,
+                             socklen_t addr_len) {
     struct udp_sock *udpsock;
     struct sockaddr_in *realaddr;
     struct sockaddr_in6 realaddr6;
@@ -415,8 +596,6 @@ static ssize_t net_udp_sendto(net_socket_t *hnd, const void *message,
     uint16_t cscov;
     struct sockaddr_in6 local_addr;
 
-    (void)flags;
-
     if(mutex_lock_irqsafe(&udp_mutex))
         return -1;
 
@@ -477,28 +656,15 @@ static ssize_t net_udp_sendto(net_socket_t *hnd, const void *message,
         goto err;
     }
 
-    if(message == NULL) {
-        errno = EFAULT;
-        goto err;
-    }
-
     if(udpsock->local_addr.sin6_port == 0) {
-        uint16_t port = 1024, tmp = 0;
-        struct udp_sock *iter;
-
-        /* Grab the first unused port >= 1024. This is, unfortunately, O(n^2) */
-        while(tmp != port) {
-            tmp = port;
-
-            LIST_FOREACH(iter, &net_udp_sockets, sock_list) {
-                if(iter->local_addr.sin6_port == port) {
-                    ++port;
-                    break;
-                }
-            }
+        uint16_t port;
+
+        if(!(port = udp_alloc_port(udpsock))) {
+            errno = EADDRNOTAVAIL;
+            goto err;
         }
 
-        udpsock->local_addr.sin6_port = htons(port);
+        udp_set_port(udpsock, port);
     }
 
     local_addr = udpsock->local_addr;
@@ -509,14 +675,40 @@ static ssize_t net_udp_sendto(net_socket_t *hnd, const void *message,
     cscov = udpsock->udp_lite.send_cscov;
     mutex_unlock(&udp_mutex);
 
-    return net_udp_send_raw(NULL, &local_addr, &realaddr6,
-                            (const uint8_t *)message, length, sflags, hops,
-                            iflags, proto, cscov);
+    return net_udp_send_raw(NULL, &local_addr, &realaddr6, iov, iovcnt,
+                            sflags, hops, iflags, proto, cscov);
 err:
     mutex_unlock(&udp_mutex);
     return -1;
 }
 
+static ssize_t net_udp_sendto(net_socket_t *hnd, const void *message,
+                              size_t length, int flags,
+                              const struct sockaddr *addr, socklen_t addr_len) {
+    struct iovec iov;
+
+    (void)flags;
+
+    if(message == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    iov.iov_base = (void *)message;
+    iov.iov_len = length;
+
+    return net_udp_sendv(hnd, &iov, 1, addr, addr_len);
+}
+
+static ssize_t net_udp_sendmsg(net_socket_t *hnd, const struct msghdr *msg,
+                               int flags) {
+    (void)flags;
+
+    return net_udp_sendv(hnd, msg->msg_iov, msg->msg_iovlen,
+                         (const struct sockaddr *)msg->msg_name,
+                         msg->msg_namelen);
+}
+
 static int net_udp_shutdownsock(net_socket_t *hnd, int how) {
     struct udp_sock *udpsock;
 
@@ -567,12 +759,20 @@ static int net_udp_socket(net_socket_t *hnd, int domain, int type, int proto) {
     }
 
     memset(udpsock, 0, sizeof(struct udp_sock));
-    TAILQ_INIT(&udpsock->packets);
+
+    if(!(udpsock->rcvq.buf = (uint8_t *)malloc(UDP_DEFAULT_RCVBUF))) {
+        free(udpsock);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    udpsock->rcvq.size = UDP_DEFAULT_RCVBUF;
     udpsock->domain = domain;
     udpsock->proto = proto;
     udpsock->hop_limit = UDP_DEFAULT_HOPS;
 
     if(mutex_lock_irqsafe(&udp_mutex)) {
+        free(udpsock->rcvq.buf);
         free(udpsock);
         return -1;
     }
@@ -586,8 +786,6 @@ static int net_udp_socket(net_socket_t *hnd, int domain, int type, int proto) {
 
 static void net_udp_close(net_socket_t *hnd) {
     struct udp_sock *udpsock;
-    struct udp_pkt *pkt;
-    struct udp_pkt *it;
 
     if(mutex_lock_irqsafe(&udp_mutex))
         return;
@@ -600,18 +798,10 @@ static void net_udp_close(net_socket_t *hnd) {
         return;
     }
 
-    it = udpsock->packets.tqh_first;
-    while(it) {
-        pkt = it;
-        it = it->pkt_queue.tqe_next;
-
-        free(pkt->data);
-        TAILQ_REMOVE(&udpsock->packets, pkt, pkt_queue);
-        free(pkt);
-    }
-
     LIST_REMOVE(udpsock, sock_list);
+    udp_set_port(udpsock, 0);
 
+    free(udpsock->rcvq.buf);
     free(udpsock);
     mutex_unlock(&udp_mutex);
 }
@@ -640,6 +830,10 @@ static int net_udp_getsockopt(net_socket_t *hnd, int level, int option_name,
                 case SO_TYPE:
                     tmp = SOCK_DGRAM;
                     goto copy_int;
+
+                case SO_RCVBUF:
+                    tmp = sock->rcvq.size;
+                    goto copy_int;
             }
 
             break;
@@ -751,6 +945,25 @@ static int net_udp_setsockopt(net_socket_t *hnd, int level, int option_name,
                 case SO_ERROR:
                 case SO_TYPE:
                     goto ret_inval;
+
+                case SO_RCVBUF:
+                    if(option_len != sizeof(int))
+                        goto ret_inval;
+
+                    tmp = *((int *)option_value);
+
+                    if(tmp < UDP_MIN_RCVBUF)
+                        tmp = UDP_MIN_RCVBUF;
+                    else if(tmp > UDP_MAX_RCVBUF)
+                        tmp = UDP_MAX_RCVBUF;
+
+                    if(udp_rcv_resize(&sock->rcvq, tmp)) {
+                        mutex_unlock(&udp_mutex);
+                        errno = ENOMEM;
+                        return -1;
+                    }
+
+                    goto ret_success;
             }
 
             break;
@@ -1086,7 +1299,7 @@ static short net_udp_poll(net_socket_t *hnd, short events) {
         return POLLNVAL;
     }
 
-    if(!TAILQ_EMPTY(&sock->packets))
+    if(sock->rcvq.used)
         rv |= POLLRDNORM;
 
     mutex_unlock(&udp_mutex);
@@ -1102,7 +1315,7 @@ static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8_t *data,
     uint16_t cs, cscov = 0;
     int partial = 1;
     struct udp_sock *sock;
-    struct udp_pkt *pkt;
+    struct udp_rec *pkt;
 
     (void)src;
 
@@ -1159,7 +1372,7 @@ static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8_t *data,
         /* If the mutex is locked, there isn't much that can be done. */
         return -1;
 
-    LIST_FOREACH(sock, &net_udp_sockets, sock_list) {
+    LIST_FOREACH(sock, udp_port_bucket(hdr->dst_port), port_list) {
         /* Don't even bother looking at IPv6-only sockets */
         if(sock->domain == AF_INET6 && (sock->flags & FS_SOCKET_V6ONLY))
             continue;
@@ -1197,29 +1410,21 @@ static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8_t *data,
             return 0;
         }
 
-        if(!(pkt = (struct udp_pkt *)malloc(sizeof(struct udp_pkt)))) {
+        if(!(pkt = udp_rcv_alloc(&sock->rcvq, size - sizeof(udp_hdr_t)))) {
+            /* The receive buffer is full, so drop it on the floor. */
+            ++udp_stats.pkt_recv_dropped;
             mutex_unlock(&udp_mutex);
             return -1;
         }
 
-        memset(pkt, 0, sizeof(struct udp_pkt));
-
-        pkt->datasize = size - sizeof(udp_hdr_t);
-
-        if(!(pkt->data = (uint8_t *)malloc(pkt->datasize))) {
-            free(pkt);
-            mutex_unlock(&udp_mutex);
-            return -1;
-        }
+        memset(&pkt->from, 0, sizeof(struct sockaddr_in6));
 
         pkt->from.sin6_family = AF_INET6;
         pkt->from.sin6_addr.__s6_addr.__s6_addr16[5] = 0xFFFF;
         pkt->from.sin6_addr.__s6_addr.__s6_addr32[3] = ip->src;
         pkt->from.sin6_port = hdr->src_port;
 
-        memcpy(pkt->data, data + sizeof(udp_hdr_t), pkt->datasize);
-
-        TAILQ_INSERT_TAIL(&sock->packets, pkt, pkt_queue);
+        memcpy(pkt + 1, data + sizeof(udp_hdr_t), pkt->datasize);
 
         ++udp_stats.pkt_recv;
         __poll_event_trigger(sock->sock, POLLRDNORM);
@@ -1241,7 +1446,7 @@ static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8_t *dat
     uint16_t cs, cscov = 0;
     int partial = 1;
     struct udp_sock *sock;
-    struct udp_pkt *pkt;
+    struct udp_rec *pkt;
 
     (void)src;
 
@@ -1296,7 +1501,7 @@ static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8_t *dat
         /* If the mutex is locked, there isn't much that can be done. */
         return -1;
 
-    LIST_FOREACH(sock, &net_udp_sockets, sock_list) {
+    LIST_FOREACH(sock, udp_port_bucket(hdr->dst_port), port_list) {
         /* Don't even bother looking at IPv4 sockets */
         if(sock->domain == AF_INET)
             continue;
@@ -1334,28 +1539,20 @@ static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8_t *dat
             return 0;
         }
 
-        if(!(pkt = (struct udp_pkt *)malloc(sizeof(struct udp_pkt)))) {
+        if(!(pkt = udp_rcv_alloc(&sock->rcvq, size - sizeof(udp_hdr_t)))) {
+            /* The receive buffer is full, so drop it on the floor. */
+            ++udp_stats.pkt_recv_dropped;
             mutex_unlock(&udp_mutex);
             return -1;
         }
 
-        memset(pkt, 0, sizeof(struct udp_pkt));
-
-        pkt->datasize = size - sizeof(udp_hdr_t);
-
-        if(!(pkt->data = (uint8_t *)malloc(pkt->datasize))) {
-            free(pkt);
-            mutex_unlock(&udp_mutex);
-            return -1;
-        }
+        memset(&pkt->from, 0, sizeof(struct sockaddr_in6));
 
         pkt->from.sin6_family = AF_INET6;
         pkt->from.sin6_addr = ip->src_addr;
         pkt->from.sin6_port = hdr->src_port;
 
-        memcpy(pkt->data, data + sizeof(udp_hdr_t), pkt->datasize);
-
-        TAILQ_INSERT_TAIL(&sock->packets, pkt, pkt_queue);
+        memcpy(pkt + 1, data + sizeof(udp_hdr_t), pkt->datasize);
 
         ++udp_stats.pkt_recv;
         __poll_event_trigger(sock->sock, POLLRDNORM);
@@ -1384,27 +1581,27 @@ static int net_udp_input(netif_t *src, int domain, const void *hdr,
     return -1;
 }
 
-/* XXX */
+/* The datagram is handed to the network device straight from the caller's
+   buffers, unless there's too many of them. */
 static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
-                            const struct sockaddr_in6 *dst, const uint8_t *data,
-                            size_t size, uint32_t flags, int hops,
-                            uint32_t iflags, int proto, uint16_t cscov) {
-    uint8_t buf[size + sizeof(udp_hdr_t)];
-    udp_hdr_t *hdr = (udp_hdr_t *)buf;
+                            const struct sockaddr_in6 *dst,
+                            const struct iovec *iov, int iovcnt,
+                            uint32_t flags, int hops, uint32_t iflags,
+                            int proto, uint16_t cscov) {
+    net_pkt_t pkt;
+    udp_hdr_t *hdr;
+    uint8_t *buf = NULL;
+    size_t size = 0, pos = 0;
     uint16_t cs;
-    int err;
+    int err, i;
     struct in6_addr srcaddr = src->sin6_addr;
 
     (void)flags;
 
-    if(!net) {
-        net = net_default_dev;
-
-        if(!net) {
-            errno = ENETDOWN;
-            ++udp_stats.pkt_send_failed;
-            return -1;
-        }
+    if(!(net = net_lo_route6(net, &dst->sin6_addr))) {
+        errno = ENETDOWN;
+        ++udp_stats.pkt_send_failed;
+        return -1;
     }
 
     if(IN6_IS_ADDR_UNSPECIFIED(&src->sin6_addr)) {
@@ -1433,9 +1630,39 @@ static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
         }
     }
 
-    memcpy(buf + sizeof(udp_hdr_t), data, size);
+    for(i = 0; i < iovcnt; ++i)
+        size += iov[i].iov_len;
+
+    if(size > 65535 - sizeof(udp_hdr_t)) {
+        errno = EMSGSIZE;
+        ++udp_stats.pkt_send_failed;
+        return -1;
+    }
+
+    net_pkt_init(&pkt);
+
+    if(iovcnt <= NET_PKT_MAX_DATA) {
+        for(i = 0; i < iovcnt; ++i)
+            net_pkt_add(&pkt, iov[i].iov_base, iov[i].iov_len);
+    }
+    else {
+        if(!(buf = (uint8_t *)malloc(size))) {
+            errno = ENOBUFS;
+            ++udp_stats.pkt_send_failed;
+            return -1;
+        }
+
+        for(i = 0; i < iovcnt; ++i) {
+            memcpy(buf + pos, iov[i].iov_base, iov[i].iov_len);
+            pos += iov[i].iov_len;
+        }
+
+        net_pkt_add(&pkt, buf, size);
+    }
+
     size += sizeof(udp_hdr_t);
 
+    hdr = (udp_hdr_t *)net_pkt_push(&pkt, sizeof(udp_hdr_t));
     hdr->src_port = src->sin6_port;
     hdr->dst_port = dst->sin6_port;
     hdr->checksum = 0;
@@ -1447,11 +1674,13 @@ static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
         if(!(iflags & UDPSOCK_NO_CHECKSUM)) {
             cs = net_ipv6_checksum_pseudo(&srcaddr, &dst->sin6_addr, size,
                                           proto);
-            hdr->checksum = net_ipv4_checksum(buf, size, cs);
+            hdr->checksum = net_pkt_checksum(&pkt, size, cs);
         }
     }
     else {
-        if(cscov <= size) {
+        /* UDP-Lite only checksums the first cscov bytes of the datagram, and a
+           coverage of 0 means the whole thing. */
+        if(cscov && cscov <= size) {
             hdr->length = htons(cscov);
         }
         else {
@@ -1460,12 +1689,13 @@ static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
         }
 
         cs = net_ipv6_checksum_pseudo(&srcaddr, &dst->sin6_addr, size, proto);
-        hdr->checksum = net_ipv4_checksum(buf, size, cs);
+        hdr->checksum = net_pkt_checksum(&pkt, cscov, cs);
     }
 
     /* Pass everything off to the network layer to do the rest. */
-    err = net_ipv6_send(net, buf, size, hops, proto, &srcaddr,
-                        &dst->sin6_addr);
+    err = net_ipv6_send_pkt(net, &pkt, hops, proto, &srcaddr,
+                            &dst->sin6_addr);
+    free(buf);
 
     if(err < 0) {
         ++udp_stats.pkt_send_failed;
@@ -1502,7 +1732,9 @@ static fs_socket_proto_t proto = {
     net_udp_getsockname,
     net_udp_getpeername,
     net_udp_fcntl,
-    net_udp_poll
+    net_udp_poll,
+    net_udp_sendmsg,
+    net_udp_recvmsg
 };
 
 static fs_socket_proto_t proto_lite = {
@@ -1525,7 +1757,9 @@ static fs_socket_proto_t proto_lite = {
     net_udp_getsockname,
     net_udp_getpeername,
     net_udp_fcntl,
-    net_udp_poll
+    net_udp_poll,
+    net_udp_sendmsg,
+    net_udp_recvmsg
 };
 
 int net_udp_init(void) {
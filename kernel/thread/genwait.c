@@ -25,6 +25,8 @@
 #include <kos/genwait.h>
 #include <kos/sem.h>
 
+#include "timerq.h"
+
 /* Our sleep queues table. This is also modeled after the BSD numbers. I
    figure if they've been using it as long as they have, they must be
    on to something. :) */
@@ -36,36 +38,13 @@ static TAILQ_HEAD(slpquehead, kthread) slpque[TABLESIZE];
    ready to run at a later time will be placed here. Note that this doesn't
    deal with pre-emptive timeslice context switching, only things that are
    specifically blocked for a timed event (thd_sleep, genwait_wait, etc).
-   This queue is sorted by remaining time (smallest at the front). */
-static struct ktqueue timer_queue;
-
-/* Internal function to insert a thread on the timer queue. Maintains
-   sorting order by wait time. */
-static void __nonnull_all tq_insert(kthread_t *thd) {
-    kthread_t *t;
-
-    /* Search for its place; note that new threads will be placed at
-       the end of a group with the same timeout. */
-    TAILQ_FOREACH_REVERSE(t, &timer_queue, slpquehead, timerq) {
-        if(thd->wait_timeout >= t->wait_timeout) {
-            TAILQ_INSERT_AFTER(&timer_queue, t, thd, timerq);
-            return;
-        }
-    }
-
-    /* Couldn't find anything scheduled earlier, put this at the start. */
-    TAILQ_INSERT_HEAD(&timer_queue, thd, timerq);
-}
-
-/* Internal function to remove a thread from the timer queue. */
-static void __nonnull_all tq_remove(kthread_t *thd) {
-    TAILQ_REMOVE(&timer_queue, thd, timerq);
-}
+   See timerq.h for how it works. */
+static kthread_t *timer_queue;
 
 /* Returns the top thread on the timer queue (next event). If nothing is
    queued, we'll return NULL. */
 static kthread_t *tq_next(void) {
-    return TAILQ_FIRST(&timer_queue);
+    return timer_queue;
 }
 
 int genwait_wait(void *obj, const char *mesg, unsigned int timeout) {
@@ -84,22 +63,23 @@ int genwait_wait(void *obj, const char *mesg, unsigned int timeout) {
     if(timeout > 0) {
         /* If we have a timeout, insert us on the timer queue. */
         me->wait_timeout = timer_ms_gettime64() + timeout;
-        tq_insert(me);
+        tq_insert(&timer_queue, me);
     }
     else
         me->wait_timeout = 0;
 
-    /* Go through and find where to insert */
-    TAILQ_FOREACH(t, &slpque[LOOKUP(obj)], thdq) {
-        if(me->prio < t->prio) {
-            TAILQ_INSERT_BEFORE(t, me, thdq);
+    /* Go through and find where to insert. Search from the end, as most
+       sleepers share the same priority and go at the end of the queue. */
+    TAILQ_FOREACH_REVERSE(t, &slpque[LOOKUP(obj)], slpquehead, thdq) {
+        if(t->prio <= me->prio) {
+            TAILQ_INSERT_AFTER(&slpque[LOOKUP(obj)], t, me, thdq);
             break;
         }
     }
 
-    /* We got to the end of the list, so insert at end */
+    /* Everything queued has a lower priority, so insert at the start */
     if(!t)
-        TAILQ_INSERT_TAIL(&slpque[LOOKUP(obj)], me, thdq);
+        TAILQ_INSERT_HEAD(&slpque[LOOKUP(obj)], me, thdq);
 
     /* Block us until we're signaled */
     return thd_block_now(&me->context);
@@ -113,7 +93,7 @@ static void __nonnull_all genwait_unqueue(kthread_t *thd) {
 
         /* Also remove it from the timer queue if applicable */
         if(thd->wait_timeout)
-            tq_remove(thd);
+            tq_remove(&timer_queue, thd);
 
         /* Clean up wait stuff */
         thd->wait_obj = NULL;
@@ -230,7 +210,7 @@ int genwait_init(void) {
     for(i = 0; i < TABLESIZE; i++)
         TAILQ_INIT(&slpque[i]);
 
-    TAILQ_INIT(&timer_queue);
+    timer_queue = NULL;
     return 0;
 }
 
@@ -0,0 +1,105 @@
+/* KallistiOS ##version##
+
+   runq.h
+*/
+
+#ifndef __THREAD_RUNQ_H
+#define __THREAD_RUNQ_H
+
+/* The run queue used by thread.c. It's kept in here, on its own, so that it
+   can also be built on the host and tested (see test/runq_test.c). Whoever
+   includes this has to have defined kthread_t (with its prio_t queued_prio
+   and thdq fields) and struct ktqueue beforehand.
+
+   There is one FIFO bucket per priority level from 0 up to RUNQ_BUCKETS - 2,
+   and a bitmap records which buckets are non-empty, so that enqueueing,
+   dequeueing and finding the thread to run next are all constant time.
+   Anything of a lower priority than that (in practice, the idle thread and
+   maybe the odd background thread) shares the last bucket, which is kept
+   sorted by priority instead. That saves giving each of the PRIO_MAX + 1
+   priority levels a bucket of its own. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+#define RUNQ_BUCKETS    64
+#define RUNQ_WORDS      (RUNQ_BUCKETS / 32)
+
+struct runq {
+    struct ktqueue  bucket[RUNQ_BUCKETS];
+    uint32_t        bitmap[RUNQ_WORDS];
+};
+
+static inline unsigned int runq_bucket(prio_t prio) {
+    return prio < RUNQ_BUCKETS - 1 ? (unsigned int)prio : RUNQ_BUCKETS - 1;
+}
+
+static inline void runq_init(struct runq *rq) {
+    unsigned int i;
+
+    for(i = 0; i < RUNQ_BUCKETS; i++)
+        TAILQ_INIT(&rq->bucket[i]);
+
+    for(i = 0; i < RUNQ_WORDS; i++)
+        rq->bitmap[i] = 0;
+}
+
+/* Returns the first thread of the highest priority, or NULL if the queue is
+   empty. */
+static inline kthread_t *runq_first(const struct runq *rq) {
+    unsigned int w;
+
+    for(w = 0; w < RUNQ_WORDS; w++) {
+        if(rq->bitmap[w])
+            return TAILQ_FIRST(&rq->bucket[w * 32 +
+                                           __builtin_ctz(rq->bitmap[w])]);
+    }
+
+    return NULL;
+}
+
+/* Queue a thread at the given priority, after the other threads of the same
+   priority, or before them if front is set. */
+static inline void runq_insert(struct runq *rq, kthread_t *t, prio_t prio,
+                               bool front) {
+    unsigned int b = runq_bucket(prio);
+    struct ktqueue *q = &rq->bucket[b];
+    kthread_t *cur;
+
+    t->queued_prio = prio;
+
+    if(TAILQ_EMPTY(q))
+        rq->bitmap[b / 32] |= 1u << (b % 32);
+
+    if(b == RUNQ_BUCKETS - 1) {
+        TAILQ_FOREACH(cur, q, thdq) {
+            if(cur->queued_prio > prio ||
+               (front && cur->queued_prio == prio))
+                break;
+        }
+
+        if(cur)
+            TAILQ_INSERT_BEFORE(cur, t, thdq);
+        else
+            TAILQ_INSERT_TAIL(q, t, thdq);
+    }
+    else if(front) {
+        TAILQ_INSERT_HEAD(q, t, thdq);
+    }
+    else {
+        TAILQ_INSERT_TAIL(q, t, thdq);
+    }
+}
+
+static inline void runq_remove(struct runq *rq, kthread_t *t) {
+    unsigned int b = runq_bucket(t->queued_prio);
+    struct ktqueue *q = &rq->bucket[b];
+
+    TAILQ_REMOVE(q, t, thdq);
+
+    if(TAILQ_EMPTY(q))
+        rq->bitmap[b / 32] &= ~(1u << (b % 32));
+}
+
+#endif /* __THREAD_RUNQ_H */
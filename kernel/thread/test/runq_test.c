@@ -0,0 +1,237 @@
+/* KallistiOS ##version##
+
+   runq_test.c
+
+   Host-side test of the scheduler's run queue (../runq.h). This checks that
+   threads come out highest priority first, in FIFO order within each
+   priority (with front-of-line insertions going before the others of their
+   priority), both for the priorities that have buckets of their own and for
+   the ones that share the last bucket.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/queue.h>
+
+#define PRIO_MAX        4096
+
+typedef int prio_t;
+
+/* Just enough of kthread_t for runq.h */
+typedef struct kthread {
+    TAILQ_ENTRY(kthread) thdq;
+    prio_t queued_prio;
+    int id;
+} kthread_t;
+
+TAILQ_HEAD(ktqueue, kthread);
+
+#include "../runq.h"
+
+#define THREADS         1000
+
+static kthread_t threads[THREADS];
+static struct runq rq;
+static int failures;
+
+#define CHECK(cond, ...) do { \
+        if(!(cond)) { \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+            ++failures; \
+        } \
+    } while(0)
+
+static kthread_t *pop(void) {
+    kthread_t *t = runq_first(&rq);
+
+    if(t)
+        runq_remove(&rq, t);
+
+    return t;
+}
+
+/* Threads of one priority come out in the order they went in. */
+static void test_fifo(prio_t prio) {
+    kthread_t *t;
+    int i;
+
+    runq_init(&rq);
+
+    for(i = 0; i < 10; i++) {
+        threads[i].id = i;
+        runq_insert(&rq, threads + i, prio, false);
+    }
+
+    for(i = 0; i < 10; i++) {
+        t = pop();
+        CHECK(t && t->id == i, "prio %d: expected %d, got %d", prio, i,
+              t ? t->id : -1);
+    }
+
+    CHECK(!runq_first(&rq), "prio %d: queue not empty", prio);
+}
+
+/* Front-of-line insertions go before the others of the same priority, but
+   not before anything of a higher priority. */
+static void test_front(prio_t prio) {
+    kthread_t *t;
+
+    runq_init(&rq);
+
+    threads[0].id = 0;
+    threads[1].id = 1;
+    threads[2].id = 2;
+    threads[3].id = 3;
+
+    runq_insert(&rq, threads + 0, prio, false);
+    runq_insert(&rq, threads + 1, prio, false);
+    runq_insert(&rq, threads + 2, prio - 1, false);
+    runq_insert(&rq, threads + 3, prio, true);
+
+    t = pop();
+    CHECK(t && t->id == 2, "prio %d: higher priority not first", prio);
+    t = pop();
+    CHECK(t && t->id == 3, "prio %d: front insertion not first", prio);
+    t = pop();
+    CHECK(t && t->id == 0, "prio %d: FIFO order broken", prio);
+    t = pop();
+    CHECK(t && t->id == 1, "prio %d: FIFO order broken", prio);
+    CHECK(!runq_first(&rq), "prio %d: queue not empty", prio);
+}
+
+/* Reference model: an array kept in the order threads should come out. */
+static kthread_t *model[THREADS];
+static int model_count;
+
+static void model_insert(kthread_t *t, bool front) {
+    int i, j;
+
+    for(i = 0; i < model_count; i++) {
+        if(model[i]->queued_prio > t->queued_prio ||
+           (front && model[i]->queued_prio == t->queued_prio))
+            break;
+    }
+
+    for(j = model_count; j > i; j--)
+        model[j] = model[j - 1];
+
+    model[i] = t;
+    ++model_count;
+}
+
+static void model_remove(kthread_t *t) {
+    int i;
+
+    for(i = 0; model[i] != t; i++)
+        ;
+
+    for(; i < model_count - 1; i++)
+        model[i] = model[i + 1];
+
+    --model_count;
+}
+
+/* Random inserts (of a mix of priorities, some small and some sharing the
+   last bucket), removals from the middle and pops, checked against the
+   model. */
+static void test_random(void) {
+    bool queued[THREADS] = { false };
+    kthread_t *t;
+    prio_t prio;
+    bool front;
+    int i, n, errors = 0;
+
+    runq_init(&rq);
+    model_count = 0;
+    srand(1234);
+
+    for(n = 0; n < 200000 && !errors; n++) {
+        i = rand() % THREADS;
+        t = threads + i;
+        t->id = i;
+
+        switch(rand() % 3) {
+            case 0:
+                if(queued[i])
+                    break;
+
+                if(rand() % 2)
+                    prio = rand() % RUNQ_BUCKETS;
+                else
+                    prio = rand() % (PRIO_MAX + 1);
+
+                front = !(rand() % 4);
+                runq_insert(&rq, t, prio, front);
+                model_insert(t, front);
+                queued[i] = true;
+                break;
+
+            case 1:
+                if(!queued[i])
+                    break;
+
+                runq_remove(&rq, t);
+                model_remove(t);
+                queued[i] = false;
+                break;
+
+            case 2:
+                t = pop();
+
+                if(!model_count) {
+                    if(t)
+                        ++errors;
+
+                    break;
+                }
+
+                if(t != model[0]) {
+                    printf("FAIL: expected %d (prio %d), got %d (prio %d)\n",
+                           model[0]->id, model[0]->queued_prio,
+                           t ? t->id : -1, t ? t->queued_prio : -1);
+                    ++errors;
+                    break;
+                }
+
+                model_remove(t);
+                queued[t->id] = false;
+                break;
+        }
+    }
+
+    /* Drain whatever's left. */
+    while(!errors && model_count) {
+        t = pop();
+
+        if(t != model[0])
+            ++errors;
+        else
+            model_remove(t);
+    }
+
+    CHECK(!errors && !runq_first(&rq), "random test failed");
+}
+
+int main(void) {
+    test_fifo(0);
+    test_fifo(10);
+    test_fifo(RUNQ_BUCKETS - 2);
+    test_fifo(RUNQ_BUCKETS - 1);
+    test_fifo(PRIO_MAX);
+
+    test_front(10);
+    test_front(RUNQ_BUCKETS - 1);
+    test_front(PRIO_MAX);
+
+    test_random();
+
+    if(failures) {
+        printf("%d failure(s)\n", failures);
+        return EXIT_FAILURE;
+    }
+
+    printf("All run queue tests passed\n");
+    return EXIT_SUCCESS;
+}
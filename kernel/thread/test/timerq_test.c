@@ -0,0 +1,157 @@
+/* KallistiOS ##version##
+
+   timerq_test.c
+
+   Host-side test of genwait's timer queue (../timerq.h). This checks that
+   threads come off the front of the queue in order of their timeouts, with
+   random insertions and removals from the middle of the queue mixed in.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Just enough of kthread_t for timerq.h */
+typedef struct kthread {
+    struct {
+        struct kthread *child;
+        struct kthread *next;
+        struct kthread *prev;
+    } timerq;
+    uint64_t wait_timeout;
+    int id;
+} kthread_t;
+
+#include "../timerq.h"
+
+#define THREADS         1000
+
+static kthread_t threads[THREADS];
+static kthread_t *queue;
+static int failures;
+
+#define CHECK(cond, ...) do { \
+        if(!(cond)) { \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+            ++failures; \
+        } \
+    } while(0)
+
+static kthread_t *pop(void) {
+    kthread_t *t = queue;
+
+    if(t)
+        tq_remove(&queue, t);
+
+    return t;
+}
+
+/* Everything comes out in order of its timeout, whatever order it went in. */
+static void test_order(void) {
+    kthread_t *t;
+    uint64_t last = 0;
+    int i;
+
+    queue = NULL;
+
+    for(i = 0; i < THREADS; i++) {
+        threads[i].id = i;
+        threads[i].wait_timeout = (uint64_t)((i * 7919) % THREADS);
+        tq_insert(&queue, threads + i);
+    }
+
+    for(i = 0; i < THREADS; i++) {
+        t = pop();
+        CHECK(t && t->wait_timeout >= last, "out of order at %d", i);
+
+        if(!t)
+            break;
+
+        last = t->wait_timeout;
+    }
+
+    CHECK(!queue, "queue not empty");
+}
+
+/* Random inserts, removals from anywhere in the queue and pops, checking
+   each pop against a linear search for the smallest timeout. */
+static void test_random(void) {
+    bool queued[THREADS] = { false };
+    kthread_t *t, *min;
+    int i, j, n, errors = 0;
+
+    queue = NULL;
+    srand(1234);
+
+    for(n = 0; n < 200000 && !errors; n++) {
+        i = rand() % THREADS;
+        t = threads + i;
+        t->id = i;
+
+        switch(rand() % 3) {
+            case 0:
+                if(queued[i])
+                    break;
+
+                t->wait_timeout = rand() % 5000;
+                tq_insert(&queue, t);
+                queued[i] = true;
+                break;
+
+            case 1:
+                if(!queued[i])
+                    break;
+
+                tq_remove(&queue, t);
+                queued[i] = false;
+                break;
+
+            case 2:
+                min = NULL;
+
+                for(j = 0; j < THREADS; j++) {
+                    if(queued[j] && (!min ||
+                       threads[j].wait_timeout < min->wait_timeout))
+                        min = threads + j;
+                }
+
+                t = pop();
+
+                if(!min) {
+                    if(t)
+                        ++errors;
+
+                    break;
+                }
+
+                if(!t || t->wait_timeout != min->wait_timeout) {
+                    printf("FAIL: expected timeout %llu, got %lld\n",
+                           (unsigned long long)min->wait_timeout,
+                           t ? (long long)t->wait_timeout : -1LL);
+                    ++errors;
+                    break;
+                }
+
+                queued[t->id] = false;
+                break;
+        }
+    }
+
+    CHECK(!errors, "random test failed");
+}
+
+int main(void) {
+    test_order();
+    test_random();
+
+    if(failures) {
+        printf("%d failure(s)\n", failures);
+        return EXIT_FAILURE;
+    }
+
+    printf("All timer queue tests passed\n");
+    return EXIT_SUCCESS;
+}
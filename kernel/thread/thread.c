@@ -26,11 +26,14 @@
 #include <kos/cond.h>
 #include <kos/genwait.h>
 #include <kos/timer.h>
+#include <kos/slab.h>
 
 #include <arch/arch.h>
 #include <arch/stack.h>
 #include <arch/tls_static.h>
 
+#include "runq.h"
+
 /*
 
 This module supports thread scheduling in KOS. The timer interrupt is used
@@ -58,20 +61,35 @@ static unsigned int thd_sched_ms = 1000 / THD_SCHED_HZ;
 static struct ktlist thd_list;
 
 /* Run queue. This is more like on a standard time sharing system than the
-   previous versions. The top element of this priority queue should be the
-   thread that is ready to run next. When a thread is scheduled, it will be
-   removed from this queue. When it's de-scheduled, it will be re-inserted
-   by its priority value at the end of its priority group. Note that right
-   now this condition is being broken because sleeping threads are on the
-   same queue. We deal with those in thd_switch below. */
-static struct ktqueue run_queue;
+   previous versions. Threads are kept in FIFO order within each priority
+   level (see runq.h). When a thread is scheduled, it will be removed from the
+   queue. When it's de-scheduled, it will be re-inserted after the other
+   threads of its priority (or before them, see thd_schedule).
+
+   Threads blocked in thd_poll() are kept on their own queue, as their poll
+   callbacks need to be run on every reschedule anyway. */
+static struct runq run_queue;
+static struct ktqueue poll_queue;
 
 /* The currently executing thread. This thread should not be on any queues. */
 kthread_t *thd_current = NULL;
 
-/* Thread mode: uninitialized or pre-emptive. */
+/* Thread mode: uninitialized, pre-emptive or tickless. */
 static kthread_mode_t thd_mode = THD_MODE_NONE;
 
+/* Absolute time (in milliseconds) of the scheduler wakeup programmed in
+   tickless mode, or 0 if there is none. */
+static uint64_t thd_wakeup_at = 0;
+
+/* Set while thd_schedule() runs, as it reprograms the timer itself. */
+static bool thd_scheduling = false;
+
+/* Whether scheduler statistics are collected. */
+static bool thd_stats_enabled = false;
+
+/* Set while rescheduling on behalf of a thread giving up the CPU. */
+static bool thd_sched_voluntary = false;
+
 /* Reaper semaphore. Counts the number of threads waiting to be reaped. */
 static semaphore_t thd_reap_sem;
 
@@ -81,6 +99,9 @@ static size_t thd_count = 0;
 /* The idle task */
 static kthread_t *thd_idle_thd = NULL;
 
+/* Object cache for the thread structures */
+static kmem_cache_t *thd_cache;
+
 /*****************************************************************************/
 /* Debug */
 
@@ -157,31 +178,63 @@ int thd_pslist(int (*pf)(const char *fmt, ...)) {
     pf("%12llu (%6.3lf%%)       -      [system]\n", (ns_time - cpu_total),
         (double)(ns_time - cpu_total) / (double)ns_time * 100.0);
 
+    if(thd_stats_enabled) {
+        pf("Scheduler statistics:\n");
+        pf("tid\t      runs\t voluntary\t preempted\t  avg_lat_us\t"
+           "  max_lat_us\t  name\n");
+
+        LIST_FOREACH(cur, &thd_list, t_list) {
+            const kthread_sched_stats_t *st = &cur->sched_stats;
+
+            pf("%d\t", cur->tid);
+            pf("%10lu\t%10lu\t%10lu\t", st->runs, st->voluntary,
+               st->preempted);
+            pf("%12llu\t%12llu\t  ",
+               st->runs ? st->latency_total / st->runs / 1000 : 0,
+               st->latency_max / 1000);
+            pf("%-10s\n", cur->label);
+        }
+    }
+
     pf("--end of list--\n");
 
     return 0;
 }
 
+static void thd_pslist_queue_one(int (*pf)(const char *fmt, ...),
+                                 kthread_t *cur) {
+    pf("%08lx\t", CONTEXT_PC(cur->context));
+    pf("%d\t", cur->tid);
+
+    if(cur->prio == PRIO_MAX)
+        pf("MAX\t");
+    else
+        pf("%d\t", cur->prio);
+
+    pf("%08lx\t", cur->flags);
+    pf("%ld\t\t", (uint32_t)cur->wait_timeout);
+    pf("%10s", thd_state_to_str(cur));
+    pf("%s\n", cur->label);
+}
+
 int thd_pslist_queue(int (*pf)(const char *fmt, ...)) {
     kthread_t *cur;
+    unsigned int i;
 
     pf("Queued threads:\n");
     pf("addr\t\ttid\tprio\tflags\twait_timeout\tstate     name\n");
-    TAILQ_FOREACH(cur, &run_queue, thdq) {
-        pf("%08lx\t", CONTEXT_PC(cur->context));
-        pf("%d\t", cur->tid);
 
-        if(cur->prio == PRIO_MAX)
-            pf("MAX\t");
-        else
-            pf("%d\t", cur->prio);
+    irq_disable_scoped();
 
-        pf("%08lx\t", cur->flags);
-        pf("%ld\t\t", (uint32_t)cur->wait_timeout);
-        pf("%10s", thd_state_to_str(cur));
-        pf("%s\n", cur->label);
+    /* Walk the buckets from the highest priority downwards. */
+    for(i = 0; i < RUNQ_BUCKETS; i++) {
+        TAILQ_FOREACH(cur, &run_queue.bucket[i], thdq)
+            thd_pslist_queue_one(pf, cur);
     }
 
+    TAILQ_FOREACH(cur, &poll_queue, thdq)
+        thd_pslist_queue_one(pf, cur);
+
     return 0;
 }
 
@@ -213,16 +266,7 @@ kthread_t *thd_by_tid(tid_t tid) {
 
 
 static bool thd_has_polls(void) {
-    kthread_t *thd;
-
-    irq_disable_scoped();
-
-    TAILQ_FOREACH(thd, &run_queue, thdq) {
-        if(thd->state == STATE_POLLING)
-            return true;
-    }
-
-    return false;
+    return !TAILQ_EMPTY(&poll_queue);
 }
 
 /*****************************************************************************/
@@ -324,60 +368,145 @@ void thd_exit(void *rv) {
 /*****************************************************************************/
 /* Thread creation and deletion */
 
+/* Program the scheduler timer for the next event that needs a reschedule, in
+   tickless mode: the earliest timed genwait, or the end of the timeslice if
+   another thread of the same (or higher) priority is ready to run, or if
+   some thread is polling. If there's no such event, no wakeup is scheduled
+   at all. */
+static void thd_tickless_program(uint64_t now) {
+    uint64_t next, slice;
+    kthread_t *first;
+
+    next = genwait_next_timeout();
+    first = runq_first(&run_queue);
+
+    if(!TAILQ_EMPTY(&poll_queue) ||
+       (first && first->queued_prio <= thd_current->prio)) {
+        slice = now + thd_sched_ms;
+
+        if(!next || slice < next)
+            next = slice;
+    }
+
+    thd_wakeup_at = next;
+
+    /* Nothing to wait for. A previously programmed wakeup might still fire,
+       which will only cause a spurious reschedule. */
+    if(!next)
+        return;
+
+    if(next <= now)
+        next = now + 1;
+
+    if(next - now > UINT32_MAX)
+        timer_primary_wakeup(UINT32_MAX);
+    else
+        timer_primary_wakeup((uint32_t)(next - now));
+}
+
+/* Make sure a tickless wakeup happens within the given number of
+   milliseconds. */
+static void thd_tickless_kick(unsigned int ms) {
+    uint64_t deadline = timer_ms_gettime64() + ms;
+
+    if(!thd_wakeup_at || deadline < thd_wakeup_at) {
+        thd_wakeup_at = deadline;
+        timer_primary_wakeup(ms);
+    }
+}
+
 /* Enqueue a process in the runnable queue; adds it right after the
    process group of the same priority (front_of_line==0) or
    right before the process group of the same priority (front_of_line!=0).
-   See thd_schedule for why this is helpful. */
+   See thd_schedule for why this is helpful. Polling threads go on the
+   poll queue instead, see thd_schedule. */
 void thd_add_to_runnable(kthread_t *t, bool front_of_line) {
-    kthread_t *i;
-    int done;
+    prio_t prio;
 
     if(t->flags & THD_QUEUED)
         return;
 
-    done = 0;
+    if(__predict_false(t->state == STATE_POLLING)) {
+        prio = -1;
+        t->queued_prio = prio;
 
-    if(!front_of_line) {
-        /* Look for a thread of lower priority and insert
-           before it. If there is nothing on the run queue, we'll
-           fall through to the bottom. */
-        TAILQ_FOREACH(i, &run_queue, thdq) {
-            if(i->prio > t->prio) {
-                TAILQ_INSERT_BEFORE(i, t, thdq);
-                done = 1;
-                break;
-            }
-        }
+        if(front_of_line)
+            TAILQ_INSERT_HEAD(&poll_queue, t, thdq);
+        else
+            TAILQ_INSERT_TAIL(&poll_queue, t, thdq);
     }
     else {
-        /* Look for a thread of the same or lower priority and
-           insert before it. If there is nothing on the run queue,
-           we'll fall through to the bottom. */
-        TAILQ_FOREACH(i, &run_queue, thdq) {
-            if(i->prio >= t->prio) {
-                TAILQ_INSERT_BEFORE(i, t, thdq);
-                done = 1;
-                break;
-            }
-        }
-    }
+        prio = t->prio;
 
-    /* Didn't find one, put it at the end */
-    if(!done)
-        TAILQ_INSERT_TAIL(&run_queue, t, thdq);
+        if(__predict_false(prio < 0))
+            prio = 0;
+        else if(__predict_false(prio > PRIO_MAX))
+            prio = PRIO_MAX;
+
+        runq_insert(&run_queue, t, prio, front_of_line);
+    }
 
     t->flags |= THD_QUEUED;
+
+    /* Remember when the thread became ready, unless it was simply moved
+       around in the run queue. */
+    if(__predict_false(thd_stats_enabled) && prio >= 0
+       && !t->sched_stats.ready_time)
+        t->sched_stats.ready_time = timer_ns_gettime64();
+
+    /* In tickless mode, make sure that the scheduler gets to run soon enough
+       if the new thread should preempt or share the CPU with the current
+       one. Polling threads need their callbacks to be run periodically. */
+    if(thd_mode == THD_MODE_TICKLESS && !thd_scheduling && thd_current) {
+        if(prio < 0 || prio == thd_current->prio)
+            thd_tickless_kick(thd_sched_ms);
+        else if(prio < thd_current->prio)
+            thd_tickless_kick(1);
+    }
 }
 
 /* Removes a thread from the runnable queue, if it's there. */
 int thd_remove_from_runnable(kthread_t *thd) {
+    prio_t prio = thd->queued_prio;
+
     if(!(thd->flags & THD_QUEUED)) return 0;
 
     thd->flags &= ~THD_QUEUED;
-    TAILQ_REMOVE(&run_queue, thd, thdq);
+
+    if(prio < 0) {
+        TAILQ_REMOVE(&poll_queue, thd, thdq);
+    }
+    else {
+        runq_remove(&run_queue, thd);
+    }
+
     return 0;
 }
 
+/* Runs the callbacks of all polling threads, and moves the ones that are
+   done polling (or timed out) over to the run queue. */
+static void thd_check_polls(uint64_t now) {
+    kthread_t *thd, *tmp;
+    int ret;
+
+    TAILQ_FOREACH_SAFE(thd, &poll_queue, thdq, tmp) {
+        if(thd->wait_timeout && thd->wait_timeout < now) {
+            ret = 0;
+        }
+        else {
+            ret = thd->poll_cb(thd->wait_obj);
+
+            if(!ret)
+                continue;
+        }
+
+        thd_remove_from_runnable(thd);
+        thd->state = STATE_READY;
+        CONTEXT_RET(thd->context) = ret;
+        thd_add_to_runnable(thd, false);
+    }
+}
+
 /* New thread function; given a routine address, it will create a
    new thread with the given attributes. When the routine returns,
    the thread will exit. Returns the new thread struct.
@@ -414,7 +543,7 @@ kthread_t *thd_create_ex(const kthread_attr_t *restrict attr,
 
     if(tid >= 0) {
         /* Create a new thread structure */
-        nt = aligned_alloc(32, sizeof(kthread_t));
+        nt = kmem_cache_alloc(thd_cache);
 
         if(nt != NULL) {
             /* Clear out potentially unused stuff */
@@ -429,7 +558,7 @@ kthread_t *thd_create_ex(const kthread_attr_t *restrict attr,
                                                      real_attr.stack_size);
 
                 if(!nt->stack) {
-                    free(nt);
+                    kmem_cache_free(thd_cache, nt);
                     return NULL;
                 }
 
@@ -464,7 +593,7 @@ kthread_t *thd_create_ex(const kthread_attr_t *restrict attr,
             } else if(!arch_tls_setup_data(nt)) {
                 if(nt->flags & THD_OWNS_STACK)
                     free(nt->stack);
-                free(nt);
+                kmem_cache_free(thd_cache, nt);
                 return NULL;
             }
 
@@ -552,6 +681,9 @@ int thd_destroy(kthread_t *thd) {
         i = i2;
     }
 
+    /* Give back the memory blocks it still has cached. */
+    malloc_thread_cache_flush(thd);
+
     /* Free its stack (if we're managing it). */
     if(thd->flags & THD_OWNS_STACK)
         free(thd->stack);
@@ -561,7 +693,7 @@ int thd_destroy(kthread_t *thd) {
         arch_tls_destroy_data(thd);
 
     /* Free the thread */
-    free(thd);
+    kmem_cache_free(thd_cache, thd);
 
     /* Remove it from the count */
     --thd_count;
@@ -580,9 +712,18 @@ int thd_set_prio(kthread_t *thd, prio_t prio) {
     if((prio < 0) || (prio > PRIO_MAX))
         return -2;
 
-    /* Set the new priority */
+    /* Set the new priority, and move the thread to its new run queue
+       bucket if it is currently queued. */
+    irq_disable_scoped();
+
     thd->prio = prio;
     thd->real_prio = prio;
+
+    if((thd->flags & THD_QUEUED) && thd->state == STATE_READY) {
+        thd_remove_from_runnable(thd);
+        thd_add_to_runnable(thd, false);
+    }
+
     return 0;
 }
 
@@ -612,10 +753,74 @@ static void thd_update_cpu_time(kthread_t *thd) {
     thd->cpu_time.scheduled = ns;
 }
 
+/* Returns the scheduler statistics histogram bucket for a duration. */
+static unsigned int thd_sched_stats_bucket(uint64_t ns) {
+    uint64_t us = ns / 1000;
+    unsigned int bucket;
+
+    if(us < 2)
+        return 0;
+
+    if(us > UINT32_MAX)
+        return THD_SCHED_HIST_SIZE - 1;
+
+    bucket = 31 - __builtin_clz((uint32_t)us);
+
+    return bucket < THD_SCHED_HIST_SIZE ? bucket : THD_SCHED_HIST_SIZE - 1;
+}
+
+/* Account for a context switch from the current thread to another one. */
+static void thd_update_sched_stats(kthread_t *thd) {
+    const uint64_t ns = timer_ns_gettime64();
+    kthread_sched_stats_t *st;
+    uint64_t latency;
+
+    if(thd_current) {
+        st = &thd_current->sched_stats;
+
+        if(st->run_time)
+            st->slice_hist[thd_sched_stats_bucket(ns - st->run_time)]++;
+
+        st->run_time = 0;
+
+        /* Threads still ready to run after a switch which was not requested
+           by themselves got preempted. */
+        if(thd_current->state == STATE_READY && !thd_sched_voluntary)
+            st->preempted++;
+        else
+            st->voluntary++;
+    }
+
+    st = &thd->sched_stats;
+    st->runs++;
+    st->run_time = ns;
+
+    if(st->ready_time) {
+        latency = ns - st->ready_time;
+        st->ready_time = 0;
+
+        st->latency_total += latency;
+        st->latency_hist[thd_sched_stats_bucket(latency)]++;
+
+        if(latency > st->latency_max)
+            st->latency_max = latency;
+    }
+}
+
 /* Helper function that sets a thread being scheduled */
 static inline void thd_schedule_inner(kthread_t *thd) {
     thd_remove_from_runnable(thd);
 
+    if(__predict_false(thd_stats_enabled)) {
+        /* A thread that just got re-enqueued and picked again never stopped
+           running, so it shouldn't be charged for any wakeup latency the next
+           time that it really gets switched to. */
+        if(thd != thd_current)
+            thd_update_sched_stats(thd);
+        else
+            thd->sched_stats.ready_time = 0;
+    }
+
     thd_update_cpu_time(thd);
 
     thd_current = thd;
@@ -653,9 +858,9 @@ static inline void thd_schedule_inner(kthread_t *thd) {
 void thd_schedule(bool front_of_line) {
     kthread_t *thd;
     uint64_t now;
-    int ret;
 
     now = timer_ms_gettime64();
+    thd_scheduling = true;
 
     /* If there's only two thread left, it's the idle task and the reaper task:
        exit the OS */
@@ -674,31 +879,14 @@ void thd_schedule(bool front_of_line) {
     /* Look for timed out waits */
     genwait_check_timeouts(now);
 
-    /* Search downwards through the run queue for a runnable thread; if
-       we don't find a normal runnable thread, the idle process will
-       always be there at the bottom. */
-    TAILQ_FOREACH(thd, &run_queue, thdq) {
-        if(__predict_false(thd->state == STATE_POLLING)) {
-            /* Is it polling? Call the polling function. */
+    /* Give the polling threads a chance to become runnable. */
+    if(__predict_false(!TAILQ_EMPTY(&poll_queue)))
+        thd_check_polls(now);
 
-            if(thd->wait_timeout && thd->wait_timeout < now) {
-                thd->state = STATE_READY;
-                CONTEXT_RET(thd->context) = 0;
-            }
-            else {
-                ret = thd->poll_cb(thd->wait_obj);
-
-                if(ret) {
-                    thd->state = STATE_READY;
-                    CONTEXT_RET(thd->context) = ret;
-                }
-            }
-        }
-
-        /* Is it runnable? If not, keep going */
-        if(thd->state == STATE_READY)
-            break;
-    }
+    /* Grab the first thread of the highest priority; if we don't find a
+       normal runnable thread, the idle process will always be there at the
+       bottom. */
+    thd = runq_first(&run_queue);
 
     /* If we didn't already re-enqueue the thread and we are supposed to do so,
        do it now. */
@@ -724,6 +912,11 @@ void thd_schedule(bool front_of_line) {
     /* We should now have a runnable thread, so remove it from the
        run queue and switch to it. */
     thd_schedule_inner(thd);
+
+    if(thd_mode == THD_MODE_TICKLESS)
+        thd_tickless_program(now);
+
+    thd_scheduling = false;
 }
 
 /* Temporary priority boosting function: call this from within an interrupt
@@ -753,14 +946,20 @@ void thd_schedule_next(kthread_t *thd) {
     }
 
     thd_schedule_inner(thd);
+
+    if(thd_mode == THD_MODE_TICKLESS)
+        thd_tickless_program(timer_ms_gettime64());
 }
 
 /* See kos/thread.h for description */
 irq_context_t *thd_choose_new(void) {
     //printf("thd_choose_new() woken at %d\n", (uint32_t)now);
 
-    /* Do any re-scheduling */
+    /* Do any re-scheduling. We're only ever called from thd_block_now(), so
+       the current thread is giving up the CPU on its own. */
+    thd_sched_voluntary = true;
     thd_schedule(false);
+    thd_sched_voluntary = false;
 
     /* Return the new IRQ context back to the caller */
     return &thd_current->context;
@@ -771,14 +970,18 @@ irq_context_t *thd_choose_new(void) {
 /* Timer function. Check to see if we were woken because of a timeout event
    or because of a preempt. For timeouts, just go take care of it and sleep
    again until our next context switch (if any). For pre-empts, re-schedule
-   threads, swap out contexts, and sleep. */
+   threads, swap out contexts, and sleep. In tickless mode, thd_schedule()
+   programs the next wakeup by itself. */
 static void thd_timer_hnd(irq_context_t *context) {
     (void)context;
 
     //printf("timer woke at %d\n", (uint32_t)now);
 
+    thd_wakeup_at = 0;
     thd_schedule(false);
-    timer_primary_wakeup(thd_sched_ms);
+
+    if(thd_mode != THD_MODE_TICKLESS)
+        timer_primary_wakeup(thd_sched_ms);
 }
 
 /*****************************************************************************/
@@ -1006,14 +1209,68 @@ uint64_t thd_get_total_cpu_time(void) {
     return retval;
 }
 
+bool thd_set_sched_stats(bool enable) {
+    bool old = thd_stats_enabled;
+    kthread_t *cur;
+
+    irq_disable_scoped();
+
+    if(enable && !old) {
+        LIST_FOREACH(cur, &thd_list, t_list) {
+            memset(&cur->sched_stats, 0, sizeof(cur->sched_stats));
+        }
+
+        if(thd_current)
+            thd_current->sched_stats.run_time = timer_ns_gettime64();
+    }
+
+    thd_stats_enabled = enable;
+
+    return old;
+}
+
+int thd_get_sched_stats(const kthread_t *thd, kthread_sched_stats_t *stats) {
+    if(!thd_stats_enabled)
+        return -1;
+
+    if(!thd)
+        thd = thd_current;
+
+    irq_disable_scoped();
+    *stats = thd->sched_stats;
+
+    return 0;
+}
+
 /*****************************************************************************/
 
 /* Change threading modes */
 int thd_set_mode(kthread_mode_t mode) {
-    dbglog(DBG_WARNING, "thd_set_mode() has no effect. Cooperative threading "
-           "mode is deprecated. Threading is always in preemptive mode.\n");
+    kthread_mode_t old = thd_mode;
+
+    if(mode != THD_MODE_PREEMPT && mode != THD_MODE_TICKLESS) {
+        dbglog(DBG_WARNING, "thd_set_mode(): unsupported mode %d. Cooperative "
+               "threading mode is deprecated.\n", mode);
+        return -1;
+    }
 
-    return mode;
+    /* Can't do anything before the scheduler is up */
+    if(old == THD_MODE_NONE)
+        return -1;
+
+    irq_disable_scoped();
+
+    thd_mode = mode;
+
+    if(mode == THD_MODE_TICKLESS) {
+        thd_tickless_program(timer_ms_gettime64());
+    }
+    else if(old == THD_MODE_TICKLESS) {
+        thd_wakeup_at = 0;
+        timer_primary_wakeup(thd_sched_ms);
+    }
+
+    return old;
 }
 
 kthread_mode_t thd_get_mode(void) {
@@ -1076,11 +1333,24 @@ int thd_init(void) {
     LIST_INIT(&thd_list);
 
     /* Initialize the run queue */
-    TAILQ_INIT(&run_queue);
+    runq_init(&run_queue);
+    TAILQ_INIT(&poll_queue);
 
     /* Start off with no "current" thread */
     thd_current = NULL;
 
+    /* Create the object cache for thread structures. It is kept across
+       shutdowns, as the kernel thread is never destroyed. */
+    if(!thd_cache) {
+        thd_cache = kmem_cache_create("kthread", sizeof(kthread_t), 0,
+                                      KMEM_CACHE_HWALIGN);
+
+        if(!thd_cache) {
+            dbglog(DBG_DEAD, "thd: failed to create thread cache\n");
+            return -1;
+        }
+    }
+
     /* Init thread-local storage. */
     kthread_tls_init();
 
@@ -0,0 +1,122 @@
+/* KallistiOS ##version##
+
+   timerq.h
+*/
+
+#ifndef __THREAD_TIMERQ_H
+#define __THREAD_TIMERQ_H
+
+/* The timer queue used by genwait.c. Like runq.h, it's kept in here, on its
+   own, so that it can be built on the host and tested (see test/), and so
+   that the timer queue benchmark can time it directly. Whoever includes this
+   has to have defined kthread_t (with its uint64_t wait_timeout and its
+   timerq child/next/prev links) beforehand.
+
+   The queue is an intrusive pairing heap keyed on the wait timeout (with the
+   smallest at the root), so inserting is constant time, and removing any
+   thread (including the one with the next timeout) is amortized logarithmic
+   time. The heap is just a pointer to its root, NULL when it's empty. */
+
+#include <stddef.h>
+
+/* Melds two heaps together, returning the new root. Both must be roots
+   (no siblings nor parent). */
+static inline kthread_t *tq_meld(kthread_t *a, kthread_t *b) {
+    kthread_t *t;
+
+    if(!a)
+        return b;
+    if(!b)
+        return a;
+
+    if(b->wait_timeout < a->wait_timeout) {
+        t = a;
+        a = b;
+        b = t;
+    }
+
+    /* Make b the first child of a */
+    b->timerq.prev = a;
+    b->timerq.next = a->timerq.child;
+
+    if(a->timerq.child)
+        a->timerq.child->timerq.prev = b;
+
+    a->timerq.child = b;
+
+    return a;
+}
+
+/* Melds a list of siblings into a single heap, using the standard two-pass
+   method: meld pairs from left to right, then meld the results together
+   from right to left. */
+static inline kthread_t *tq_merge_pairs(kthread_t *first) {
+    kthread_t *a, *b, *next, *stack = NULL, *heap = NULL;
+
+    while(first) {
+        a = first;
+        b = a->timerq.next;
+        next = b ? b->timerq.next : NULL;
+
+        a->timerq.next = a->timerq.prev = NULL;
+
+        if(b) {
+            b->timerq.next = b->timerq.prev = NULL;
+            a = tq_meld(a, b);
+        }
+
+        /* Push the pair on the stack for the second pass */
+        a->timerq.next = stack;
+        stack = a;
+        first = next;
+    }
+
+    while(stack) {
+        next = stack->timerq.next;
+        stack->timerq.next = NULL;
+        heap = tq_meld(heap, stack);
+        stack = next;
+    }
+
+    return heap;
+}
+
+/* Insert a thread on the timer queue, keyed on its wait_timeout. */
+static inline void tq_insert(kthread_t **root, kthread_t *thd) {
+    thd->timerq.child = NULL;
+    thd->timerq.next = NULL;
+    thd->timerq.prev = NULL;
+
+    *root = tq_meld(*root, thd);
+}
+
+/* Remove a thread from the timer queue. */
+static inline void tq_remove(kthread_t **root, kthread_t *thd) {
+    kthread_t *prev, *sub;
+
+    sub = tq_merge_pairs(thd->timerq.child);
+
+    if(thd == *root) {
+        *root = sub;
+    }
+    else {
+        /* Unlink the thread from its parent's list of children */
+        prev = thd->timerq.prev;
+
+        if(prev->timerq.child == thd)
+            prev->timerq.child = thd->timerq.next;
+        else
+            prev->timerq.next = thd->timerq.next;
+
+        if(thd->timerq.next)
+            thd->timerq.next->timerq.prev = prev;
+
+        *root = tq_meld(*root, sub);
+    }
+
+    thd->timerq.child = NULL;
+    thd->timerq.next = NULL;
+    thd->timerq.prev = NULL;
+}
+
+#endif /* __THREAD_TIMERQ_H */